@@ -38,6 +38,12 @@ extern void * MFDBCore_AcquireBufferForInsert(uint64 ch, string collection, uint
 [<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_ReleaseBufferForInsert",CallingConvention=CallingConvention.StdCall)>]
 extern uint32 MFDBCore_ReleaseBufferForInsert(uint64 ch, string collection, void *);
 
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_AcquireBuffersForInsert",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_AcquireBuffersForInsert(uint64 ch, string collection, uint32 count, uint32[] sizes, nativeint[] buffers, uint64[] handles);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_ReleaseBuffersForInsert",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_ReleaseBuffersForInsert(uint64 ch, string collection, uint32 count, uint64[] handles, byte[] released);
+
 [<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_Initialize_QueryEngine",CallingConvention=CallingConvention.StdCall)>]
 extern void MFDBCore_Initialize_QueryEngine(uint32, uint32, uint32, uint32, string datapath);
 
@@ -47,6 +53,39 @@ extern uint32 MFDBCore_Query_Find(uint64 ch, string collection, void * z2selecto
 [<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_Query_Aggregate",CallingConvention=CallingConvention.StdCall)>]
 extern uint32 MFDBCore_Query_Aggregate(uint64 ch, string collection, void * z2query, uint32 queryBytes, void * retbuf, uint32 uintsort);
 
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_Query_Remove",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_Query_Remove(uint64 ch, string collection, void * z2query, uint32 lftBytes, uint32 qpBytes);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_Query_Count",CallingConvention=CallingConvention.StdCall)>]
+extern uint64 MFDBCore_Query_Count(uint64 ch, string collection, void * z2query, uint32 lftBytes, uint32 qpBytes);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_Query_Update",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_Query_Update(uint64 ch, string collection, void * z2query, uint32 lftBytes, uint32 qpBytes, void * updates, uint32 updateBytes);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_Set_MemoryBudget",CallingConvention=CallingConvention.StdCall)>]
+extern void MFDBCore_Set_MemoryBudget(uint64 bytes);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_Get_PageMetrics",CallingConvention=CallingConvention.StdCall)>]
+extern void MFDBCore_Get_PageMetrics(uint64[] metrics);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_AddBlob",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_AddBlob(uint64 ch, string collection, uint64 hash, byte[] bytes, uint32 size);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_FindBlob",CallingConvention=CallingConvention.StdCall)>]
+extern nativeint MFDBCore_FindBlob(uint64 ch, string collection, uint64 hash, uint32& size);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_PromoteColumn",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_PromoteColumn(uint64 ch, string collection, uint32 z2name);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_CreateHashIndex",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_CreateHashIndex(uint64 ch, string collection, uint32 z2name);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_CreateRangeIndex",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_CreateRangeIndex(uint64 ch, string collection, uint32[] z2names, uint32 count);
+
+[<DllImport("MFDBCore.dll",EntryPoint="MFDBCore_CreateBitmapIndex",CallingConvention=CallingConvention.StdCall)>]
+extern uint32 MFDBCore_CreateBitmapIndex(uint64 ch, string collection, uint32 z2name);
+
 type CoreProxy() =
     static member AcquireInsertBuffer (candle : uint64) (collection : string) (size : uint32) =
         let mutable c_str = collection
@@ -58,6 +97,14 @@ type CoreProxy() =
         let ret = MFDBCore_ReleaseBufferForInsert(candle, c_str, nint)
         ret
 
+    static member AcquireInsertBuffers (candle : uint64) (collection : string) (sizes : uint32[]) (buffers : nativeint[]) (handles : uint64[]) =
+        let mutable c_str = collection
+        MFDBCore_AcquireBuffersForInsert(candle, c_str, uint32 sizes.Length, sizes, buffers, handles)
+
+    static member ReleaseInsertBuffers (candle : uint64) (collection : string) (handles : uint64[]) (count : uint32) (released : byte[]) =
+        let mutable c_str = collection
+        MFDBCore_ReleaseBuffersForInsert(candle, c_str, count, handles, released)
+
     static member InitializeQueryEngine (maxConcIB, bmaxelems, bmaxsize, maxbins, datapath) =
         MFDBCore_Initialize_QueryEngine(maxConcIB, bmaxelems, bmaxsize, maxbins, datapath)
 
@@ -68,3 +115,57 @@ type CoreProxy() =
     static member Query_Aggregate (candle : uint64) (collection : string) (z2query : nativeint) (queryBytes : uint32) (retbuf : nativeint) (uintsort : uint32) =
         let mutable c_str = collection
         MFDBCore_Query_Aggregate(candle, c_str, z2query, queryBytes, retbuf, uintsort)
+
+    static member Query_Remove (candle : uint64) (collection : string) (z2query : nativeint) (lftBytes : uint32) (qpBytes : uint32) =
+        let mutable c_str = collection
+        MFDBCore_Query_Remove(candle, c_str, z2query, lftBytes, qpBytes)
+
+    static member Query_Count (candle : uint64) (collection : string) (z2query : nativeint) (lftBytes : uint32) (qpBytes : uint32) =
+        let mutable c_str = collection
+        MFDBCore_Query_Count(candle, c_str, z2query, lftBytes, qpBytes)
+
+    static member Query_Update (candle : uint64) (collection : string) (z2query : nativeint) (lftBytes : uint32) (qpBytes : uint32) (updates : nativeint) (updateBytes : uint32) =
+        let mutable c_str = collection
+        MFDBCore_Query_Update(candle, c_str, z2query, lftBytes, qpBytes, updates, updateBytes)
+
+    static member SetMemoryBudget (bytes : uint64) =
+        MFDBCore_Set_MemoryBudget(bytes)
+
+    // bytes with 4KB, 2MB and 1GB pages, then large page fallbacks
+    static member GetPageMetrics () =
+        let metrics = Array.zeroCreate<uint64> 4
+        MFDBCore_Get_PageMetrics(metrics)
+        metrics
+
+    static member AddBlob (candle : uint64) (collection : string) (hash : uint64) (bytes : byte[]) =
+        let mutable c_str = collection
+        MFDBCore_AddBlob(candle, c_str, hash, bytes, uint32 bytes.Length)
+
+    // None when the hash is unknown
+    static member FindBlob (candle : uint64) (collection : string) (hash : uint64) =
+        let mutable c_str = collection
+        let mutable size = 0u
+        let ptr = MFDBCore_FindBlob(candle, c_str, hash, &size)
+        if ptr = 0n then None
+        else
+            let bytes = Array.zeroCreate<byte> (int size)
+            Marshal.Copy(ptr, bytes, 0, int size)
+            Some bytes
+
+    static member PromoteColumn (candle : uint64) (collection : string) (z2name : uint32) =
+        let mutable c_str = collection
+        MFDBCore_PromoteColumn(candle, c_str, z2name)
+
+    static member CreateHashIndex (candle : uint64) (collection : string) (z2name : uint32) =
+        let mutable c_str = collection
+        MFDBCore_CreateHashIndex(candle, c_str, z2name)
+
+    // equality on the first ones, a range on the next
+    static member CreateRangeIndex (candle : uint64) (collection : string) (z2names : uint32[]) =
+        let mutable c_str = collection
+        MFDBCore_CreateRangeIndex(candle, c_str, z2names, uint32 z2names.Length)
+
+    // few distinct values: $eq, $ne and counts answered by bitmaps
+    static member CreateBitmapIndex (candle : uint64) (collection : string) (z2name : uint32) =
+        let mutable c_str = collection
+        MFDBCore_CreateBitmapIndex(candle, c_str, z2name)
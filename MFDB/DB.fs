@@ -139,6 +139,7 @@ type DB(dbname : string) =
     let insertBuffers = new InsertBuffers(10, MaxMongoMsgSize)
     let cursorMap = new Dictionary<int64, (int * string * BSON_Document [])>()
 
+    // only for z2encode / z2decode, which have no collection: the others use its NativeBlobHash
     let collectionblobs = new HybridBlobHash(null, "collBlobs", 8*MEGABYTE, GIGABYTE)
     let collectionMap = new Dictionary<string, Collection>()
 
@@ -509,9 +510,10 @@ type DB(dbname : string) =
     member private x.GetQueryContext(filterPresent, collection : Collection) =
         let querybw = new CustomBW2(querybuffer)
         let selectbw = new CustomBW2(selectbuffer)
-        let z2ctx = new Z2Ctx<QPfull>(querybw, collectionblobs, acquireName, (QPappend,QP_noaction))
-        let z2fctx = new Z2Ctx<z2>(selectbw, collectionblobs, acquireName, (append,noaction))
-        let z2rctx = new Z2RCtx(collectionblobs, decodeNameIdx)
+        let blobs = new NativeBlobHash(0UL, collection.getname())
+        let z2ctx = new Z2Ctx<QPfull>(querybw, blobs, acquireName, (QPappend,QP_noaction))
+        let z2fctx = new Z2Ctx<z2>(selectbw, blobs, acquireName, (append,noaction))
+        let z2rctx = new Z2RCtx(blobs, decodeNameIdx)
         { z2ctx = z2ctx; z2fctx = z2fctx ; z2rctx = z2rctx }
 
     member x.Handle_MemFusion_Query header (query : OP_INSERT) =
@@ -649,7 +651,7 @@ type DB(dbname : string) =
     //  accname: pop
     //  op: $sum
     //
-    member x.Handle_Aggregate_Group header collection doc sort =
+    member x.Handle_Aggregate_Group header (collection : Collection) doc sort =
         try
             logInfo (sprintf "Aggregate: \n\n %A \n\n" doc)
             let elist = BsonElemList doc
@@ -672,7 +674,7 @@ type DB(dbname : string) =
                             writeQO accop querybw
                           )
 
-            let z2rctx = new Z2RCtx(collectionblobs, decodeNameIdx)
+            let z2rctx = new Z2RCtx(new NativeBlobHash(0UL, collection.getname()), decodeNameIdx)
             let queryBytes = (querybw :> ICustomBW).BytesWritten()
             collection.execute_aggregation 0UL retbuffer querybuffer queryBytes sort 
             |> Unz2.z2bytes_to_BSON z2rctx
@@ -754,7 +756,7 @@ type DB(dbname : string) =
                         | true -> ()
                     collectionMap.[realname])
 
-        let z2ctx = new Z2Ctx<z2>(new DummyBW(), collectionblobs, acquireName, (noaction, noaction))
+        let z2ctx = new Z2Ctx<z2>(new DummyBW(), new NativeBlobHash(0UL, collection.getname()), acquireName, (noaction, noaction))
         let z2doclist = Z2<z2>.z2_doc doc z2ctx
         let z2docsize = (uint32 z2doclist.Length) * (uint32 Z2Constants.z2size)
         let cbw = collection.FS_AcquireInsertBuffer 0UL (z2docsize)
@@ -32,10 +32,15 @@ open System.Threading
 open MemFusionDB.Z2
 open MemFusionDB.Exceptions
 open MemFusionDB.Persistence
+open MemFusionDB.CoreProxy
 
 exception BlobHashMapCollision of string * byte[] * byte[]
 exception BlobHashNotFound of string * HashType
 
+// Where Z2Ctx puts and Z2RCtx finds long strings and binary data, by hash
+type IBlobHash =
+    abstract add_hash : HashType -> byte [] -> unit
+    abstract decode_hash : HashType -> byte []
 
 type HybridBlobHash(device, name : string, maxNumHashes, maxSize) =
     let data = new System.Collections.Generic.Dictionary<HashType, byte []>()
@@ -87,4 +92,23 @@ type HybridBlobHash(device, name : string, maxNumHashes, maxSize) =
                 let blob = br.ReadBytes(bloblen)
                 data.Add(hash, blob)
             )
-        )
\ No newline at end of file
+        )
+
+    interface IBlobHash with
+        member x.add_hash hash bytes = x.add_hash hash bytes
+        member x.decode_hash hash = x.decode_hash hash
+
+
+// The blob store of 'collection' in MFDBCore: outside the CLR heap, and
+// what the core reads to filter on long strings
+type NativeBlobHash(candle : uint64, collection : string) =
+    interface IBlobHash with
+        member x.add_hash hash bytes =
+            if CoreProxy.AddBlob candle collection hash bytes = 0u then
+                let there = defaultArg (CoreProxy.FindBlob candle collection hash) [||]
+                raise(BlobHashMapCollision(collection, there, bytes))
+
+        member x.decode_hash hash =
+            match CoreProxy.FindBlob candle collection hash with
+                | Some bytes -> bytes
+                | None -> raise(BlobHashNotFound(collection, hash))
@@ -63,7 +63,7 @@ type z2reader(z2list : Z2list) =
         z2array.[index]
 
 
-type Z2RCtx(blobs : HybridBlobHash, decodeNameIdx) =
+type Z2RCtx(blobs : IBlobHash, decodeNameIdx) =
     let _blobs = blobs
 
     member x.decode_binary_hash (hash : HashType) : byte [] = _blobs.decode_hash hash
@@ -48,7 +48,7 @@ type Consumer<'Payload> = Z2Ctx<'Payload> -> Zstate<'Payload list> -> z2compword
 
 and Consumers<'Payload> = Consumer<'Payload> * Consumer<'Payload>
 
-and Z2Ctx<'Payload>(bw : ICustomBW, blobs : HybridBlobHash, acquireName: string -> uint32, consumers : Consumers<'Payload>) =
+and Z2Ctx<'Payload>(bw : ICustomBW, blobs : IBlobHash, acquireName: string -> uint32, consumers : Consumers<'Payload>) =
     let _bw = bw
     let _blobs = blobs
     let nextLFTidx = ref 0l
@@ -43,6 +43,9 @@
 #include "MemFusion/LF/bvec2.h"
 #include "MemFusion/TimeStamp.h"
 #include "MemFusion/Buffer.h"
+#include "MemFusion/Platform/Numa.h"
+#include "MemFusion/PageAllocator.h"
+#include "MemFusion/Utils.h"
 
 #undef min
 
@@ -57,32 +60,78 @@ using namespace std;
 #define FALSE   0
 
 const char * Collection::BIN_SERIALIZATION_EXTENSION = "bin";
+const char * Collection::MAPPED_BIN_EXTENSION = "mbin";
+const char * Collection::SPILLED_BIN_EXTENSION = "spill";
+const char * Collection::BLOBS_EXTENSION = "blobs";
 
-
-void FindProcessData(uint32 numLFTs, Stage2 & stage2PerBin, const Z2FindQuery & z2query, LFTStage3 & matchesPerBin)
+namespace
 {
-    for (auto stage2elem : stage2PerBin)
+    //   Mapped Bin file: this header (one page), the ElemInfo of every slot
+    //   (rounded up to pages), then the atoms. Everything but the atoms is
+    //   written at flush time, the atoms are written in place by inserts.
+    struct MappedBinHeader
     {
-        uint32 elemIdx = stage2elem.first;
-        vector<cuint32> & trues = stage2elem.second;
-        vector<bool> lfts(numLFTs, false);
+        uint64 magic;
+        uint32 binIdx;
+        uint32 elemsSize;
+        uint64 binByteSize;
+        uint32 elemsToCopy;         // s_nFreeElemIdx at the last flush
+        uint32 durableElems;        // elements below are released and written back
+        uint64 nNumActive;
+        uint64 nNumDeleted;
+    };
+
+    const uint64 MAPPED_BIN_MAGIC = 0x314E494242444D46ULL;    // "FMDBBIN1"
+
+    uint64 RoundToPage(uint64 bytes)
+    {
+        uint64 page = MappedFile::PageSize();
+        return (((bytes + page - 1) / page) * page);
+    }
+
+    uint64 MappedElemsOffset()
+    {
+        return (RoundToPage(sizeof(MappedBinHeader)));
+    }
+
+    uint64 MappedRawOffset(uint32 elemsSize)
+    {
+        return (MappedElemsOffset() + RoundToPage(elemsSize * sizeof(ElemInfo)));
+    }
+}
 
-        for (uint LFTidx = 0; LFTidx < numLFTs; ++LFTidx)
-        {
-            auto iter = std::find(trues.begin(), trues.end(), LFTidx);
-            if (iter != trues.end())
-            {
-                lfts[LFTidx] = true;
-                trues.erase(iter);
-            }
-        }
 
-        bool match = z2query.apply_qp(lfts);
-        if (match)
+// Active elements of the first 'numElems' of 'bin': what NOT complements against.
+static void ActiveElems(const Bin<Z2raw> * bin, uint32 numElems, ElemBitmap & active)
+{
+    auto core = bin->Get();
+    active.reset(numElems);
+    for (uint32 idx = 0; idx < numElems; ++idx)
+    {
+        if (core->s_vElems[idx].status() == ElemState::ElemActive)
         {
-            matchesPerBin.push_back(elemIdx);
+            active.add(idx);
         }
     }
+    active.normalize();
+    if (active.count() * ElemBitmap::DENSE_RATIO > numElems)
+    {
+        active.densify();
+    }
+}
+
+void FindProcessData(Stage2 & stage2PerBin, const Z2FindQuery & z2query, const Bin<Z2raw> * bin, uint32 numElems, LFTStage3 & matchesPerBin)
+{
+    stage2PerBin.finish();
+
+    ElemBitmap active;
+    if (z2query.GetProgram().needs_universe())
+    {
+        ActiveElems(bin, numElems, active);
+    }
+
+    ElemBitmap matches = z2query.apply_qp(stage2PerBin.bitmaps(), &active);
+    matches.extract(matchesPerBin);
     stage2PerBin.clear();
 }
 
@@ -187,142 +236,1657 @@ uint32 Collection::Aggregate(uint64 transId, Buffer & retbuf, const Z2AggrQuery
             ret = WriteAggregationOutput<double>(stage3_data, retbuf);
         }
 
-        lastQueryCounters = queryCtx->metrics;
+        lastQueryCounters = queryCtx->metrics;
+
+        //printf("Stage1: iterations %llu,  slow threads=%llu,  cancellations=%llu\n",
+        //    lastQueryCounters.stage1Iterations, lastQueryCounters.stage1ThreadsSlowed, lastQueryCounters.cancellations);
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " c++ exception in " << __FUNCTION__ << ": " << ex.what();
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " unknown exception in " << __FUNCTION__;
+        LOG(ss.str());
+    }
+
+    return (ret);
+}
+
+// Runs the LFTs and the query program of 'z2query': matchesPerBin of the
+// returned context has the elemIdx of the matching documents in each Bin
+// of its snapshot. The Bins are not freed while it is alive.
+// The matches of 'z2query', told apart when some long strings could not be
+// ordered: their bytes are not in m_blobs, and the filters skipped them.
+std::unique_ptr<Collection::FindContext, align_deleter> Collection::FindMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query)
+{
+    cuint64 unresolved = m_strings.unresolved();
+    auto queryCtx = PlanMatches(transId, retbuf, z2query);
+    cuint64 missed = m_strings.unresolved() - unresolved;
+    if (missed > 0)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << ": " << missed << " long strings without bytes in the BlobStore were not matched "
+           << "by a range or prefix filter. Results can be incomplete.";
+        LOG(ss.str());
+    }
+    return (std::move(queryCtx));
+}
+
+// by an index when one answers, scanning otherwise
+std::unique_ptr<Collection::FindContext, align_deleter> Collection::PlanMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query)
+{
+    auto answered = BitmapMatches(transId, retbuf, z2query);
+    if (answered)
+        return (std::move(answered));
+
+    const std::vector<Z2raw> equals = z2query->equalities();
+    for (const Z2raw & equal : equals)
+    {
+        const HashIndex * index = FindHashIndex(Z2(equal).z2name());
+        if (index != nullptr)
+            return (LookupMatches(transId, retbuf, z2query, *index, std::vector<Z2raw>(1, equal)));
+    }
+    const std::vector<Z2raw> alternatives = z2query->alternatives();
+    if (!alternatives.empty())
+    {
+        const HashIndex * index = FindHashIndex(Z2(alternatives.front()).z2name());
+        if (index != nullptr)
+            return (LookupMatches(transId, retbuf, z2query, *index, alternatives));
+    }
+    const std::vector<LFTraw> comparisons = z2query->comparisons();
+    for (uint32 idx = 0; idx < s_numRangeIndexes.load(); ++idx)
+    {
+        const RangeIndex & index = *s_rangeIndexes[idx].load();
+        RangeIndex::Key lo, hi;
+        if (!index.bounds(equals, comparisons, lo, hi))
+            continue;
+        auto queryCtx = RangeMatches(transId, retbuf, z2query, index, lo, hi);
+        if (queryCtx)
+            return (std::move(queryCtx));
+    }
+
+    uint32 numLFTs = z2query->lft_size();
+
+    auto handle2LFTidx = [](xHandle handle) -> uint32 { return (static_cast<uint32>(handle & 0xFFFFFFFF)); };
+    auto queryCtx = CreateQueryProcessor<FindContext>(transId, retbuf, z2query, handle2LFTidx);
+    std::vector<Stage2> stage2PerBin(queryCtx->numBins);
+
+    std::function<void(FullSlot<uint32, Stage1Payload>)> stage2_lambda;
+    std::function<void(uint32)> stage3_lambda;
+
+    if (z2query->IsFused())
+    {
+        // slots already carry final matches: just collect them per Bin
+        stage2_lambda = [&queryCtx](FullSlot<uint32, Stage1Payload> slot)
+        {
+            cuint32 binIdx = std::get<2>(slot).second;
+            LFTStage3 & matches = queryCtx->matchesPerBin[binIdx];
+            matches.insert(matches.end(), std::get<0>(slot), std::get<1>(slot));
+        };
+        // the Composer consumes slots in slot order, not in scan order
+        stage3_lambda = [&queryCtx](uint32 binIdx)
+        {
+            LFTStage3 & matches = queryCtx->matchesPerBin[binIdx];
+            std::sort(matches.begin(), matches.end());
+        };
+    }
+    else
+    {
+        for (uint32 binIdx = 0; binIdx < stage2PerBin.size(); ++binIdx)
+        {
+            stage2PerBin[binIdx].reset(numLFTs, queryCtx->elemsPerBin[binIdx]);
+        }
+
+        stage2_lambda = [&stage2PerBin]
+        // elemIdx, LFTidx
+        (FullSlot<uint32, Stage1Payload> slot)
+        {
+            cuint32 LFTidx = std::get<2>(slot).first;
+            cuint32 binIdx = std::get<2>(slot).second;
+            stage2PerBin[binIdx].add(LFTidx, std::get<0>(slot), std::get<1>(slot));
+        };
+
+        stage3_lambda =
+            [this, &stage2PerBin, &queryCtx, z2query](uint32 binIdx)
+        {
+            FindProcessData(stage2PerBin[binIdx], *z2query, queryCtx->bins[binIdx], queryCtx->elemsPerBin[binIdx], queryCtx->matchesPerBin[binIdx]);
+        };
+    }
+
+    queryCtx->ProcessQuery(stage2_lambda, stage3_lambda);
+    return (std::move(queryCtx));
+}
+
+// FindMatches of a conjunction with $eq on an indexed name, or of $in on
+// it: the candidates the index has under one of 'equals' are checked on
+// their Bins, nothing is scanned.
+std::unique_ptr<Collection::FindContext, align_deleter> Collection::LookupMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query, const HashIndex & index, const std::vector<Z2raw> & equals)
+{
+    (void) transId;
+    TimeStamp start;
+    auto handle2LFTidx = [](xHandle handle) -> uint32 { return (static_cast<uint32>(handle & 0xFFFFFFFF)); };
+    auto mem = _aligned_malloc(sizeof(FindContext), CACHE_LINE);
+    std::unique_ptr<FindContext, align_deleter>
+        queryCtx(new (mem) FindContext(z2query, m_epoch, bins, retbuf, handle2LFTidx,
+            [this](Bin<Z2raw> * bin) { LoadBin(bin); }));
+    ++x_indexLookups;
+
+    // in the snapshot, and already there when it was taken
+    std::vector<InsertHandle> handles;
+    for (const Z2raw & equal : equals)
+    {
+        index.find(HashIndex::key(equal), handles);
+    }
+    std::sort(handles.begin(), handles.end());
+    handles.erase(std::unique(handles.begin(), handles.end()), handles.end());
+    for (InsertHandle handle : handles)
+    {
+        cuint32 binIdx = static_cast<uint32>(handle >> 32);
+        cuint32 elemIdx = static_cast<uint32>(handle);
+        if ((binIdx < queryCtx->numBins) && (elemIdx < queryCtx->elemsPerBin[binIdx]))
+        {
+            queryCtx->matchesPerBin[binIdx].push_back(elemIdx);
+        }
+    }
+    TimeStamp preparation;
+
+    CheckMatches(*queryCtx, z2query);
+    TimeStamp end;
+
+    queryCtx->metrics.prepare_us = TimeStamp::millis(start, preparation);
+    queryCtx->metrics.lfts_us = TimeStamp::millis(preparation, end);
+    return (std::move(queryCtx));
+}
+
+// FindMatches of a conjunction bounding the first Z2name of 'index': the
+// Runs give the candidates of their Bins, the Bins without one have all
+// their elements checked. nullptr when more than RANGE_INDEX_MAX_PERCENT
+// of the elements are candidates: a scan is cheaper then.
+std::unique_ptr<Collection::FindContext, align_deleter> Collection::RangeMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query, const RangeIndex & index, const RangeIndex::Key & lo, const RangeIndex::Key & hi)
+{
+    (void) transId;
+    TimeStamp start;
+    auto handle2LFTidx = [](xHandle handle) -> uint32 { return (static_cast<uint32>(handle & 0xFFFFFFFF)); };
+    auto mem = _aligned_malloc(sizeof(FindContext), CACHE_LINE);
+    std::unique_ptr<FindContext, align_deleter>
+        queryCtx(new (mem) FindContext(z2query, m_epoch, bins, retbuf, handle2LFTidx,
+            [this](Bin<Z2raw> * bin) { LoadBin(bin); }));
+
+    // the Runs of the snapshot, and what they find
+    std::vector<std::shared_ptr<const RangeIndex::Run>> runs(queryCtx->numBins);
+    std::vector<std::pair<uint32, uint32>> found(queryCtx->numBins);
+    uint64 total = 0ULL;
+    uint64 candidates = 0ULL;
+    for (uint32 binIdx = 0; binIdx < queryCtx->numBins; ++binIdx)
+    {
+        Bin<Z2raw> * bin = queryCtx->bins[binIdx];
+        total += queryCtx->elemsPerBin[binIdx];
+        runs[binIdx] = index.run(binIdx);
+        if (runs[binIdx] && runs[binIdx]->current(bin, bin->atomsVersion()))
+        {
+            runs[binIdx]->find(lo, hi, found[binIdx].first, found[binIdx].second);
+            candidates += found[binIdx].second - found[binIdx].first;
+        }
+        else {
+            runs[binIdx].reset();
+            candidates += queryCtx->elemsPerBin[binIdx];
+        }
+    }
+    if (candidates * 100 > total * RANGE_INDEX_MAX_PERCENT)
+        return (nullptr);
+    ++x_indexLookups;
+
+    for (uint32 binIdx = 0; binIdx < queryCtx->numBins; ++binIdx)
+    {
+        LFTStage3 & matches = queryCtx->matchesPerBin[binIdx];
+        if (runs[binIdx])
+        {
+            for (uint32 idx = found[binIdx].first; idx < found[binIdx].second; ++idx)
+            {
+                matches.push_back(runs[binIdx]->elem(idx));
+            }
+            std::sort(matches.begin(), matches.end());
+        }
+        else {
+            matches.resize(queryCtx->elemsPerBin[binIdx]);
+            std::iota(matches.begin(), matches.end(), 0U);
+        }
+    }
+    TimeStamp preparation;
+
+    CheckMatches(*queryCtx, z2query);
+    TimeStamp end;
+
+    queryCtx->metrics.prepare_us = TimeStamp::millis(start, preparation);
+    queryCtx->metrics.lfts_us = TimeStamp::millis(preparation, end);
+    return (std::move(queryCtx));
+}
+
+// FindMatches of a query with only $eq and $ne on Z2names with a bitmap
+// index: the Bins with current Bitmaps are answered by the query program
+// on them, the others have all their elements checked. nullptr when those
+// have more than BITMAP_INDEX_MAX_PERCENT of the elements. With 'counted',
+// what the Bins answered match is only added to it: nothing is listed or
+// pinned for them, their atoms are not needed.
+std::unique_ptr<Collection::FindContext, align_deleter> Collection::BitmapMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query, uint64 * counted)
+{
+    (void) transId;
+    const std::vector<LFTraw> & filters = z2query->GetFilters();
+    std::vector<const BitmapIndex*> indexes;
+    for (const LFTraw & lft : filters)
+    {
+        const BitmapIndex * index = BitmapIndex::answers(lft) ? FindBitmapIndex(Z2(lft.z2raw).z2name()) : nullptr;
+        if (index == nullptr)
+            return (nullptr);
+        indexes.push_back(index);
+    }
+
+    TimeStamp start;
+    auto handle2LFTidx = [](xHandle handle) -> uint32 { return (static_cast<uint32>(handle & 0xFFFFFFFF)); };
+    auto mem = _aligned_malloc(sizeof(FindContext), CACHE_LINE);
+    std::unique_ptr<FindContext, align_deleter>
+        queryCtx(new (mem) FindContext(z2query, m_epoch, bins, retbuf, handle2LFTidx,
+            [this](Bin<Z2raw> * bin) { LoadBin(bin); }));
+
+    // the Bitmaps of the snapshot, of each LFT
+    std::vector<std::vector<std::shared_ptr<const BitmapIndex::Bitmaps>>> bitmaps(queryCtx->numBins);
+    std::vector<bool> exact(queryCtx->numBins, false);
+    std::vector<uint32> some;
+    uint64 total = 0ULL;
+    uint64 unindexed = 0ULL;
+    for (uint32 binIdx = 0; binIdx < queryCtx->numBins; ++binIdx)
+    {
+        Bin<Z2raw> * bin = queryCtx->bins[binIdx];
+        cuint64 version = bin->atomsVersion();
+        cuint32 numElems = queryCtx->elemsPerBin[binIdx];
+        total += numElems;
+        for (const BitmapIndex * index : indexes)
+        {
+            auto one = index->bitmaps(binIdx);
+            if (!one || !one->complete() || !one->current(bin, version, numElems))
+                break;
+            bitmaps[binIdx].push_back(one);
+        }
+        exact[binIdx] = (bitmaps[binIdx].size() == indexes.size());
+        if (exact[binIdx])
+        {
+            some.push_back(binIdx);
+        }
+        else {
+            bitmaps[binIdx].clear();
+            unindexed += numElems;
+        }
+    }
+    if (unindexed * 100 > total * BITMAP_INDEX_MAX_PERCENT)
+        return (nullptr);
+    ++x_indexLookups;
+
+    std::vector<uint64> counts(queryCtx->numBins, 0ULL);
+    auto answer = [&queryCtx, &bitmaps, &filters, &counts, z2query, counted](uint32 binIdx)
+    {
+        std::vector<ElemBitmap> perLFT(filters.size());
+        for (uint32 LFTidx = 0; LFTidx < filters.size(); ++LFTidx)
+        {
+            const HashIndex::Key key = HashIndex::key(filters[LFTidx].z2raw);
+            if (filters[LFTidx].qo == QO::EQ)
+                bitmaps[binIdx][LFTidx]->equal(key, perLFT[LFTidx]);
+            else
+                bitmaps[binIdx][LFTidx]->not_equal(key, perLFT[LFTidx]);
+        }
+
+        // removed since the Bitmaps were built
+        ElemBitmap active;
+        ActiveElems(queryCtx->bins[binIdx], queryCtx->elemsPerBin[binIdx], active);
+        ElemBitmap matches = z2query->apply_qp(perLFT, &active);
+        matches.and_with(active);
+        if (counted != nullptr)
+            counts[binIdx] = matches.count();
+        else
+            matches.extract(queryCtx->matchesPerBin[binIdx]);
+    };
+    Concurrency::parallel_for(size_t(0), some.size(), [&some, &answer](size_t idx) { answer(some[idx]); });
+
+    for (uint32 binIdx = 0; binIdx < queryCtx->numBins; ++binIdx)
+    {
+        if (!exact[binIdx])
+        {
+            LFTStage3 & matches = queryCtx->matchesPerBin[binIdx];
+            matches.resize(queryCtx->elemsPerBin[binIdx]);
+            std::iota(matches.begin(), matches.end(), 0U);
+        }
+    }
+    TimeStamp preparation;
+
+    CheckMatches(*queryCtx, z2query, &exact);
+    TimeStamp end;
+
+    if (counted != nullptr)
+    {
+        *counted += std::accumulate(counts.begin(), counts.end(), 0ULL);
+    }
+    queryCtx->metrics.prepare_us = TimeStamp::millis(start, preparation);
+    queryCtx->metrics.lfts_us = TimeStamp::millis(preparation, end);
+    return (std::move(queryCtx));
+}
+
+// Keeps in matchesPerBin the candidates that are active and match, one
+// word of them at a time as the fused scan does, but in the 'exact' Bins.
+// The Bins left with matches stay pinned till the context goes.
+void Collection::CheckMatches(FindContext & queryCtx, const Z2FindQuery * z2query, const std::vector<bool> * exact)
+{
+    std::vector<uint32> some;
+    for (uint32 binIdx = 0; binIdx < queryCtx.numBins; ++binIdx)
+    {
+        if (!queryCtx.matchesPerBin[binIdx].empty())
+        {
+            some.push_back(binIdx);
+        }
+    }
+
+    auto check = [&queryCtx, z2query, exact](uint32 binIdx)
+    {
+        LFTStage3 & matches = queryCtx.matchesPerBin[binIdx];
+        const Bin<Z2raw> * bin = queryCtx.bins[binIdx];
+        queryCtx.AdmitBin(binIdx);
+        if (!bin->WaitResident())
+        {
+            queryCtx.BinScanned(binIdx, false);
+            throw EXCEPTION("Bin %u could not be read back from disk", binIdx);
+        }
+        if ((exact != nullptr) && (*exact)[binIdx])
+        {
+            queryCtx.BinScanned(binIdx, true);
+            return;
+        }
+
+        std::vector<uint64> regs(z2query->GetProgram().reg_size(), 0ULL);
+        const Z2FindQuery::ShapeLookups lookups = z2query->shape_lookups(bin);
+        uint32 kept = 0;
+        for (uint32 first = 0; first < matches.size();)
+        {
+            cuint32 base = matches[first] & ~63U;
+            uint64 active = 0ULL;
+            uint32 last = first;
+            for (; (last < matches.size()) && (matches[last] < base + 64); ++last)
+            {
+                if (bin->Get()->s_vElems[matches[last]].status() == ElemState::ElemActive)
+                {
+                    active |= 1ULL << (matches[last] - base);
+                }
+            }
+            uint64 found = active ? z2query->match_word(bin, lookups, base, active, regs.data()) : 0ULL;
+            while (found)
+            {
+                unsigned long bit;
+                _BitScanForward64(&bit, found);
+                found &= found - 1;
+                matches[kept++] = base + bit;
+            }
+            first = last;
+        }
+        matches.resize(kept);
+        queryCtx.BinScanned(binIdx, kept > 0);
+    };
+
+    // a point lookup has one Bin
+    if (some.size() == 1)
+    {
+        check(some.front());
+        return;
+    }
+    Concurrency::parallel_for(size_t(0), some.size(), [&some, &check](size_t idx) { check(some[idx]); });
+}
+
+// returns number of z2 elements in retbuf
+uint32 Collection::FindAndProject(uint64 transId, opt<Projections&> onames, Buffer & retbuf, const Z2FindQuery * z2query)
+{
+    uint32 ret = 0;
+    try
+    {
+        auto queryCtx = FindMatches(transId, retbuf, z2query);
+
+        ret = FindProjectPhase(queryCtx->bins, queryCtx->matchesPerBin, retbuf, onames);
+
+        lastQueryCounters = queryCtx->metrics;
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " c++ exception in " << __FUNCTION__ << ": " << ex.what();
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " unknown exception in " << __FUNCTION__;
+        LOG(ss.str());
+    }
+
+    return (ret);
+}
+
+uint64 Collection::Count(uint64 transId, const Z2FindQuery * z2query)
+{
+    uint64 ret = 0ULL;
+    try
+    {
+        Buffer none(nullptr, 0);
+        uint64 counted = 0ULL;
+        auto queryCtx = BitmapMatches(transId, none, z2query, &counted);
+        if (!queryCtx)
+        {
+            queryCtx = FindMatches(transId, none, z2query);
+        }
+        for (const LFTStage3 & matches : queryCtx->matchesPerBin)
+        {
+            counted += matches.size();
+        }
+        ret = counted;
+
+        lastQueryCounters = queryCtx->metrics;
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " c++ exception in " << __FUNCTION__ << ": " << ex.what();
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " unknown exception in " << __FUNCTION__;
+        LOG(ss.str());
+    }
+
+    return (ret);
+}
+
+uint32 Collection::Remove(uint64 transId, const Z2FindQuery * z2query)
+{
+    uint32 ret = 0;
+    try
+    {
+        Buffer none(nullptr, 0);
+        auto queryCtx = FindMatches(transId, none, z2query);
+
+        // before the context goes: the Bins stay those it matched in
+        for (uint32 binIdx = 0; binIdx < queryCtx->numBins; ++binIdx)
+        {
+            Bin<Z2raw> * bin = queryCtx->bins[binIdx];
+            for (uint32 elemIdx : queryCtx->matchesPerBin[binIdx])
+            {
+                if (bin->RemoveElem(elemIdx))
+                    ++ret;
+            }
+        }
+
+        lastQueryCounters = queryCtx->metrics;
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " c++ exception in " << __FUNCTION__ << ": " << ex.what();
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " unknown exception in " << __FUNCTION__;
+        LOG(ss.str());
+    }
+
+    if (ret > 0)
+    {
+        WakeCompactor();
+    }
+    return (ret);
+}
+
+// Past the atoms of the inner document or array that starts at 'atom'
+static const Z2raw * SkipInnerDoc(const Z2raw * atom, const Z2raw * end)
+{
+    const Z2 z2(*atom);
+    int32 parentDepthToSkip = (z2.z2type() == BSONtypeCompressed::CArrayDoc) ? (int32) z2.z2value() : 0;
+    const Z2DocDepth parentDocNum = z2.z2docdepth();
+    const Z2raw * cur = atom + 1;
+    for (; (cur != end) && !Z2::invalid(*cur); ++cur)
+    {
+        if (((Z2DocDepth) Z2(*cur).z2docdepth() == parentDocNum) && (--parentDepthToSkip < 0))
+            break;
+    }
+    return (cur);
+}
+
+// Rewrites element 'elemIdx' with 'updates' where inserts go. The old copy
+// is removed first: of concurrent updaters only one gets to rewrite it.
+// An update in place of the old copy while it is being rewritten is lost.
+bool Collection::RelocateElem(Bin<Z2raw> * bin, uint32 elemIdx, const Z2Updates & updates)
+{
+    std::vector<Z2raw> doc;
+    std::vector<bool> found(updates.size(), false);
+    bool changed = false;
+
+    auto range = bin->get_elem_range(elemIdx);
+    for (const Z2raw * cur = range.begin(); (cur != range.end()) && !Z2::invalid(*cur);)
+    {
+        const Z2raw * next = Z2(*cur).HasInnerDoc() ? SkipInnerDoc(cur, range.end()) : cur + 1;
+        Z2raw atom = *cur;
+        bool hit = false;
+        for (uint32 updIdx = 0; (cur->m128i_u32[0] == RootDocnum) && (updIdx < updates.size()); ++updIdx)
+        {
+            if (Z2(updates[updIdx].z2).z2name() == Z2(*cur).z2name())
+            {
+                found[updIdx] = true;
+                hit = Z2Update::apply(updates[updIdx], atom) || hit;
+            }
+        }
+        if (hit)
+        {
+            doc.push_back(atom);
+            changed = true;
+        }
+        else {
+            doc.insert(doc.end(), cur, next);
+        }
+        cur = next;
+    }
+    for (uint32 updIdx = 0; updIdx < updates.size(); ++updIdx)
+    {
+        if (!found[updIdx])
+        {
+            doc.push_back(Z2Update::initial(updates[updIdx]));
+            changed = true;
+        }
+    }
+    if (!changed)
+        return (false);
+
+    void * buffer;
+    InsertHandle handle;
+    cuint32 sizeBytes = static_cast<uint32>(doc.size() * sizeof(Z2raw));
+    if (AcquireInsertBuffers(1, &sizeBytes, &buffer, &handle) == 0)
+        return (false);
+    memcpy(buffer, doc.data(), sizeBytes);
+
+    // The copy takes the _id over before the old one goes: an insert of
+    // that _id meanwhile sees either of them and is the duplicate. Of two
+    // copies of the same element the second does not get the _id.
+    LF::epoch_guard guard(m_epoch);
+    Bin<Z2raw> * to = bins[static_cast<uint32>(handle >> 32)];
+    cuint32 toIdx = static_cast<uint32>(handle);
+    if (!ClaimId(to, toIdx, MakeInsertHandle(bin->binIdx(), elemIdx)) || !bin->RemoveElem(elemIdx))
+    {
+        // its entry in the _id index, if any, is stale from now on
+        to->DiscardElem(toIdx);
+        return (false);
+    }
+    to->ReleaseElems(&toIdx, 1);
+    IndexElem(to, toIdx, true);
+    return (true);
+}
+
+// In place when every field updated is there as a single atom the update
+// fits, rewritten otherwise. A Bin being compacted is copied as it was:
+// its elements are rewritten, their removal is replayed on the copy.
+// Called within the epoch of the query that matched the element.
+bool Collection::UpdateElem(Bin<Z2raw> * bin, uint32 elemIdx, const Z2Updates & updates)
+{
+    if (bin->Get()->s_vElems[elemIdx].status() != ElemState::ElemActive)
+        return (false);
+    if (bin->compacting())
+        return (RelocateElem(bin, elemIdx, updates));
+
+    std::vector<Z2raw*> atoms(updates.size());
+    for (uint32 updIdx = 0; updIdx < updates.size(); ++updIdx)
+    {
+        atoms[updIdx] = bin->FindField(elemIdx, Z2(updates[updIdx].z2).z2name());
+        if ((atoms[updIdx] == nullptr) || !Z2Update::fits(updates[updIdx], *atoms[updIdx]))
+            return (RelocateElem(bin, elemIdx, updates));
+    }
+
+    bool changed = false;
+    const InsertHandle handle = MakeInsertHandle(bin->binIdx(), elemIdx);
+    for (uint32 updIdx = 0; updIdx < updates.size(); ++updIdx)
+    {
+        // Indexed: the swap and its entries as one, or two updates of the
+        // element could each remove the entry the other one added
+        HashIndex * index = FindHashIndex(Z2(updates[updIdx].z2).z2name());
+        std::unique_lock<std::mutex> lock;
+        if (index != nullptr)
+        {
+            lock = std::unique_lock<std::mutex>(m_updateLocks[handle % NUM_UPDATE_LOCKS]);
+        }
+        Z2raw was, now;
+        if (!Z2Update::apply_in_place(updates[updIdx], atoms[updIdx], was, now))
+            continue;
+        changed = true;
+
+        // under the new value before it goes from the old one
+        const HashIndex::Key wasKey = HashIndex::key(was);
+        const HashIndex::Key nowKey = HashIndex::key(now);
+        if ((index != nullptr) && !(nowKey == wasKey))
+        {
+            index->add(nowKey, handle);
+            index->remove(wasKey, handle);
+        }
+    }
+    if (changed)
+    {
+        bin->Refresh(elemIdx);
+    }
+    return (changed);
+}
+
+uint32 Collection::Update(uint64 transId, const Z2FindQuery * z2query, const Z2Updates & updates)
+{
+    for (const UpdateRaw & upd : updates)
+    {
+        if (Z2(upd.z2).z2name() == MFDB::Constants::Id_1)
+        {
+            std::stringstream ss;
+            ss << "Collection " << name() << ": _id cannot be updated. Update failed.";
+            LOG(ss.str());
+            return (0);
+        }
+    }
+
+    uint32 ret = 0;
+    try
+    {
+        Buffer none(nullptr, 0);
+        auto queryCtx = FindMatches(transId, none, z2query);
+
+        // one Bin per task: the documents it updates are next to each other
+        std::atomic<uint32> modified(0);
+        Concurrency::parallel_for(0U, queryCtx->numBins,
+            [this, &queryCtx, &updates, &modified](uint32 binIdx)
+        {
+            Bin<Z2raw> * bin = queryCtx->bins[binIdx];
+            uint32 done = 0;
+            for (uint32 elemIdx : queryCtx->matchesPerBin[binIdx])
+            {
+                if (UpdateElem(bin, elemIdx, updates))
+                    ++done;
+            }
+            modified += done;
+        });
+        ret = modified.load();
+
+        lastQueryCounters = queryCtx->metrics;
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " c++ exception in " << __FUNCTION__ << ": " << ex.what();
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << " unknown exception in " << __FUNCTION__;
+        LOG(ss.str());
+    }
+
+    // the Runs and Bitmaps of the Bins updated in place are built again
+    if ((ret > 0) && ((s_numRangeIndexes.load() > 0) || (s_numBitmapIndexes.load() > 0)))
+    {
+        WakeCompactor();
+    }
+    return (ret);
+}
+
+uint32 Collection::FindAndReturnAll(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query)
+{
+    return FindAndProject(transId, opt<Projections&>(), retbuf, z2query);
+}
+
+void Collection::grow(Bin<Z2raw>* bin)
+{
+    std::lock_guard<std::mutex> guard(m_columnsMutex);
+    for (Z2name name : m_promoted)
+    {
+        bin->AddColumn(name);
+    }
+    bins.add(bin);
+
+    // the one before is full: it can be sealed
+    WakeCompactor();
+}
+
+void Collection::AddPromotedColumns(Bin<Z2raw>* bin)
+{
+    std::lock_guard<std::mutex> guard(m_columnsMutex);
+    for (Z2name name : m_promoted)
+    {
+        bin->AddColumn(name);
+    }
+}
+
+void Collection::PromoteColumn(Z2name name)
+{
+    std::lock_guard<std::mutex> guard(m_columnsMutex);
+    if (std::find(m_promoted.begin(), m_promoted.end(), name) != m_promoted.end())
+        return;
+
+    if (m_promoted.size() == Bin<Z2raw>::MAX_COLUMNS)
+        throw std::exception("Too many promoted columns.");
+    m_promoted.push_back(name);
+
+    std::stringstream ss;
+    ss << "Collection " << this->name() << " promoting Z2name " << name << " to a column in " << bins.size() << " Bins.";
+    LOG(ss.str());
+
+    for (auto bin : bins)
+    {
+        ResidentBin resident(*this, bin);
+        bin->AddColumn(name);
+    }
+    WakeCompactor();
+}
+
+HashIndex * Collection::FindHashIndex(Z2name name) const
+{
+    cuint32 numIndexes = s_numHashIndexes.load();
+    for (uint32 idx = 0; idx < numIndexes; ++idx)
+    {
+        HashIndex * index = s_hashIndexes[idx].load();
+        if (index->name() == name)
+            return (index);
+    }
+    return (nullptr);
+}
+
+// Once 'elemIdx' is active, or copied by a compaction. 'claimed': its _id
+// is in already (ClaimId).
+void Collection::IndexElem(const Bin<Z2raw> * bin, uint32 elemIdx, bool claimed)
+{
+    cuint32 numIndexes = s_numHashIndexes.load();
+    AtomRange<Z2raw> range = bin->get_elem_range(elemIdx);
+    for (uint32 idx = claimed ? ID_INDEX + 1 : 0; idx < numIndexes; ++idx)
+    {
+        s_hashIndexes[idx].load()->add(range.begin(), range.end(), MakeInsertHandle(bin->binIdx(), elemIdx));
+    }
+}
+
+// Before the acquired 'elemIdx' is released: its _id goes in the _id
+// index, unless a document active or being released has it. Those went in
+// before, so of two inserters of one _id the second sees the first. False
+// and nothing added for a duplicate. A copy of 'relocated' does not count
+// it: the copy takes its _id over.
+bool Collection::ClaimId(Bin<Z2raw> * bin, uint32 elemIdx, InsertHandle relocated)
+{
+    const Z2raw * id = bin->FindField(elemIdx, MFDB::Constants::Id_1);
+    if (id == nullptr)
+        return (true);
+
+    HashIndex * index = s_hashIndexes[ID_INDEX].load();
+    const HashIndex::Key key = HashIndex::key(*id);
+    const InsertHandle handle = MakeInsertHandle(bin->binIdx(), elemIdx);
+    std::vector<InsertHandle> before;
+    index->add(key, handle, before);
+    for (InsertHandle other : before)
+    {
+        if ((other != relocated) && HoldsId(other, key))
+        {
+            index->remove(key, handle);
+            if (relocated == NO_HANDLE)
+            {
+                ++x_duplicateIds;
+            }
+            return (false);
+        }
+    }
+    return (true);
+}
+
+// Entries can be stale: 'handle' still has _id 'key', and is active or
+// being released
+bool Collection::HoldsId(InsertHandle handle, const HashIndex::Key & key)
+{
+    cuint32 binIdx = static_cast<uint32>(handle >> 32);
+    cuint32 elemIdx = static_cast<uint32>(handle);
+    if (binIdx >= bins.size())
+        return (false);
+    Bin<Z2raw> * bin = bins[binIdx];
+    if (elemIdx >= bin->Get()->s_nFreeElemIdx)
+        return (false);
+    const ElemState status = bin->Get()->s_vElems[elemIdx].status();
+    if ((status != ElemState::ElemActive) && (status != ElemState::ElemAcquired))
+        return (false);
+
+    ResidentBin resident(*this, bin);
+    const Z2raw * id = bin->FindField(elemIdx, MFDB::Constants::Id_1);
+    return ((id != nullptr) && (HashIndex::key(*id) == key));
+}
+
+// Inserters see the index before the Bins are walked: once the epoch
+// turned, any element they did not index is active already and the walk
+// finds it. Both can index the same one: lookups take it once.
+void Collection::CreateHashIndex(Z2name name)
+{
+    std::lock_guard<std::mutex> indexes(m_indexesMutex);
+    if (FindHashIndex(name) != nullptr)
+        return;
+
+    cuint32 numIndexes = s_numHashIndexes.load();
+    if (numIndexes == MAX_HASH_INDEXES)
+        throw std::exception("Too many hash indexes.");
+    HashIndex * index = new HashIndex(name);
+    s_hashIndexes[numIndexes].store(index);
+    s_numHashIndexes.store(numIndexes + 1);
+    m_epoch.synchronize();
+
+    TimeStamp start;
+    LF::epoch_guard guard(m_epoch);
+    const std::vector<Bin<Z2raw>*> snapshot = bins.snapshot();
+    Concurrency::parallel_for(0U, static_cast<uint32>(snapshot.size()),
+        [this, &snapshot, index](uint32 binIdx)
+    {
+        Bin<Z2raw> * bin = snapshot[binIdx];
+        ResidentBin resident(*this, bin);
+        cuint32 numElems = bin->Get()->s_nFreeElemIdx;
+        for (uint32 elemIdx = 0; elemIdx < numElems; ++elemIdx)
+        {
+            if (bin->Get()->s_vElems[elemIdx].status() != ElemState::ElemActive)
+                continue;
+            AtomRange<Z2raw> range = bin->get_elem_range(elemIdx);
+            index->add(range.begin(), range.end(), MakeInsertHandle(binIdx, elemIdx));
+        }
+    });
+    TimeStamp end;
+
+    std::stringstream ss;
+    ss << "Collection " << this->name() << " indexed Z2name " << name << " over " << snapshot.size() << " Bins: "
+       << index->size() << " entries in " << TimeStamp::millis(start, end) << " ms.";
+    LOG(ss.str());
+}
+
+// Only registered here: the compactor builds the Runs
+void Collection::CreateRangeIndex(const std::vector<Z2name> & names)
+{
+    if (names.empty() || (names.size() > RangeIndex::MAX_KEYS))
+        throw std::exception("Range index of no or too many Z2names.");
+
+    {
+        std::lock_guard<std::mutex> indexes(m_indexesMutex);
+        cuint32 numIndexes = s_numRangeIndexes.load();
+        for (uint32 idx = 0; idx < numIndexes; ++idx)
+        {
+            if (s_rangeIndexes[idx].load()->names() == names)
+                return;
+        }
+        if (numIndexes == MAX_RANGE_INDEXES)
+            throw std::exception("Too many range indexes.");
+        s_rangeIndexes[numIndexes].store(new RangeIndex(names));
+        s_numRangeIndexes.store(numIndexes + 1);
+    }
+
+    std::stringstream ss;
+    ss << "Collection " << this->name() << " range index on Z2names";
+    for (Z2name name : names)
+    {
+        ss << " " << name;
+    }
+    ss << ", Runs of " << bins.size() - 1 << " Bins to build.";
+    LOG(ss.str());
+    WakeCompactor();
+}
+
+// Not the last Bin, nothing being inserted: a Run of it is for good, till
+// the Bin is compacted or updated in place
+bool Collection::NeedsRangeRuns(uint32 binIdx)
+{
+    Bin<Z2raw> * bin = bins[binIdx];
+    if ((bin == bins.back()) || bin->HasPending())
+        return (false);
+
+    cuint64 version = bin->atomsVersion();
+    for (uint32 idx = 0; idx < s_numRangeIndexes.load(); ++idx)
+    {
+        auto run = s_rangeIndexes[idx].load()->run(binIdx);
+        if (!run || !run->current(bin, version))
+            return (true);
+    }
+    return (false);
+}
+
+void Collection::BuildRangeRuns(uint32 binIdx)
+{
+    Bin<Z2raw> * bin = bins[binIdx];
+
+    // before the atoms are read: updated meanwhile, the Run is not current
+    cuint64 version = bin->atomsVersion();
+    ResidentBin resident(*this, bin);
+    cuint32 numElems = bin->Get()->s_nFreeElemIdx;
+    for (uint32 idx = 0; idx < s_numRangeIndexes.load(); ++idx)
+    {
+        RangeIndex * index = s_rangeIndexes[idx].load();
+        auto current = index->run(binIdx);
+        if (current && current->current(bin, version))
+            continue;
+
+        std::shared_ptr<RangeIndex::Run> run = std::make_shared<RangeIndex::Run>(bin, version);
+        RangeIndex::Key key;
+        for (uint32 elemIdx = 0; elemIdx < numElems; ++elemIdx)
+        {
+            if (bin->Get()->s_vElems[elemIdx].status() != ElemState::ElemActive)
+                continue;
+            AtomRange<Z2raw> range = bin->get_elem_range(elemIdx);
+            if (index->key(range.begin(), range.end(), key))
+            {
+                run->add(key, elemIdx);
+            }
+        }
+        run->finish();
+        index->put(binIdx, run);
+        ++x_rangeRuns;
+    }
+}
+
+const BitmapIndex * Collection::FindBitmapIndex(Z2name name) const
+{
+    cuint32 numIndexes = s_numBitmapIndexes.load();
+    for (uint32 idx = 0; idx < numIndexes; ++idx)
+    {
+        const BitmapIndex * index = s_bitmapIndexes[idx].load();
+        if (index->name() == name)
+            return (index);
+    }
+    return (nullptr);
+}
+
+void Collection::CreateBitmapIndex(Z2name name)
+{
+    {
+        std::lock_guard<std::mutex> indexes(m_indexesMutex);
+        if (FindBitmapIndex(name) != nullptr)
+            return;
+        cuint32 numIndexes = s_numBitmapIndexes.load();
+        if (numIndexes == MAX_BITMAP_INDEXES)
+            throw std::exception("Too many bitmap indexes.");
+        s_bitmapIndexes[numIndexes].store(new BitmapIndex(name));
+        s_numBitmapIndexes.store(numIndexes + 1);
+    }
+
+    std::stringstream ss;
+    ss << "Collection " << this->name() << " bitmap index on Z2name " << name
+       << ", Bitmaps of " << bins.size() - 1 << " Bins to build.";
+    LOG(ss.str());
+    WakeCompactor();
+}
+
+// Same as the Runs: for good once the Bin is full, till it is compacted
+// or updated in place
+bool Collection::NeedsBitmaps(uint32 binIdx)
+{
+    Bin<Z2raw> * bin = bins[binIdx];
+    if ((bin == bins.back()) || bin->HasPending())
+        return (false);
+
+    cuint64 version = bin->atomsVersion();
+    cuint32 numElems = bin->Get()->s_nFreeElemIdx;
+    for (uint32 idx = 0; idx < s_numBitmapIndexes.load(); ++idx)
+    {
+        auto bitmaps = s_bitmapIndexes[idx].load()->bitmaps(binIdx);
+        if (!bitmaps || !bitmaps->current(bin, version, numElems))
+            return (true);
+    }
+    return (false);
+}
+
+void Collection::BuildBitmaps(uint32 binIdx)
+{
+    Bin<Z2raw> * bin = bins[binIdx];
+
+    // before the atoms are read: updated meanwhile, they are not current
+    cuint64 version = bin->atomsVersion();
+    ResidentBin resident(*this, bin);
+    cuint32 numElems = bin->Get()->s_nFreeElemIdx;
+    for (uint32 idx = 0; idx < s_numBitmapIndexes.load(); ++idx)
+    {
+        BitmapIndex * index = s_bitmapIndexes[idx].load();
+        auto current = index->bitmaps(binIdx);
+        if (current && current->current(bin, version, numElems))
+            continue;
+
+        std::shared_ptr<BitmapIndex::Bitmaps> bitmaps = std::make_shared<BitmapIndex::Bitmaps>(bin, version, numElems);
+        for (uint32 elemIdx = 0; elemIdx < numElems; ++elemIdx)
+        {
+            if (bin->Get()->s_vElems[elemIdx].status() != ElemState::ElemActive)
+                continue;
+            AtomRange<Z2raw> range = bin->get_elem_range(elemIdx);
+            index->add(range.begin(), range.end(), elemIdx, *bitmaps);
+        }
+        bitmaps->finish();
+        index->put(binIdx, bitmaps);
+        ++x_bitmapsBuilt;
+    }
+}
+
+void Collection::grow()
+{
+    std::stringstream ss;
+    if (!BelowMaxBins(bins.size()))
+    {
+        ss << "Collection " << name() << " has reached its maximum of " << m_cfgi.maxBinNum << " Bins.";
+        throw std::exception(ss.str().c_str());
+    }
+    ss << "Collection " << name() << " adding one Bin to " << bins.size() + 1;
+    if (m_cfgi.binMaxSize >= 1024 * 1024)
+    {
+        ss << " (" << m_cfgi.binMaxSize / (1024*1024) << " MB each Bin).";
+    }
+    else {
+        ss << " (" << m_cfgi.binMaxSize / (1024) << " KB each Bin).";
+    }
+#ifndef NDEBUG
+    if (bins.size() > 0) {
+        ss << " Last Bin contains " << bins.back()->s_nFreeElemIdx << " elements";
+    }
+#endif
+    // round robin over the NUMA nodes, whoever is inserting
+    cuint32 binIdx = (uint32) bins.size();
+    cuint32 node = Numa::Node(binIdx);
+    if (node != ANY_NODE)
+    {
+        ss << " On NUMA node " << node << ".";
+    }
+    Bin<Z2raw> * spare = TakeSpare(binIdx);
+    if (spare != nullptr)
+    {
+        ss << " Spare.";
+    }
+    LOG(ss.str());
+
+
+    uint64 expected_size = Bin<Z2raw>::ComputeSize(m_cfgi.binMaxElems, m_cfgi.binMaxSize);
+    (void) expected_size;
+    //Create
+
+    if (spare != nullptr)
+    {
+        grow(spare);
+        ++x_binsFromSpare;
+    }
+    else if (IsMapped())
+    {
+        grow(CreateMappedBin(binIdx));
+        ++x_binsAllocated;
+    }
+    else {
+        grow(new Bin<Z2raw>(binIdx, m_cfgi.binMaxElems, m_cfgi.binMaxSize, node));
+        ++x_binsAllocated;
+    }
+}
+
+// The spare for 'binIdx', if ready. Spares for other indexes are stale: a
+// Bin was added while they were being made.
+Bin<Z2raw> * Collection::TakeSpare(uint32 binIdx)
+{
+    Bin<Z2raw> * ret = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(m_sparesMutex);
+        while (!m_spares.empty() && (m_spares.front()->binIdx() != binIdx))
+        {
+            delete m_spares.front();
+            m_spares.pop_front();
+        }
+        if (!m_spares.empty())
+        {
+            ret = m_spares.front();
+            m_spares.pop_front();
+        }
+        // there is work again
+        m_sparesIdle = false;
+    }
+    m_sparesCond.notify_one();
+    return (ret);
+}
+
+// Keeps m_cfgi.spareBins Bins ready: an inserter finding the last Bin full
+// only swaps one in, instead of allocating and faulting in a whole Bin
+// while the others sleep.
+void Collection::PrepareSpares()
+{
+    DEBUG_ONLY_SET_THREAD_NAME("Spare Bins");
+
+    std::unique_lock<std::mutex> lock(m_sparesMutex);
+    auto idle = [this, &lock]()
+    {
+        m_sparesIdle = true;
+        m_sparesIdleCond.notify_all();
+        m_sparesCond.wait(lock);
+        m_sparesIdle = false;
+    };
+    while (!m_stopping)
+    {
+        cuint32 binIdx = static_cast<uint32>(bins.size() + m_spares.size());
+        if ((m_spares.size() >= m_cfgi.spareBins) || !BelowMaxBins(binIdx))
+        {
+            idle();
+            continue;
+        }
+        lock.unlock();
+
+        Bin<Z2raw> * bin = nullptr;
+        try
+        {
+            bin = new Bin<Z2raw>(binIdx, m_cfgi.binMaxElems, m_cfgi.binMaxSize, Numa::Node(binIdx));
+            PageAllocator::Prefault(bin->f_pRaw, bin->f_binSizeBytes);
+            AddPromotedColumns(bin);
+        }
+        catch (std::exception & ex)
+        {
+            delete bin;
+            bin = nullptr;
+            std::stringstream ss;
+            ss << "Collection " << name() << ": failed preparing spare Bin " << binIdx << ": '" << ex.what() << "'";
+            LOG(ss.str());
+        }
+
+        lock.lock();
+        if (bin == nullptr)
+        {
+            // try again when a Bin is added
+            idle();
+            continue;
+        }
+        m_spares.push_back(bin);
+    }
+}
+
+uint32 Collection::WaitForSpares()
+{
+    std::unique_lock<std::mutex> lock(m_sparesMutex);
+    if (!m_sparesThread.joinable())
+        return (0);
+    m_sparesIdleCond.wait(lock, [this]() { return (m_sparesIdle || m_stopping); });
+    return (static_cast<uint32>(m_spares.size()));
+}
+
+// Not the last Bin: inserts go there. Not while elements are being
+// inserted: once a Bin is not the last one no more are.
+bool Collection::NeedsCompaction(const Bin<Z2raw> * bin) const
+{
+    cuint64 numElems = bin->Get()->s_nFreeElemIdx.load();
+    cuint64 removed = bin->numDeleted();
+    return ((removed > 0) &&
+            (removed * 100 >= numElems * COMPACT_REMOVED_PERCENT) &&
+            (bin != bins.back()) &&
+            !bin->HasPending());
+}
+
+void Collection::CompactBin(uint32 binIdx)
+{
+    Bin<Z2raw> * old = bins[binIdx];
+
+    // not spilled till it goes: its file is the one of 'fresh' then
+    std::unique_ptr<ResidentBin> resident(new ResidentBin(*this, old));
+
+    // updates in place that did not see the mark are over before the copy
+    old->MarkCompacting();
+    m_epoch.synchronize();
+    std::vector<uint32> moved;
+    Bin<Z2raw> * fresh = Bin<Z2raw>::Compact(*old, moved);
+
+    // the indexes find the elements where they go before they are there:
+    // lookups check what they find on the Bin
+    std::lock_guard<std::mutex> indexes(m_indexesMutex);
+    cuint32 numIndexes = s_numHashIndexes.load();
+    for (uint32 idx = 0; idx < moved.size(); ++idx)
+    {
+        IndexElem(fresh, idx);
+    }
+    {
+        // PromoteColumn adds to the Bins it finds: the one swapped in has its columns already
+        std::lock_guard<std::mutex> guard(m_columnsMutex);
+        for (Z2name name : m_promoted)
+        {
+            fresh->AddColumn(name);
+        }
+
+        // built for 'old': another Bin can be allocated where it was
+        for (uint32 idx = 0; idx < s_numRangeIndexes.load(); ++idx)
+        {
+            s_rangeIndexes[idx].load()->put(binIdx, nullptr);
+        }
+        for (uint32 idx = 0; idx < s_numBitmapIndexes.load(); ++idx)
+        {
+            s_bitmapIndexes[idx].load()->put(binIdx, nullptr);
+        }
+        bins.replace(binIdx, fresh);
+    }
+    m_epoch.synchronize();
+
+    // removed in 'old' while it was copied, or by queries that matched there
+    uint32 late = 0;
+    for (uint32 idx = 0; idx < moved.size(); ++idx)
+    {
+        if ((old->Get()->s_vElems[moved[idx]].status() != ElemState::ElemActive) && fresh->RemoveElem(idx))
+            ++late;
+    }
+
+    // entries of the old elemIdx, but where the element now there has the same key
+    cuint32 oldElems = old->Get()->s_nFreeElemIdx;
+    for (uint32 indexIdx = 0; indexIdx < numIndexes; ++indexIdx)
+    {
+        HashIndex * index = s_hashIndexes[indexIdx].load();
+        for (uint32 idx = 0; idx < oldElems; ++idx)
+        {
+            if (uint64(old->Get()->s_vElems[idx]) == 0ULL)
+                continue;
+            AtomRange<Z2raw> was = old->get_elem_range(idx);
+            if (idx < moved.size())
+            {
+                AtomRange<Z2raw> now = fresh->get_elem_range(idx);
+                index->remove(was.begin(), was.end(), MakeInsertHandle(binIdx, idx), now.begin(), now.end());
+            }
+            else {
+                index->remove(was.begin(), was.end(), MakeInsertHandle(binIdx, idx));
+            }
+        }
+    }
+    ++x_binsCompacted;
+
+    std::stringstream ss;
+    ss << "Collection " << name() << " compacted Bin " << binIdx << ": " << moved.size() << " elements kept out of "
+       << old->Get()->s_nFreeElemIdx.load() << ", " << late << " removed meanwhile.";
+    LOG(ss.str());
+    resident.reset();
+    delete old;
+}
+
+// Not the last Bin, nothing being inserted: it takes no more elements.
+bool Collection::NeedsSealing(Bin<Z2raw> * bin) const
+{
+    return ((bin != bins.back()) && !bin->HasPending() && (!bin->sealed() || bin->Unsealed()));
+}
+
+// Packs the promoted columns of a full Bin. Scans read the packed columns
+// as soon as they are there; the 16-byte entries go when no scan can still
+// be reading them. An inserter that took the Bin when it was the last is
+// gone then too: after that it can spill. The atoms are not packed: a Bin
+// is no smaller than without columns, and only spilling takes them out.
+void Collection::SealBin(uint32 binIdx)
+{
+    Bin<Z2raw> * bin = bins[binIdx];
+    cuint32 packed = bin->Seal(&m_strings);
+    if ((packed == 0) && bin->sealed())
+        return;
+    m_epoch.synchronize();
+    bool closed = false;
+    if (!bin->sealed() && !bin->HasPending())
+    {
+        bin->MarkSealed();
+        closed = true;
+        ++x_binsClosed;
+        x_sealKeptBytes += bin->usedAtoms() * sizeof(Z2raw);
+    }
+    cuint64 freed = (packed > 0) ? bin->DropSealed() : 0ULL;
+    if (packed > 0)
+    {
+        ++x_binsPacked;
+        x_sealFreedBytes += freed;
+    }
+    if (!closed && (packed == 0))
+        return;
+
+    std::stringstream ss;
+    ss << "Collection " << name() << " sealed Bin " << binIdx << ": " << packed << " promoted columns packed, "
+       << freed / 1024 << " KB of column entries freed, " << bin->usedAtoms() * sizeof(Z2raw) / 1024 << " KB of atoms kept as they are.";
+    LOG(ss.str());
+}
+
+void Collection::WakeCompactor()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_compactMutex);
+        m_compactPending = true;
+    }
+    m_compactCond.notify_one();
+}
+
+// Rewrites Bins with many removed elements, after Remove says there are
+// some, seals the full ones and spills the cold ones over the budget. Queries and inserters go on meanwhile:
+// they see the old Bin or the new one, and the old one is freed only when
+// nobody can see it.
+void Collection::CompactBins()
+{
+    DEBUG_ONLY_SET_THREAD_NAME("Compactor");
+
+    std::unique_lock<std::mutex> lock(m_compactMutex);
+    while (!m_compactStop)
+    {
+        if (!m_compactPending)
+        {
+            m_compactCond.wait(lock);
+            continue;
+        }
+        m_compactPending = false;
+        ++m_compactPassesStarted;
+        lock.unlock();
+
+        try
+        {
+            for (uint32 binIdx = 0; binIdx < bins.size(); ++binIdx)
+            {
+                if (NeedsCompaction(bins[binIdx]))
+                {
+                    CompactBin(binIdx);
+                }
+                if (NeedsSealing(bins[binIdx]))
+                {
+                    SealBin(binIdx);
+                }
+                if (NeedsRangeRuns(binIdx))
+                {
+                    BuildRangeRuns(binIdx);
+                }
+                if (NeedsBitmaps(binIdx))
+                {
+                    BuildBitmaps(binIdx);
+                }
+            }
+            if (m_cfgi.budget != nullptr)
+            {
+                m_cfgi.budget->Enforce();
+            }
+        }
+        catch (std::exception & ex)
+        {
+            std::stringstream ss;
+            ss << "Collection " << name() << ": failed compacting, sealing or spilling Bins: '" << ex.what() << "'";
+            LOG(ss.str());
+        }
+
+        lock.lock();
+        ++m_compactPassesDone;
+        m_compactDoneCond.notify_all();
+    }
+    m_compactDoneCond.notify_all();
+}
+
+uint64 Collection::WaitForCompactor()
+{
+    std::unique_lock<std::mutex> lock(m_compactMutex);
+    if (!m_compactorThread.joinable())
+        return (0);
+    // a pass running now may have gone past some Bins already: the next one
+    m_compactPending = true;
+    cuint64 pass = m_compactPassesStarted + 1;
+    m_compactCond.notify_one();
+    m_compactDoneCond.wait(lock, [this, pass]() { return ((m_compactPassesDone >= pass) || m_compactStop); });
+    return (m_compactPassesDone);
+}
+
+Path Collection::ComposeBinSerializedPath(cuint32 binIdx)
+{
+    Path retpath = m_percyCollectionBasePath
+        .Append(Platform::DOT)
+        .Append(std::to_string(binIdx))
+        .Append(Platform::DOT)
+        .Append(IsMapped() ? MAPPED_BIN_EXTENSION : BIN_SERIALIZATION_EXTENSION);
+
+    return (retpath);
+}
+
+void Collection::PersistAll()
+{
+    // Persist configuration
+    // ...
+    LF::epoch_guard guard(m_epoch);
+
+    std::for_each(bins.begin(), bins.end(),
+        [this](Bin<Z2raw>* bin)
+    {
+        if (IsMapped())
+        {
+            FlushMappedBin(bin);
+        }
+        else if (bin->PinSpilled())
+        {
+            // from its spill file, one at a time: not read back for this
+            Z2raw * raw = nullptr;
+            try
+            {
+                raw = ReadSpill(bin);
+                SerializeBin(bin, raw);
+            }
+            catch (...)
+            {
+                if (raw != nullptr)
+                {
+                    PageAllocator::Free(raw, bin->binByteSize());
+                }
+                bin->Unpin();
+                throw;
+            }
+            PageAllocator::Free(raw, bin->binByteSize());
+            bin->Unpin();
+        }
+        else {
+            ResidentBin resident(*this, bin);
+            SerializeBin(bin, bin->Get()->f_pRaw);
+        }
+    });
+
+    PercyFS percy(ComposeBlobsPath());
+    m_blobs.Persist(percy);
+    percy.Flush();
+}
+
+Path Collection::ComposeBlobsPath() const
+{
+    Path retpath = m_percyCollectionBasePath
+        .Append(Platform::DOT)
+        .Append(BLOBS_EXTENSION);
+
+    return (retpath);
+}
+
+Path Collection::ComposeBinSpillPath(cuint32 binIdx) const
+{
+    Path retpath = m_percyCollectionBasePath
+        .Append(Platform::DOT)
+        .Append(std::to_string(binIdx))
+        .Append(Platform::DOT)
+        .Append(SPILLED_BIN_EXTENSION);
+
+    return (retpath);
+}
+
+// Only the atoms: ElemInfo, zone maps and columns stay in memory. The
+// file is made empty first: that of an earlier spill may be longer.
+void Collection::WriteSpill(const Bin<Z2raw> * bin) const
+{
+    cuint64 usedBytes = bin->usedAtoms() * sizeof(Z2raw);
+    const Path path = ComposeBinSpillPath(bin->binIdx());
+    FILE * file = nullptr;
+    if (0 != fopen_s(&file, std::string(path).c_str(), "wb"))
+    {
+        std::stringstream msg;
+        msg << "Collection " << m_cfgi.name << ".\n";
+        msg << "Error creating the spill file of Bin " << bin->binIdx() << ".";
+        throw std::exception(msg.str().c_str());
+    }
+    fclose(file);
+
+    PercyFS percy(path);
+    percy.PersistUint32(bin->binIdx());
+    percy.PersistUint64(bin->binByteSize());
+    percy.PersistUint64(usedBytes);
+    percy.PersistBlob(bin->Get()->f_pRaw, usedBytes);
+    percy.Flush();
+}
 
-        //printf("Stage1: iterations %llu,  slow threads=%llu,  cancellations=%llu\n",
-        //    lastQueryCounters.stage1Iterations, lastQueryCounters.stage1ThreadsSlowed, lastQueryCounters.cancellations);
+// Its atoms from the spill file, in new zeroed pages: past the last
+// element they are as they were
+Z2raw * Collection::ReadSpill(const Bin<Z2raw> * bin) const
+{
+    DepercyFS percy(ComposeBinSpillPath(bin->binIdx()));
+    cuint32 binIdx = percy.DeserializeUint32();
+    cuint64 binByteSize = percy.DeserializeUint64();
+    cuint64 usedBytes = percy.DeserializeUint64();
+    if ((binIdx != bin->binIdx()) || (binByteSize != bin->binByteSize()) || (usedBytes > binByteSize))
+    {
+        std::stringstream msg;
+        msg << "Collection " << m_cfgi.name << ".\n";
+        msg << "Error reading back spilled Bin " << bin->binIdx() << ": not its file.";
+        throw std::exception(msg.str().c_str());
     }
-    catch (std::exception & ex)
+
+    Z2raw * raw = Bin<Z2raw>::AllocateBinRaw(binByteSize, bin->numaNode());
+    try
     {
-        std::stringstream ss;
-        ss << "Collection " << name() << " c++ exception in " << __FUNCTION__ << ": " << ex.what();
-        LOG(ss.str());
+        percy.DeserializeBlob(raw, usedBytes);
     }
     catch (...)
     {
-        std::stringstream ss;
-        ss << "Collection " << name() << " unknown exception in " << __FUNCTION__;
-        LOG(ss.str());
+        PageAllocator::Free(raw, binByteSize);
+        throw;
     }
-
-    return (ret);
+    return (raw);
 }
 
-// returns number of z2 elements in retbuf
-uint32 Collection::FindAndProject(uint64 transId, opt<Projections&> onames, Buffer & retbuf, const Z2FindQuery * z2query)
+// After Pin() said OnDisk
+void Collection::FaultIn(Bin<Z2raw> * bin) const
 {
-    typedef QueryContext<uint32, LFTStage3, Stage1Payload> QC;  // 3rd is LFTidx
-
-    uint32 ret = 0;
+    Z2raw * raw = nullptr;
     try
     {
-        std::vector<Stage2> stage2PerBin(bins.size());
-        uint32 numLFTs = z2query->lft_size();
-
-        auto stage2_lambda = [this, &stage2PerBin]
-        // elemIdx, LFTidx
-        (FullSlot<uint32, Stage1Payload> slot)
-        {
-            cuint32 LFTidx = std::get<2>(slot).first;
-            cuint32 binIdx = std::get<2>(slot).second;
-            Stage2 & stage2 = stage2PerBin[binIdx];
-            std::for_each(std::get<0>(slot), std::get<1>(slot),
-                [&stage2, LFTidx](uint32 elemIdx)
-            {
-                stage2.add(elemIdx, LFTidx);
-            });
-        };
-        auto handle2LFTidx = [](xHandle handle) -> uint32 { return (static_cast<uint32>(handle & 0xFFFFFFFF)); };
-        auto queryCtx = CreateQueryProcessor<QC>(transId, retbuf, z2query, handle2LFTidx);
-
-        auto stage3_lambda =
-            [&stage2PerBin, &queryCtx, z2query, numLFTs](uint32 binIdx)
-        {
-            if (stage2PerBin[binIdx].size() > 0)
-            {
-                FindProcessData(numLFTs, stage2PerBin[binIdx], *z2query, queryCtx->matchesPerBin[binIdx]);
-            }
-        };
-
-        queryCtx->ProcessQuery(stage2_lambda, stage3_lambda);
-
-        ret = FindProjectPhase(queryCtx->matchesPerBin, retbuf, onames);
-
-        lastQueryCounters = queryCtx->metrics;
+        raw = ReadSpill(bin);
     }
     catch (std::exception & ex)
     {
+        bin->Loaded(nullptr);
         std::stringstream ss;
-        ss << "Collection " << name() << " c++ exception in " << __FUNCTION__ << ": " << ex.what();
+        ss << "Collection " << name() << ": failed reading back Bin " << bin->binIdx() << ": '" << ex.what() << "'";
         LOG(ss.str());
+        throw;
     }
-    catch (...)
+    bin->Loaded(raw);
+
+    // it is pinned: others go if that is over the budget
+    if (m_cfgi.budget != nullptr)
     {
-        std::stringstream ss;
-        ss << "Collection " << name() << " unknown exception in " << __FUNCTION__;
-        LOG(ss.str());
+        m_cfgi.budget->Enforce();
     }
-
-    return (ret);
 }
 
-uint32 Collection::FindAndReturnAll(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query)
+void Collection::LoadBin(Bin<Z2raw> * bin)
 {
-    return FindAndProject(transId, opt<Projections&>(), retbuf, z2query);
+    m_loadQueue.enqueue(bin);
 }
 
-void Collection::grow(Bin<Z2raw>* bin)
+// One of the loaders: the spilled Bins the queries pinned, in order
+void Collection::LoadBins()
 {
-    bins.add(bin);
+    DEBUG_ONLY_SET_THREAD_NAME("Loader");
+
+    for (Bin<Z2raw> * bin = m_loadQueue.dequeue(); bin != nullptr; bin = m_loadQueue.dequeue())
+    {
+        try
+        {
+            FaultIn(bin);
+        }
+        catch (std::exception &)
+        {
+            // logged, and OnDisk again: the queries waiting for it throw
+        }
+    }
 }
 
-void Collection::grow()
+Collection::ResidentBin::ResidentBin(const Collection & coll, Bin<Z2raw> * bin)
+    : m_bin(bin)
 {
-    std::stringstream ss;
-    ss << "Collection " << name() << " adding one Bin to " << bins.size() + 1;
-    if (m_cfgi.binMaxSize >= 1024 * 1024)
+    try
     {
-        ss << " (" << m_cfgi.binMaxSize / (1024*1024) << " MB each Bin).";
-    }
-    else {
-        ss << " (" << m_cfgi.binMaxSize / (1024) << " KB each Bin).";
+        if (bin->Pin() == Residency::OnDisk)
+        {
+            coll.FaultIn(bin);
+        }
+
+        // a query is reading it back
+        if (!bin->WaitResident())
+            throw EXCEPTION("Bin %u could not be read back from disk", bin->binIdx());
     }
-#ifndef NDEBUG
-    if (bins.size() > 0) {
-        ss << " Last Bin contains " << bins.back()->s_nFreeElemIdx << " elements";
+    catch (...)
+    {
+        bin->Unpin();
+        throw;
     }
-#endif
-    LOG(ss.str());
-
-
-    uint64 expected_size = Bin<Z2raw>::ComputeSize(m_cfgi.binMaxElems, m_cfgi.binMaxSize);
-    (void) expected_size;
-    //Create
-
-    grow(new Bin<Z2raw>((uint32) bins.size(), m_cfgi.binMaxElems, m_cfgi.binMaxSize));
 }
 
-Path Collection::ComposeBinSerializedPath(cuint32 binIdx)
+uint64 Collection::ResidentBytes()
 {
-    Path retpath = m_percyCollectionBasePath
-        .Append(Platform::DOT)
-        .Append(std::to_string(binIdx))
-        .Append(Platform::DOT)
-        .Append(BIN_SERIALIZATION_EXTENSION);
-
-    return (retpath);
+    uint64 ret = 0ULL;
+    LF::epoch_guard guard(m_epoch);
+    for (auto bin : bins)
+    {
+        if (bin->residency() != Residency::OnDisk)
+        {
+            ret += bin->binByteSize();
+        }
+    }
+    return (ret);
 }
 
-void Collection::PersistAll()
+// The last Bin takes the inserts: never spilled
+bool Collection::ColdestBin(uint64 & lastScan, uint32 & binIdx)
 {
-    // Persist configuration
-    // ...
+    bool ret = false;
+    LF::epoch_guard guard(m_epoch);
+    cuint32 numBins = static_cast<uint32>(bins.size());
+    for (uint32 idx = 0; idx + 1 < numBins; ++idx)
+    {
+        const Bin<Z2raw> * bin = bins[idx];
+        if (bin->sealed() && (bin->residency() == Residency::InMemory) && (!ret || (bin->lastScan() < lastScan)))
+        {
+            lastScan = bin->lastScan();
+            binIdx = idx;
+            ret = true;
+        }
+    }
+    return (ret);
+}
 
-    std::for_each(bins.begin(), bins.end(),
-        [this](const Bin<Z2raw>* bin)
+// A query pinning it meanwhile keeps it: its atoms were written for nothing,
+// but the next spill does not write them again.
+uint64 Collection::SpillBin(uint32 binIdx)
+{
+    LF::epoch_guard guard(m_epoch);
+    Bin<Z2raw> * bin = bins[binIdx];
+    uint64 version;
+    bool written;
+    if (!bin->BeginSpill(version, written))
+        return (0ULL);
+    try
     {
-        SerializeBin(bin);
-    });
+        if (!written)
+        {
+            WriteSpill(bin);
+        }
+    }
+    catch (...)
+    {
+        bin->AbortSpill();
+        throw;
+    }
+    cuint64 freed = bin->EndSpill(version);
+    if (freed == 0ULL)
+        return (0ULL);
+    ++x_binsSpilled;
+
+    std::stringstream ss;
+    ss << "Collection " << name() << " spilled Bin " << binIdx << ": " << freed / 1024 << " KB freed"
+       << (written ? ", written already." : ".");
+    LOG(ss.str());
+    return (freed);
 }
 
 void Collection::DeserializeAll()
@@ -332,13 +1896,29 @@ void Collection::DeserializeAll()
         Path path = ComposeBinSerializedPath(idx);
         if (!path.Exists())
             break;
-        auto bin = DeserializeBin(path);
+        auto bin = IsMapped() ? OpenMappedBin(path, idx) : DeserializeBin(path);
         grow(bin);
+
+        // the _id index is not persisted
+        for (uint32 elemIdx = 0; elemIdx < bin->Get()->s_nFreeElemIdx; ++elemIdx)
+        {
+            if (bin->Get()->s_vElems[elemIdx].status() == ElemState::ElemActive)
+            {
+                IndexElem(bin, elemIdx);
+            }
+        }
+    }
+    Path blobs = ComposeBlobsPath();
+    if (blobs.Exists())
+    {
+        DepercyFS percy(blobs);
+        m_blobs.Reload(percy);
     }
     // ....
 }
 
-void Collection::SerializeBin(const Bin<Z2raw> * bin)
+// 'raw': its atoms, in memory or read from its spill file
+void Collection::SerializeBin(const Bin<Z2raw> * bin, const Z2raw * raw)
 {
     uint32 binIdx = bin->binIdx();
     uint64 binByteSize = bin->binByteSize();
@@ -372,7 +1952,7 @@ void Collection::SerializeBin(const Bin<Z2raw> * bin)
         percy.PersistUint64(elem);
     });
 
-    percy.PersistBlob(bincore->f_pRaw, binByteSize);
+    percy.PersistBlob(raw, binByteSize);
 
     uint64 cursize = percy.GetCurrentSize();
 
@@ -396,7 +1976,8 @@ Bin<Z2raw> *Collection::DeserializeBin(Path path)
     bincore.s_nFreeElemIdx.store(elemsToCopy);
     bincore.s_vElems.resize(elemsSize);
 
-    bincore.f_pRaw = Core::Bin<Z2raw>::AllocateBinRaw(static_cast<uint32>(binByteSize));
+    cuint32 node = Numa::Node(binIdx);
+    bincore.f_pRaw = Core::Bin<Z2raw>::AllocateBinRaw(static_cast<uint32>(binByteSize), node);
 
     for (uint32 idx=0U; idx!=elemsToCopy; ++idx)
     {
@@ -414,12 +1995,115 @@ Bin<Z2raw> *Collection::DeserializeBin(Path path)
         throw std::exception(msg.str().c_str());
     }
 
-    Bin<Z2raw> * bin = new Bin<Z2raw>(binIdx, binByteSize, std::move(bincore));
+    Bin<Z2raw> * bin = new Bin<Z2raw>(binIdx, binByteSize, std::move(bincore), node);
     bin->x_nNumActive = nNumActive;
     bin->x_nNumDeleted = nNumDeleted;
     return (bin);
 }
 
+Bin<Z2raw> * Collection::CreateMappedBin(uint32 binIdx)
+{
+    cuint32 elemsSize = m_cfgi.binMaxElems;
+    cuint64 rawOffset = MappedRawOffset(elemsSize);
+    cuint32 node = Numa::Node(binIdx);
+
+    // a new file reads as zero: no need to clear the atoms
+    std::unique_ptr<MappedFile> file(new MappedFile(ComposeBinSerializedPath(binIdx), rawOffset + m_cfgi.binMaxSize, node));
+    MappedBinHeader * header = reinterpret_cast<MappedBinHeader*>(file->data());
+    header->magic = MAPPED_BIN_MAGIC;
+    header->binIdx = binIdx;
+    header->elemsSize = elemsSize;
+    header->binByteSize = m_cfgi.binMaxSize;
+
+    Bin<Z2raw> * bin = new Bin<Z2raw>(binIdx, elemsSize, m_cfgi.binMaxSize, reinterpret_cast<Z2raw*>(file->data() + rawOffset), node);
+    bin->f_mapped = std::move(file);
+    return (bin);
+}
+
+Bin<Z2raw> * Collection::OpenMappedBin(Path path, uint32 binIdx)
+{
+    cuint32 node = Numa::Node(binIdx);
+    std::unique_ptr<MappedFile> file(new MappedFile(path, node));
+    const MappedBinHeader * header = reinterpret_cast<const MappedBinHeader*>(file->data());
+
+    if ((file->size() < sizeof(MappedBinHeader)) || (header->magic != MAPPED_BIN_MAGIC) ||
+        (file->size() != MappedRawOffset(header->elemsSize) + header->binByteSize) ||
+        (header->elemsToCopy > header->elemsSize))
+    {
+        std::stringstream msg;
+        msg << "Collection " << m_cfgi.name << ".\n";
+        msg << "Error opening mapped Bin " << std::string(path) << ": not a mapped Bin, or truncated.";
+        throw std::exception(msg.str().c_str());
+    }
+
+    // only the ElemInfo are copied, the atoms are used in place
+    BinCore<Z2raw> bincore(header->elemsSize);
+    bincore.s_nFreeElemIdx.store(header->elemsToCopy);
+    const uint64 * elems = reinterpret_cast<const uint64*>(file->data() + MappedElemsOffset());
+    for (uint32 idx = 0U; idx != header->elemsToCopy; ++idx)
+    {
+        bincore.s_vElems[idx].set(elems[idx]);
+    }
+    bincore.f_pRaw = reinterpret_cast<Z2raw*>(file->data() + MappedRawOffset(header->elemsSize));
+
+    Bin<Z2raw> * bin = new Bin<Z2raw>(header->binIdx, header->binByteSize, std::move(bincore), node);
+    bin->x_nNumActive = header->nNumActive;
+    bin->x_nNumDeleted = header->nNumDeleted;
+    bin->f_mapped = std::move(file);
+    return (bin);
+}
+
+// Writes back what changed since the last flush: atoms are appended, so only
+// the ones from the first element not yet durable on, plus those updated in
+// place; the ElemInfo are small and statuses change anywhere, they are
+// written back whole.
+void Collection::FlushMappedBin(Bin<Z2raw> * bin)
+{
+    MappedFile & file = *bin->f_mapped;
+    MappedBinHeader * header = reinterpret_cast<MappedBinHeader*>(file.data());
+    const BinCore<Z2raw> * bincore = bin->Get();
+    cuint32 elemsToCopy = std::min<uint32>(bincore->s_nFreeElemIdx, header->elemsSize);
+
+    uint64 * elems = reinterpret_cast<uint64*>(file.data() + MappedElemsOffset());
+    for (uint32 idx = 0U; idx != elemsToCopy; ++idx)
+    {
+        elems[idx] = bincore->s_vElems[idx];
+    }
+
+    uint32 durable = header->durableElems;
+    uint64 dirtyFrom = (durable < elemsToCopy) ? bincore->s_vElems[durable].atomIdx() : 0ULL;
+    uint64 dirtyTo = dirtyFrom;
+    for (uint32 idx = durable; idx != elemsToCopy; ++idx)
+    {
+        const ElemInfo & elem = bincore->s_vElems[idx];
+        if (elem.atomSize() == 0)
+            break;
+        dirtyTo = elem.atomIdx() + elem.atomSize();
+        if ((durable == idx) && (elem.status() != ElemState::ElemAcquired))
+        {
+            ++durable;
+        }
+    }
+
+    cuint64 rawOffset = MappedRawOffset(header->elemsSize);
+    file.Flush(rawOffset + dirtyFrom * sizeof(Z2raw), (dirtyTo - dirtyFrom) * sizeof(Z2raw));
+
+    // durable elements updated in place since the last flush
+    uint64 touchedFrom, touchedTo;
+    if (bin->TakeTouched(touchedFrom, touchedTo))
+    {
+        file.Flush(rawOffset + touchedFrom * sizeof(Z2raw), (touchedTo - touchedFrom) * sizeof(Z2raw));
+    }
+    file.Flush(MappedElemsOffset(), elemsToCopy * sizeof(ElemInfo));
+
+    header->elemsToCopy = elemsToCopy;
+    header->durableElems = durable;
+    header->nNumActive = bin->x_nNumActive;
+    header->nNumDeleted = bin->x_nNumDeleted;
+    file.Flush(0, sizeof(MappedBinHeader));
+    file.Sync();
+}
+
 tuple<bool, string> Collection::Compare(const Collection * coll1, const Collection * coll2)
 {
     bool different = false;
@@ -434,6 +2118,8 @@ tuple<bool, string> Collection::Compare(const Collection * coll1, const Collecti
 
     for (uint idx = 0; idx != coll1->GetNumBins(); ++idx)
     {
+        ResidentBin resident1(*coll1, coll1->bins[idx]);
+        ResidentBin resident2(*coll2, coll2->bins[idx]);
         auto ret = CompareBins(coll1->bins[idx], coll2->bins[idx]);
         different = (different || !std::get<0>(ret));
         ss << std::get<1>(ret);
@@ -486,54 +2172,163 @@ tuple<bool, string> Collection::CompareBins(const Bin<Z2raw> * bin1, const Bin<Z
 bool Collection::ReleaseInsertBuffer(void * buffer)
 {
     bool found = false;
+    LF::epoch_guard guard(m_epoch);
 
     std::for_each(bins.begin(), bins.end(),
-        [&found, buffer](Bin<Z2raw>* bin)
+        [this, &found, buffer](Bin<Z2raw>* bin)
     {
         if (bin->contains(buffer))
         {
-            bin->ReleaseBuffer(buffer);
-            found = true;
+            cuint32 elemIdx = bin->AcquiredElem(buffer);
+            if (ClaimId(bin, elemIdx))
+            {
+                bin->ReleaseElems(&elemIdx, 1);
+                IndexElem(bin, elemIdx, true);
+                found = true;
+            }
+            else {
+                bin->DiscardElem(elemIdx);
+            }
         }
     });
 
     return (found);
 }
 
+// 'bin' could not take a document of 'sizeBytes': false when no Bin ever will
+bool Collection::GrowFrom(const Bin<Z2raw> * bin, uint32 sizeBytes)
+{
+    cuint32 atomSize = (sizeBytes + sizeof(Z2raw) - 1) / sizeof(Z2raw);
+    if (AppendCursor::oversized(atomSize, bin->binSizeAtoms()))
+    {
+        std::stringstream ss;
+        ss << "Collection " << name() << ": a document of " << sizeBytes << " bytes does not fit in a Bin. Insert failed.";
+        LOG(ss.str());
+        return (false);
+    }
+
+    // full: one inserter adds a Bin, unless somebody did already
+    bool newvalue = true;
+    bool expected = false;
+    if (s_growing.compare_exchange_strong(expected, newvalue))
+    {
+        try
+        {
+            if (bins.back() == bin)
+            {
+                grow();
+            }
+            s_growing.store(false);
+        }
+        catch (...)
+        {
+            s_growing.store(false);
+            std::stringstream ss;
+            ss << "Collection " << name() << ": failed adding Bin. Current bin number is " << bins.size() << ". Insert failed.";
+            LOG(ss.str());
+            return (false);
+        }
+    }
+    else
+    {
+        ++x_growWaits;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return (true);
+}
+
 void * Collection::AcquireInsertBuffer(uint32 sizeBytes)
 {
+    // the last Bin can fill up and be compacted under us
+    LF::epoch_guard guard(m_epoch);
     for (;;)
     {
-        try {
-            auto bin = bins.back();
-            return (bin->AcquireBuffer(sizeBytes));
+        auto bin = bins.back();
+        void * ret = bin->AcquireBuffer(sizeBytes);
+        if (ret != nullptr)
+            return (ret);
+
+        if (!GrowFrom(bin, sizeBytes))
+            return nullptr;
+    }
+}
+
+uint32 Collection::AcquireInsertBuffers(uint32 count, const uint32 * sizesBytes, void ** buffers, InsertHandle * handles)
+{
+    std::vector<uint32> elemIdxs(count);
+    uint32 done = 0;
+    LF::epoch_guard guard(m_epoch);
+    while (done < count)
+    {
+        auto bin = bins.back();
+        cuint32 got = bin->AcquireBuffers(count - done, sizesBytes + done, buffers + done, &elemIdxs[done]);
+        for (uint32 idx = done; idx < done + got; ++idx)
+        {
+            handles[idx] = MakeInsertHandle(bin->binIdx(), elemIdxs[idx]);
         }
-        catch (BinFull & ex)
+        done += got;
+
+        if ((got == 0) && !GrowFrom(bin, sizesBytes[done]))
+            break;
+    }
+    return (done);
+}
+
+uint32 Collection::ReleaseInsertBuffers(uint32 count, const InsertHandle * handles, byte * released)
+{
+    if (released != nullptr)
+    {
+        std::fill(released, released + count, byte(0));
+    }
+    std::vector<uint32> elemIdxs;
+    std::vector<uint32> claimed;
+    elemIdxs.reserve(count);
+    claimed.reserve(count);
+    uint32 ret = 0;
+    LF::epoch_guard guard(m_epoch);
+
+    // one call per run of handles in the same Bin
+    for (uint32 first = 0; first < count;)
+    {
+        cuint32 binIdx = static_cast<uint32>(handles[first] >> 32);
+        if (binIdx >= bins.size())
+            throw ReleaseBufferError(nullptr, static_cast<uint32>(handles[first]));  //handled
+
+        elemIdxs.clear();
+        uint32 last = first;
+        for (; (last < count) && (static_cast<uint32>(handles[last] >> 32) == binIdx); ++last)
         {
-            try
+            elemIdxs.push_back(static_cast<uint32>(handles[last]));
+        }
+        Bin<Z2raw> * bin = bins[binIdx];
+        bin->CheckAcquired(elemIdxs.data(), static_cast<uint32>(elemIdxs.size()));
+
+        // a duplicate _id is never active
+        claimed.clear();
+        for (uint32 idx = first; idx < last; ++idx)
+        {
+            cuint32 elemIdx = elemIdxs[idx - first];
+            if (ClaimId(bin, elemIdx))
             {
-                (void) ex;
-                bool newvalue = true;
-                bool expected = false;
-                if (s_growing.compare_exchange_strong(expected, newvalue))
-                {
-                    grow();
-                    s_growing.store(false);
-                }
-                else
+                claimed.push_back(elemIdx);
+                if (released != nullptr)
                 {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    released[idx] = 1;
                 }
             }
-            catch (...)
-            {
-                std::stringstream ss;
-                ss << "Collection " << name() << ": failed adding Bin. Current bin number is " << bins.size() << ". Insert failed.";
-                LOG(ss.str());
-                return nullptr;
+            else {
+                bin->DiscardElem(elemIdx);
             }
         }
+        bin->ReleaseElems(claimed.data(), static_cast<uint32>(claimed.size()));
+        for (uint32 elemIdx : claimed)
+        {
+            IndexElem(bin, elemIdx, true);
+        }
+        ret += static_cast<uint32>(claimed.size());
+        first = last;
     }
+    return (ret);
 }
 
 Collection * Collection::InstantiateBase(cCollectionIntrinsicCfg & cfgi, cCollectionPercyCfg & cfgp, bool deserialize)
@@ -556,11 +2351,48 @@ Collection * Collection::DeserializeFromFile(cCollectionIntrinsicCfg & cfgi, cCo
 Collection::Collection(cCollectionIntrinsicCfg & cfgi, cCollectionPercyCfg & cfgp, bool deserialize)
     : m_cfgi(cfgi),
     m_cfgp(cfgp),
-    bins(cfgi.maxBinNum),
     m_percyCollectionBasePath(cfgp.basePath.Append(Platform::DIR_SEPARATOR)
-                                           .Append(m_cfgi.name))
+                                           .Append(m_cfgi.name)),
+    s_growing(false),
+    m_stopping(false),
+    m_sparesIdle(false),
+    x_binsFromSpare(0ULL),
+    x_binsAllocated(0ULL),
+    x_growWaits(0ULL),
+    m_compactPending(false),
+    m_compactStop(false),
+    m_compactPassesStarted(0ULL),
+    m_compactPassesDone(0ULL),
+    x_binsCompacted(0ULL),
+    x_binsPacked(0ULL),
+    x_binsClosed(0ULL),
+    x_sealFreedBytes(0ULL),
+    x_sealKeptBytes(0ULL),
+    x_binsSpilled(0ULL),
+    m_strings(m_blobs),
+    s_numHashIndexes(0U),
+    x_indexLookups(0ULL),
+    x_duplicateIds(0ULL),
+    s_numRangeIndexes(0U),
+    x_rangeRuns(0ULL),
+    s_numBitmapIndexes(0U),
+    x_bitmapsBuilt(0ULL)
 {
     static_assert(sizeof(ElemInfo) == 8, "sizeof ElemInfo is not what you think");
+    for (uint32 idx = 0; idx < MAX_HASH_INDEXES; ++idx)
+    {
+        s_hashIndexes[idx].store(nullptr);
+    }
+    s_hashIndexes[ID_INDEX].store(new HashIndex(MFDB::Constants::Id_1));
+    s_numHashIndexes.store(ID_INDEX + 1);
+    for (uint32 idx = 0; idx < MAX_RANGE_INDEXES; ++idx)
+    {
+        s_rangeIndexes[idx].store(nullptr);
+    }
+    for (uint32 idx = 0; idx < MAX_BITMAP_INDEXES; ++idx)
+    {
+        s_bitmapIndexes[idx].store(nullptr);
+    }
 
     //FILE_LOG(logINFO) << "Collection " << name << " started. MaxElems=" << binMaxElems << ", MaxSize=" << binMaxSize << ", maxBins=" << (uint32)maxBinNum;
     if (deserialize)
@@ -570,14 +2402,78 @@ Collection::Collection(cCollectionIntrinsicCfg & cfgi, cCollectionPercyCfg & cfg
     {
         grow();
     }
+
+    if (!IsMapped() && (m_cfgi.spareBins > 0))
+    {
+        m_sparesThread = std::thread([this]() { PrepareSpares(); });
+    }
+    // mapped Bins are their files: not rewritten
+    if (!IsMapped())
+    {
+        m_compactorThread = std::thread([this]() { CompactBins(); });
+        for (uint32 idx = 0; idx < NUM_LOADERS; ++idx)
+        {
+            m_loaderThreads.emplace_back([this]() { LoadBins(); });
+        }
+    }
+    if (!IsMapped() && (m_cfgi.budget != nullptr))
+    {
+        m_cfgi.budget->Register(this);
+    }
 }
 
 Collection::~Collection()
 {
+    if (!IsMapped() && (m_cfgi.budget != nullptr))
+    {
+        m_cfgi.budget->Unregister(this);
+    }
+    if (m_sparesThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_sparesMutex);
+            m_stopping = true;
+        }
+        m_sparesCond.notify_one();
+        m_sparesThread.join();
+    }
+    if (m_compactorThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_compactMutex);
+            m_compactStop = true;
+        }
+        m_compactCond.notify_one();
+        m_compactorThread.join();
+    }
+    for (size_t idx = 0; idx < m_loaderThreads.size(); ++idx)
+    {
+        m_loadQueue.enqueue(nullptr);
+    }
+    for (auto & loader : m_loaderThreads)
+    {
+        loader.join();
+    }
+    for (auto bin : m_spares)
+    {
+        delete (bin);
+    }
     for (auto bin : bins)
     {
         delete (bin);
     }
+    for (uint32 idx = 0; idx < s_numHashIndexes.load(); ++idx)
+    {
+        delete s_hashIndexes[idx].load();
+    }
+    for (uint32 idx = 0; idx < s_numRangeIndexes.load(); ++idx)
+    {
+        delete s_rangeIndexes[idx].load();
+    }
+    for (uint32 idx = 0; idx < s_numBitmapIndexes.load(); ++idx)
+    {
+        delete s_bitmapIndexes[idx].load();
+    }
 }
 
 namespace
@@ -0,0 +1,107 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#include "stdafx.h"
+#include <intrin.h>
+#include <sstream>
+
+#include "MemFusion/CpuFeatures.h"
+#include "MemFusion/Logger.h"
+
+namespace MemFusion
+{
+
+SimdLevel CpuFeatures::s_level = SimdLevel::SimdSSE42;
+
+SimdLevel CpuFeatures::Detect()
+{
+    int regs[4];   // eax, ebx, ecx, edx
+    __cpuid(regs, 0);
+    const int maxLeaf = regs[0];
+    if (maxLeaf < 7)
+        return (SimdLevel::SimdSSE42);
+
+    __cpuid(regs, 1);
+    const bool osxsave = (regs[2] & (1 << 27)) != 0;
+    const bool avx = (regs[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx)
+        return (SimdLevel::SimdSSE42);
+
+    // XCR0: the OS must save XMM/YMM state (bits 1,2) and, for AVX-512,
+    // opmask/ZMM state too (bits 5,6,7).
+    const uint64 xcr0 = _xgetbv(0);
+    const bool osymm = (xcr0 & 0x06) == 0x06;
+    const bool oszmm = (xcr0 & 0xE6) == 0xE6;
+
+    __cpuidex(regs, 7, 0);
+    const bool avx2 = (regs[1] & (1 << 5)) != 0;
+    const bool avx512f = (regs[1] & (1 << 16)) != 0;
+
+    if (avx512f && oszmm)
+    {
+#ifdef MF_AVX512_INTRINSICS
+        return (SimdLevel::SimdAVX512);
+#else
+        return (SimdLevel::SimdAVX2);
+#endif
+    }
+    if (avx2 && osymm)
+        return (SimdLevel::SimdAVX2);
+
+    return (SimdLevel::SimdSSE42);
+}
+
+void CpuFeatures::Initialize(SimdLevel maxLevel)
+{
+    SimdLevel detected = Detect();
+    s_level = (detected < maxLevel) ? detected : maxLevel;
+
+    std::stringstream ss;
+    ss << "CPU scan kernels: detected " << Name(detected) << ", using " << Name(s_level) << ".";
+    LOG(ss.str());
+}
+
+bool CpuFeatures::Supports(SimdLevel level)
+{
+    return (level <= Detect());
+}
+
+const char * CpuFeatures::Name(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::SimdAVX512:
+        return ("AVX-512");
+    case SimdLevel::SimdAVX2:
+        return ("AVX2");
+    default:
+        return ("SSE4.2");
+    }
+}
+
+}
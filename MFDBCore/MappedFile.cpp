@@ -0,0 +1,144 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#include "stdafx.h"
+
+#include <windows.h>
+#include <sstream>
+
+#include "MemFusion/Platform/MappedFile.h"
+
+namespace MemFusion
+{
+
+namespace
+{
+    void ThrowLastError(const char * what, cPath path)
+    {
+        std::stringstream ss;
+        ss << what << " failed for file " << std::string(path) << " with error " << GetLastError();
+        throw (std::exception(ss.str().c_str()));
+    }
+}
+
+MappedFile::MappedFile(Path path, uint64 size, uint32 node)
+    : m_path(path),
+    m_file(INVALID_HANDLE_VALUE),
+    m_mapping(nullptr),
+    m_view(nullptr),
+    m_size(size),
+    m_node(node)
+{
+    Map(true);
+}
+
+MappedFile::MappedFile(Path path, uint32 node)
+    : m_path(path),
+    m_file(INVALID_HANDLE_VALUE),
+    m_mapping(nullptr),
+    m_view(nullptr),
+    m_size(0ULL),
+    m_node(node)
+{
+    Map(false);
+}
+
+void MappedFile::Map(bool create)
+{
+    m_file = CreateFileA(std::string(m_path).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+        create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        ThrowLastError("CreateFile", m_path);
+
+    try
+    {
+        LARGE_INTEGER fileSize;
+        if (create)
+        {
+            // extended files read as zero, nothing to clear
+            fileSize.QuadPart = static_cast<LONGLONG>(m_size);
+            if (!SetFilePointerEx(m_file, fileSize, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file))
+                ThrowLastError("SetEndOfFile", m_path);
+        }
+        else
+        {
+            if (!GetFileSizeEx(m_file, &fileSize))
+                ThrowLastError("GetFileSizeEx", m_path);
+            m_size = static_cast<uint64>(fileSize.QuadPart);
+        }
+
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+        if (m_mapping == nullptr)
+            ThrowLastError("CreateFileMapping", m_path);
+
+        m_view = static_cast<byte*>(MapViewOfFileExNuma(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0, nullptr, m_node));
+        if (m_view == nullptr)
+            ThrowLastError("MapViewOfFile", m_path);
+    }
+    catch (...)
+    {
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw;
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    UnmapViewOfFile(m_view);
+    CloseHandle(m_mapping);
+    CloseHandle(m_file);
+}
+
+void MappedFile::Flush(uint64 offset, uint64 bytes)
+{
+    if (bytes == 0)
+        return;
+
+    uint64 page = PageSize();
+    uint64 begin = (offset / page) * page;
+    uint64 end = ((offset + bytes) < m_size) ? (offset + bytes) : m_size;
+    if (!FlushViewOfFile(m_view + begin, static_cast<SIZE_T>(end - begin)))
+        ThrowLastError("FlushViewOfFile", m_path);
+}
+
+void MappedFile::Sync()
+{
+    if (!FlushFileBuffers(m_file))
+        ThrowLastError("FlushFileBuffers", m_path);
+}
+
+uint32 MappedFile::PageSize()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwPageSize);
+}
+
+}
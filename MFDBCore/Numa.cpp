@@ -0,0 +1,107 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#include "stdafx.h"
+
+#include <windows.h>
+#include <sstream>
+
+#include "MemFusion/Platform/Numa.h"
+#include "MemFusion/Logger.h"
+
+namespace MemFusion
+{
+
+std::vector<uint32> Numa::s_nodes;
+
+void Numa::Initialize()
+{
+    s_nodes.clear();
+
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest))
+    {
+        for (ULONG node = 0; node <= highest; ++node)
+        {
+            // memory only nodes get no Bins: nobody would scan them locally
+            GROUP_AFFINITY affinity = {};
+            if (GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) && (affinity.Mask != 0))
+            {
+                s_nodes.push_back(node);
+            }
+        }
+    }
+
+    std::stringstream ss;
+    ss << "NUMA: " << NumNodes() << " node(s) with processors";
+    ss << ((s_nodes.size() < 2) ? ", no placement." : ", Bins and workers round robin.");
+    LOG(ss.str());
+}
+
+uint32 Numa::Ordinal(uint32 node)
+{
+    for (uint32 ordinal = 0; ordinal < s_nodes.size(); ++ordinal)
+    {
+        if (s_nodes[ordinal] == node)
+            return (ordinal);
+    }
+    return (0);
+}
+
+NumaPin::NumaPin(uint32 node)
+    : m_pinned(false),
+    m_prevMask(0ULL),
+    m_prevGroup(0)
+{
+    if (node == ANY_NODE)
+        return;
+
+    GROUP_AFFINITY affinity = {};
+    GROUP_AFFINITY previous = {};
+    if (GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) &&
+        SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous))
+    {
+        m_pinned = true;
+        m_prevMask = static_cast<uint64>(previous.Mask);
+        m_prevGroup = previous.Group;
+    }
+}
+
+NumaPin::~NumaPin()
+{
+    if (m_pinned)
+    {
+        GROUP_AFFINITY previous = {};
+        previous.Mask = static_cast<KAFFINITY>(m_prevMask);
+        previous.Group = static_cast<WORD>(m_prevGroup);
+        SetThreadGroupAffinity(GetCurrentThread(), &previous, nullptr);
+    }
+}
+
+}
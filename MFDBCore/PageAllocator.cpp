@@ -0,0 +1,217 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#include "stdafx.h"
+
+#include <windows.h>
+#include <malloc.h>
+#include <string.h>
+#include <sstream>
+
+#include "MemFusion/PageAllocator.h"
+#include "MemFusion/Logger.h"
+#include "MemFusion/Cache.h"
+
+#ifdef MEM_EXTENDED_PARAMETER_NONPAGED_HUGE
+#pragma comment(lib, "mincore.lib")     // VirtualAlloc2
+#endif
+
+namespace MemFusion
+{
+
+uint64 PageAllocator::s_largePageSize = 0;
+bool PageAllocator::s_hugePages = false;
+std::atomic<uint64> PageAllocator::s_bytes[NumPageSizes];
+std::atomic<uint64> PageAllocator::s_fallbacks(0);
+
+namespace
+{
+    const uint64 HUGE_PAGE_SIZE = 1024ULL * 1024 * 1024;
+    const uint64 SMALL_PAGE_SIZE = 4096;
+
+    // large pages are locked in memory: the token must hold SeLockMemoryPrivilege
+    bool EnableLockMemoryPrivilege()
+    {
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+            return (false);
+
+        TOKEN_PRIVILEGES privileges;
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool ret = LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+            (GetLastError() == ERROR_SUCCESS);
+        CloseHandle(token);
+        return (ret);
+    }
+
+    uint64 RoundUp(uint64 bytes, uint64 page)
+    {
+        return (((bytes + page - 1) / page) * page);
+    }
+}
+
+void PageAllocator::Initialize(PageSize maxSize)
+{
+    if (maxSize == PageSmall)
+        return;
+
+    std::stringstream ss;
+    if (!EnableLockMemoryPrivilege())
+    {
+        ss << "PageAllocator: no SeLockMemoryPrivilege, using " << Name(PageSmall) << " pages only.";
+        LOG(ss.str());
+        return;
+    }
+
+    s_largePageSize = GetLargePageMinimum();
+#ifdef MEM_EXTENDED_PARAMETER_NONPAGED_HUGE
+    s_hugePages = (s_largePageSize != 0) && (maxSize == PageHuge);
+#endif
+    ss << "PageAllocator: largest pages " << Name(Largest()) << ".";
+    LOG(ss.str());
+}
+
+void * PageAllocator::Allocate(uint64 bytes, PageSize & obtained, uint32 node)
+{
+    void * ret = nullptr;
+    if (bytes < MIN_PAGED_BYTES)
+    {
+        // not worth a system call
+        ret = _aligned_malloc(static_cast<size_t>(bytes), CACHE_LINE);
+        if (ret == nullptr)
+        {
+            std::stringstream ss;
+            ss << "PageAllocator: out of memory allocating " << bytes << " bytes.";
+            throw std::exception(ss.str().c_str());
+        }
+        memset(ret, 0, static_cast<size_t>(bytes));
+        obtained = PageSmall;
+        s_bytes[PageSmall] += bytes;
+        return (ret);
+    }
+#ifdef MEM_EXTENDED_PARAMETER_NONPAGED_HUGE
+    if (s_hugePages && (bytes >= HUGE_PAGE_SIZE))
+    {
+        MEM_EXTENDED_PARAMETER params[2] = {};
+        params[0].Type = MemExtendedParameterAttributeFlags;
+        params[0].ULong64 = MEM_EXTENDED_PARAMETER_NONPAGED_HUGE;
+        params[1].Type = MemExtendedParameterNumaNode;
+        params[1].ULong = node;
+        ret = VirtualAlloc2(nullptr, nullptr, static_cast<SIZE_T>(RoundUp(bytes, HUGE_PAGE_SIZE)),
+            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, params, (node == ANY_NODE) ? 1 : 2);
+        if (ret != nullptr)
+        {
+            obtained = PageHuge;
+            s_bytes[PageHuge] += RoundUp(bytes, HUGE_PAGE_SIZE);
+            return (ret);
+        }
+        ++s_fallbacks;
+    }
+#endif
+    if ((s_largePageSize != 0) && (bytes >= s_largePageSize))
+    {
+        // fails when physical memory is too fragmented
+        ret = VirtualAllocExNuma(GetCurrentProcess(), nullptr, static_cast<SIZE_T>(RoundUp(bytes, s_largePageSize)),
+            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+        if (ret != nullptr)
+        {
+            obtained = PageLarge;
+            s_bytes[PageLarge] += RoundUp(bytes, s_largePageSize);
+            return (ret);
+        }
+        ++s_fallbacks;
+    }
+
+    // pages land on 'node' when first touched
+    ret = VirtualAllocExNuma(GetCurrentProcess(), nullptr, static_cast<SIZE_T>(bytes), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+    if (ret == nullptr)
+    {
+        std::stringstream ss;
+        ss << "PageAllocator: out of memory allocating " << bytes << " bytes.";
+        throw std::exception(ss.str().c_str());
+    }
+    obtained = PageSmall;
+    s_bytes[PageSmall] += bytes;
+    return (ret);
+}
+
+void PageAllocator::Free(void * ptr, uint64 bytes)
+{
+    if (ptr == nullptr)
+        return;
+
+    if (bytes < MIN_PAGED_BYTES)
+    {
+        _aligned_free(ptr);
+    }
+    else {
+        VirtualFree(ptr, 0, MEM_RELEASE);
+    }
+}
+
+void PageAllocator::Prefault(void * ptr, uint64 bytes)
+{
+    // already zero: writing zero keeps it so
+    volatile byte * bytePtr = static_cast<volatile byte*>(ptr);
+    for (uint64 offset = 0; offset < bytes; offset += SMALL_PAGE_SIZE)
+    {
+        bytePtr[offset] = 0;
+    }
+}
+
+PageSize PageAllocator::Largest()
+{
+    if (s_hugePages)
+        return (PageHuge);
+    return ((s_largePageSize != 0) ? PageLarge : PageSmall);
+}
+
+PageMetrics PageAllocator::GetMetrics()
+{
+    PageMetrics ret;
+    for (uint32 size = 0; size < NumPageSizes; ++size)
+    {
+        ret.bytes[size] = s_bytes[size].load();
+    }
+    ret.fallbacks = s_fallbacks.load();
+    return (ret);
+}
+
+const char * PageAllocator::Name(PageSize size)
+{
+    switch (size)
+    {
+    case PageHuge:  return ("1GB");
+    case PageLarge: return ("2MB");
+    default:        return ("4KB");
+    }
+}
+
+}
@@ -41,14 +41,14 @@ namespace Core
 {
 using std::vector;
 
-uint32 Collection::FindProjectPhase(vector<LFTStage3> & matchesPerBin, Buffer & retbuf, opt<Projections&> onames)
+uint32 Collection::FindProjectPhase(const vector<Bin<Z2raw>*> & snapshot, vector<LFTStage3> & matchesPerBin, Buffer & retbuf, opt<Projections&> onames)
 {
     uint32 ret = 0;
     Z2raw * dstPtr = static_cast<Z2raw*>(retbuf.get());
     Z2raw * pstart = dstPtr++;
     uint32 doccount = 0;
 
-    for (const Bin<Z2raw> * bin : bins)
+    for (const Bin<Z2raw> * bin : snapshot)
     {
         cuint32 binIdx = bin->binIdx();
         LFTStage3 & stage3 = matchesPerBin[binIdx];
@@ -10,6 +10,9 @@
 #include "MemFusion/RetryTimes.h"
 #include "MemFusion/Logger.h"
 #include "LFT/LFT.h"
+#include "MemFusion/CpuFeatures.h"
+#include "MemFusion/PageAllocator.h"
+#include "MemFusion/Platform/Numa.h"
 
 using namespace MFDB;
 using namespace std;
@@ -20,7 +23,8 @@ Perfy * Perfy::m_instance = nullptr;
 QueryEngine * QueryEngine::m_instance = nullptr;
 std::atomic<bool> QueryEngine::m_initializing = false;
 
-void QueryEngine::InitializeQueryEngine(uint32 maxConcIB, uint32 bmaxelems, uint32 bmaxsize, uint32 maxbins, Path percypath)
+void QueryEngine::InitializeQueryEngine(uint32 maxConcIB, uint32 bmaxelems, uint32 bmaxsize, uint32 maxbins, Path percypath,
+    PercyTraits::PersistencyType ptype, uint64 memoryBudget)
 {
     Logger::Initialize("BE");
 
@@ -33,12 +37,30 @@ void QueryEngine::InitializeQueryEngine(uint32 maxConcIB, uint32 bmaxelems, uint
     {
         return;
     }
+    // before any Bin is allocated or deserialized
+    Numa::Initialize();
+    // 1GB pages for areas that big (Bins of 1GB or more), 2MB ones below
+    PageAllocator::Initialize(PageHuge);
+
     auto aligned_mem = _aligned_malloc(sizeof(QueryEngine), CACHE_LINE);
-    Config cfg = { maxConcIB, bmaxelems, bmaxsize, maxbins, percypath };
+    Config cfg = { maxConcIB, bmaxelems, bmaxsize, maxbins, percypath, ptype, memoryBudget };
     auto temp = new (aligned_mem) QueryEngine(cfg);
     m_instance = temp;
 
     Perfy::Initialize();
+    CpuFeatures::Initialize();
+}
+
+Core::Collection * QueryEngine::FindOrInstantiate(const std::string & collection)
+{
+    auto iter = m_collections.findinsert(collection,
+            [this, collection]() -> Core::Collection *
+    {
+        Core::cCollectionIntrinsicCfg cfgi(collection, cfg.m_binMaxElems, cfg.m_binMaxSize, cfg.m_maxBinNum, 1, &m_budget);
+        Core::cCollectionPercyCfg cfgp(cfg.m_percyBasePath, cfg.m_persistency);
+        return (Core::Collection::Instantiate(cfgi, cfgp));
+    });
+    return (iter);
 }
 
 // Obviously re-entrant 
@@ -48,15 +70,7 @@ void * QueryEngine::AcquireInsertBuffer(Candle ch, const std::string & collectio
     void * buffer = nullptr;
     try
     {
-        auto iter = m_collections.findinsert(collection,
-                [this, collection]() -> Core::Collection *
-        {
-            Core::cCollectionIntrinsicCfg cfgi(collection, cfg.m_binMaxElems, cfg.m_binMaxSize, cfg.m_maxBinNum);
-            Core::cCollectionPercyCfg cfgp(cfg.m_percyBasePath, PercyTraits::PersistencyType::LocalFileSystem);
-            return (Core::Collection::Instantiate(cfgi, cfgp));
-        });
-
-        buffer = iter->AcquireInsertBuffer(size);
+        buffer = FindOrInstantiate(collection)->AcquireInsertBuffer(size);
     }
     catch (std::exception & ex)
     {
@@ -75,6 +89,32 @@ void * QueryEngine::AcquireInsertBuffer(Candle ch, const std::string & collectio
     return (buffer);
 }
 
+// Obviously re-entrant 
+uint32 QueryEngine::AcquireInsertBuffers(Candle ch, const std::string & collection, uint32 count, const uint32 * sizes, void ** buffers, uint64 * handles)
+{
+    (void) ch;
+    uint32 ret = 0;
+    try
+    {
+        ret = FindOrInstantiate(collection)->AcquireInsertBuffers(count, sizes, buffers, handles);
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "std::exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " '" << ex.what() << " '";
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Unknown exception in " << __FUNCTION__ << " collection=" << collection;
+        LOG(ss.str());
+    }
+
+    return (ret);
+}
+
 using namespace Core;
 
 // Obviously re-entrant 
@@ -106,6 +146,203 @@ bool QueryEngine::ReleaseBufferForInsert(Candle ch, const char * collection, voi
     return (false);
 }
 
+// Obviously re-entrant 
+uint32 QueryEngine::ReleaseBuffersForInsert(Candle ch, const char * collection, uint32 count, const uint64 * handles, byte * released)
+{
+    (void) ch;
+
+    try {
+        auto optiter = m_collections.find(string(collection));
+        if (optiter.is_initialized())
+        {
+            return (optiter.get()->ReleaseInsertBuffers(count, handles, released));
+        }
+    }
+    catch (ReleaseBufferError e)
+    {
+        std::stringstream ss;
+        ss << "ReleaseBufferError exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " elemIdx=" << e.elemIdx;
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Unknown exception in " << __FUNCTION__ << " collection=" << collection;
+        LOG(ss.str());
+    }
+    // some may have been released before the error: 'released' tells
+    return (0);
+}
+
+void QueryEngine::SetMemoryBudget(uint64 bytes)
+{
+    std::stringstream ss;
+    ss << "Memory budget set to " << bytes / (1024 * 1024) << " MB (0: no limit).";
+    LOG(ss.str());
+    m_budget.limit(bytes);
+    m_budget.Enforce();
+}
+
+bool QueryEngine::PromoteColumn(Candle ch, const char * collection, Z2name name)
+{
+    (void) ch;
+
+    try {
+        auto optiter = m_collections.find(string(collection));
+        if (optiter.is_initialized())
+        {
+            optiter.get()->PromoteColumn(name);
+            return (true);
+        }
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "std::exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " name=" << name << " '" << ex.what() << " '";
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Unknown exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " name=" << name;
+        LOG(ss.str());
+    }
+    return (false);
+}
+
+bool QueryEngine::CreateHashIndex(Candle ch, const char * collection, Z2name name)
+{
+    (void) ch;
+
+    try {
+        auto optiter = m_collections.find(string(collection));
+        if (optiter.is_initialized())
+        {
+            optiter.get()->CreateHashIndex(name);
+            return (true);
+        }
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "std::exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " name=" << name << " '" << ex.what() << " '";
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Unknown exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " name=" << name;
+        LOG(ss.str());
+    }
+    return (false);
+}
+
+bool QueryEngine::CreateBitmapIndex(Candle ch, const char * collection, Z2name name)
+{
+    (void) ch;
+
+    try {
+        auto optiter = m_collections.find(string(collection));
+        if (optiter.is_initialized())
+        {
+            optiter.get()->CreateBitmapIndex(name);
+            return (true);
+        }
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "std::exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " name=" << name << " '" << ex.what() << " '";
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Unknown exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " name=" << name;
+        LOG(ss.str());
+    }
+    return (false);
+}
+
+bool QueryEngine::CreateRangeIndex(Candle ch, const char * collection, const Z2name * names, uint32 count)
+{
+    (void) ch;
+
+    try {
+        auto optiter = m_collections.find(string(collection));
+        if (optiter.is_initialized())
+        {
+            optiter.get()->CreateRangeIndex(std::vector<Z2name>(names, names + count));
+            return (true);
+        }
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "std::exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " names=" << count << " '" << ex.what() << " '";
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Unknown exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " names=" << count;
+        LOG(ss.str());
+    }
+    return (false);
+}
+
+// Obviously re-entrant
+bool QueryEngine::AddBlob(Candle ch, const char * collection, uint64 hash, const void * bytes, uint32 size)
+{
+    (void) ch;
+
+    try {
+        if (FindOrInstantiate(collection)->AddBlob(hash, bytes, size))
+            return (true);
+
+        std::stringstream ss;
+        ss << "Blob hash collision in collection " << collection << " hash=" << hash;
+        LOG(ss.str());
+    }
+    catch (std::exception & ex)
+    {
+        std::stringstream ss;
+        ss << "std::exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " hash=" << hash << " '" << ex.what() << " '";
+        LOG(ss.str());
+    }
+    catch (...)
+    {
+        std::stringstream ss;
+        ss << "Unknown exception in " << __FUNCTION__ << " collection=" << collection;
+        ss << " hash=" << hash;
+        LOG(ss.str());
+    }
+    return (false);
+}
+
+// Lock free
+const void * QueryEngine::FindBlob(Candle ch, const char * collection, uint64 hash, uint32 & size)
+{
+    (void) ch;
+
+    auto optiter = m_collections.find(string(collection));
+    if (optiter.is_initialized())
+    {
+        return (optiter.get()->FindBlob(hash, size));
+    }
+    return (nullptr);
+}
+
 uint32 QueryEngine::Query_Aggregate(uint64 ch, const char * collection, void * z2query, uint32 queryBytes, void * retbuf, uint32 uintsort)
 {
     (void) ch, queryBytes, retbuf, z2query;
@@ -149,7 +386,7 @@ uint32 QueryEngine::Query_Find(uint64 ch, const char * collection, void * z2sele
         std::vector<LFTraw> lfts_raw((LFTraw*) z2queryraw, (LFTraw*) lft_end);
         std::vector<QPraw> qps_raw((QPraw*) lft_end, (QPraw*) all_end);
 
-        Z2FindQuery z2query(lfts_raw, qps_raw);
+        Z2FindQuery z2query(lfts_raw, qps_raw, Z2FindQuery::ScanMode::ScanAuto, &iter->GetStrings());
         Buffer buffer(retbuf, MongoRetBufferSize);
 
         if (selectBytes == 0)
@@ -167,6 +404,78 @@ uint32 QueryEngine::Query_Find(uint64 ch, const char * collection, void * z2sele
     return (0);
 }
 
+uint32 QueryEngine::Query_Remove(uint64 ch, const char * collection, void * z2queryraw, uint32 lftBytes, uint32 qpBytes)
+{
+    (void) ch;
+    assert(lftBytes >= sizeof(Z2raw));
+
+    auto optiter = m_collections.find(string(collection));
+    if (optiter.is_initialized())
+    {
+        auto iter = optiter.get();
+        uint64 transId = 0ULL;
+        auto lft_end = ((byte*) z2queryraw) + lftBytes;
+        auto all_end = lft_end + qpBytes;
+
+        std::vector<LFTraw> lfts_raw((LFTraw*) z2queryraw, (LFTraw*) lft_end);
+        std::vector<QPraw> qps_raw((QPraw*) lft_end, (QPraw*) all_end);
+
+        Z2FindQuery z2query(lfts_raw, qps_raw, Z2FindQuery::ScanMode::ScanAuto, &iter->GetStrings());
+        return (iter->Remove(transId, &z2query));
+    }
+
+    return (0);
+}
+
+uint64 QueryEngine::Query_Count(uint64 ch, const char * collection, void * z2queryraw, uint32 lftBytes, uint32 qpBytes)
+{
+    (void) ch;
+    assert(lftBytes >= sizeof(Z2raw));
+
+    auto optiter = m_collections.find(string(collection));
+    if (optiter.is_initialized())
+    {
+        auto iter = optiter.get();
+        uint64 transId = 0ULL;
+        auto lft_end = ((byte*) z2queryraw) + lftBytes;
+        auto all_end = lft_end + qpBytes;
+
+        std::vector<LFTraw> lfts_raw((LFTraw*) z2queryraw, (LFTraw*) lft_end);
+        std::vector<QPraw> qps_raw((QPraw*) lft_end, (QPraw*) all_end);
+
+        Z2FindQuery z2query(lfts_raw, qps_raw, Z2FindQuery::ScanMode::ScanAuto, &iter->GetStrings());
+        return (iter->Count(transId, &z2query));
+    }
+
+    return (0ULL);
+}
+
+uint32 QueryEngine::Query_Update(uint64 ch, const char * collection, void * z2queryraw, uint32 lftBytes, uint32 qpBytes, void * updatesraw, uint32 updateBytes)
+{
+    (void) ch;
+    assert(lftBytes >= sizeof(Z2raw));
+    assert(updateBytes >= sizeof(Core::UpdateRaw));
+
+    auto optiter = m_collections.find(string(collection));
+    if (optiter.is_initialized())
+    {
+        auto iter = optiter.get();
+        uint64 transId = 0ULL;
+        auto lft_end = ((byte*) z2queryraw) + lftBytes;
+        auto all_end = lft_end + qpBytes;
+        auto upd_end = ((byte*) updatesraw) + updateBytes;
+
+        std::vector<LFTraw> lfts_raw((LFTraw*) z2queryraw, (LFTraw*) lft_end);
+        std::vector<QPraw> qps_raw((QPraw*) lft_end, (QPraw*) all_end);
+        Core::Z2Updates updates((Core::UpdateRaw*) updatesraw, (Core::UpdateRaw*) upd_end);
+
+        Z2FindQuery z2query(lfts_raw, qps_raw, Z2FindQuery::ScanMode::ScanAuto, &iter->GetStrings());
+        return (iter->Update(transId, &z2query, updates));
+    }
+
+    return (0);
+}
+
 Core::Projections QueryEngine::ExtractProjections(std::vector<Z2raw> sels)
 {
     std::set<Z2name> ret;
@@ -184,6 +493,7 @@ Core::Projections QueryEngine::ExtractProjections(std::vector<Z2raw> sels)
 
 QueryEngine::QueryEngine(Config cfg_)
     : cfg(cfg_),
+    m_budget(cfg_.m_memoryBudget),
     outputs(MAX_BIN_NUMBER, OUTPUT_BVEC_SIZE_PER_BIN),
     m_collections(MAX_NUMBER_OF_COLLECTIONS)
 {
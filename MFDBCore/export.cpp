@@ -30,6 +30,7 @@
 
 #include "MFDBCore.h"
 #include "QueryEngine.h"
+#include "MemFusion/PageAllocator.h"
 
 
 extern "C" EXPORT_FUNC void * MFDBCore_AcquireBufferForInsert(MFDB::Candle ch, const char * collection, uint32 size)
@@ -42,6 +43,16 @@ extern "C" EXPORT_FUNC uint32 MFDBCore_ReleaseBufferForInsert(MFDB::Candle ch, c
     return (MFDB::QueryEngine::Instance()->ReleaseBufferForInsert(ch, collection, buffer) ? 1 : 0);
 }
 
+extern "C" EXPORT_FUNC uint32 MFDBCore_AcquireBuffersForInsert(MFDB::Candle ch, const char * collection, uint32 count, const uint32 * sizes, void ** buffers, uint64 * handles)
+{
+    return (MFDB::QueryEngine::Instance()->AcquireInsertBuffers(ch, collection, count, sizes, buffers, handles));
+}
+
+extern "C" EXPORT_FUNC uint32 MFDBCore_ReleaseBuffersForInsert(MFDB::Candle ch, const char * collection, uint32 count, const uint64 * handles, byte * released)
+{
+    return (MFDB::QueryEngine::Instance()->ReleaseBuffersForInsert(ch, collection, count, handles, released));
+}
+
 extern "C" EXPORT_FUNC void MFDBCore_Initialize_QueryEngine(uint32 maxConcIB, uint32 bmaxelems, uint32 bmaxsize, uint32 maxbins, const char * datapath)
 {
     return (MFDB::QueryEngine::InitializeQueryEngine(maxConcIB, bmaxelems, bmaxsize, maxbins, MemFusion::Path(datapath)));
@@ -57,3 +68,63 @@ extern "C" EXPORT_FUNC uint32 MFDBCore_Query_Aggregate(MFDB::Candle ch, const ch
     return (MFDB::QueryEngine::Instance()->Query_Aggregate(ch, collection, z2query, queryBytes, retbuf, uintsort));
 }
 
+extern "C" EXPORT_FUNC uint32 MFDBCore_Query_Remove(MFDB::Candle ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes)
+{
+    return (MFDB::QueryEngine::Instance()->Query_Remove(ch, collection, z2query, lftBytes, qpBytes));
+}
+
+extern "C" EXPORT_FUNC uint64 MFDBCore_Query_Count(MFDB::Candle ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes)
+{
+    return (MFDB::QueryEngine::Instance()->Query_Count(ch, collection, z2query, lftBytes, qpBytes));
+}
+
+extern "C" EXPORT_FUNC uint32 MFDBCore_Query_Update(MFDB::Candle ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes, void * updates, uint32 updateBytes)
+{
+    return (MFDB::QueryEngine::Instance()->Query_Update(ch, collection, z2query, lftBytes, qpBytes, updates, updateBytes));
+}
+
+extern "C" EXPORT_FUNC void MFDBCore_Set_MemoryBudget(uint64 bytes)
+{
+    MFDB::QueryEngine::Instance()->SetMemoryBudget(bytes);
+}
+
+extern "C" EXPORT_FUNC void MFDBCore_Get_PageMetrics(uint64 * metrics)
+{
+    const MemFusion::PageMetrics pages = MemFusion::PageAllocator::GetMetrics();
+    for (uint32 size = 0; size < MemFusion::NumPageSizes; ++size)
+    {
+        metrics[size] = pages.bytes[size];
+    }
+    metrics[MemFusion::NumPageSizes] = pages.fallbacks;
+}
+
+extern "C" EXPORT_FUNC uint32 MFDBCore_AddBlob(MFDB::Candle ch, const char * collection, uint64 hash, const void * bytes, uint32 size)
+{
+    return (MFDB::QueryEngine::Instance()->AddBlob(ch, collection, hash, bytes, size) ? 1 : 0);
+}
+
+// nullptr when unknown, the bytes stay there as long as the collection
+extern "C" EXPORT_FUNC const void * MFDBCore_FindBlob(MFDB::Candle ch, const char * collection, uint64 hash, uint32 * size)
+{
+    return (MFDB::QueryEngine::Instance()->FindBlob(ch, collection, hash, *size));
+}
+
+extern "C" EXPORT_FUNC uint32 MFDBCore_PromoteColumn(MFDB::Candle ch, const char * collection, uint32 z2name)
+{
+    return (MFDB::QueryEngine::Instance()->PromoteColumn(ch, collection, z2name) ? 1 : 0);
+}
+
+extern "C" EXPORT_FUNC uint32 MFDBCore_CreateHashIndex(MFDB::Candle ch, const char * collection, uint32 z2name)
+{
+    return (MFDB::QueryEngine::Instance()->CreateHashIndex(ch, collection, z2name) ? 1 : 0);
+}
+
+extern "C" EXPORT_FUNC uint32 MFDBCore_CreateRangeIndex(MFDB::Candle ch, const char * collection, const uint32 * z2names, uint32 count)
+{
+    return (MFDB::QueryEngine::Instance()->CreateRangeIndex(ch, collection, z2names, count) ? 1 : 0);
+}
+
+extern "C" EXPORT_FUNC uint32 MFDBCore_CreateBitmapIndex(MFDB::Candle ch, const char * collection, uint32 z2name)
+{
+    return (MFDB::QueryEngine::Instance()->CreateBitmapIndex(ch, collection, z2name) ? 1 : 0);
+}
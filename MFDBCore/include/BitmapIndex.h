@@ -0,0 +1,209 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+#include "MemFusion/types.h"
+#include "MemFusion/LF/spinlock.h"
+#include "z2types.h"
+#include "LFT/LFTtypes.h"
+#include "LFT/Bitmap.h"
+#include "StringDictionary.h"
+#include "HashIndex.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   Bitmap index of one Z2name with few distinct values: per Bin, the set
+//   of elements having each value. $eq and $ne on it are then answered by
+//   the QP program on bitmaps, without reading the atoms.
+//
+//   The Bitmaps of a Bin are built by the compactor once the Bin takes no
+//   more elements, and built again when it is compacted or updated in
+//   place. They are exact for the elements active when built: removed ones
+//   are masked off when queried. A Bin with more than MAX_VALUES values is
+//   not indexed: it is scanned.
+class BitmapIndex
+{
+public:
+    // TBD: from configuration
+    static const uint32 MAX_VALUES = 1024;
+
+    class Bitmaps
+    {
+        const void * m_bin;             // built for, as long as it is not freed
+        const uint64 m_version;         // of its atoms
+        const uint32 m_numElems;
+        bool m_complete;
+        std::map<std::pair<uint64, uint64>, std::vector<uint32>> m_adding;
+        std::vector<HashIndex::Key> m_keys;     // sorted
+        std::vector<ElemBitmap> m_bitmaps;      // of each key
+
+        static bool less(const HashIndex::Key & left, const HashIndex::Key & right)
+        {
+            return ((left.low < right.low) || ((left.low == right.low) && (left.value < right.value)));
+        }
+
+        Bitmaps(const Bitmaps &);
+        void operator = (const Bitmaps &);
+    public:
+        Bitmaps(const void * bin, uint64 version, uint32 numElems)
+            : m_bin(bin),
+            m_version(version),
+            m_numElems(numElems),
+            m_complete(true)
+        {
+        }
+
+        bool current(const void * bin, uint64 version, uint32 numElems) const
+        {
+            return ((m_bin == bin) && (m_version == version) && (m_numElems == numElems));
+        }
+
+        // false: too many values, nothing kept
+        bool complete() const { return (m_complete); }
+        uint32 size() const { return (static_cast<uint32>(m_keys.size())); }
+
+        void add(const HashIndex::Key & key, uint32 elemIdx)
+        {
+            if (!m_complete)
+                return;
+            m_adding[std::make_pair(key.low, key.value)].push_back(elemIdx);
+            if (m_adding.size() > MAX_VALUES)
+            {
+                m_complete = false;
+                m_adding.clear();
+            }
+        }
+
+        // compresses what was added: sparse or dense, per value
+        void finish()
+        {
+            m_keys.reserve(m_adding.size());
+            m_bitmaps.reserve(m_adding.size());
+            for (auto & one : m_adding)
+            {
+                HashIndex::Key key = { one.first.first, one.first.second };
+                m_keys.push_back(key);
+                m_bitmaps.emplace_back(m_numElems);
+                m_bitmaps.back().add(one.second.cbegin(), one.second.cend());
+                m_bitmaps.back().normalize();
+            }
+            m_adding.clear();
+        }
+
+        // the elements with a root level atom 'key'
+        void equal(const HashIndex::Key & key, ElemBitmap & out) const
+        {
+            out.reset(m_numElems);
+            auto found = std::lower_bound(m_keys.begin(), m_keys.end(), key, less);
+            if ((found != m_keys.end()) && (*found == key))
+            {
+                out.or_with(m_bitmaps[found - m_keys.begin()]);
+            }
+        }
+
+        // the elements with a root level atom of the low qword of 'key' but
+        // another value
+        void not_equal(const HashIndex::Key & key, ElemBitmap & out) const
+        {
+            out.reset(m_numElems);
+            const HashIndex::Key first = { key.low, 0ULL };
+            for (auto found = std::lower_bound(m_keys.begin(), m_keys.end(), first, less);
+                (found != m_keys.end()) && (found->low == key.low); ++found)
+            {
+                if (found->value != key.value)
+                {
+                    out.or_with(m_bitmaps[found - m_keys.begin()]);
+                }
+            }
+        }
+    };
+
+private:
+    const Z2name m_name;
+    mutable MemFusion::LF::spinlock m_bitmapsLock;
+    std::vector<std::shared_ptr<const Bitmaps>> m_bitmaps;  // by binIdx, under m_bitmapsLock
+
+    BitmapIndex(const BitmapIndex &);
+    void operator = (const BitmapIndex &);
+public:
+    explicit BitmapIndex(Z2name name)
+        : m_name(name)
+    {
+    }
+
+    Z2name name() const { return (m_name); }
+
+    // $eq, and $ne but on strings: the dictionary tells those apart by
+    // their bytes, whatever their length
+    static bool answers(const LFTraw & lft)
+    {
+        return ((lft.qo == QO::EQ) || ((lft.qo == QO::NE) && !is_string(Z2(lft.z2raw).z2low())));
+    }
+
+    // the element 'elemIdx' has atoms [begin, end)
+    void add(const Z2raw * begin, const Z2raw * end, uint32 elemIdx, Bitmaps & bitmaps) const
+    {
+        for (const Z2raw * cur = begin; (cur < end) && !Z2::invalid(*cur); ++cur)
+        {
+            if ((cur->m128i_u32[0] == RootDocnum) && (Z2(*cur).z2name() == m_name))
+            {
+                bitmaps.add(HashIndex::key(*cur), elemIdx);
+            }
+        }
+    }
+
+    std::shared_ptr<const Bitmaps> bitmaps(uint32 binIdx) const
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(m_bitmapsLock);
+        return ((binIdx < m_bitmaps.size()) ? m_bitmaps[binIdx] : nullptr);
+    }
+
+    void put(uint32 binIdx, std::shared_ptr<const Bitmaps> bitmaps)
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(m_bitmapsLock);
+        if (binIdx >= m_bitmaps.size())
+        {
+            m_bitmaps.resize(binIdx + 1);
+        }
+        m_bitmaps[binIdx] = bitmaps;
+    }
+};
+
+}
+}
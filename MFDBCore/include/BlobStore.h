@@ -0,0 +1,271 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstring>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Exceptions.h"
+#include "MemFusion/PageAllocator.h"
+#include "MemFusion/Percy.h"
+
+namespace MFDB
+{
+namespace Core
+{
+using namespace MemFusion;
+
+//   Long strings and binary data of a Collection, by the 64-bit hash their
+//   atom keeps in z2value.
+//
+//   Blobs are appended to arenas that never move: what find() returns
+//   stays valid as long as the store. Lookups take no lock: the index is
+//   open addressing over atomic slots, a blob pointer published after its
+//   hash. Writers serialize; growing the index copies it, and the old ones
+//   are kept for the readers still probing them (all together they are as
+//   big as the current one).
+class BlobStore
+{
+public:
+    // TBD: from configuration
+    static const uint64 ARENA_BYTES = 64 * 1024 * 1024;  // bigger blobs get their own
+    static const uint32 MIN_SLOTS = 4096;
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64> hash;
+        std::atomic<const uint32*> blob;    // size, then the bytes; nullptr when free
+    };
+
+    struct Index
+    {
+        uint64 mask;
+        std::unique_ptr<Slot[]> slots;
+
+        explicit Index(uint64 numSlots)
+            : mask(numSlots - 1),
+            slots(new Slot[numSlots])
+        {
+            for (uint64 idx = 0; idx < numSlots; ++idx)
+            {
+                slots[idx].hash.store(0ULL, std::memory_order_relaxed);
+                slots[idx].blob.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    std::atomic<Index*> s_index;
+    std::mutex m_writers;
+    std::vector<std::unique_ptr<Index>> m_indexes;      // the current one last, under m_writers
+    std::vector<std::pair<byte*, uint64>> m_arenas;     // under m_writers
+    byte * m_arenaNext;
+    uint64 m_arenaLeft;
+    std::atomic<uint64> x_count;
+    std::atomic<uint64> x_bytes;
+
+    BlobStore(const BlobStore &);
+    void operator = (const BlobStore &);
+
+    // hashes are MD5 prefixes already, but anything may come
+    static uint64 mix(uint64 hash)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return (hash);
+    }
+
+    // a blob is its size in a qword, then its bytes
+    static uint64 blob_bytes(uint32 size)
+    {
+        return ((sizeof(uint64) + size + 7) & ~7ULL);
+    }
+
+    static const byte * payload(const uint32 * blob)
+    {
+        return (reinterpret_cast<const byte*>(blob) + sizeof(uint64));
+    }
+
+    // the slot of 'hash', or the free one where it goes
+    static Slot & probe(const Index & index, uint64 hash)
+    {
+        for (uint64 pos = mix(hash) & index.mask;; pos = (pos + 1) & index.mask)
+        {
+            Slot & slot = index.slots[pos];
+            if ((slot.blob.load(std::memory_order_acquire) == nullptr) ||
+                (slot.hash.load(std::memory_order_relaxed) == hash))
+                return (slot);
+        }
+    }
+
+    // under m_writers
+    uint32 * AllocateBlob(uint32 size)
+    {
+        cuint64 bytes = blob_bytes(size);
+        if (bytes > ARENA_BYTES / 4)
+        {
+            byte * own = static_cast<byte*>(PageAllocator::Allocate(bytes));
+            m_arenas.push_back(std::make_pair(own, bytes));
+            return (reinterpret_cast<uint32*>(own));
+        }
+        if (bytes > m_arenaLeft)
+        {
+            m_arenaNext = static_cast<byte*>(PageAllocator::Allocate(ARENA_BYTES));
+            m_arenaLeft = ARENA_BYTES;
+            m_arenas.push_back(std::make_pair(m_arenaNext, ARENA_BYTES));
+        }
+        uint32 * ret = reinterpret_cast<uint32*>(m_arenaNext);
+        m_arenaNext += bytes;
+        m_arenaLeft -= bytes;
+        return (ret);
+    }
+
+    // under m_writers: at most half full
+    void Grow()
+    {
+        const Index & old = *s_index.load();
+        std::unique_ptr<Index> bigger(new Index((old.mask + 1) * 2));
+        for (uint64 pos = 0; pos <= old.mask; ++pos)
+        {
+            const uint32 * blob = old.slots[pos].blob.load(std::memory_order_relaxed);
+            if (blob != nullptr)
+            {
+                cuint64 hash = old.slots[pos].hash.load(std::memory_order_relaxed);
+                Slot & slot = probe(*bigger, hash);
+                slot.hash.store(hash, std::memory_order_relaxed);
+                slot.blob.store(blob, std::memory_order_relaxed);
+            }
+        }
+        s_index.store(bigger.get(), std::memory_order_release);
+        m_indexes.push_back(std::move(bigger));
+    }
+
+public:
+    BlobStore()
+        : m_arenaNext(nullptr),
+        m_arenaLeft(0ULL),
+        x_count(0ULL),
+        x_bytes(0ULL)
+    {
+        m_indexes.emplace_back(new Index(MIN_SLOTS));
+        s_index.store(m_indexes.back().get());
+    }
+
+    ~BlobStore()
+    {
+        for (auto & arena : m_arenas)
+        {
+            PageAllocator::Free(arena.first, arena.second);
+        }
+    }
+
+    uint64 count() const { return (x_count.load()); }
+    uint64 bytes() const { return (x_bytes.load()); }
+
+    // nullptr when there is no blob for 'hash'
+    const void * find(uint64 hash, uint32 & size) const
+    {
+        const Slot & slot = probe(*s_index.load(std::memory_order_acquire), hash);
+        const uint32 * blob = slot.blob.load(std::memory_order_acquire);
+        if (blob == nullptr)
+            return (nullptr);
+        size = *blob;
+        return (payload(blob));
+    }
+
+    // False when 'hash' has other bytes already: a collision
+    bool add(uint64 hash, const void * data, uint32 size)
+    {
+        uint32 there;
+        const void * found = find(hash, there);
+        if (found != nullptr)
+            return ((there == size) && (memcmp(found, data, size) == 0));
+
+        std::lock_guard<std::mutex> guard(m_writers);
+        Slot & slot = probe(*s_index.load(), hash);
+        const uint32 * blob = slot.blob.load();
+        if (blob != nullptr)
+        {
+            // added meanwhile
+            return ((*blob == size) && (memcmp(payload(blob), data, size) == 0));
+        }
+
+        uint32 * copy = AllocateBlob(size);
+        *copy = size;
+        memcpy(const_cast<byte*>(payload(copy)), data, size);
+        slot.hash.store(hash, std::memory_order_relaxed);
+        slot.blob.store(copy, std::memory_order_release);
+        x_bytes += size;
+        if (++x_count * 2 > s_index.load()->mask + 1)
+        {
+            Grow();
+        }
+        return (true);
+    }
+
+    void Persist(PercyFS & percy)
+    {
+        std::lock_guard<std::mutex> guard(m_writers);
+        const Index & index = *s_index.load();
+        percy.PersistUint64(x_count.load());
+        for (uint64 pos = 0; pos <= index.mask; ++pos)
+        {
+            const uint32 * blob = index.slots[pos].blob.load();
+            if (blob != nullptr)
+            {
+                percy.PersistUint64(index.slots[pos].hash.load());
+                percy.PersistUint32(*blob);
+                percy.PersistBlob(payload(blob), *blob);
+            }
+        }
+    }
+
+    void Reload(DepercyFS & percy)
+    {
+        cuint64 numBlobs = percy.DeserializeUint64();
+        std::vector<byte> data;
+        for (uint64 idx = 0; idx < numBlobs; ++idx)
+        {
+            cuint64 hash = percy.DeserializeUint64();
+            cuint32 size = percy.DeserializeUint32();
+            data.resize(size);
+            percy.DeserializeBlob(data.data(), size);
+            if (!add(hash, data.data(), size))
+                throw EXCEPTION("Blob %llx reloaded twice with different bytes", hash);
+        }
+    }
+};
+
+}
+}
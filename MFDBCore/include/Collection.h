@@ -34,18 +34,30 @@
 #include <vector>
 #include <memory>
 #include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
 
 #include "LFT/LFTtypes.h"
 #include "bin.h"
 #include "z2types.h"
 #include "MemFusion/TimeStamp.h"
-#include "MemFusion/LF/bvec.h"
+#include "MemFusion/LF/segvec.h"
+#include "MemFusion/LF/epoch.h"
 #include "Filter.h"
 #include "LFT/LFT.h"
 #include "LFT/AT.h"
 #include "Perfy.h"
 #include "Z2Query.h"
+#include "Z2Update.h"
 #include "QueryContext.h"
+#include "MemoryBudget.h"
+#include "BlobStore.h"
+#include "StringDictionary.h"
+#include "HashIndex.h"
+#include "RangeIndex.h"
+#include "BitmapIndex.h"
 #include "MemFusion/Platform/FileSystem.h"
 #include "MemFusion/Percy.h"
 
@@ -60,6 +72,15 @@ using std::tuple;
 
 typedef std::set<Z2name> Projections;
 
+// binIdx << 32 | elemIdx: an element acquired in a batch, till released
+typedef uint64 InsertHandle;
+const InsertHandle NO_HANDLE = ~0ULL;
+
+inline InsertHandle MakeInsertHandle(uint32 binIdx, uint32 elemIdx)
+{
+    return ((uint64(binIdx) << 32) | elemIdx);
+}
+
 class align_deleter
 {
 public:
@@ -128,13 +149,17 @@ struct CollectionIntrinsicCfg
     std::string name;
     uint32 binMaxElems;
     uint64 binMaxSize;
-    uint32 maxBinNum;
+    uint32 maxBinNum;       // 0: no limit
+    uint32 spareBins;       // kept ready by a background thread
+    MemoryBudget * budget;  // of the engine, nullptr: no limit
 
-    explicit CollectionIntrinsicCfg(std::string n, uint32 bme, uint64 bms, uint32 mbn)
+    explicit CollectionIntrinsicCfg(std::string n, uint32 bme, uint64 bms, uint32 mbn, uint32 sb = 1, MemoryBudget * mb = nullptr)
         : name(n),
         binMaxElems(bme),
         binMaxSize(bms),
-        maxBinNum(mbn)
+        maxBinNum(mbn),
+        spareBins(sb),
+        budget(mb)
     {}
 private:
     CollectionIntrinsicCfg();
@@ -142,8 +167,28 @@ private:
 
 typedef const CollectionIntrinsicCfg cCollectionIntrinsicCfg;
 
+// How the Bins of a Collection were added
+struct GrowMetrics
+{
+    uint64 fromSpare;       // swapped in ready
+    uint64 allocated;       // allocated by the inserter that found the last Bin full (or by the ctor)
+    uint64 waits;           // 1ms sleeps of inserters while another one added a Bin
+};
+
+// What sealing did: a full Bin is closed, and its promoted columns packed.
+// That is not compression of the Bin. The atoms keep their 16-byte insert
+// layout, name and docdepth in each, and a Column is a copy of one field
+// on top of them: packing makes that copy small, and only its 16-byte
+// entries go. The atoms stay resident until the Bin spills.
+struct SealMetrics
+{
+    uint64 closed;          // Bins that took no more elements, with columns or not
+    uint64 freedBytes;      // Column entries dropped for their packed form
+    uint64 keptBytes;       // atoms of the closed Bins, still in memory
+};
 
-class Collection
+
+class Collection : public ISpillable
 {
     enum PerfMetrics
     {
@@ -151,23 +196,163 @@ class Collection
     };
 
     static const char * BIN_SERIALIZATION_EXTENSION;
+    static const char * MAPPED_BIN_EXTENSION;
+    static const char * SPILLED_BIN_EXTENSION;
+    static const char * BLOBS_EXTENSION;
+
+    // TBD: from configuration
+    static const uint32 COMPACT_REMOVED_PERCENT = 25;
 
     std::atomic<bool> s_growing;
     void grow();
     void grow(Bin<Z2raw> * bin);
+    bool GrowFrom(const Bin<Z2raw> * bin, uint32 sizeBytes);
+    bool BelowMaxBins(uint32 numBins) const
+    {
+        return ((m_cfgi.maxBinNum == 0) || (numBins < m_cfgi.maxBinNum));
+    }
+    void AddPromotedColumns(Bin<Z2raw> * bin);
+
+    // Bins allocated, zeroed and faulted in ahead by m_sparesThread,
+    // next binIdx first (not for mapped Bins: no memset to save there)
+    std::mutex m_sparesMutex;
+    std::condition_variable m_sparesCond;
+    std::deque<Bin<Z2raw>*> m_spares;
+    bool m_stopping;
+    bool m_sparesIdle;                          // waiting for a Bin to be taken or added
+    std::condition_variable m_sparesIdleCond;
+    std::thread m_sparesThread;
+    std::atomic<uint64> x_binsFromSpare;
+    std::atomic<uint64> x_binsAllocated;
+    std::atomic<uint64> x_growWaits;
+    void PrepareSpares();
+    Bin<Z2raw> * TakeSpare(uint32 binIdx);
+
+    // Bins where removed elements cross COMPACT_REMOVED_PERCENT are
+    // rewritten packed by m_compactorThread and swapped in. The old one is
+    // freed when no query or inserter entered in m_epoch can still use it.
+    // Full Bins are sealed there too: their promoted columns get packed.
+    std::mutex m_compactMutex;
+    std::condition_variable m_compactCond;
+    bool m_compactPending;
+    bool m_compactStop;
+    uint64 m_compactPassesStarted;              // under m_compactMutex
+    uint64 m_compactPassesDone;
+    std::condition_variable m_compactDoneCond;
+    std::thread m_compactorThread;
+    std::atomic<uint64> x_binsCompacted;
+    std::atomic<uint64> x_binsPacked;          // sealed with promoted columns packed
+    std::atomic<uint64> x_binsClosed;
+    std::atomic<uint64> x_sealFreedBytes;
+    std::atomic<uint64> x_sealKeptBytes;
+    LF::epoch m_epoch;
+    void WakeCompactor();
+    void CompactBins();
+    bool NeedsCompaction(const Bin<Z2raw> * bin) const;
+    void CompactBin(uint32 binIdx);
+    bool NeedsSealing(Bin<Z2raw> * bin) const;
+    void SealBin(uint32 binIdx);
+
+    // Over m_cfgi.budget sealed Bins go to local disk, coldest first, and
+    // are read back when a query, compaction or backfill needs them.
+    std::atomic<uint64> x_binsSpilled;
+    Path ComposeBinSpillPath(cuint32 binIdx) const;
+    void WriteSpill(const Bin<Z2raw> * bin) const;
+    Z2raw * ReadSpill(const Bin<Z2raw> * bin) const;
+    void FaultIn(Bin<Z2raw> * bin) const;
+
+    // Read back by NUM_LOADERS threads however many Bins the queries pin:
+    // LoadBin() queues one after Pin() said OnDisk, a nullptr stops a loader
+    static const uint32 NUM_LOADERS = 2;   // TBD: from configuration
+    MemFusion::syncqueue<Bin<Z2raw>*> m_loadQueue;
+    std::vector<std::thread> m_loaderThreads;
+    void LoadBin(Bin<Z2raw> * bin);
+    void LoadBins();
+
+    // Pinned with its atoms in memory, read back here if spilled
+    class ResidentBin
+    {
+        Bin<Z2raw> * m_bin;
+
+        ResidentBin(const ResidentBin &);
+        void operator = (const ResidentBin &);
+    public:
+        ResidentBin(const Collection & coll, Bin<Z2raw> * bin);
+        ~ResidentBin() { m_bin->Unpin(); }
+    };
+
+    // Z2names also kept by column in every Bin
+    std::mutex m_columnsMutex;
+    std::vector<Z2name> m_promoted;
 
     cCollectionIntrinsicCfg m_cfgi;
     cCollectionPercyCfg     m_cfgp;
     Path                    m_percyCollectionBasePath;
 
     Path ComposeBinSerializedPath(cuint32 binIdx);
+    Path ComposeBlobsPath() const;
+
+    // strings longer than 8 bytes and binary data, by the hash in their atom
+    BlobStore m_blobs;
+
+    // order-preserving codes of the strings in sealed Bins, after m_blobs
+    StringDictionary m_strings;
+
+    // Equality indexes, added by CreateHashIndex and never dropped: those
+    // releasing inserts read them without locking. A build and a
+    // compaction do not run together (m_indexesMutex). The one of _id
+    // comes with the collection: inserts keep _id unique with it.
+    static const uint32 MAX_HASH_INDEXES = 16;  // TBD: from configuration
+    static const uint32 ID_INDEX = 0;
+    std::atomic<HashIndex*> s_hashIndexes[MAX_HASH_INDEXES];
+    std::atomic<uint32> s_numHashIndexes;
+    std::mutex m_indexesMutex;
+    std::atomic<uint64> x_indexLookups;
+    std::atomic<uint64> x_duplicateIds;
+    // in place updates of an indexed field, striped by InsertHandle
+    static const uint32 NUM_UPDATE_LOCKS = 64;  // TBD: from configuration
+    std::mutex m_updateLocks[NUM_UPDATE_LOCKS];
+    HashIndex * FindHashIndex(Z2name name) const;
+    void IndexElem(const Bin<Z2raw> * bin, uint32 elemIdx, bool claimed = false);
+    bool ClaimId(Bin<Z2raw> * bin, uint32 elemIdx, InsertHandle relocated = NO_HANDLE);
+    bool HoldsId(InsertHandle handle, const HashIndex::Key & key);
+
+    // Ordered indexes, added by CreateRangeIndex and never dropped. Their
+    // Runs are built and dropped by m_compactorThread only.
+    static const uint32 MAX_RANGE_INDEXES = 8;          // TBD: from configuration
+    static const uint32 RANGE_INDEX_MAX_PERCENT = 10;   // of the elements: candidates above it are scanned
+    std::atomic<RangeIndex*> s_rangeIndexes[MAX_RANGE_INDEXES];
+    std::atomic<uint32> s_numRangeIndexes;
+    std::atomic<uint64> x_rangeRuns;
+    bool NeedsRangeRuns(uint32 binIdx);
+    void BuildRangeRuns(uint32 binIdx);
+
+    // Bitmap indexes, added by CreateBitmapIndex and never dropped. Their
+    // Bitmaps are built and dropped by m_compactorThread only.
+    static const uint32 MAX_BITMAP_INDEXES = 16;        // TBD: from configuration
+    static const uint32 BITMAP_INDEX_MAX_PERCENT = 25;  // of the elements in Bins without Bitmaps: above it all is scanned
+    std::atomic<BitmapIndex*> s_bitmapIndexes[MAX_BITMAP_INDEXES];
+    std::atomic<uint32> s_numBitmapIndexes;
+    std::atomic<uint64> x_bitmapsBuilt;
+    const BitmapIndex * FindBitmapIndex(Z2name name) const;
+    bool NeedsBitmaps(uint32 binIdx);
+    void BuildBitmaps(uint32 binIdx);
 
     // These are all relative to LFT queries
     //
-    uint32 FindProjectPhase(std::vector<LFTStage3> & matchesPerBin, Buffer & retbuf, opt<Projections &> onames);
+    typedef QueryContext<uint32, LFTStage3, Stage1Payload> FindContext;  // 3rd is LFTidx
+    std::unique_ptr<FindContext, align_deleter> FindMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query);
+    std::unique_ptr<FindContext, align_deleter> PlanMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query);
+    std::unique_ptr<FindContext, align_deleter> LookupMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query, const HashIndex & index, const std::vector<Z2raw> & equals);
+    std::unique_ptr<FindContext, align_deleter> RangeMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query, const RangeIndex & index, const RangeIndex::Key & lo, const RangeIndex::Key & hi);
+    std::unique_ptr<FindContext, align_deleter> BitmapMatches(uint64 transId, Buffer & retbuf, const Z2FindQuery * z2query, uint64 * counted = nullptr);
+    void CheckMatches(FindContext & queryCtx, const Z2FindQuery * z2query, const std::vector<bool> * exact = nullptr);
+    uint32 FindProjectPhase(const std::vector<Bin<Z2raw>*> & snapshot, std::vector<LFTStage3> & matchesPerBin, Buffer & retbuf, opt<Projections &> onames);
     uint32 FindProject(LFTStage3 & stage3, Z2raw *& dstPtr, const Bin<Z2raw> * bin, opt<Projections &> onames);
     uint32 FindProjectSome(LFTStage3 & stage3, Z2raw *& dstPtr, const Bin<Z2raw> * bin, bool projectId, Projections & names);
     uint32 FindProjectAll(LFTStage3 & stage3, Z2raw *& dstPtr, const Bin<Z2raw> * bin);
+    bool UpdateElem(Bin<Z2raw> * bin, uint32 elemIdx, const Z2Updates & updates);
+    bool RelocateElem(Bin<Z2raw> * bin, uint32 elemIdx, const Z2Updates & updates);
     //
 
     INLINE static void AddDocDelimiter(Z2raw *& dstPtr)
@@ -184,7 +369,8 @@ class Collection
         TimeStamp start;
         auto mem = _aligned_malloc(sizeof(QC), CACHE_LINE);
         std::unique_ptr<QC, align_deleter>
-            queryCtx(new (mem) QC(z2query, bins, retbuf, STAGE1_ELEMS_PER_THREAD, decoder));
+            queryCtx(new (mem) QC(z2query, m_epoch, bins, retbuf, STAGE1_ELEMS_PER_THREAD, decoder,
+                [this](Bin<Z2raw> * bin) { LoadBin(bin); }));
         TimeStamp preparation;
 
         queryCtx->metrics.prepare_us = TimeStamp::millis(start, preparation);
@@ -196,8 +382,14 @@ private:
 
     const std::string & name() const { return m_cfgi.name; }
 
-    void SerializeBin(const Bin<Z2raw> * bin);
+    void SerializeBin(const Bin<Z2raw> * bin, const Z2raw * raw);
     Bin<Z2raw> * DeserializeBin(Path path);
+
+    // PersistencyType::MappedFileSystem: Bins are backed by their files
+    bool IsMapped() const { return (m_cfgp.ptype == PercyTraits::PersistencyType::MappedFileSystem); }
+    Bin<Z2raw> * CreateMappedBin(uint32 binIdx);
+    Bin<Z2raw> * OpenMappedBin(Path path, uint32 binIdx);
+    void FlushMappedBin(Bin<Z2raw> * bin);
     static std::tuple<bool, std::string> CompareBins(const Bin<Z2raw> *, const Bin<Z2raw> *);
 
     static Collection * InstantiateBase(cCollectionIntrinsicCfg & cfgi, cCollectionPercyCfg & cfgp, bool deserialize = false);
@@ -228,14 +420,97 @@ public:
 
     uint32 Aggregate(uint64 transId, Buffer & retbuf, const Z2AggrQuery * z2query);
 
+    // Number of documents matching 'z2query'
+    uint64 Count(uint64 transId, const Z2FindQuery * z2query);
+
+    // Marks the documents matching 'z2query' removed, returns how many.
+    // Their memory goes back when their Bin is compacted.
+    uint32 Remove(uint64 transId, const Z2FindQuery * z2query);
+
+    // $set / $inc of root level fields of the documents matching 'z2query',
+    // returns how many changed. Numbers, bools and dates are updated in
+    // place; a document changing size is rewritten where inserts go.
+    uint32 Update(uint64 transId, const Z2FindQuery * z2query, const Z2Updates & updates);
+
+    // False when 'buffer' was not acquired, or its document has an _id
+    // already in the collection: it is discarded then.
     bool ReleaseInsertBuffer(void * buffer);
 
     void * AcquireInsertBuffer(uint32 sizeBytes);
 
+    // Bulk loads: one call for many documents, released by handle without
+    // looking for them. Returns how many were acquired (fewer only when
+    // the collection cannot grow), how many were released (fewer when
+    // documents with an _id already there were discarded). 'released', when
+    // given, gets 1 for each handle released and 0 for each discarded.
+    uint32 AcquireInsertBuffers(uint32 count, const uint32 * sizesBytes, void ** buffers, InsertHandle * handles);
+    uint32 ReleaseInsertBuffers(uint32 count, const InsertHandle * handles, byte * released = nullptr);
+    uint64 GetDuplicateIds() const { return (x_duplicateIds.load()); }
+
     uint32 GetNumBins() const { return static_cast<uint32>(bins.size()); }
 
+    GrowMetrics GetGrowMetrics() const
+    {
+        GrowMetrics ret = { x_binsFromSpare.load(), x_binsAllocated.load(), x_growWaits.load() };
+        return (ret);
+    }
+
+    // Blocks till m_sparesThread has made all the spare Bins it can for
+    // now: how many are ready. 0 right away without spares.
+    uint32 WaitForSpares();
+
+    // Wakes m_compactorThread and blocks till a whole pass over the Bins
+    // started after the call is done: how many passes are. 0 right away
+    // without a compactor (mapped Bins).
+    uint64 WaitForCompactor();
+
+    uint64 GetBinsCompacted() const { return (x_binsCompacted.load()); }
+    uint64 GetBinsPacked() const { return (x_binsPacked.load()); }
+    SealMetrics GetSealMetrics() const
+    {
+        SealMetrics ret = { x_binsClosed.load(), x_sealFreedBytes.load(), x_sealKeptBytes.load() };
+        return (ret);
+    }
+    uint64 GetBinsSpilled() const { return (x_binsSpilled.load()); }
+
+    // ISpillable
+    virtual uint64 ResidentBytes();
+    virtual bool ColdestBin(uint64 & lastScan, uint32 & binIdx);
+    virtual uint64 SpillBin(uint32 binIdx);
+
+    // 'name' gets a Column in every Bin, present and future ones
+    void PromoteColumn(Z2name name);
+
+    // $eq on 'name' in a conjunction is looked up, not scanned. Built over
+    // the present Bins in parallel, kept by inserts from then on.
+    void CreateHashIndex(Z2name name);
+    uint64 GetIndexLookups() const { return (x_indexLookups.load()); }
+
+    // $gt/$gte/$lt/$lte on numbers and dates, after $eq on the Z2names
+    // before, looked up when that is estimated cheaper than a scan. Its
+    // Runs are built in the background, Bin by Bin.
+    void CreateRangeIndex(const std::vector<Z2name> & names);
+    uint64 GetRangeRuns() const { return (x_rangeRuns.load()); }
+
+    // Queries with only $eq and $ne on Z2names with a bitmap index are
+    // answered from their Bitmaps, built in the background Bin by Bin:
+    // Count without reading any document.
+    void CreateBitmapIndex(Z2name name);
+    uint64 GetBitmapsBuilt() const { return (x_bitmapsBuilt.load()); }
+
+    // False when 'hash' has other bytes already. Persisted with the Bins.
+    bool AddBlob(uint64 hash, const void * bytes, uint32 size) { return (m_blobs.add(hash, bytes, size)); }
+
+    // Without locking; nullptr when unknown. Valid as long as the collection.
+    const void * FindBlob(uint64 hash, uint32 & size) const { return (m_blobs.find(hash, size)); }
+    uint64 GetNumBlobs() const { return (m_blobs.count()); }
+
+    // For the string filters of queries on this collection (Z2FindQuery)
+    const StringDictionary & GetStrings() const { return (m_strings); }
+    uint64 GetUnresolvedStrings() const { return (m_strings.unresolved()); }
+
 private:
-    LF::bvec<Bin<Z2raw>*> bins;
+    LF::segvec<Bin<Z2raw>*> bins;
 
     static std::map<QO, AccumulatorLambda> accumulators;
 
@@ -275,7 +550,7 @@ private:
 };
 
 
-void FindProcessData(uint32 numLFTs, Stage2 & stage2PerBin, const Z2FindQuery & z2query, LFTStage3 & matchesPerBin);
+void FindProcessData(Stage2 & stage2PerBin, const Z2FindQuery & z2query, const Bin<Z2raw> * bin, uint32 numElems, LFTStage3 & matchesPerBin);
 
 
 
@@ -0,0 +1,125 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <atomic>
+
+#include "MemFusion/types.h"
+#include "MemFusion/PageAllocator.h"
+#include "z2types.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   One promoted Z2name of a Bin, stored by column: entry elemIdx holds the
+//   root level atom with that name of element elemIdx, or an empty (all zero)
+//   atom when the element has none.
+//
+//   Scans read 16 bytes per element instead of walking every atom of every
+//   element. An empty atom never matches a filter (its low qword is zero).
+//   Entries are allocated in words of 64 elements, so a scan can always read
+//   a whole word.
+class Column
+{
+    const Z2name name;
+    const uint32 capacity;
+    const uint32 node;
+    Z2raw * atoms;                  // nullptr once dropped
+    std::atomic<bool> s_published;
+
+    Column(const Column &);
+    void operator = (const Column &);
+public:
+    Column(Z2name name_, uint32 numElems, uint32 node_ = MemFusion::ANY_NODE)
+        : name(name_),
+        capacity(((numElems + 63) / 64) * 64),
+        node(node_),
+        s_published(false)
+    {
+        // zeroed, next to the atoms of its Bin
+        atoms = static_cast<Z2raw*>(MemFusion::PageAllocator::Allocate(capacity * sizeof(Z2raw), node));
+    }
+
+    ~Column()
+    {
+        drop();
+    }
+
+    Z2name GetName() const { return (name); }
+
+    // backfilled: from now on queries can use it
+    bool published() const { return (s_published.load(std::memory_order_acquire)); }
+    void publish() { s_published.store(true, std::memory_order_release); }
+
+    const Z2raw * data() const { return (atoms); }
+
+    const Z2raw & operator [] (uint32 elemIdx) const { return (atoms[elemIdx]); }
+
+    // Sealed Bins answer from the PackedColumn: the entries go, bytes freed.
+    uint64 drop()
+    {
+        if (atoms == nullptr)
+            return (0ULL);
+        MemFusion::PageAllocator::Free(atoms, capacity * sizeof(Z2raw));
+        atoms = nullptr;
+        return (capacity * sizeof(Z2raw));
+    }
+
+    bool dropped() const { return (atoms == nullptr); }
+
+    // back from the PackedColumn: empty entries, to be filled again
+    void restore()
+    {
+        if (atoms == nullptr)
+        {
+            atoms = static_cast<Z2raw*>(MemFusion::PageAllocator::Allocate(capacity * sizeof(Z2raw), node));
+        }
+    }
+
+    // the atoms of element 'elemIdx'
+    void fill(uint32 elemIdx, const Z2raw * begin, const Z2raw * end)
+    {
+        if (atoms == nullptr)
+            return;
+        for (const Z2raw * cur = begin; cur < end; ++cur)
+        {
+            if ((cur->m128i_u32[0] == 0) && (Z2(*cur).z2name() == name))
+            {
+                atoms[elemIdx] = *cur;
+                return;
+            }
+        }
+    }
+};
+
+}
+}
@@ -0,0 +1,216 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+
+#include "MemFusion/types.h"
+#include "MemFusion/LF/spinlock.h"
+#include "z2types.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   Equality index of one Z2name: binIdx << 32 | elemIdx of the elements
+//   with a root level atom of that name, by what $eq compares of it.
+//
+//   Entries are sharded by key, each shard under its own spinlock, so that
+//   inserters releasing elements and a parallel build do not serialize.
+//   Entries can be stale (removed elements, old values updated in place,
+//   a handle listed twice): whoever looks up checks them on the Bin.
+//   Compaction drops those of the elements it moved.
+class HashIndex
+{
+public:
+    // TBD: from configuration
+    static const uint32 NUM_SHARDS = 64;
+
+    // low qword (docnum 0 at root level) and z2value: all $eq compares
+    struct Key
+    {
+        uint64 low;
+        uint64 value;
+
+        bool operator == (const Key & other) const
+        {
+            return ((low == other.low) && (value == other.value));
+        }
+    };
+
+private:
+    struct KeyHash
+    {
+        size_t operator () (const Key & key) const
+        {
+            return (static_cast<size_t>(mix(key)));
+        }
+    };
+
+    struct Shard
+    {
+        MemFusion::LF::spinlock lock;
+        std::unordered_map<Key, std::vector<uint64>, KeyHash> entries;
+    };
+
+    const Z2name m_name;
+    std::unique_ptr<Shard[]> m_shards;
+    std::atomic<uint64> x_entries;
+
+    static uint64 mix(const Key & key)
+    {
+        uint64 ret = (key.value ^ (key.low * 0x9E3779B97F4A7C15ULL)) * 0xC2B2AE3D27D4EB4FULL;
+        return (ret ^ (ret >> 29));
+    }
+
+    Shard & shard(const Key & key) const
+    {
+        return (m_shards[(mix(key) >> 32) % NUM_SHARDS]);
+    }
+
+    // the keys of the root level atoms 'name' in [begin, end)
+    void keys(const Z2raw * begin, const Z2raw * end, std::vector<Key> & out) const
+    {
+        for (const Z2raw * cur = begin; (cur < end) && !Z2::invalid(*cur); ++cur)
+        {
+            if ((cur->m128i_u32[0] == RootDocnum) && (Z2(*cur).z2name() == m_name))
+            {
+                out.push_back(key(*cur));
+            }
+        }
+    }
+
+    HashIndex(const HashIndex &);
+    void operator = (const HashIndex &);
+public:
+    explicit HashIndex(Z2name name)
+        : m_name(name),
+        m_shards(new Shard[NUM_SHARDS]),
+        x_entries(0ULL)
+    {
+    }
+
+    Z2name name() const { return (m_name); }
+    uint64 size() const { return (x_entries.load()); }
+
+    static Key key(const Z2raw & atom)
+    {
+        const Z2raw z2raw = Z2::remove_doc(atom);
+        Key ret = { z2raw.m128i_u64[0], z2raw.m128i_u64[1] };
+        return (ret);
+    }
+
+    void add(const Key & key, uint64 handle)
+    {
+        Shard & one = shard(key);
+        std::lock_guard<MemFusion::LF::spinlock> guard(one.lock);
+        one.entries[key].push_back(handle);
+        ++x_entries;
+    }
+
+    // Same, 'before' gets the handles under 'key' till then: whoever adds
+    // a key after another sees it
+    void add(const Key & key, uint64 handle, std::vector<uint64> & before)
+    {
+        Shard & one = shard(key);
+        std::lock_guard<MemFusion::LF::spinlock> guard(one.lock);
+        std::vector<uint64> & handles = one.entries[key];
+        before = handles;
+        handles.push_back(handle);
+        ++x_entries;
+    }
+
+    // every entry of 'handle' under 'key'
+    void remove(const Key & key, uint64 handle)
+    {
+        Shard & one = shard(key);
+        std::lock_guard<MemFusion::LF::spinlock> guard(one.lock);
+        auto found = one.entries.find(key);
+        if (found == one.entries.end())
+            return;
+        std::vector<uint64> & handles = found->second;
+        const auto last = std::remove(handles.begin(), handles.end(), handle);
+        x_entries -= static_cast<uint64>(std::distance(last, handles.end()));
+        handles.erase(last, handles.end());
+        if (handles.empty())
+        {
+            one.entries.erase(found);
+        }
+    }
+
+    // the element at 'handle' has atoms [begin, end)
+    void add(const Z2raw * begin, const Z2raw * end, uint64 handle)
+    {
+        std::vector<Key> found;
+        keys(begin, end, found);
+        for (const Key & one : found)
+        {
+            add(one, handle);
+        }
+    }
+
+    // The element at 'handle' had atoms [begin, end) and now has [keepBegin,
+    // keepEnd): its entries under keys it has no more go.
+    void remove(const Z2raw * begin, const Z2raw * end, uint64 handle, const Z2raw * keepBegin = nullptr, const Z2raw * keepEnd = nullptr)
+    {
+        std::vector<Key> gone;
+        std::vector<Key> kept;
+        keys(begin, end, gone);
+        keys(keepBegin, keepEnd, kept);
+        for (const Key & one : gone)
+        {
+            if (std::find(kept.begin(), kept.end(), one) == kept.end())
+            {
+                remove(one, handle);
+            }
+        }
+    }
+
+    // appends the handles under 'key', possibly stale or repeated
+    void find(const Key & key, std::vector<uint64> & out) const
+    {
+        Shard & one = shard(key);
+        std::lock_guard<MemFusion::LF::spinlock> guard(one.lock);
+        auto found = one.entries.find(key);
+        if (found != one.entries.end())
+        {
+            out.insert(out.end(), found->second.begin(), found->second.end());
+        }
+    }
+};
+
+}
+}
@@ -74,7 +74,7 @@ template <typename T>
 class IZ2LAT
 {
 public:
-    virtual void apply_filter(const Bin<Z2raw> * bin, IStage1Producer<T, Stage1Payload> * stage1) const = 0;
+    virtual void apply_filter(const Bin<Z2raw> * bin, uint32 numElems, IStage1Producer<T, Stage1Payload> * stage1) const = 0;
 };
 
 struct SUMExtractPolicy
@@ -149,6 +149,12 @@ public:
     {
         return (LFTidx);
     }
+
+    // both the group and the accumulated field must occur
+    bool may_match(const ZoneMap & zone) const
+    {
+        return (zone.may_contain(z2groupname) && zone.may_contain(z2accname));
+    }
 };
 
 #pragma warning(push)
@@ -162,12 +168,11 @@ public:
         : Z2LATBase(groupname, accname, tgtname, op, idx)
     {}
 
-    void apply_filter(const Bin<Z2raw> * bin, IStage1Producer<NV, Stage1Payload> * realstage1) const
+    void apply_filter(const Bin<Z2raw> * bin, uint32 numElems, IStage1Producer<NV, Stage1Payload> * realstage1) const
     {
         uint64 numAtoms = 0ULL;
         auto core = bin->Get();
         cuint32 binIdx = bin->binIdx();
-        auto numElems = core->s_nFreeElemIdx.load();
 
         xHandle handle;
         EmptySlot<NV> stage1slot = realstage1->get_stage1(handle);
@@ -177,53 +182,110 @@ public:
         uint32 stage1_elems = (uint32)std::distance(stage1_begin, stage1_end);
         auto payload = std::make_pair(LFTidx, binIdx);
 
-        for (uint32 idx = 0; idx < numElems; ++idx)
+        auto emit = [&](const Z2raw & group, Z2value accvalue)
         {
-            // for each Z2 in this elem
-            bool notactive = (core->s_vElems[idx].status() != ElemState::ElemActive);
-            AtomRange<Z2raw> range = bin->get_elem_range(idx);
-            auto range_begin = range.begin();
-            auto range_end = range.end();
-
-            if (notactive) continue;
+            *stage1_cur++ = NV(group, accvalue);
+            if (stage1_cur == stage1_end)
+            {
+                // this one might block
+                realstage1->promote(handle, stage1_elems, payload);
+                stage1slot = realstage1->get_stage1(handle);
+                stage1_cur = stage1_begin = stage1slot.first;
+                stage1_end = stage1slot.second;
+            }
+        };
+
+        // both fields promoted: read two atoms per element, decoded when sealed;
+        // Columns hold the first root-level atom of a field, so the row path below
+        // takes the same one and $group does not change once a field gets promoted
+        const PackedColumn * groupPacked = bin->packed(z2groupname);
+        const PackedColumn * accPacked = bin->packed(z2accname);
+        const Column * groupCol = bin->column(z2groupname);
+        const Column * accCol = bin->column(z2accname);
+        bool byColumn = (groupCol != nullptr) && (accCol != nullptr);
+        auto groupAt = [groupPacked, groupCol](uint32 idx) { return ((groupPacked != nullptr) ? groupPacked->at(idx) : (*groupCol)[idx]); };
+        auto accAt = [accPacked, accCol](uint32 idx) { return ((accPacked != nullptr) ? accPacked->at(idx) : (*accCol)[idx]); };
+        const ShapeCatalog & shapes = bin->shapes();
+        const ShapeLookup groupLookup(shapes, z2groupname, true);
+        const ShapeLookup accLookup(shapes, z2accname, true);
+
+        for (uint32 blockIdx = 0; blockIdx < Bin<Z2raw>::num_blocks(numElems); ++blockIdx)
+        {
+            if (!may_match(bin->blockZone(blockIdx)))
+                continue;
 
-            bool valueFound = false;
-            bool matchedGroup = false;
-            Z2value accvalue;
-            Z2raw group;
+            cuint32 blockEnd = std::min(numElems, (blockIdx + 1) * Bin<Z2raw>::BLOCK_ELEMS);
+            if (byColumn)
+            {
+                for (uint32 idx = blockIdx * Bin<Z2raw>::BLOCK_ELEMS; idx < blockEnd; ++idx)
+                {
+                    const Z2raw group = groupAt(idx);
+                    const Z2raw acc = accAt(idx);
+                    if (Z2::invalid(group) || Z2::invalid(acc) ||
+                        (core->s_vElems[idx].status() != ElemState::ElemActive))
+                        continue;
+
+                    emit(group, ExtractPolicy::Apply(acc));
+                    numAtoms += 2;
+                }
+                continue;
+            }
 
-            for (const __m128i * z2ptr = range_begin; z2ptr < range_end; ++z2ptr)
+            for (uint32 idx = blockIdx * Bin<Z2raw>::BLOCK_ELEMS; idx < blockEnd; ++idx)
             {
-                const Z2raw z = *z2ptr;
-                if (z2groupname == Z2(z).z2name())
+                // for each Z2 in this elem
+                bool notactive = (core->s_vElems[idx].status() != ElemState::ElemActive);
+                AtomRange<Z2raw> range = bin->get_elem_range(idx);
+                auto range_begin = range.begin();
+                auto range_end = range.end();
+
+                if (notactive) continue;
+
+                // straight to both fields when the shape is known
+                byte shapeId = shapes.shape(idx);
+                int32 groupOffset = groupLookup.at(shapeId);
+                int32 accOffset = accLookup.at(shapeId);
+                if ((groupOffset == ShapeCatalog::ABSENT) || (accOffset == ShapeCatalog::ABSENT))
+                    continue;
+                if ((groupOffset >= 0) && (accOffset >= 0))
                 {
-                    matchedGroup = true;
-                    group = z;
-                    if (valueFound)
-                        break;
+                    emit(range_begin[groupOffset], ExtractPolicy::Apply(range_begin[accOffset]));
+                    numAtoms += 2;
+                    continue;
                 }
-                if (z2accname == Z2(z).z2name())
+
+                bool valueFound = false;
+                bool matchedGroup = false;
+                Z2value accvalue;
+                Z2raw group;
+
+                for (const __m128i * z2ptr = range_begin; z2ptr < range_end; ++z2ptr)
                 {
-                    valueFound = true;
-                    //accvalue = Z2(z).z2value();
-                    accvalue = ExtractPolicy::Apply(z);
-                    if (matchedGroup)
-                        break;
+                    if (z2ptr->m128i_u32[0] != RootDocnum)
+                        continue;
+                    const Z2raw z = *z2ptr;
+                    if (!matchedGroup && (z2groupname == Z2(z).z2name()))
+                    {
+                        matchedGroup = true;
+                        group = z;
+                        if (valueFound)
+                            break;
+                    }
+                    if (!valueFound && (z2accname == Z2(z).z2name()))
+                    {
+                        valueFound = true;
+                        //accvalue = Z2(z).z2value();
+                        accvalue = ExtractPolicy::Apply(z);
+                        if (matchedGroup)
+                            break;
+                    }
                 }
-            }
-            if (valueFound && matchedGroup)
-            {
-                *stage1_cur++ = NV(group, accvalue);
-                if (stage1_cur == stage1_end)
+                if (valueFound && matchedGroup)
                 {
-                    // this one might block
-                    realstage1->promote(handle, stage1_elems, payload);
-                    stage1slot = realstage1->get_stage1(handle);
-                    stage1_cur = stage1_begin = stage1slot.first;
-                    stage1_end = stage1slot.second;
+                    emit(group, accvalue);
                 }
+                numAtoms += range_end - range_begin;
             }
-            numAtoms += range_end - range_begin;
         }
 
         if (stage1_cur != stage1_begin)
@@ -0,0 +1,329 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <intrin.h>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Inline.h"
+#include "z2types.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   Set of elemIdx of one Bin, in [0, universe).
+//
+//   Starts sparse (a vector of indexes) and turns dense (one bit per element)
+//   once more than one element in DENSE_RATIO is set. Sparse indexes are
+//   appended as they come and must be normalize()d before being combined.
+class ElemBitmap
+{
+public:
+    // TBD: from configuration
+    static const uint32 DENSE_RATIO = 32;   // dense costs 1 bit/elem, sparse 32
+
+private:
+    uint32 universe;
+    bool dense;
+    bool sorted;
+    std::vector<uint32> sparse;
+    std::vector<uint64> words;
+
+    static uint32 num_words(uint32 bits)
+    {
+        return ((bits + 63) / 64);
+    }
+
+    void check_densify()
+    {
+        if (!dense && (sparse.size() * DENSE_RATIO > universe))
+        {
+            densify();
+        }
+    }
+
+    ElemBitmap(const ElemBitmap &);
+    void operator = (const ElemBitmap &);
+public:
+    explicit ElemBitmap(uint32 universe_ = 0)
+        : universe(universe_),
+        dense(false),
+        sorted(true)
+    {
+    }
+
+    ElemBitmap(ElemBitmap && other)
+        : universe(other.universe),
+        dense(other.dense),
+        sorted(other.sorted),
+        sparse(std::move(other.sparse)),
+        words(std::move(other.words))
+    {
+    }
+
+    ElemBitmap & operator = (ElemBitmap && other)
+    {
+        universe = other.universe;
+        dense = other.dense;
+        sorted = other.sorted;
+        sparse = std::move(other.sparse);
+        words = std::move(other.words);
+        return (*this);
+    }
+
+    void reset(uint32 universe_)
+    {
+        universe = universe_;
+        dense = false;
+        sorted = true;
+        sparse.clear();
+        words.clear();
+    }
+
+    uint32 size() const { return (universe); }
+    bool is_dense() const { return (dense); }
+
+    INLINE void add(uint32 idx)
+    {
+        if (dense)
+        {
+            words[idx >> 6] |= (1ULL << (idx & 63));
+            return;
+        }
+        sorted = sorted && (sparse.empty() || (sparse.back() < idx));
+        sparse.push_back(idx);
+    }
+
+    template <typename Iter>
+    void add(Iter begin, Iter end)
+    {
+        for (Iter iter = begin; iter != end; ++iter)
+        {
+            add(*iter);
+        }
+        check_densify();
+    }
+
+    bool test(uint32 idx) const
+    {
+        if (dense)
+            return ((words[idx >> 6] & (1ULL << (idx & 63))) != 0);
+        return (std::binary_search(sparse.begin(), sparse.end(), idx));
+    }
+
+    uint64 count() const
+    {
+        if (!dense)
+            return (sparse.size());
+        uint64 ret = 0;
+        for (uint64 word : words)
+        {
+            ret += _mm_popcnt_u64(word);
+        }
+        return (ret);
+    }
+
+    // stage1 slots of the same LFT can be consumed in any order
+    void normalize()
+    {
+        if (!dense && !sorted)
+        {
+            std::sort(sparse.begin(), sparse.end());
+            sparse.erase(std::unique(sparse.begin(), sparse.end()), sparse.end());
+            sorted = true;
+        }
+    }
+
+    void densify()
+    {
+        if (dense)
+            return;
+        words.assign(num_words(universe), 0ULL);
+        dense = true;
+        for (uint32 idx : sparse)
+        {
+            words[idx >> 6] |= (1ULL << (idx & 63));
+        }
+        sparse.clear();
+        sparse.shrink_to_fit();
+    }
+
+    void and_with(const ElemBitmap & other)
+    {
+        if (dense && other.dense)
+        {
+            uint64 * dst = words.data();
+            const uint64 * src = other.words.data();
+            uint32 numw = (uint32) std::min(words.size(), other.words.size());
+            uint32 idx = 0;
+            for (; idx + 2 <= numw; idx += 2)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i *) (dst + idx));
+                __m128i b = _mm_loadu_si128((const __m128i *) (src + idx));
+                _mm_storeu_si128((__m128i *) (dst + idx), _mm_and_si128(a, b));
+            }
+            for (; idx < numw; ++idx)
+            {
+                dst[idx] &= src[idx];
+            }
+            std::fill(words.begin() + numw, words.end(), 0ULL);
+            return;
+        }
+        if (dense)
+        {
+            // result is at most as big as the sparse side
+            std::vector<uint32> kept;
+            kept.reserve(other.sparse.size());
+            std::copy_if(other.sparse.begin(), other.sparse.end(), std::back_inserter(kept),
+                [this](uint32 idx) { return ((idx < universe) && test(idx)); });
+            words.clear();
+            dense = false;
+            sparse.swap(kept);
+            sorted = true;
+            return;
+        }
+        if (other.dense)
+        {
+            sparse.erase(std::remove_if(sparse.begin(), sparse.end(),
+                [&other](uint32 idx) { return ((idx >= other.universe) || !other.test(idx)); }),
+                sparse.end());
+            return;
+        }
+        std::vector<uint32> both;
+        both.reserve(std::min(sparse.size(), other.sparse.size()));
+        std::set_intersection(sparse.begin(), sparse.end(), other.sparse.begin(), other.sparse.end(),
+            std::back_inserter(both));
+        sparse.swap(both);
+    }
+
+    void or_with(const ElemBitmap & other)
+    {
+        if (!dense && !other.dense)
+        {
+            std::vector<uint32> either;
+            either.reserve(sparse.size() + other.sparse.size());
+            std::set_union(sparse.begin(), sparse.end(), other.sparse.begin(), other.sparse.end(),
+                std::back_inserter(either));
+            sparse.swap(either);
+            check_densify();
+            return;
+        }
+        densify();
+        if (!other.dense)
+        {
+            for (uint32 idx : other.sparse)
+            {
+                if (idx < universe)
+                    words[idx >> 6] |= (1ULL << (idx & 63));
+            }
+            return;
+        }
+        uint64 * dst = words.data();
+        const uint64 * src = other.words.data();
+        uint32 numw = (uint32) std::min(words.size(), other.words.size());
+        uint32 idx = 0;
+        for (; idx + 2 <= numw; idx += 2)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *) (dst + idx));
+            __m128i b = _mm_loadu_si128((const __m128i *) (src + idx));
+            _mm_storeu_si128((__m128i *) (dst + idx), _mm_or_si128(a, b));
+        }
+        for (; idx < numw; ++idx)
+        {
+            dst[idx] |= src[idx];
+        }
+    }
+
+    // becomes 'universe' minus this (NOT): elements outside 'universe' are
+    // not alive and never match
+    void complement(const ElemBitmap & universe_)
+    {
+        if (!universe_.dense)
+        {
+            std::vector<uint32> kept;
+            kept.reserve(universe_.sparse.size());
+            std::copy_if(universe_.sparse.begin(), universe_.sparse.end(), std::back_inserter(kept),
+                [this](uint32 idx) { return ((idx >= universe) || !test(idx)); });
+            words.clear();
+            dense = false;
+            sparse.swap(kept);
+            sorted = true;
+            universe = universe_.universe;
+            return;
+        }
+        densify();
+        words.resize(universe_.words.size(), 0ULL);
+        universe = universe_.universe;
+
+        uint64 * dst = words.data();
+        const uint64 * src = universe_.words.data();
+        uint32 numw = (uint32) words.size();
+        uint32 idx = 0;
+        for (; idx + 2 <= numw; idx += 2)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *) (dst + idx));
+            __m128i b = _mm_loadu_si128((const __m128i *) (src + idx));
+            _mm_storeu_si128((__m128i *) (dst + idx), _mm_andnot_si128(a, b));
+        }
+        for (; idx < numw; ++idx)
+        {
+            dst[idx] = ~dst[idx] & src[idx];
+        }
+    }
+
+    // appends the set elemIdx, in ascending order
+    void extract(std::vector<uint32> & out) const
+    {
+        if (!dense)
+        {
+            out.insert(out.end(), sparse.begin(), sparse.end());
+            return;
+        }
+        out.reserve(out.size() + (size_t) count());
+        for (uint32 widx = 0; widx < words.size(); ++widx)
+        {
+            uint64 word = words[widx];
+            while (word)
+            {
+                unsigned long bit;
+                _BitScanForward64(&bit, word);
+                out.push_back((widx << 6) + bit);
+                word &= word - 1;
+            }
+        }
+    }
+};
+
+}
+}
@@ -37,6 +37,8 @@
 #include "Perfy.h"
 #include "MemFusion/non_copyable.h"
 #include "LFT/QueryOperators.h"
+#include "LFT/ScanKernels.h"
+#include "MemFusion/CpuFeatures.h"
 #include "MemFusion/LF/bvec.h"
 #include "bin.h"
 
@@ -52,7 +54,72 @@ template <typename T>
 class IZ2LFT
 {
 public:
-    virtual void apply_filter(const Bin<Z2raw> * bin, IStage1Producer<T, Stage1Payload> * stage1) const = 0;
+    // scans the first 'numElems' elements of 'bin' (the query snapshot)
+    virtual void apply_filter(const Bin<Z2raw> * bin, uint32 numElems, IStage1Producer<T, Stage1Payload> * stage1) const = 0;
+
+    // false when 'zone' (of a Bin, or of a block) proves that none of its
+    // elements passes this filter
+    virtual bool may_match(const ZoneMap & zone) const
+    {
+        return (true);
+    }
+};
+
+// A find LFT can also be asked about single elements (the fused scan).
+class IZ2FindLFT : public IZ2LFT<uint32>
+{
+public:
+    // the field it looks for: its ShapeLookup is taken once per Bin
+    virtual Z2name field() const = 0;
+
+    // subset of 'candidates' that matches; bit i stands for elemIdx base + i.
+    // 'lookup' is that of field() in the shapes of 'bin'.
+    virtual uint64 match_word(const Bin<Z2raw> * bin, const ShapeLookup & lookup, uint32 base, uint64 candidates) const = 0;
+};
+
+// Fills stage1 slots with matching elemIdx, promoting them when full.
+class Stage1Writer
+{
+    IStage1Producer<uint32, Stage1Payload> * realstage1;
+    const Stage1Payload payload;
+    xHandle handle;
+    veciter<uint32> stage1_begin;
+    veciter<uint32> stage1_end;
+    veciter<uint32> stage1_cur;
+
+    Stage1Writer(const Stage1Writer &);
+    void operator = (const Stage1Writer &);
+public:
+    Stage1Writer(IStage1Producer<uint32, Stage1Payload> * stage1, Stage1Payload payload_)
+        : realstage1(stage1),
+        payload(payload_)
+    {
+        EmptySlot<uint32> stage1slot = realstage1->get_stage1(handle);
+        stage1_cur = stage1_begin = stage1slot.first;
+        stage1_end = stage1slot.second;
+    }
+
+    INLINE void add(uint32 idx)
+    {
+        *stage1_cur++ = idx;
+        if (stage1_cur == stage1_end)
+        {
+            realstage1->promote(handle, (uint32) std::distance(stage1_begin, stage1_end), payload);
+            // this one might block
+            EmptySlot<uint32> stage1slot = realstage1->get_stage1(handle);
+            stage1_cur = stage1_begin = stage1slot.first;
+            stage1_end = stage1slot.second;
+        }
+    }
+
+    void flush()
+    {
+        if (stage1_cur != stage1_begin)
+        {
+            realstage1->promote(handle, (uint32) std::distance(stage1_begin, stage1_cur), payload);
+            stage1_begin = stage1_cur;
+        }
+    }
 };
 
 
@@ -60,10 +127,14 @@ public:
 #pragma warning(disable: 4324)  // structure was padded due to __declspec(align())
 
 template <typename T>
-class Z2LFT : public IZ2LFT<uint32>
+class Z2LFT : public IZ2FindLFT
 {
     const Z2raw z2raw;
+    const Z2name name;
     cuint32 LFTidx;
+    const MemFusion::SimdLevel simdLevel;
+    const StringDictionary * strings;           // a string filter: ScanStrings
+    StringDictionary::Constant constant;
 
     // TBD: this should come from configuration
     static const int STAGE1_MAX_NUM_ELEMS = 100000;
@@ -74,7 +145,21 @@ public:
     Z2LFT(Z2raw z2raw_, uint32 idx)
         //: z2raw(z2raw_),
         : z2raw(Z2::remove_doc(z2raw_)),
-        LFTidx(idx)
+        name(Z2(z2raw_).z2name()),
+        LFTidx(idx),
+        simdLevel(MemFusion::CpuFeatures::Level()),
+        strings(nullptr)
+    {
+    }
+
+    // string filter: 'constant_' is what 'strings_' has for it
+    Z2LFT(Z2raw z2raw_, uint32 idx, const StringDictionary & strings_, const StringDictionary::Constant & constant_)
+        : z2raw(Z2::remove_doc(z2raw_)),
+        name(Z2(z2raw_).z2name()),
+        LFTidx(idx),
+        simdLevel(MemFusion::CpuFeatures::Level()),
+        strings(&strings_),
+        constant(constant_)
     {
     }
 
@@ -83,54 +168,219 @@ public:
         return (LFTidx);
     }
 
-    void apply_filter(const Bin<Z2raw> * bin, IStage1Producer<uint32, Stage1Payload> * realstage1) const
+    void apply_filter(const Bin<Z2raw> * bin, uint32 numElems, IStage1Producer<uint32, Stage1Payload> * realstage1) const
+    {
+        if (strings != nullptr)
+        {
+            scan(LFT::ScanStrings<T>(z2raw, *strings, constant), bin, numElems, realstage1);
+            return;
+        }
+        switch (simdLevel)
+        {
+#ifdef MF_AVX512_INTRINSICS
+        case MemFusion::SimdLevel::SimdAVX512:
+            scan(LFT::ScanAVX512<T>(z2raw), bin, numElems, realstage1);
+            break;
+#endif
+        case MemFusion::SimdLevel::SimdAVX2:
+            scan(LFT::ScanAVX2<T>(z2raw), bin, numElems, realstage1);
+            break;
+        default:
+            scan(LFT::ScanSSE<T>(z2raw), bin, numElems, realstage1);
+            break;
+        }
+    }
+
+    bool may_match(const ZoneMap & zone) const
+    {
+        // zones are by low qword and z2value: those of strings are neither
+        if (strings != nullptr)
+            return (true);
+        ZoneRange range;
+        if (!zone.find(z2raw.m128i_u64[0], range))
+            return (false);
+        return (T::may_match(range, z2raw.m128i_u64[1]));
+    }
+
+    Z2name field() const
+    {
+        return (name);
+    }
+
+    uint64 match_word(const Bin<Z2raw> * bin, const ShapeLookup & lookup, uint32 base, uint64 candidates) const
+    {
+        const PackedColumn * packed = bin->packed(name);
+        if (packed != nullptr)
+        {
+            return (LFT::ScanPacked::match(packed->codes(base), packed->GetWidth(), range(packed)) & candidates);
+        }
+
+        if (strings != nullptr)
+            return (match_bits(LFT::ScanStrings<T>(z2raw, *strings, constant), bin, bin->column(name), lookup, base, candidates));
+        switch (simdLevel)
+        {
+#ifdef MF_AVX512_INTRINSICS
+        case MemFusion::SimdLevel::SimdAVX512:
+            return (match_bits(LFT::ScanAVX512<T>(z2raw), bin, bin->column(name), lookup, base, candidates));
+#endif
+        case MemFusion::SimdLevel::SimdAVX2:
+            return (match_bits(LFT::ScanAVX2<T>(z2raw), bin, bin->column(name), lookup, base, candidates));
+        default:
+            return (match_bits(LFT::ScanSSE<T>(z2raw), bin, bin->column(name), lookup, base, candidates));
+        }
+    }
+
+private:
+    LFT::CodeRange range(const PackedColumn * packed) const
+    {
+        return (packed->range<T>(z2raw, (strings != nullptr) ? &constant : nullptr));
+    }
+
+    template <typename Kernel>
+    uint64 match_bits(const Kernel & kernel, const Bin<Z2raw> * bin, const Column * col, const ShapeLookup & lookup, uint32 base, uint64 candidates) const
+    {
+        if (col != nullptr)
+        {
+            // columns are allocated in whole words
+            return (kernel.column(col->data() + base, 64) & candidates);
+        }
+
+        uint64 ret = 0ULL;
+        const ShapeCatalog & shapes = bin->shapes();
+        while (candidates)
+        {
+            unsigned long bit;
+            _BitScanForward64(&bit, candidates);
+            candidates &= candidates - 1;
+
+            AtomRange<Z2raw> range = bin->get_elem_range(base + bit);
+            int32 offset = lookup.at(shapes.shape(base + bit));
+            if (offset == ShapeCatalog::ABSENT)
+                continue;
+            if ((offset >= 0) ? kernel.any(range.begin() + offset, range.begin() + offset + 1) :
+                kernel.any(range.begin(), range.end()))
+            {
+                ret |= (1ULL << bit);
+            }
+        }
+        return (ret);
+    }
+
+    template <typename Kernel>
+    void scan(const Kernel & kernel, const Bin<Z2raw> * bin, uint32 numElems, IStage1Producer<uint32, Stage1Payload> * realstage1) const
     {
         uint64 numAtoms = 0ULL;
         auto core = bin->Get();
-        auto numElems = core->s_nFreeElemIdx.load();
-        // Note: allocate on stack or on heap?
-        xHandle handle;
-        EmptySlot<uint32> stage1slot = realstage1->get_stage1(handle);
-        auto stage1_begin = stage1slot.first;
-        auto stage1_end = stage1slot.second;
-        auto stage1_cur = stage1_begin;
-        cuint32 binIdx = bin->binIdx();
-        auto payload = std::make_pair(LFTidx, binIdx);
+        Stage1Writer writer(realstage1, std::make_pair(LFTidx, bin->binIdx()));
+        const PackedColumn * packed = bin->packed(name);
+        const Column * col = bin->column(name);
+        const ShapeCatalog & shapes = bin->shapes();
+        const ShapeLookup lookup(shapes, name, true);
+        const LFT::CodeRange codes = (packed != nullptr) ? range(packed) : LFT::CodeRange();
 
-        for (uint32 idx = 0; idx < numElems; ++idx)
+        for (uint32 blockIdx = 0; blockIdx < Bin<Z2raw>::num_blocks(numElems); ++blockIdx)
         {
-            // for each Z2 in this elem
-            bool notactive = (core->s_vElems[idx].status() != ElemState::ElemActive);
-            AtomRange<Z2raw> range = bin->get_elem_range(idx);
-            auto range_begin = range.begin();
-            auto range_end = range.end();
+            if (!may_match(bin->blockZone(blockIdx)))
+                continue;
 
-            if (notactive) continue;
+            if (packed != nullptr)
+            {
+                if (!codes.empty())
+                {
+                    numAtoms += scan_packed(packed, codes, core, blockIdx, numElems, writer);
+                }
+                continue;
+            }
+            if (col != nullptr)
+            {
+                numAtoms += scan_column(kernel, core, col, blockIdx, numElems, writer);
+                continue;
+            }
 
-            for (const __m128i * z2ptr = range_begin; z2ptr < range_end; ++z2ptr)
+            cuint32 blockEnd = std::min(numElems, (blockIdx + 1) * Bin<Z2raw>::BLOCK_ELEMS);
+            for (uint32 idx = blockIdx * Bin<Z2raw>::BLOCK_ELEMS; idx < blockEnd; ++idx)
             {
-                if (T::apply(z2raw, *z2ptr))
+                // for each Z2 in this elem
+                bool notactive = (core->s_vElems[idx].status() != ElemState::ElemActive);
+                AtomRange<Z2raw> range = bin->get_elem_range(idx);
+                auto range_begin = range.begin();
+                auto range_end = range.end();
+
+                if (notactive) continue;
+
+                // straight to the field when the shape is known
+                int32 offset = lookup.at(shapes.shape(idx));
+                if (offset >= 0)
+                {
+                    range_begin += offset;
+                    range_end = range_begin + 1;
+                }
+                else if (offset == ShapeCatalog::ABSENT)
                 {
-                    *stage1_cur++ = idx;
-                    if (stage1_cur == stage1_end)
-                    {
-                        realstage1->promote(handle, (uint32) std::distance(stage1_begin, stage1_end), payload);
-                        // this one might block
-                        stage1slot = realstage1->get_stage1(handle);
-                        stage1_cur = stage1_begin = stage1slot.first;
-                        stage1_end = stage1slot.second;
-                    }
-                    break;
+                    continue;
                 }
+
+                if (kernel.any(range_begin, range_end))
+                {
+                    writer.add(idx);
+                }
+                numAtoms += range_end - range_begin;
             }
-            numAtoms += range_end - range_begin;
         }
+        kernel.done();
+        writer.flush();
 
-        if (stage1_cur != stage1_begin)
+        MemFusion::Perfy::Instance().add<1>(0, numElems, numAtoms);
+    }
+
+    // one block of a promoted field: one atom per element, 64 elements at a time
+    template <typename Kernel>
+    static uint64 scan_column(const Kernel & kernel, const BinCore<Z2raw> * core, const Column * col, uint32 blockIdx, uint32 numElems, Stage1Writer & writer)
+    {
+        cuint32 blockEnd = std::min(numElems, (blockIdx + 1) * Bin<Z2raw>::BLOCK_ELEMS);
+        for (uint32 base = blockIdx * Bin<Z2raw>::BLOCK_ELEMS; base < blockEnd; base += 64)
         {
-            realstage1->promote(handle, (uint32) std::distance(stage1_begin, stage1_cur), payload);
+            uint32 count = std::min(64U, blockEnd - base);
+            uint64 matches = kernel.column(col->data() + base, count);
+            while (matches)
+            {
+                unsigned long bit;
+                _BitScanForward64(&bit, matches);
+                matches &= matches - 1;
+                if (core->s_vElems[base + bit].status() == ElemState::ElemActive)
+                {
+                    writer.add(base + bit);
+                }
+            }
         }
-        MemFusion::Perfy::Instance().add<1>(0, numElems, numAtoms);
+        return (blockEnd - blockIdx * Bin<Z2raw>::BLOCK_ELEMS);
+    }
+
+    // one block of a sealed field: 'width' bits per element, the codes
+    // matching are known before reading them
+    static uint64 scan_packed(const PackedColumn * packed, const LFT::CodeRange & codes, const BinCore<Z2raw> * core, uint32 blockIdx, uint32 numElems, Stage1Writer & writer)
+    {
+        cuint32 blockEnd = std::min(numElems, (blockIdx + 1) * Bin<Z2raw>::BLOCK_ELEMS);
+        for (uint32 base = blockIdx * Bin<Z2raw>::BLOCK_ELEMS; base < blockEnd; base += 64)
+        {
+            cuint32 count = std::min(64U, blockEnd - base);
+            uint64 matches = LFT::ScanPacked::match(packed->codes(base), packed->GetWidth(), codes);
+            if (count < 64)
+            {
+                matches &= (1ULL << count) - 1;
+            }
+            while (matches)
+            {
+                unsigned long bit;
+                _BitScanForward64(&bit, matches);
+                matches &= matches - 1;
+                if (core->s_vElems[base + bit].status() == ElemState::ElemActive)
+                {
+                    writer.add(base + bit);
+                }
+            }
+        }
+        return (blockEnd - blockIdx * Bin<Z2raw>::BLOCK_ELEMS);
     }
 
 };
@@ -38,6 +38,8 @@
 #include "MemFusion/non_copyable.h"
 #include "MemFusion/syncqueue.h"
 #include "MemFusion/opt.h"
+#include "MemFusion/PageAllocator.h"
+#include "LFT/Bitmap.h"
 
 namespace MFDB
 {
@@ -111,11 +113,15 @@ enum LFTConstants
     QP_RAW_SIZE = 8,
 };
 
+// Stage1 slots: big, and written then read once per query
 template <typename T>
-using veciter = typename std::vector<T>::iterator;
+using SlotVector = std::vector<T, MemFusion::PageAllocation<T>>;
 
 template <typename T>
-using cveciter = typename std::vector<T>::const_iterator;
+using veciter = typename SlotVector<T>::iterator;
+
+template <typename T>
+using cveciter = typename SlotVector<T>::const_iterator;
 
 template <typename T, typename Payload>
 using FullSlot = std::tuple<cveciter<T>, cveciter<T>, Payload>;
@@ -159,7 +165,7 @@ class Stage1 : public IStage1Producer<T, Payload>,
     static const uint32 MAX_STAGE1_WAIT_ITERATIONS = 1000;
     static const uint32 STAGE1_WAIT_ITERATIONS_MS = 1;
 
-    std::vector<std::vector<T>> stage1Slots;
+    std::vector<SlotVector<T>> stage1Slots;
     std::vector<std::atomic<uint32> *> slotOwners;
     std::array<uint32, STAGE1_NUM_SLOTS> slotStatus;
     std::array<uint32, STAGE1_NUM_SLOTS> slotElems;
@@ -229,7 +235,7 @@ public:
                 if (waited)   ++fullStage1Threads;
                 uint32 slotIdx = oslotIdx.get();
                 handle = slotIdx | 0x1111111100000000;
-                std::vector<T> & vec = stage1Slots[slotIdx];
+                SlotVector<T> & vec = stage1Slots[slotIdx];
                 return (make_emptyslot(vec.begin(), vec.end()));
             }
             std::this_thread::sleep_for(std::chrono::milliseconds(STAGE1_WAIT_ITERATIONS_MS));
@@ -271,7 +277,7 @@ public:
                     uint32 numElems = slotElems[slotIdx];
                     handle = slotIdx;
                     --s_promotedSlots;
-                    const std::vector<T> & vec = stage1Slots[slotIdx];
+                    const SlotVector<T> & vec = stage1Slots[slotIdx];
                     return (make_fullslot(vec.begin(), vec.begin() + numElems, slotPayloads[slotIdx]));
                 }
             }
@@ -301,28 +307,52 @@ public:
     }
 };
 
-struct Stage2
+// Stage2 of one Bin for a find query: a bitmap of matching elements per LFT.
+class Stage2
 {
-protected:
-    typedef std::map<cuint32, std::vector<cuint32>> DataType;
-    typedef DataType::iterator iterator;
-
-    DataType elem2LFTidxs;  // matching LFTs
+    std::vector<ElemBitmap> perLFT;
 
+    Stage2(const Stage2 &);
+    void operator = (const Stage2 &);
 public:
-    void add(cuint32 elemIdx, cuint32 LFTidx)
+    Stage2() {}
+
+    Stage2(Stage2 && other)
+        : perLFT(std::move(other.perLFT))
+    {}
+
+    void reset(uint32 numLFTs, uint32 numElems)
+    {
+        perLFT.resize(numLFTs);
+        for (ElemBitmap & bitmap : perLFT)
+        {
+            bitmap.reset(numElems);
+        }
+    }
+
+    void add(cuint32 LFTidx, cveciter<uint32> begin, cveciter<uint32> end)
     {
-        elem2LFTidxs[elemIdx].push_back(LFTidx);
+        perLFT[LFTidx].add(begin, end);
     }
 
-    iterator begin() { return (elem2LFTidxs.begin()); }
-    iterator end() { return (elem2LFTidxs.end()); }
+    ElemBitmap & operator [] (uint32 LFTidx) { return (perLFT[LFTidx]); }
+
+    uint32 size() const { return (static_cast<uint32>(perLFT.size())); }
+
+    // ready to be combined by the QP
+    void finish()
+    {
+        for (ElemBitmap & bitmap : perLFT)
+        {
+            bitmap.normalize();
+        }
+    }
 
-    size_t size() const { return (elem2LFTidxs.size()); }
+    std::vector<ElemBitmap> & bitmaps() { return (perLFT); }
 
     void clear()
     {
-        elem2LFTidxs.clear();
+        perLFT.clear();
     }
 };
 
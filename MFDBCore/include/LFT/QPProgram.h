@@ -0,0 +1,268 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Inline.h"
+#include "LFT/LFTtypes.h"
+#include "LFT/Bitmap.h"
+#include "retail_assert.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   The QP list of a find query, compiled once into a flat register program.
+//
+//   Registers [0, numLFTs) hold the LFT results, the others the partial
+//   results of the QP nodes. Every instruction combines two registers (or
+//   negates one) into a new register, so the same program runs on 64 elements
+//   at a time (one uint64 word per register) or on whole ElemBitmaps.
+//
+//   QP semantics: the LFTs are pushed in order, each QP pops 'kids' operands
+//   and pushes its result. NOT negates the AND of its operands, NOR the OR.
+//   Operands left on the stack at the end are ANDed.
+class QPProgram
+{
+public:
+    enum Shape
+    {
+        ShapeSingle,    // one LFT, no QP
+        ShapeAnd,       // only ANDs: conjunction of all the LFTs
+        ShapeOr,        // only ORs: disjunction of all the LFTs
+        ShapeGeneral,
+    };
+
+    enum OpCode : uint8
+    {
+        OpAnd,
+        OpOr,
+        OpNot,
+    };
+
+    // dst = (((left & right) & andMask) | ((left | right) & orMask)) ^ xorMask
+    struct Instr
+    {
+        uint64 andMask;
+        uint64 orMask;
+        uint64 xorMask;
+        uint32 dst;
+        uint32 left;
+        uint32 right;
+        OpCode op;
+    };
+
+private:
+    std::vector<Instr> code;
+    uint32 numLFTs;
+    uint32 numRegs;
+    uint32 result;
+    Shape shape;
+
+    uint32 emit(OpCode op, uint32 left, uint32 right)
+    {
+        Instr instr;
+        instr.andMask = (op == OpCode::OpOr) ? 0ULL : ~0ULL;
+        instr.orMask = (op == OpCode::OpOr) ? ~0ULL : 0ULL;
+        instr.xorMask = (op == OpCode::OpNot) ? ~0ULL : 0ULL;
+        instr.dst = numRegs++;
+        instr.left = left;
+        instr.right = right;
+        instr.op = op;
+        code.push_back(instr);
+        return (instr.dst);
+    }
+
+    static uint32 pop(std::vector<uint32> & mystack)
+    {
+        if (mystack.empty())
+            throw std::exception("QP list pops more operands than pushed.");
+        uint32 ret = mystack.back();
+        mystack.pop_back();
+        return (ret);
+    }
+
+    QPProgram(const QPProgram &);
+    void operator = (const QPProgram &);
+public:
+    QPProgram(uint32 numLFTs_, const std::vector<QPraw> & qps)
+        : numLFTs(numLFTs_),
+        numRegs(numLFTs_),
+        result(0),
+        shape(Shape::ShapeGeneral)
+    {
+        if (numLFTs == 0)
+            throw std::exception("Wrong number of LFTs in QPProgram ctor.");
+
+        std::vector<uint32> mystack;
+        for (uint32 idx = 0; idx < numLFTs; ++idx) { mystack.push_back(idx); }
+
+        for (const QPraw & qp : qps)
+        {
+            QO cmd = qp.command;
+            uint32 kids = (cmd == QO::AND_ALL) ? static_cast<uint32>(mystack.size()) : std::max(qp.kids, 1U);
+            OpCode op;
+
+            switch (cmd)
+            {
+            case QO::AND:
+            case QO::AND_ALL:
+            case QO::NOT:
+                op = OpCode::OpAnd;
+                break;
+            case QO::OR:
+            case QO::NOR:
+                op = OpCode::OpOr;
+                break;
+            default:
+                throw std::exception("Unknown QO in QP list.");
+            }
+
+            uint32 reg = pop(mystack);
+            for (uint32 times = 1; times < kids; ++times)
+            {
+                reg = emit(op, reg, pop(mystack));
+            }
+            if ((cmd == QO::NOT) || (cmd == QO::NOR))
+            {
+                reg = emit(OpCode::OpNot, reg, reg);
+            }
+            mystack.push_back(reg);
+        }
+
+        uint32 reg = pop(mystack);
+        while (!mystack.empty())
+        {
+            reg = emit(OpCode::OpAnd, reg, pop(mystack));
+        }
+        result = reg;
+
+        bool onlyAnd = std::all_of(code.begin(), code.end(), [](const Instr & instr) { return (instr.op == OpCode::OpAnd); });
+        bool onlyOr = std::all_of(code.begin(), code.end(), [](const Instr & instr) { return (instr.op == OpCode::OpOr); });
+        if (code.empty())
+            shape = Shape::ShapeSingle;
+        else if (onlyAnd)
+            shape = Shape::ShapeAnd;
+        else if (onlyOr)
+            shape = Shape::ShapeOr;
+    }
+
+    Shape GetShape() const { return (shape); }
+    uint32 lft_size() const { return (numLFTs); }
+    uint32 reg_size() const { return (numRegs); }
+
+    // NOT and NOR need the set of live elements to complement against
+    bool needs_universe() const
+    {
+        return (std::any_of(code.begin(), code.end(), [](const Instr & instr) { return (instr.op == OpCode::OpNot); }));
+    }
+
+    // 'regs' has reg_size() words, the first lft_size() loaded with the LFT
+    // results of 64 elements. NOT sets bits of dead elements too: mask them.
+    INLINE uint64 eval(uint64 * regs) const
+    {
+        for (const Instr & instr : code)
+        {
+            uint64 left = regs[instr.left];
+            uint64 right = regs[instr.right];
+            regs[instr.dst] = (((left & right) & instr.andMask) | ((left | right) & instr.orMask)) ^ instr.xorMask;
+        }
+        return (regs[result]);
+    }
+
+    // Same program on the per-LFT bitmaps of a whole Bin. Consumes 'bitmaps'.
+    // 'universe' (the live elements) is only needed by needs_universe() programs.
+    ElemBitmap eval(std::vector<ElemBitmap> & bitmaps, const ElemBitmap * universe) const
+    {
+        assert(bitmaps.size() == numLFTs);
+
+        if ((shape == Shape::ShapeAnd) || (shape == Shape::ShapeOr))
+        {
+            // AND: smallest first, the others only filter it
+            // OR: biggest first, the others only add to it
+            std::vector<uint32> order(numLFTs);
+            for (uint32 idx = 0; idx < order.size(); ++idx) { order[idx] = idx; }
+            std::sort(order.begin(), order.end(),
+                [&bitmaps](uint32 left, uint32 right) -> bool
+            {
+                return (bitmaps[left].count() < bitmaps[right].count());
+            });
+            if (shape == Shape::ShapeOr)
+            {
+                std::reverse(order.begin(), order.end());
+            }
+
+            ElemBitmap ret(std::move(bitmaps[order[0]]));
+            for (uint32 idx = 1; idx < order.size(); ++idx)
+            {
+                if (shape == Shape::ShapeAnd)
+                    ret.and_with(bitmaps[order[idx]]);
+                else
+                    ret.or_with(bitmaps[order[idx]]);
+                bitmaps[order[idx]].reset(0);
+            }
+            return (ret);
+        }
+
+        std::vector<ElemBitmap> regs(numRegs);
+        for (uint32 idx = 0; idx < numLFTs; ++idx) { regs[idx] = std::move(bitmaps[idx]); }
+
+        for (const Instr & instr : code)
+        {
+            ElemBitmap & dst = regs[instr.dst];
+            dst = std::move(regs[instr.left]);
+            switch (instr.op)
+            {
+            case OpCode::OpAnd:
+                dst.and_with(regs[instr.right]);
+                regs[instr.right].reset(0);
+                break;
+            case OpCode::OpOr:
+                dst.or_with(regs[instr.right]);
+                regs[instr.right].reset(0);
+                break;
+            case OpCode::OpNot:
+                retail_assert(universe != nullptr, "NOT in QP program without universe");
+                dst.complement(*universe);
+                break;
+            default:
+                assert(UNREACHED);
+            }
+        }
+        return (std::move(regs[result]));
+    }
+};
+
+}
+}
@@ -29,7 +29,9 @@
 #pragma once
 
 #include "MemFusion/non_copyable.h"
+#include "MemFusion/CpuFeatures.h"
 #include "z2types.h"
+#include "ZoneMap.h"
 
 namespace MFDB
 {
@@ -38,147 +40,345 @@ namespace LFT
 #pragma warning(push)
 #pragma warning(disable: 4324)  // structure was padded due to __declspec(align())
 
-class GT : public MemFusion::non_copyable
+//   A Z2 atom matches a filter when its low qword (docdepth, name, type, vlen)
+//   is equal to the filter's AND the value qword satisfies the operator.
+//
+//   Every operator only provides 'value_mask': one bit per 64bit lane telling
+//   whether the value condition holds. The low qwords sit in the even lanes
+//   and the values in the odd ones, so
+//
+//      match = eq_mask & (value_mask >> 1)    restricted to the even lanes
+//
+//   'may_match' tells from the ZoneRange of the filter's low qword whether
+//   any atom can satisfy the value condition: when not, the scan is skipped.
+//
+//   apply  : SSE,     1 atom,  bit 0
+//   apply2 : AVX2,    2 atoms, bits 0,2
+//   apply4 : AVX-512, 4 atoms, bits 0,2,4,6
+//
+//   'shape' tells which of the values, in order, satisfy the operator: a
+//   packed column turns it into a range of codes (PackedColumn::range).
+enum class MatchShape
+{
+    Above,      // from some value on
+    Below,      // up to some value
+    Equal,      // one value
+    NotEqual,   // all values but one
+    Prefix,     // strings starting with some bytes
+};
+
+template <typename Op>
+class Z2Predicate : public MemFusion::non_copyable
 {
 public:
     INLINE static bool apply(Z2raw filter, Z2raw actualz2)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128i reg_v = _mm_cmpgt_epi64(actualz2, filter);
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        ret += _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64) + bitsof(uint64));
+        int eq = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(actualz2, filter)));
+        int val = Op::value_mask(filter, actualz2);
+        return ((eq & (val >> 1) & 0x1) != 0);
     }
+
+    INLINE static double as_double(uint64 value)
+    {
+        return (*(double*) &value);
+    }
+
+    INLINE static uint32 apply2(__m256i filter, __m256i actual)
+    {
+        int eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(actual, filter)));
+        int val = Op::value_mask(filter, actual);
+        return (eq & (val >> 1) & 0x5);
+    }
+
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static uint32 apply4(__m512i filter, __m512i actual)
+    {
+        uint32 eq = _mm512_cmpeq_epi64_mask(actual, filter);
+        uint32 val = Op::value_mask(filter, actual);
+        return (eq & (val >> 1) & 0x55);
+    }
+#endif
 };
 
-class LTE : public MemFusion::non_copyable
+class GT : public Z2Predicate<GT>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Above;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (range.maxInt > static_cast<int64>(value));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(actual, filter))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(actual, filter))));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128i reg_v = _mm_cmpgt_epi64(actualz2, filter);
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        ret ^= _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64));
+        return (_mm512_cmpgt_epi64_mask(actual, filter));
     }
+#endif
 };
 
-class GT_float : public MemFusion::non_copyable
+class LTE : public Z2Predicate<LTE>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Below;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (range.minInt <= static_cast<int64>(value));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
     {
-        __m128d reg_v = _mm_cmpgt_pd(*(__m128d*)&actualz2, *(__m128d*)&filter);
-        uint64 ret = _mm_popcnt_u64(_mm_cmpeq_epi32(actualz2, filter).m128i_u64[0]);
-        ret += _mm_popcnt_u64(*(uint64*)&reg_v.m128d_f64[1]);
-        return (ret == bitsof(uint64) + bitsof(uint64));
+        return (~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(actual, filter))));
     }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(actual, filter))));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
+    {
+        return (~_mm512_cmpgt_epi64_mask(actual, filter));
+    }
+#endif
 };
 
-class LTE_float : public MemFusion::non_copyable
+class GTE : public Z2Predicate<GTE>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Above;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (range.maxInt >= static_cast<int64>(value));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
     {
-        __m128d reg_v = _mm_cmpgt_pd(*(__m128d*)&actualz2, *(__m128d*)&filter);
-        uint64 ret = _mm_popcnt_u64(_mm_cmpeq_epi32(actualz2, filter).m128i_u64[0]);
-        ret ^= _mm_popcnt_u64(*(uint64*) &reg_v.m128d_f64[1]);
-        return (ret == bitsof(uint64));
+        return (~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(filter, actual))));
     }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(filter, actual))));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
+    {
+        return (~_mm512_cmpgt_epi64_mask(filter, actual));
+    }
+#endif
 };
 
-class GTE : public MemFusion::non_copyable
+class LT : public Z2Predicate<LT>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Below;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128i reg_v1 = _mm_cmpgt_epi64(actualz2, filter);
-        __m128i reg_v2 = _mm_cmpeq_epi64(actualz2, filter);
-        __m128i reg_v = _mm_or_si128(reg_v1, reg_v2);
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        ret += _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64) + bitsof(uint64));
+        return (range.minInt < static_cast<int64>(value));
     }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(filter, actual))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(filter, actual))));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
+    {
+        return (_mm512_cmpgt_epi64_mask(filter, actual));
+    }
+#endif
 };
 
-class LT : public MemFusion::non_copyable
+class EQ : public Z2Predicate<EQ>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Equal;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128i reg_v1 = _mm_cmpgt_epi64(actualz2, filter);
-        __m128i reg_v2 = _mm_cmpeq_epi64(actualz2, filter);
-        __m128i reg_v = _mm_or_si128(reg_v1, reg_v2);
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        ret ^= _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64));
+        return ((range.minInt <= static_cast<int64>(value)) && (static_cast<int64>(value) <= range.maxInt));
     }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(actual, filter))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(actual, filter))));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
+    {
+        return (_mm512_cmpeq_epi64_mask(actual, filter));
+    }
+#endif
 };
 
-class GTE_float : public MemFusion::non_copyable
+class NE : public Z2Predicate<NE>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::NotEqual;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return ((range.minInt != static_cast<int64>(value)) || (range.maxInt != static_cast<int64>(value)));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(actual, filter))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(actual, filter))));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128d *act = (__m128d*)&actualz2;
-        __m128d *filt = (__m128d*)&filter;
-        __m128d reg_v1 = _mm_cmpgt_pd(*act, *filt);
-        __m128d reg_v2 = _mm_cmpeq_pd(*act, *filt);
-        __m128i reg_v = _mm_or_si128(*(__m128i*)&reg_v1, *(__m128i*)&reg_v2);
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        ret += _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64) + bitsof(uint64));
+        return (~_mm512_cmpeq_epi64_mask(actual, filter));
     }
+#endif
 };
 
-class EQ : public MemFusion::non_copyable
+// Anchored prefix of a string ($regex "^literal"). Strings are compared
+// through the StringDictionary (LFT::ScanStrings, PackedColumn::range): on
+// the value qwords it matches nothing.
+class PREFIX : public Z2Predicate<PREFIX>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Prefix;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (true);
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (0);
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (0);
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128i reg_v = _mm_cmpeq_epi64(actualz2, filter);
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        ret += _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64) + bitsof(uint64));
+        return (0);
     }
+#endif
 };
 
-class NE : public MemFusion::non_copyable
+// Floating point operators compare the value qword as a double. They use
+// ordered predicates, so a NaN never matches a range condition.
+
+class GT_float : public Z2Predicate<GT_float>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Above;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (range.maxFloat > as_double(value));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (_mm_movemask_pd(_mm_cmpgt_pd(_mm_castsi128_pd(actual), _mm_castsi128_pd(filter))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128i reg_v = _mm_cmpeq_epi64(actualz2, filter);
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        ret ^= _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64));
+        return (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_castsi256_pd(actual), _mm256_castsi256_pd(filter), _CMP_GT_OQ)));
     }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
+    {
+        return (_mm512_cmp_pd_mask(_mm512_castsi512_pd(actual), _mm512_castsi512_pd(filter), _CMP_GT_OQ));
+    }
+#endif
 };
 
+class LTE_float : public Z2Predicate<LTE_float>
+{
+public:
+    static const MatchShape shape = MatchShape::Below;
 
-class LT_float : public MemFusion::non_copyable
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (range.minFloat <= as_double(value));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (_mm_movemask_pd(_mm_cmple_pd(_mm_castsi128_pd(actual), _mm_castsi128_pd(filter))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_castsi256_pd(actual), _mm256_castsi256_pd(filter), _CMP_LE_OQ)));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
+    {
+        return (_mm512_cmp_pd_mask(_mm512_castsi512_pd(actual), _mm512_castsi512_pd(filter), _CMP_LE_OQ));
+    }
+#endif
+};
+
+class GTE_float : public Z2Predicate<GTE_float>
 {
 public:
-    INLINE static bool apply(Z2raw filter, Z2raw actualz2)
+    static const MatchShape shape = MatchShape::Above;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (range.maxFloat >= as_double(value));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (_mm_movemask_pd(_mm_cmpge_pd(_mm_castsi128_pd(actual), _mm_castsi128_pd(filter))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_castsi256_pd(actual), _mm256_castsi256_pd(filter), _CMP_GE_OQ)));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
+    {
+        return (_mm512_cmp_pd_mask(_mm512_castsi512_pd(actual), _mm512_castsi512_pd(filter), _CMP_GE_OQ));
+    }
+#endif
+};
+
+class LT_float : public Z2Predicate<LT_float>
+{
+public:
+    static const MatchShape shape = MatchShape::Below;
+
+    INLINE static bool may_match(const Core::ZoneRange & range, uint64 value)
+    {
+        return (range.minFloat < as_double(value));
+    }
+    INLINE static int value_mask(__m128i filter, __m128i actual)
+    {
+        return (_mm_movemask_pd(_mm_cmplt_pd(_mm_castsi128_pd(actual), _mm_castsi128_pd(filter))));
+    }
+    INLINE static int value_mask(__m256i filter, __m256i actual)
+    {
+        return (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_castsi256_pd(actual), _mm256_castsi256_pd(filter), _CMP_LT_OQ)));
+    }
+#ifdef MF_AVX512_INTRINSICS
+    INLINE static int value_mask(__m512i filter, __m512i actual)
     {
-        __m128i reg_dnt = _mm_cmpeq_epi32(actualz2, filter);
-        __m128d *act = (__m128d*)&actualz2;
-        __m128d *filt = (__m128d*)&filter;
-        __m128d reg_v1 = _mm_cmpgt_pd(*act, *filt);
-        __m128d reg_v2 = _mm_cmpeq_pd(*act, *filt);
-        __m128i reg_v = _mm_or_si128(*(__m128i*)&reg_v1, *(__m128i*)&reg_v2);
-        // same name and doc depth? (64 bits on if so)
-        uint64 ret = _mm_popcnt_u64(reg_dnt.m128i_u64[0]);
-        // expectd reg_v1 and reg_v2 both false ... all zeros
-        ret ^= _mm_popcnt_u64(reg_v.m128i_u64[1]);
-        return (ret == bitsof(uint64));
+        return (_mm512_cmp_pd_mask(_mm512_castsi512_pd(actual), _mm512_castsi512_pd(filter), _CMP_LT_OQ));
     }
+#endif
 };
 
 #pragma warning(pop)
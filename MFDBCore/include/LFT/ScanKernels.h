@@ -0,0 +1,395 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include "MemFusion/CpuFeatures.h"
+#include "LFT/QueryOperators.h"
+#include "z2types.h"
+#include "StringDictionary.h"
+
+namespace MFDB
+{
+namespace LFT
+{
+
+//   Scan kernels answer "does any atom in [begin, end) match the filter?"
+//   for one element, and "which of these 'count' (<= 64) column entries
+//   match?" for consecutive elements of a Column, bit i for atoms[i].
+//   T is one of the operators in QueryOperators.h.
+//   Each kernel keeps its widened filter in a register for the whole bin;
+//   Z2LFT picks the kernel once, according to CpuFeatures::Level().
+
+template <typename T>
+struct ScanSSE
+{
+    const Z2raw filter;
+
+    explicit ScanSSE(Z2raw filter_)
+        : filter(filter_)
+    {}
+
+    INLINE bool any(const Z2raw * begin, const Z2raw * end) const
+    {
+        for (const Z2raw * cur = begin; cur < end; ++cur)
+        {
+            if (T::apply(filter, *cur))
+                return (true);
+        }
+        return (false);
+    }
+
+    INLINE uint64 column(const Z2raw * atoms, uint32 count) const
+    {
+        uint64 ret = 0ULL;
+        for (uint32 idx = 0; idx < count; ++idx)
+        {
+            ret |= uint64(T::apply(filter, atoms[idx])) << idx;
+        }
+        return (ret);
+    }
+
+    void done() const
+    {
+    }
+
+private:
+    void operator = (const ScanSSE &);
+};
+
+template <typename T>
+struct ScanAVX2
+{
+    const Z2raw filter;
+    const __m256i filter2;
+
+    explicit ScanAVX2(Z2raw filter_)
+        : filter(filter_),
+        filter2(_mm256_broadcastsi128_si256(filter_))
+    {}
+
+    INLINE bool any(const Z2raw * begin, const Z2raw * end) const
+    {
+        const Z2raw * cur = begin;
+        for (; cur + 2 <= end; cur += 2)
+        {
+            if (T::apply2(filter2, _mm256_loadu_si256((const __m256i *) cur)))
+                return (true);
+        }
+        return ((cur < end) && T::apply(filter, *cur));
+    }
+
+    INLINE uint64 column(const Z2raw * atoms, uint32 count) const
+    {
+        uint64 ret = 0ULL;
+        uint32 idx = 0;
+        for (; idx + 2 <= count; idx += 2)
+        {
+            uint32 mask = T::apply2(filter2, _mm256_loadu_si256((const __m256i *) &atoms[idx]));
+            ret |= uint64((mask & 0x1) | ((mask >> 1) & 0x2)) << idx;
+        }
+        if (idx < count)
+        {
+            ret |= uint64(T::apply(filter, atoms[idx])) << idx;
+        }
+        return (ret);
+    }
+
+    // avoid AVX->SSE transition penalties in whatever runs next
+    void done() const
+    {
+        _mm256_zeroupper();
+    }
+
+private:
+    void operator = (const ScanAVX2 &);
+};
+
+#ifdef MF_AVX512_INTRINSICS
+template <typename T>
+struct ScanAVX512
+{
+    const __m512i filter4;
+
+    explicit ScanAVX512(Z2raw filter_)
+        : filter4(_mm512_broadcast_i32x4(filter_))
+    {}
+
+    INLINE bool any(const Z2raw * begin, const Z2raw * end) const
+    {
+        const Z2raw * cur = begin;
+        for (; cur + 4 <= end; cur += 4)
+        {
+            if (T::apply4(filter4, _mm512_loadu_si512(cur)))
+                return (true);
+        }
+        if (cur < end)
+        {
+            // masked load: lanes past 'end' read as zero and are never touched,
+            // a zero low qword never equals a filter (its name is not zero).
+            __mmask8 lanes = (__mmask8) ((1u << (2 * (end - cur))) - 1);
+            return (T::apply4(filter4, _mm512_maskz_loadu_epi64(lanes, cur)) != 0);
+        }
+        return (false);
+    }
+
+    INLINE uint64 column(const Z2raw * atoms, uint32 count) const
+    {
+        uint64 ret = 0ULL;
+        for (uint32 idx = 0; idx < count; idx += 4)
+        {
+            __m512i actual = (idx + 4 <= count) ? _mm512_loadu_si512(&atoms[idx]) :
+                _mm512_maskz_loadu_epi64((__mmask8) ((1u << (2 * (count - idx))) - 1), &atoms[idx]);
+            uint32 mask = T::apply4(filter4, actual);
+            ret |= uint64((mask & 0x1) | ((mask >> 1) & 0x2) | ((mask >> 2) & 0x4) | ((mask >> 3) & 0x8)) << idx;
+        }
+        return (ret);
+    }
+
+    void done() const
+    {
+        _mm256_zeroupper();
+    }
+
+private:
+    void operator = (const ScanAVX512 &);
+};
+#endif
+
+//   Filters on strings, when the Collection has a StringDictionary: the
+//   atoms are compared by their bytes, whatever their length (the low
+//   qwords differ in vlen). One at a time: packed columns are where strings
+//   compare as integers.
+template <typename T>
+struct ScanStrings
+{
+    const Core::StringDictionary & strings;
+    const Core::StringDictionary::Constant & constant;
+    const uint64 low;
+
+    ScanStrings(Z2raw filter_, const Core::StringDictionary & strings_, const Core::StringDictionary::Constant & constant_)
+        : strings(strings_),
+        constant(constant_),
+        low(Core::string_low(filter_.m128i_u64[0]))
+    {}
+
+    // T on a three way comparison: 0, 1 or 2 against 1
+    INLINE static bool holds(int cmp)
+    {
+        return (T::apply(Z2(1ULL, 1ULL), Z2(1ULL, static_cast<uint64>(1 + cmp))));
+    }
+
+    INLINE bool match(const Z2raw & atom) const
+    {
+        if (Core::string_low(atom.m128i_u64[0]) != low)
+            return (false);
+
+        Core::StringKey key = { atom.m128i_u64[1], Core::string_vlen(atom.m128i_u64[0]) };
+        if ((T::shape != MatchShape::Prefix) && (key == constant.key))
+            return (holds(0));
+        Core::StringText text;
+        if (!constant.known || !strings.text(key, text))
+        {
+            // not the same string, which way is unknown: only Z2FindQuery
+            // lets $eq and $ne have a constant without bytes
+            if (T::shape == MatchShape::NotEqual)
+                return (true);
+            if (T::shape != MatchShape::Equal)
+            {
+                strings.Unresolved();
+            }
+            return (false);
+        }
+        return ((T::shape == MatchShape::Prefix) ? text.starts_with(constant.text) : holds(text.compare(constant.text)));
+    }
+
+    INLINE bool any(const Z2raw * begin, const Z2raw * end) const
+    {
+        for (const Z2raw * cur = begin; cur < end; ++cur)
+        {
+            if (match(*cur))
+                return (true);
+        }
+        return (false);
+    }
+
+    INLINE uint64 column(const Z2raw * atoms, uint32 count) const
+    {
+        uint64 ret = 0ULL;
+        for (uint32 idx = 0; idx < count; ++idx)
+        {
+            ret |= uint64(match(atoms[idx])) << idx;
+        }
+        return (ret);
+    }
+
+    void done() const
+    {
+    }
+
+private:
+    void operator = (const ScanStrings &);
+};
+
+//   Codes of a packed column (sealed Bins) matching a filter: those in
+//   [lo, hi), or those not in it when 'negate'. Code 0 is an element without
+//   the field and never matches.
+struct CodeRange
+{
+    uint32 lo;
+    uint32 hi;
+    bool negate;
+
+    bool empty() const
+    {
+        return (!negate && (lo == hi));
+    }
+
+    INLINE bool contains(uint32 code) const
+    {
+        return ((code != 0) && (((code - lo) < (hi - lo)) != negate));
+    }
+};
+
+//   Kernel on packed codes: 'width' bits each (1, 2, 4, 8, 16 or 32), never
+//   across two words, so 64 consecutive codes are in 'width' words. Bit i
+//   of the result for code i. Whole 8/16/32 bits codes are compared 16, 8
+//   or 4 at a time; smaller ones go through a table of the codes matching.
+struct ScanPacked
+{
+    static uint64 match(const uint64 * words, uint32 width, const CodeRange & range)
+    {
+        switch (width)
+        {
+        case 8:
+            return (match8(words, range));
+        case 16:
+            return (match16(words, range));
+        case 32:
+            return (match32(words, range));
+        default:
+            return (match_small(words, width, range));
+        }
+    }
+
+private:
+    // (code - lo) <= (hi - lo - 1) unsigned, code != 0
+    static uint64 match8(const uint64 * words, const CodeRange & range)
+    {
+        const __m128i lo = _mm_set1_epi8((char) range.lo);
+        const __m128i last = _mm_set1_epi8((char) (range.hi - range.lo - 1));
+        const __m128i zero = _mm_setzero_si128();
+        const bool none = (range.lo == range.hi);
+        uint64 ret = 0ULL;
+        for (uint32 idx = 0; idx < 4; ++idx)
+        {
+            __m128i codes = _mm_loadu_si128((const __m128i *) (words + 2 * idx));
+            __m128i off = _mm_sub_epi8(codes, lo);
+            uint64 in = none ? 0ULL : (uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(off, last), off));
+            uint64 present = ~(uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(codes, zero)) & 0xFFFF;
+            ret |= ((range.negate ? ~in : in) & present) << (16 * idx);
+        }
+        return (ret);
+    }
+
+    static uint64 match16(const uint64 * words, const CodeRange & range)
+    {
+        const __m128i lo = _mm_set1_epi16((short) range.lo);
+        const __m128i last = _mm_set1_epi16((short) (range.hi - range.lo - 1));
+        const __m128i zero = _mm_setzero_si128();
+        const bool none = (range.lo == range.hi);
+        uint64 ret = 0ULL;
+        for (uint32 idx = 0; idx < 4; ++idx)
+        {
+            __m128i codes0 = _mm_loadu_si128((const __m128i *) (words + 4 * idx));
+            __m128i codes1 = _mm_loadu_si128((const __m128i *) (words + 4 * idx + 2));
+            __m128i off0 = _mm_sub_epi16(codes0, lo);
+            __m128i off1 = _mm_sub_epi16(codes1, lo);
+            // one byte per code
+            __m128i in8 = _mm_packs_epi16(_mm_cmpeq_epi16(_mm_min_epu16(off0, last), off0),
+                                          _mm_cmpeq_epi16(_mm_min_epu16(off1, last), off1));
+            __m128i absent8 = _mm_packs_epi16(_mm_cmpeq_epi16(codes0, zero), _mm_cmpeq_epi16(codes1, zero));
+            uint64 in = none ? 0ULL : (uint32) _mm_movemask_epi8(in8);
+            uint64 present = ~(uint32) _mm_movemask_epi8(absent8) & 0xFFFF;
+            ret |= ((range.negate ? ~in : in) & present) << (16 * idx);
+        }
+        return (ret);
+    }
+
+    static uint64 match32(const uint64 * words, const CodeRange & range)
+    {
+        const __m128i lo = _mm_set1_epi32((int) range.lo);
+        const __m128i last = _mm_set1_epi32((int) (range.hi - range.lo - 1));
+        const __m128i zero = _mm_setzero_si128();
+        const bool none = (range.lo == range.hi);
+        uint64 ret = 0ULL;
+        for (uint32 idx = 0; idx < 4; ++idx)
+        {
+            __m128i in16[2];
+            __m128i absent16[2];
+            for (uint32 half = 0; half < 2; ++half)
+            {
+                const uint64 * src = words + 8 * idx + 4 * half;
+                __m128i codes0 = _mm_loadu_si128((const __m128i *) src);
+                __m128i codes1 = _mm_loadu_si128((const __m128i *) (src + 2));
+                __m128i off0 = _mm_sub_epi32(codes0, lo);
+                __m128i off1 = _mm_sub_epi32(codes1, lo);
+                in16[half] = _mm_packs_epi32(_mm_cmpeq_epi32(_mm_min_epu32(off0, last), off0),
+                                             _mm_cmpeq_epi32(_mm_min_epu32(off1, last), off1));
+                absent16[half] = _mm_packs_epi32(_mm_cmpeq_epi32(codes0, zero), _mm_cmpeq_epi32(codes1, zero));
+            }
+            uint64 in = none ? 0ULL : (uint32) _mm_movemask_epi8(_mm_packs_epi16(in16[0], in16[1]));
+            uint64 present = ~(uint32) _mm_movemask_epi8(_mm_packs_epi16(absent16[0], absent16[1])) & 0xFFFF;
+            ret |= ((range.negate ? ~in : in) & present) << (16 * idx);
+        }
+        return (ret);
+    }
+
+    // 1, 2 or 4 bits: at most 16 codes
+    static uint64 match_small(const uint64 * words, uint32 width, const CodeRange & range)
+    {
+        uint32 table = 0;
+        for (uint32 code = 1; code < (1U << width); ++code)
+        {
+            table |= uint32(range.contains(code)) << code;
+        }
+
+        cuint64 mask = (1ULL << width) - 1;
+        uint64 ret = 0ULL;
+        for (uint32 idx = 0; idx < 64; ++idx)
+        {
+            cuint32 bit = idx * width;
+            cuint64 code = (words[bit >> 6] >> (bit & 63)) & mask;
+            ret |= uint64((table >> code) & 1) << idx;
+        }
+        return (ret);
+    }
+};
+
+}
+}
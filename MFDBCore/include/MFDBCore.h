@@ -40,7 +40,16 @@
 
 extern "C" EXPORT_FUNC void * MFDBCore_AcquireBufferForInsert(MFDB::Candle ch, const char * collection, uint32 size);
 extern "C" EXPORT_FUNC uint32 MFDBCore_ReleaseBufferForInsert(MFDB::Candle ch, const char * collection, void * buffer);
+extern "C" EXPORT_FUNC uint32 MFDBCore_AcquireBuffersForInsert(MFDB::Candle ch, const char * collection, uint32 count, const uint32 * sizes, void ** buffers, uint64 * handles);
+extern "C" EXPORT_FUNC uint32 MFDBCore_ReleaseBuffersForInsert(MFDB::Candle ch, const char * collection, uint32 count, const uint64 * handles, byte * released);
 extern "C" EXPORT_FUNC void MFDBCore_Initialize_QueryEngine(uint32 maxConcIB, uint32 bmaxelems, uint32 bmaxsize, uint32 maxbins, const char * datapath);
 extern "C" EXPORT_FUNC uint32 MFDBCore_Query_Find(MFDB::Candle ch, const char * collection, void * z2selector, uint32 selectBytes, void * z2query, uint32 lftBytes, uint32 qpBytes, void * retbuf);
 extern "C" EXPORT_FUNC uint32 MFDBCore_Query_Aggregate(MFDB::Candle ch, const char * collection, void * z2query, uint32 queryBytes, void * retbuf, uint32 uintsort);
+extern "C" EXPORT_FUNC uint32 MFDBCore_Query_Remove(MFDB::Candle ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes);
+extern "C" EXPORT_FUNC uint32 MFDBCore_Query_Update(MFDB::Candle ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes, void * updates, uint32 updateBytes);
+extern "C" EXPORT_FUNC void MFDBCore_Set_MemoryBudget(uint64 bytes);
+// bytes allocated with 4KB, 2MB and 1GB pages, then the times large pages were not there
+extern "C" EXPORT_FUNC void MFDBCore_Get_PageMetrics(uint64 * metrics);
+extern "C" EXPORT_FUNC uint32 MFDBCore_AddBlob(MFDB::Candle ch, const char * collection, uint64 hash, const void * bytes, uint32 size);
+extern "C" EXPORT_FUNC const void * MFDBCore_FindBlob(MFDB::Candle ch, const char * collection, uint64 hash, uint32 * size);
 
@@ -0,0 +1,176 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <sstream>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Logger.h"
+
+namespace MFDB
+{
+namespace Core
+{
+using namespace MemFusion;
+
+//   What the MemoryBudget spills from: the Bins of a Collection.
+class ISpillable
+{
+public:
+    virtual ~ISpillable() {}
+
+    // bytes of atoms in memory
+    virtual uint64 ResidentBytes() = 0;
+
+    // the sealed Bin in memory and not in use scanned least recently:
+    // false when there is none
+    virtual bool ColdestBin(uint64 & lastScan, uint32 & binIdx) = 0;
+
+    // writes its atoms to local disk and frees them, returns the bytes
+    // freed: 0 when it got used meanwhile
+    virtual uint64 SpillBin(uint32 binIdx) = 0;
+};
+
+//   Memory for atoms shared by the Collections of an engine. Over it, the
+//   sealed Bins scanned least recently, whatever their Collection, go to
+//   local disk; a query needing one reads it back.
+class MemoryBudget
+{
+    std::mutex m_mutex;                     // one spiller at a time, and m_owners
+    std::vector<ISpillable*> m_owners;
+    std::atomic<uint64> f_limit;
+    std::atomic<uint64> x_binsSpilled;
+    bool m_overLogged;                      // under m_mutex
+
+    MemoryBudget(const MemoryBudget &);
+    void operator = (const MemoryBudget &);
+public:
+    // 0: no limit
+    explicit MemoryBudget(uint64 limit = 0ULL)
+        : f_limit(limit),
+        x_binsSpilled(0ULL),
+        m_overLogged(false)
+    {}
+
+    uint64 limit() const { return (f_limit.load()); }
+    void limit(uint64 bytes) { f_limit.store(bytes); }
+    uint64 binsSpilled() const { return (x_binsSpilled.load()); }
+
+    void Register(ISpillable * owner)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_owners.push_back(owner);
+    }
+
+    // waits for a spill going on: 'owner' can go after this
+    void Unregister(ISpillable * owner)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_owners.erase(std::remove(m_owners.begin(), m_owners.end(), owner), m_owners.end());
+    }
+
+    uint64 ResidentBytes()
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return (ResidentBytesLocked());
+    }
+
+    // Spills the coldest Bins till the atoms in memory fit the limit, or
+    // there is no sealed Bin left to spill. Returns how many it spilled.
+    uint32 Enforce()
+    {
+        cuint64 bytes = f_limit.load();
+        if (bytes == 0ULL)
+            return (0);
+
+        uint32 ret = 0;
+        std::lock_guard<std::mutex> guard(m_mutex);
+        uint64 resident = ResidentBytesLocked();
+        while (resident > bytes)
+        {
+            ISpillable * coldest = nullptr;
+            uint64 coldestScan = ~0ULL;
+            uint32 coldestIdx = 0;
+            for (ISpillable * owner : m_owners)
+            {
+                uint64 lastScan;
+                uint32 binIdx;
+                if (owner->ColdestBin(lastScan, binIdx) && (lastScan < coldestScan))
+                {
+                    coldest = owner;
+                    coldestScan = lastScan;
+                    coldestIdx = binIdx;
+                }
+            }
+            if (coldest == nullptr)
+            {
+                // inserts go on: the last Bins are never spilled
+                if (!m_overLogged)
+                {
+                    std::stringstream ss;
+                    ss << "Memory budget of " << bytes / (1024 * 1024) << " MB exceeded: " << resident / (1024 * 1024)
+                       << " MB in memory and no sealed Bin left to spill.";
+                    LOG(ss.str());
+                    m_overLogged = true;
+                }
+                break;
+            }
+
+            cuint64 freed = coldest->SpillBin(coldestIdx);
+            if (freed == 0ULL)
+                break;      // a query took it: next time
+            resident -= std::min(resident, freed);
+            ++x_binsSpilled;
+            ++ret;
+        }
+        if (resident <= bytes)
+        {
+            m_overLogged = false;
+        }
+        return (ret);
+    }
+
+private:
+    uint64 ResidentBytesLocked()
+    {
+        uint64 ret = 0ULL;
+        for (ISpillable * owner : m_owners)
+        {
+            ret += owner->ResidentBytes();
+        }
+        return (ret);
+    }
+};
+
+}
+}
@@ -0,0 +1,541 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <intrin.h>
+
+#include "MemFusion/types.h"
+#include "MemFusion/PageAllocator.h"
+#include "z2types.h"
+#include "Column.h"
+#include "LFT/QueryOperators.h"
+#include "LFT/ScanKernels.h"
+#include "StringDictionary.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   Read-optimized form of a promoted Column in a sealed Bin (one taking no
+//   more elements): its atoms all have the same low qword, kept once, and
+//   each value is a code of 'width' bits. The Bin's atoms stay as they are:
+//   this packs the copy of one field the Column is, not the documents.
+//
+//      FrameOfReference    code = value - base + 1     (not for doubles)
+//      Dictionary          code = index in 'dict' + 1  (sorted values)
+//
+//   Code 0 is an element without the field. Codes are in the order of the
+//   values as the operators compare them (int64, or double with NaNs last),
+//   so the values matching a filter are a range of codes, and LFTs scan the
+//   codes without decoding them (LFT::ScanPacked).
+//
+//   Strings, with a StringDictionary, are in a Dictionary of their codes
+//   there (the order of the strings, not of z2value) whatever their length:
+//   'low' has no vlen, 'keys' has the atom of each code.
+//
+//   Writers (in place updates) hold the Bin's columns lock; a value that
+//   has no code makes the Bin go back to the Column.
+class PackedColumn
+{
+public:
+    enum class Encoding
+    {
+        FrameOfReference,
+        Dictionary,
+    };
+
+    // TBD: from configuration
+    static const uint32 MAX_DICT = 0xFFFF;      // codes up to 16 bits
+    static const uint32 MAX_WIDTH = 32;         // at least 4x smaller than the Column
+
+private:
+    const Z2name name;
+    const uint32 capacity;                      // elements, whole words of 64
+    const uint32 node;
+    uint64 low;                                 // 0: no element has the field
+    Encoding encoding;
+    uint32 width;
+    int64 base;
+    std::vector<uint64> dict;
+    uint32 codeEnd;                             // codes [1, codeEnd) exist
+    uint32 orderedEnd;                          // past them: NaNs
+    uint64 * words;
+    const StringDictionary * strings;           // nullptr but for strings
+    std::shared_ptr<const StringCodes> stringCodes;  // the generation of 'dict'
+    std::vector<StringKey> keys;                // of each code, for strings
+
+    PackedColumn(Z2name name_, uint32 numElems, uint32 node_)
+        : name(name_),
+        capacity(((numElems + 63) / 64) * 64),
+        node(node_),
+        low(0ULL),
+        encoding(Encoding::FrameOfReference),
+        width(1),
+        base(0),
+        codeEnd(1),
+        orderedEnd(1),
+        words(nullptr),
+        strings(nullptr)
+    {
+    }
+
+    PackedColumn(const PackedColumn &);
+    void operator = (const PackedColumn &);
+
+    static double as_double(uint64 value)
+    {
+        return (*(double*) &value);
+    }
+
+    static bool is_nan(uint64 value)
+    {
+        return (as_double(value) != as_double(value));
+    }
+
+    // the order of the float operators, NaNs last; ties (0.0, -0.0) by bits
+    static bool less_float(uint64 left, uint64 right)
+    {
+        if (is_nan(left) || is_nan(right))
+            return (!is_nan(left) || (is_nan(right) && (left < right)));
+        return ((as_double(left) < as_double(right)) ||
+                ((as_double(left) == as_double(right)) && (left < right)));
+    }
+
+    static bool less_int(uint64 left, uint64 right)
+    {
+        return (static_cast<int64>(left) < static_cast<int64>(right));
+    }
+
+    bool is_float() const
+    {
+        return (Z2(low, 0ULL).z2type() == BSONtypeCompressed::CFloatnum);
+    }
+
+    bool less(uint64 left, uint64 right) const
+    {
+        return (is_float() ? less_float(left, right) : less_int(left, right));
+    }
+
+    // 1, 2, 4, 8, 16 or 32 bits for codes [0, numCodes)
+    static uint32 width_for(uint64 numCodes)
+    {
+        uint32 ret = 1;
+        while ((ret < 64) && ((numCodes - 1) >> ret) != 0)
+        {
+            ret *= 2;
+        }
+        return (ret);
+    }
+
+    uint64 value(uint32 code) const
+    {
+        return ((encoding == Encoding::Dictionary) ? dict[code - 1] :
+                static_cast<uint64>(base + static_cast<int64>(code) - 1));
+    }
+
+    // 0 when 'value' has no code
+    uint32 encode(uint64 value) const
+    {
+        if (encoding == Encoding::Dictionary)
+        {
+            auto iter = std::lower_bound(dict.begin(), dict.end(), value,
+                [this](uint64 left, uint64 right) { return (less(left, right)); });
+            return (((iter != dict.end()) && (*iter == value)) ? static_cast<uint32>(iter - dict.begin()) + 1 : 0);
+        }
+        cuint64 offset = static_cast<uint64>(static_cast<int64>(value) - base);
+        return ((offset < codeEnd - 1ULL) ? static_cast<uint32>(offset) + 1 : 0);
+    }
+
+    // the code of string atom 'atom', 0 when it has none
+    uint32 encode_string(const Z2raw & atom) const
+    {
+        if (string_low(atom.m128i_u64[0]) != low)
+            return (0);
+        StringKey key = { atom.m128i_u64[1], string_vlen(atom.m128i_u64[0]) };
+        cuint64 global = strings->Find(*stringCodes, key);
+        return ((global == 0ULL) ? 0 : encode(global));
+    }
+
+    // the first code from 'global' on (codeEnd when none)
+    uint32 local(uint64 global) const
+    {
+        return (static_cast<uint32>(std::lower_bound(dict.begin(), dict.end(), global) - dict.begin()) + 1);
+    }
+
+    // Every value a string: by their codes in 'strings_'
+    static PackedColumn * PackStrings(const Column & col, uint32 numElems, uint32 node, StringDictionary & strings_)
+    {
+        std::unique_ptr<PackedColumn> ret(new PackedColumn(col.GetName(), numElems, node));
+        ret->strings = &strings_;
+        ret->encoding = Encoding::Dictionary;
+        std::unordered_map<StringKey, uint32, StringKeyHash> distinct;
+        for (uint32 idx = 0; idx < numElems; ++idx)
+        {
+            const Z2raw & atom = col[idx];
+            if (Z2::invalid(atom))
+                continue;
+            if (!is_string(atom.m128i_u64[0]))
+                return (nullptr);
+            if (ret->low == 0ULL)
+            {
+                ret->low = string_low(atom.m128i_u64[0]);
+            }
+            else if (string_low(atom.m128i_u64[0]) != ret->low)
+            {
+                return (nullptr);
+            }
+            StringKey key = { atom.m128i_u64[1], string_vlen(atom.m128i_u64[0]) };
+            if (distinct.insert(std::make_pair(key, 0)).second)
+            {
+                ret->keys.push_back(key);
+            }
+        }
+        if (ret->keys.size() > MAX_DICT)
+            return (nullptr);
+        if (!ret->Code())
+            return (nullptr);
+
+        for (uint32 code = 1; code <= ret->keys.size(); ++code)
+        {
+            distinct[ret->keys[code - 1]] = code;
+        }
+        ret->words = static_cast<uint64*>(MemFusion::PageAllocator::Allocate(ret->bytes(), node));
+        for (uint32 idx = 0; idx < numElems; ++idx)
+        {
+            const Z2raw & atom = col[idx];
+            if (!Z2::invalid(atom))
+            {
+                StringKey key = { atom.m128i_u64[1], string_vlen(atom.m128i_u64[0]) };
+                ret->store(idx, distinct[key]);
+            }
+        }
+        return (ret.release());
+    }
+
+    // 'dict' from the current generation of codes of 'keys', which get the
+    // same order; false when some has no code
+    bool Code()
+    {
+        std::vector<uint64> codes;
+        stringCodes = strings->Code(keys, codes);
+        std::vector<uint32> order(keys.size());
+        for (uint32 idx = 0; idx < order.size(); ++idx)
+        {
+            if (codes[idx] == 0ULL)
+                return (false);
+            order[idx] = idx;
+        }
+        std::sort(order.begin(), order.end(), [&codes](uint32 left, uint32 right) { return (codes[left] < codes[right]); });
+
+        std::vector<StringKey> sortedKeys(keys.size());
+        dict.resize(keys.size());
+        for (uint32 idx = 0; idx < order.size(); ++idx)
+        {
+            sortedKeys[idx] = keys[order[idx]];
+            dict[idx] = codes[order[idx]];
+        }
+        keys.swap(sortedKeys);
+        codeEnd = orderedEnd = static_cast<uint32>(dict.size()) + 1;
+        width = width_for(codeEnd);
+        return (true);
+    }
+
+    void store(uint32 elemIdx, uint32 code)
+    {
+        cuint32 bit = elemIdx * width;
+        cuint64 mask = ((width == 64) ? ~0ULL : ((1ULL << width) - 1)) << (bit & 63);
+        uint64 & word = words[bit >> 6];
+        // one store: scans see the old code or the new one
+        InterlockedExchange64(reinterpret_cast<volatile int64*>(&word),
+            static_cast<int64>((word & ~mask) | ((uint64(code) << (bit & 63)) & mask)));
+    }
+
+    // first code in [lo, hi) for which 'pred' holds, 'pred' false then true
+    template <typename Pred>
+    uint32 first(uint32 lo, uint32 hi, Pred pred) const
+    {
+        while (lo < hi)
+        {
+            cuint32 mid = lo + (hi - lo) / 2;
+            if (pred(mid))
+            {
+                hi = mid;
+            }
+            else {
+                lo = mid + 1;
+            }
+        }
+        return (lo);
+    }
+
+public:
+    ~PackedColumn()
+    {
+        if (words != nullptr)
+        {
+            MemFusion::PageAllocator::Free(words, bytes());
+        }
+    }
+
+    // nullptr when the values of the first 'numElems' entries of 'col' do
+    // not fit MAX_WIDTH bits, or have more than one low qword. Strings are
+    // coded by 'strings' when there is one.
+    static PackedColumn * Pack(const Column & col, uint32 numElems, uint32 node = MemFusion::ANY_NODE, StringDictionary * strings = nullptr)
+    {
+        if (strings != nullptr)
+        {
+            for (uint32 idx = 0; idx < numElems; ++idx)
+            {
+                if (!Z2::invalid(col[idx]))
+                {
+                    if (is_string(col[idx].m128i_u64[0]))
+                        return (PackStrings(col, numElems, node, *strings));
+                    break;
+                }
+            }
+        }
+
+        std::unique_ptr<PackedColumn> ret(new PackedColumn(col.GetName(), numElems, node));
+        std::vector<uint64> values;
+        values.reserve(numElems);
+        for (uint32 idx = 0; idx < numElems; ++idx)
+        {
+            const Z2raw & atom = col[idx];
+            if (Z2::invalid(atom))
+                continue;
+            if (ret->low == 0ULL)
+            {
+                ret->low = atom.m128i_u64[0];
+            }
+            else if (atom.m128i_u64[0] != ret->low)
+            {
+                return (nullptr);
+            }
+            values.push_back(atom.m128i_u64[1]);
+        }
+
+        uint64 forCodes = ~0ULL;
+        if (!ret->is_float() && !values.empty())
+        {
+            auto minmax = std::minmax_element(values.begin(), values.end(), less_int);
+            cuint64 span = static_cast<uint64>(static_cast<int64>(*minmax.second) - static_cast<int64>(*minmax.first));
+            if (span < 0xFFFFFFFEULL)
+            {
+                forCodes = span + 2;
+                ret->base = static_cast<int64>(*minmax.first);
+            }
+        }
+        else if (values.empty())
+        {
+            forCodes = 1;
+        }
+
+        // only when it takes fewer bits
+        if (width_for(forCodes) > 8)
+        {
+            std::sort(values.begin(), values.end(),
+                [&ret](uint64 left, uint64 right) { return (ret->less(left, right)); });
+            values.erase(std::unique(values.begin(), values.end()), values.end());
+            if ((values.size() <= MAX_DICT) && (width_for(values.size() + 1) < width_for(forCodes)))
+            {
+                ret->encoding = Encoding::Dictionary;
+                ret->dict.swap(values);
+            }
+        }
+
+        if (ret->encoding == Encoding::Dictionary)
+        {
+            ret->codeEnd = static_cast<uint32>(ret->dict.size()) + 1;
+            ret->orderedEnd = !ret->is_float() ? ret->codeEnd :
+                static_cast<uint32>(std::find_if(ret->dict.begin(), ret->dict.end(), is_nan) - ret->dict.begin()) + 1;
+        }
+        else {
+            if (forCodes == ~0ULL)
+                return (nullptr);
+            ret->codeEnd = ret->orderedEnd = static_cast<uint32>(forCodes);
+        }
+        ret->width = width_for(ret->codeEnd);
+        if (ret->width > MAX_WIDTH)
+            return (nullptr);
+
+        ret->words = static_cast<uint64*>(MemFusion::PageAllocator::Allocate(ret->bytes(), node));
+        for (uint32 idx = 0; idx < numElems; ++idx)
+        {
+            const Z2raw & atom = col[idx];
+            if (!Z2::invalid(atom))
+            {
+                ret->store(idx, ret->encode(atom.m128i_u64[1]));
+            }
+        }
+        return (ret.release());
+    }
+
+    Z2name GetName() const { return (name); }
+    Encoding GetEncoding() const { return (encoding); }
+    uint32 GetWidth() const { return (width); }
+    uint64 bytes() const { return (uint64(capacity) * width / 8 + dict.size() * sizeof(uint64) + keys.size() * sizeof(StringKey)); }
+
+    // coded by a generation of strings that is not the current one
+    bool stale() const
+    {
+        return ((strings != nullptr) && (stringCodes->GetGeneration() != strings->generation()));
+    }
+
+    // The same codes (the order of the strings does not change) from the
+    // current generation; nullptr when some string has no code there.
+    PackedColumn * Recode() const
+    {
+        std::unique_ptr<PackedColumn> ret(new PackedColumn(name, capacity, node));
+        ret->strings = strings;
+        ret->encoding = encoding;
+        ret->low = low;
+        ret->keys = keys;
+        if (!ret->Code() || (ret->keys != keys))
+            return (nullptr);
+        ret->words = static_cast<uint64*>(MemFusion::PageAllocator::Allocate(ret->bytes(), node));
+        memcpy(ret->words, words, uint64(capacity) * width / 8);
+        return (ret.release());
+    }
+
+    uint32 code(uint32 elemIdx) const
+    {
+        cuint32 bit = elemIdx * width;
+        return (static_cast<uint32>((words[bit >> 6] >> (bit & 63)) & ((1ULL << width) - 1)));
+    }
+
+    // the codes of elements [base, base + 64), base a multiple of 64
+    const uint64 * codes(uint32 base) const
+    {
+        return (&words[(base / 64) * width]);
+    }
+
+    // what the Column had: an empty atom for an element without the field
+    Z2raw at(uint32 elemIdx) const
+    {
+        cuint32 c = code(elemIdx);
+        if ((c != 0) && (strings != nullptr))
+            return (Z2(low | (uint64(keys[c - 1].vlen) << 60), keys[c - 1].value));
+        return ((c == 0) ? Z2(0ULL, 0ULL) : Z2(low, value(c)));
+    }
+
+    // The atoms of element 'elemIdx' changed: false when its value has no
+    // code, and the packed form cannot be used any more.
+    bool fill(uint32 elemIdx, const Z2raw * begin, const Z2raw * end)
+    {
+        for (const Z2raw * cur = begin; cur < end; ++cur)
+        {
+            if ((cur->m128i_u32[0] == RootDocnum) && (Z2(*cur).z2name() == name))
+            {
+                if ((elemIdx >= capacity) || ((strings == nullptr) && (cur->m128i_u64[0] != low)))
+                    return (false);
+                cuint32 c = (strings != nullptr) ? encode_string(*cur) : encode(cur->m128i_u64[1]);
+                if (c == 0)
+                    return (false);
+                store(elemIdx, c);
+                return (true);
+            }
+        }
+        return (true);
+    }
+
+    // The codes whose values T matches against 'filter'. A string one is
+    // 'constant' when the query has resolved it.
+    template <typename T>
+    LFT::CodeRange range(const Z2raw & filter, const StringDictionary::Constant * constant = nullptr) const
+    {
+        LFT::CodeRange none = { 0, 0, false };
+        if (strings != nullptr)
+            return (range_string<T>(filter, constant));
+        if ((filter.m128i_u64[0] != low) || (low == 0ULL))
+            return (none);
+
+        auto matches = [this, &filter](uint32 code) { return (T::apply(filter, Z2(low, value(code)))); };
+        LFT::CodeRange ret = none;
+        uint32 eq;
+        switch (T::shape)
+        {
+        case LFT::MatchShape::Above:
+            ret.lo = first(1, orderedEnd, matches);
+            ret.hi = orderedEnd;
+            break;
+        case LFT::MatchShape::Below:
+            ret.lo = 1;
+            ret.hi = first(1, orderedEnd, [&matches](uint32 code) { return (!matches(code)); });
+            break;
+        case LFT::MatchShape::Equal:
+        case LFT::MatchShape::NotEqual:
+            eq = encode(filter.m128i_u64[1]);
+            ret.lo = eq;
+            ret.hi = (eq == 0) ? 0 : eq + 1;
+            ret.negate = (T::shape == LFT::MatchShape::NotEqual);
+            break;
+        case LFT::MatchShape::Prefix:
+            break;
+        }
+        if (ret.lo >= ret.hi)
+        {
+            ret.lo = ret.hi = 0;
+        }
+        return (ret);
+    }
+
+private:
+    // the strings T matches are a range of codes in the dictionary, and so
+    // in 'dict'
+    template <typename T>
+    LFT::CodeRange range_string(const Z2raw & filter, const StringDictionary::Constant * constant) const
+    {
+        LFT::CodeRange ret = { 0, 0, false };
+        if ((string_low(filter.m128i_u64[0]) != low) || (low == 0ULL))
+            return (ret);
+
+        StringDictionary::Constant resolved = (constant != nullptr) ? *constant : strings->constant(filter);
+        ret.negate = (T::shape == LFT::MatchShape::NotEqual);
+        if (!resolved.known)
+        {
+            // no bytes: it is none of the strings
+            return (ret);
+        }
+        StringCodeRange global = strings->Select<T>(*stringCodes, resolved.text);
+        ret.lo = local(global.lo);
+        ret.hi = local(global.hi);
+        if (ret.lo >= ret.hi)
+        {
+            ret.lo = ret.hi = 0;
+        }
+        return (ret);
+    }
+};
+
+}
+}
@@ -29,7 +29,10 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
 
 #include "MemFusion/types.h"
 #include "z2types.h"
@@ -38,10 +41,12 @@
 #include "MemFusion/opt.h"
 #include "MemFusion/Cache.h"
 #include "MemFusion/Buffer.h"
-#include "MemFusion/LF/bvec.h"
+#include "MemFusion/LF/segvec.h"
+#include "MemFusion/LF/epoch.h"
 #include "MemFusion/Utils.h"
 #include "MemFusion/CatchAllThread.h"
 #include "MemFusion/cancellation_token.h"
+#include "MemFusion/Platform/Numa.h"
 
 namespace MFDB
 {
@@ -49,7 +54,7 @@ namespace Core
 {
 using MemFusion::non_copyable;
 using MemFusion::Buffer;
-using MemFusion::LF::bvec;
+using MemFusion::LF::segvec;
 using MemFusion::cancellation_token;
 
 template <typename T>
@@ -60,6 +65,7 @@ class Z2Query;
 
 //  LFTidx, binIdx
 typedef std::tuple<uint32, uint32> Chore;
+static cuint32 ALL_LFTS = ~0U;      // LFTidx of the one chore of a spilled Bin
 
 // TBD: from configuration
 enum Constants
@@ -73,6 +79,8 @@ struct QueryMetrics
 {
     CACHE_ALIGN vuint64 numCores;
     CACHE_ALIGN vuint64 numChores;
+    CACHE_ALIGN vuint64 choresSkipped;
+    CACHE_ALIGN vuint64 choresStolen;       // run by a worker of another NUMA node
     CACHE_ALIGN vuint64 numLFTs;
     CACHE_ALIGN vuint64 numBins;
     CACHE_ALIGN vuint64 prepare_us;
@@ -85,6 +93,7 @@ struct QueryMetrics
     CACHE_ALIGN vuint64 composerIterations;
     CACHE_ALIGN vuint64 stage1Iterations;
     CACHE_ALIGN vuint64 stage1ThreadsSlowed;
+    CACHE_ALIGN vuint64 binsFromDisk;       // spilled when the query started: read back for it
 };
 
 template <typename T1, typename T4, typename Payload1>
@@ -110,32 +119,69 @@ public:
     Buffer & retbuf;
 
     const Z2Query<T1> * pz2query;
-    const bvec<Bin<Z2raw>*> & bins;
+    MemFusion::LF::epoch_guard readGuard;     // none of 'bins' is freed before the query ends
+    const std::vector<Bin<Z2raw>*> bins;      // snapshot: Bins added later are not seen
 
-    MemFusion::syncqueue<opt<Chore>> chorequeue;
+    // one per NUMA node: a worker takes the chores of its node first and
+    // steals from the others only when its own queue is empty
+    std::vector<std::unique_ptr<MemFusion::syncqueue<Chore>>> chorequeues;
     Stage1<T1,Payload1> stage1Common;
     std::vector<T4> matchesPerBin;
+    std::vector<uint32> elemsPerBin;      // snapshot: what this query sees
     std::vector<vuint64*> choresDonePerBin;
     QueryMetrics metrics;
     std::function<uint32(xHandle)> handleDecoder;
 
+    // A Bin with chores is pinned till they are done, and till the query
+    // ends if it has matches: they are read again. The spilled ones are
+    // pinned and read back by 'loader' when a worker gets to them, at most
+    // MAX_LOADS_IN_FLIGHT of them at a time.
+    static const uint32 MAX_LOADS_IN_FLIGHT = 4;    // TBD: from configuration
+    std::function<void(Bin<Z2raw>*)> loader;
+    std::mutex pinsMutex;
+    std::condition_variable pinsCond;
+    std::vector<byte> pinned;                   // per Bin: pinned by this query
+    std::vector<byte> deferred;                 // per Bin: spilled, pinned by its ALL_LFTS chore
+    std::vector<std::vector<uint32>> deferredLFTs;  // per Bin: what its ALL_LFTS chore runs
+    std::vector<byte> inFlight;                 // per Bin: read back, chores not done yet
+    uint32 loadsInFlight;
+    bool pinsClosed;                            // done or cancelled: no more pins
+
     ~QueryContext()
     {
+        for (uint32 binIdx = 0; binIdx < pinned.size(); ++binIdx)
+        {
+            if (pinned[binIdx] != 0)
+            {
+                bins[binIdx]->WaitResident();
+                bins[binIdx]->Unpin();
+            }
+        }
         for (auto chore : choresDonePerBin)
         {
             delete chore;
         }
     }
 
-    QueryContext(const Z2Query<T1> * pz2query_, const bvec<Bin<Z2raw>*> & bins_, Buffer & retbuf_, uint32 stage1ElemsPerThread, std::function<uint32(xHandle)> decoder)
+    // 'loader_' has the atoms of a spilled Bin read back by another thread
+    QueryContext(const Z2Query<T1> * pz2query_, MemFusion::LF::epoch & epoch_, const segvec<Bin<Z2raw>*> & bins_, Buffer & retbuf_, uint32 stage1ElemsPerThread, std::function<uint32(xHandle)> decoder,
+        std::function<void(Bin<Z2raw>*)> loader_)
         : pz2query(pz2query_),
         stage1Common(stage1ElemsPerThread),
-        numLFTs(pz2query_->lft_size()),
+        numLFTs(pz2query_->scan_size()),
         retbuf(retbuf_),
-        bins(bins_),
-        handleDecoder(decoder)
+        readGuard(epoch_),
+        bins(bins_.snapshot()),
+        handleDecoder(decoder),
+        loader(loader_),
+        loadsInFlight(0),
+        pinsClosed(false)
     {
-        numBins = bins.size();
+        numBins = static_cast<uint32>(bins.size());
+        pinned.resize(numBins, 0);
+        deferred.resize(numBins, 0);
+        deferredLFTs.resize(numBins);
+        inFlight.resize(numBins, 0);
 
         for (uint32 idx = 0; idx < numBins; ++idx)
         {
@@ -144,50 +190,228 @@ public:
         }
 
         matchesPerBin.resize(numBins);
+        for (uint32 idx = 0; idx < numBins; ++idx)
+        {
+            elemsPerBin.push_back(bins[idx]->Get()->s_nFreeElemIdx.load());
+        }
         memset(&metrics, 0, sizeof(metrics));
 
         uint32 numCores = std::thread::hardware_concurrency();
 
+        for (uint32 nodeIdx = 0; nodeIdx < MemFusion::Numa::NumNodes(); ++nodeIdx)
+        {
+            chorequeues.emplace_back(new MemFusion::syncqueue<Chore>());
+        }
+
+        // The chores of spilled Bins go last, read back when a worker gets
+        // there. Those of a Bin still on disk are one: the worker that reads
+        // it back runs all its LFTs, so the Bins read back are all scanned.
+        std::vector<Chore> spilled;
+        uint64 numChores = 0ULL;
         for (uint32 binIdx = 0; binIdx < numBins; ++binIdx)
         {
+            auto & chorequeue = *chorequeues[MemFusion::Numa::Ordinal(bins[binIdx]->numaNode())];
+            bool scanned = false;
             for (uint32 LFTidx = 0; LFTidx < numLFTs; ++LFTidx)
             {
-                chorequeue.enqueue(std::make_tuple(LFTidx, binIdx));
+                // zone map says nothing in this Bin can match: done already
+                if (!pz2query->get_scan(LFTidx)->may_match(bins[binIdx]->zoneMap()))
+                {
+                    InterlockedIncrement64(choresDonePerBin[binIdx]);
+                    InterlockedIncrement64(&metrics.choresSkipped);
+                    continue;
+                }
+                if (!scanned)
+                {
+                    deferred[binIdx] = (bins[binIdx]->residency() == Residency::OnDisk);
+                    if (deferred[binIdx] == 0)
+                    {
+                        PinBin(binIdx);
+                    }
+                    scanned = true;
+                }
+                ++numChores;
+                if (deferred[binIdx] != 0)
+                    deferredLFTs[binIdx].push_back(LFTidx);
+                else if (bins[binIdx]->resident())
+                    chorequeue.enqueue(std::make_tuple(LFTidx, binIdx));
+                else
+                    spilled.push_back(std::make_tuple(LFTidx, binIdx));
+            }
+            if (!deferredLFTs[binIdx].empty())
+            {
+                spilled.push_back(std::make_tuple(ALL_LFTS, binIdx));
             }
         }
-        metrics.numChores = chorequeue.size();
-        LFTthreads = std::min<uint32>(static_cast<uint32>(metrics.numChores), (numCores * 3) / 2);
+        for (const Chore & chore : spilled)
+        {
+            chorequeues[MemFusion::Numa::Ordinal(bins[std::get<1>(chore)]->numaNode())]->enqueue(chore);
+        }
+        uint64 queued = 0ULL;
+        for (auto & chorequeue : chorequeues)
+        {
+            queued += chorequeue->size();
+        }
+        metrics.numChores = numChores;
+        LFTthreads = std::min<uint32>(static_cast<uint32>(queued), (numCores * 3) / 2);
         metrics.numLFTs = numLFTs;
         metrics.numCores = numCores;
         metrics.numBins = numBins;
         workDone = 0L;
     }
 
+    // Answered by an index: no chores, no stage1 slots. The caller fills
+    // matchesPerBin and pins with AdmitBin the Bins it reads.
+    QueryContext(const Z2Query<T1> * pz2query_, MemFusion::LF::epoch & epoch_, const segvec<Bin<Z2raw>*> & bins_, Buffer & retbuf_, std::function<uint32(xHandle)> decoder,
+        std::function<void(Bin<Z2raw>*)> loader_)
+        : pz2query(pz2query_),
+        stage1Common(0),
+        numLFTs(pz2query_->scan_size()),
+        retbuf(retbuf_),
+        readGuard(epoch_),
+        bins(bins_.snapshot()),
+        handleDecoder(decoder),
+        loader(loader_),
+        loadsInFlight(0),
+        pinsClosed(false)
+    {
+        numBins = static_cast<uint32>(bins.size());
+        pinned.resize(numBins, 0);
+        deferred.resize(numBins, 1);
+        inFlight.resize(numBins, 0);
+        matchesPerBin.resize(numBins);
+        for (uint32 idx = 0; idx < numBins; ++idx)
+        {
+            elemsPerBin.push_back(bins[idx]->Get()->s_nFreeElemIdx.load());
+        }
+        memset(&metrics, 0, sizeof(metrics));
+        LFTthreads = 0;
+        metrics.numLFTs = numLFTs;
+        metrics.numBins = numBins;
+        workDone = 1L;
+    }
+
+    // Spilled: 'loader' has it read back while the workers scan what is in
+    // memory. Another query may be reading it back already. Under pinsMutex
+    // but in the constructor: true when it was not in memory.
+    bool PinBin(uint32 binIdx)
+    {
+        Bin<Z2raw> * bin = bins[binIdx];
+        const Residency was = bin->Pin();
+        pinned[binIdx] = 1;
+        if (was == Residency::OnDisk)
+        {
+            loader(bin);
+        }
+        if ((was == Residency::OnDisk) || (was == Residency::Loading))
+        {
+            ++metrics.binsFromDisk;
+            return (true);
+        }
+        return (false);
+    }
+
+    // Before reading a 'deferred' Bin: pinned once, waiting for fewer than
+    // MAX_LOADS_IN_FLIGHT Bins to be read back and scanned if it is spilled.
+    // False when the query is done or cancelled meanwhile.
+    bool AdmitBin(uint32 binIdx)
+    {
+        std::unique_lock<std::mutex> lock(pinsMutex);
+        for (;;)
+        {
+            if (pinned[binIdx] != 0)
+                return (true);
+            if (pinsClosed)
+                return (false);
+            if (bins[binIdx]->resident() || (loadsInFlight < MAX_LOADS_IN_FLIGHT))
+                break;
+            pinsCond.wait(lock);
+        }
+        if (PinBin(binIdx))
+        {
+            // scanned by whoever admitted it: this limit cannot hold up its chores
+            inFlight[binIdx] = 1;
+            ++loadsInFlight;
+        }
+        return (true);
+    }
+
+    // Done reading it: no more a load in flight, and unpinned unless the
+    // matches in it are read again
+    void BinScanned(uint32 binIdx, bool keep)
+    {
+        {
+            std::lock_guard<std::mutex> guard(pinsMutex);
+            if (inFlight[binIdx] != 0)
+            {
+                inFlight[binIdx] = 0;
+                --loadsInFlight;
+            }
+            if (!keep && (pinned[binIdx] != 0))
+            {
+                bins[binIdx]->WaitResident();
+                bins[binIdx]->Unpin();
+                pinned[binIdx] = 0;
+            }
+        }
+        pinsCond.notify_all();
+    }
+
+    // worker 'thdIdx' belongs to node ordinal thdIdx % number of nodes
+    uint32 HomeQueue(uint32 thdIdx) const
+    {
+        return (thdIdx % static_cast<uint32>(chorequeues.size()));
+    }
+
     void RunLeafs(uint32 thdIdx, cancellation_token & token)
     {
         uint64 myWaitMS = 0ULL;
+        cuint32 numQueues = static_cast<uint32>(chorequeues.size());
+        cuint32 home = HomeQueue(thdIdx);
 
-        // pick from chore queue
+        // pick from chore queues: all chores are queued upfront, so when
+        // every queue is empty there is nothing left to do
         while (!InterlockedAdd(&workDone, 0) && (!token.canceled()))
         {
+            Chore chore;
             TimeStamp one;
-            opt<Chore> chore = chorequeue.dequeue();
+            bool got = chorequeues[home]->try_dequeue(chore);
+            for (uint32 step = 1; !got && (step < numQueues); ++step)
+            {
+                got = chorequeues[(home + step) % numQueues]->try_dequeue(chore);
+                if (got)
+                {
+                    InterlockedIncrement64(&metrics.choresStolen);
+                }
+            }
             TimeStamp two;
             myWaitMS += TimeStamp::millis(one, two);
 
-            if (token.canceled())
+            if (!got || token.canceled())
                 break;
 
-            if (chore.is_initialized() && (!InterlockedAdd(&workDone, 0)))
+            if (!InterlockedAdd(&workDone, 0))
             {
-                uint32 LFTidx = std::get<0>(chore.get());
-                uint32 binIdx = std::get<1>(chore.get());
-                const IZ2LFT<T1> * lft = pz2query->get_lft(LFTidx);
-
-                lft->apply_filter(bins[binIdx], &stage1Common);
+                uint32 LFTidx = std::get<0>(chore);
+                uint32 binIdx = std::get<1>(chore);
+                // not back from disk yet: its chores are the last ones
+                if ((LFTidx == ALL_LFTS) && !AdmitBin(binIdx))
+                    break;
+                if (!bins[binIdx]->WaitResident())
+                {
+                    BinScanned(binIdx, false);
+                    throw EXCEPTION("Bin %u could not be read back from disk", bins[binIdx]->binIdx());
+                }
 
-                InterlockedIncrement64(choresDonePerBin[binIdx]);
-                InterlockedIncrement64(&metrics.choresDonePerThread[thdIdx]);
+                if (LFTidx != ALL_LFTS)
+                {
+                    RunChore(thdIdx, LFTidx, binIdx);
+                    continue;
+                }
+                for (uint32 one : deferredLFTs[binIdx])
+                {
+                    RunChore(thdIdx, one, binIdx);
+                }
             }
         }
 
@@ -199,13 +423,24 @@ public:
         InterlockedAdd64(&metrics.queueWait_ms, myWaitMS);
     }
 
+    void RunChore(uint32 thdIdx, uint32 LFTidx, uint32 binIdx)
+    {
+        const IZ2LFT<T1> * lft = pz2query->get_scan(LFTidx);
+
+        lft->apply_filter(bins[binIdx], elemsPerBin[binIdx], &stage1Common);
+
+        InterlockedIncrement64(choresDonePerBin[binIdx]);
+        InterlockedIncrement64(&metrics.choresDonePerThread[thdIdx]);
+    }
+
     void BeDone()
     {
         InterlockedExchange(&workDone, 1);
-        for (uint32 threadIdx = 0; threadIdx < LFTthreads; ++threadIdx)
         {
-            chorequeue.enqueue(opt<Chore>());
+            std::lock_guard<std::mutex> guard(pinsMutex);
+            pinsClosed = true;
         }
+        pinsCond.notify_all();
     }
 
     void CancelComputations()
@@ -234,6 +469,7 @@ public:
             [this](uint thdIdx, cancellation_token & token)
         {
             DEBUG_ONLY_SET_THREAD_NAME_WITH_INDEX("Worker ", thdIdx);
+            MemFusion::NumaPin pin(MemFusion::Numa::Node(HomeQueue(thdIdx)));
             RunLeafs(thdIdx, token);
         }, token);
         TimeStamp joinedLTFs;
@@ -255,21 +491,10 @@ public:
 
         while ((binIdexes.size() > 0) && (!token.canceled()))
         {
+            // Take the finished Bins before draining stage1: a chore promotes
+            // all its slots before being counted as done, so everything a
+            // finished Bin produced is consumed below, and stage3 runs once.
             std::vector<uint32> binDelenda;
-
-            while (stage1Common.GetNumberOfPromotedSlots() > 0)
-            {
-                xHandle handle;
-                FullSlot<T1, Payload1> slot = stage1Common.consume_promoted_slot(handle);
-                if (std::get<0>(slot) != std::get<1>(slot))
-                {
-                    stage2_lambda(slot);
-                    stage1Common.release_promoted_slot();
-                }
-            }
-
-            // collect stage1 and merge into stage2 for active Bins
-            //
             for (uint32 binIdx : binIdexes)
             {
                 auto choresDone = InterlockedAdd64(choresDonePerBin[binIdx], 0ULL);
@@ -279,9 +504,17 @@ public:
                 }
             }  // for each Bin
 
+            // collect stage1 and merge into stage2 for active Bins
+            //
+            ConsumePromotedSlots(stage2_lambda);
+
+            // Bins that have done scanning we can do stage3 (QP), then
+            // let go of them unless they have matches
             std::for_each(std::begin(binDelenda), std::end(binDelenda),
-                [&binIdexes](uint32 delidx)
+                [this, &binIdexes, &stage3_lambda](uint32 delidx)
             {
+                stage3_lambda(delidx);
+                BinScanned(delidx, !matchesPerBin[delidx].empty());
                 auto iter = std::find(std::begin(binIdexes), std::end(binIdexes), delidx);
                 if (iter != std::end(binIdexes))
                 {
@@ -289,17 +522,10 @@ public:
                 }
             });
 
-            // Bins that have done scanning we can do stage3 (QP)
-            for (uint32 binIdx = 0; binIdx < numBins; ++binIdx)
+            if (binIdexes.size() > 0)
             {
-                auto choresDone = InterlockedAdd64(choresDonePerBin[binIdx], 0ULL);
-                if (choresDone == numLFTs)
-                {
-                    stage3_lambda(binIdx);
-                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(COMPOSER_SLEEP_MS));
             }
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(COMPOSER_SLEEP_MS));
             InterlockedIncrement64(&metrics.composerIterations);
         }
 
@@ -307,6 +533,20 @@ public:
         BeDone();
     }
 
+    void ConsumePromotedSlots(std::function<void(FullSlot<T1, Payload1>)> & stage2_lambda)
+    {
+        while (stage1Common.GetNumberOfPromotedSlots() > 0)
+        {
+            xHandle handle;
+            FullSlot<T1, Payload1> slot = stage1Common.consume_promoted_slot(handle);
+            if (std::get<0>(slot) != std::get<1>(slot))
+            {
+                stage2_lambda(slot);
+                stage1Common.release_promoted_slot();
+            }
+        }
+    }
+
 };
 
 #pragma warning(pop)
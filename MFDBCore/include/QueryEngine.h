@@ -53,13 +53,18 @@ public:
         uint32 m_binMaxSize;
         uint32 m_maxBinNum;
         Path   m_percyBasePath;
+        PercyTraits::PersistencyType m_persistency;
+        uint64 m_memoryBudget;      // bytes of atoms in memory, 0: no limit
 
-        Config(uint32 mcib, uint32 bme, uint32 bms, uint32 mbn, Path pbp)
+        Config(uint32 mcib, uint32 bme, uint32 bms, uint32 mbn, Path pbp,
+            PercyTraits::PersistencyType pt = PercyTraits::PersistencyType::LocalFileSystem, uint64 mb = 0ULL)
             : m_maxConcIB(mcib),
             m_binMaxElems(bme),
             m_binMaxSize(bms),
             m_maxBinNum(mbn),
-            m_percyBasePath(pbp)
+            m_percyBasePath(pbp),
+            m_persistency(pt),
+            m_memoryBudget(mb)
         {}
     private:
         Config();
@@ -75,6 +80,7 @@ private:
     static const int MAX_NUMBER_OF_COLLECTIONS = 1000;
 
     Config cfg;
+    Core::MemoryBudget m_budget;    // shared by all the collections
     LF::smallmap<std::string, Core::Collection *> m_collections;
     //LF::smallmap<Candle, Slow::set<uint32>> m_clientsActiveTrans;
 
@@ -85,21 +91,59 @@ private:
     void operator = (const QueryEngine &);
 
     static Core::Projections ExtractProjections(std::vector<Z2raw>);
+
+    Core::Collection * FindOrInstantiate(const std::string & collection);
 public:
     static QueryEngine * Instance()
     {
         return (m_instance);
     }
 
-    static void InitializeQueryEngine(uint32 maxConcIB, uint32 bmaxelems, uint32 bmaxsize, uint32 maxbins, Path percypath);
+    static void InitializeQueryEngine(uint32 maxConcIB, uint32 bmaxelems, uint32 bmaxsize, uint32 maxbins, Path percypath,
+        PercyTraits::PersistencyType ptype = PercyTraits::PersistencyType::LocalFileSystem, uint64 memoryBudget = 0ULL);
+
+    // bytes of atoms kept in memory, 0: no limit. Over it cold Bins spill.
+    void SetMemoryBudget(uint64 bytes);
 
     void * AcquireInsertBuffer(Candle, const std::string & collection, uint32 size);
 
+    // false also when the document has an _id already in 'collection'
     bool ReleaseBufferForInsert(Candle, const char * collection, void * buffer);
 
+    // 'handles' are Core::InsertHandle
+    uint32 AcquireInsertBuffers(Candle, const std::string & collection, uint32 count, const uint32 * sizes, void ** buffers, uint64 * handles);
+
+    // How many were released: the others had an _id already in 'collection'.
+    // 'released', when not nullptr, gets 1 or 0 for each handle.
+    uint32 ReleaseBuffersForInsert(Candle, const char * collection, uint32 count, const uint64 * handles, byte * released);
+
     uint32 Query_Find(uint64 ch, const char * collection, void * z2selector, uint32 selectBytes, void * z2query, uint32 lftBytes, uint32 qpBytes, void * retbuf);
 
     uint32 Query_Aggregate(uint64 ch, const char * collection, void * z2query, uint32 queryBytes, void * retbuf, uint32 uintsort);
+
+    // number of documents removed
+    uint32 Query_Remove(uint64 ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes);
+
+    // number of documents matching, without reading them when bitmap indexes answer
+    uint64 Query_Count(uint64 ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes);
+
+    // number of documents updated; 'updates' are Core::UpdateRaw
+    uint32 Query_Update(uint64 ch, const char * collection, void * z2query, uint32 lftBytes, uint32 qpBytes, void * updates, uint32 updateBytes);
+
+    bool PromoteColumn(Candle, const char * collection, Z2name name);
+
+    // equality index on 'name' of 'collection'
+    bool CreateHashIndex(Candle, const char * collection, Z2name name);
+
+    // bitmap index on 'name' of 'collection', a field with few values
+    bool CreateBitmapIndex(Candle, const char * collection, Z2name name);
+
+    // ordered index on 'count' Z2names of 'collection', a composite key
+    bool CreateRangeIndex(Candle, const char * collection, const Z2name * names, uint32 count);
+
+    // long strings and binary data of 'collection', by their hash
+    bool AddBlob(Candle, const char * collection, uint64 hash, const void * bytes, uint32 size);
+    const void * FindBlob(Candle, const char * collection, uint64 hash, uint32 & size);
 };
 
 }
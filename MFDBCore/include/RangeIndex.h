@@ -0,0 +1,266 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+#include "MemFusion/types.h"
+#include "MemFusion/LF/spinlock.h"
+#include "z2types.h"
+#include "LFT/LFTtypes.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   Ordered index of one or more Z2names: a composite key, equality on the
+//   first ones and a range on the next narrow it down.
+//
+//   One sorted Run per Bin that takes no more elements, built by the
+//   compactor and built again when the Bin is compacted or updated in
+//   place. Bins without a current Run have all their elements checked.
+//   A Run is a static two level tree: the keys in order, and every
+//   FANOUT-th of them in a fence array that stays in cache. What a Run
+//   finds is a superset: it is checked on the Bin like a scan would.
+class RangeIndex
+{
+public:
+    // TBD: from configuration
+    static const uint32 MAX_KEYS = 3;
+    static const uint32 FANOUT = 64;
+
+    // (low qword, value) per Z2name, (0, 0) when the element has none. The
+    // low qword first: types do not mix. Values in the order the LFTs
+    // compare them, unsigned.
+    struct Key
+    {
+        uint64 parts[2 * MAX_KEYS];
+
+        bool operator < (const Key & other) const
+        {
+            return (std::lexicographical_compare(parts, parts + 2 * MAX_KEYS, other.parts, other.parts + 2 * MAX_KEYS));
+        }
+    };
+
+    class Run
+    {
+        const void * m_bin;             // built for, as long as it is not freed
+        const uint64 m_version;         // of its atoms
+        std::vector<Key> m_keys;
+        std::vector<uint32> m_elems;    // elemIdx of each key
+        std::vector<Key> m_fences;
+
+        Run(const Run &);
+        void operator = (const Run &);
+
+        // in the FANOUT keys before fence 'fenceIdx', or that one
+        template <typename Bound>
+        uint32 search(const Key & key, Bound bound) const
+        {
+            cuint32 fenceIdx = static_cast<uint32>(bound(m_fences.begin(), m_fences.end(), key) - m_fences.begin());
+            cuint32 from = (fenceIdx == 0) ? 0 : (fenceIdx - 1) * FANOUT;
+            cuint32 to = std::min(static_cast<uint32>(m_keys.size()), fenceIdx * FANOUT);
+            return (static_cast<uint32>(bound(m_keys.begin() + from, m_keys.begin() + to, key) - m_keys.begin()));
+        }
+    public:
+        Run(const void * bin, uint64 version)
+            : m_bin(bin),
+            m_version(version)
+        {
+        }
+
+        bool current(const void * bin, uint64 version) const
+        {
+            return ((m_bin == bin) && (m_version == version));
+        }
+
+        uint32 size() const { return (static_cast<uint32>(m_keys.size())); }
+        uint32 elem(uint32 idx) const { return (m_elems[idx]); }
+
+        void add(const Key & key, uint32 elemIdx)
+        {
+            m_keys.push_back(key);
+            m_elems.push_back(elemIdx);
+        }
+
+        // sorts what was added
+        void finish()
+        {
+            std::vector<uint32> order(m_keys.size());
+            for (uint32 idx = 0; idx < order.size(); ++idx)
+            {
+                order[idx] = idx;
+            }
+            std::stable_sort(order.begin(), order.end(),
+                [this](uint32 left, uint32 right) { return (m_keys[left] < m_keys[right]); });
+
+            std::vector<Key> keys(m_keys.size());
+            std::vector<uint32> elems(m_elems.size());
+            for (uint32 idx = 0; idx < order.size(); ++idx)
+            {
+                keys[idx] = m_keys[order[idx]];
+                elems[idx] = m_elems[order[idx]];
+            }
+            m_keys.swap(keys);
+            m_elems.swap(elems);
+            for (uint32 idx = 0; idx < m_keys.size(); idx += FANOUT)
+            {
+                m_fences.push_back(m_keys[idx]);
+            }
+        }
+
+        // [first, last) of the keys in [lo, hi]
+        void find(const Key & lo, const Key & hi, uint32 & first, uint32 & last) const
+        {
+            first = search(lo, [](std::vector<Key>::const_iterator b, std::vector<Key>::const_iterator e, const Key & key)
+                { return (std::lower_bound(b, e, key)); });
+            last = search(hi, [](std::vector<Key>::const_iterator b, std::vector<Key>::const_iterator e, const Key & key)
+                { return (std::upper_bound(b, e, key)); });
+            last = std::max(first, last);
+        }
+    };
+
+private:
+    const std::vector<Z2name> m_names;
+    mutable MemFusion::LF::spinlock m_runsLock;
+    std::vector<std::shared_ptr<const Run>> m_runs;     // by binIdx, under m_runsLock
+
+    RangeIndex(const RangeIndex &);
+    void operator = (const RangeIndex &);
+public:
+    explicit RangeIndex(const std::vector<Z2name> & names)
+        : m_names(names)
+    {
+    }
+
+    const std::vector<Z2name> & names() const { return (m_names); }
+
+    // -0.0 is +0.0 for the LFTs
+    static uint64 ordered(const Z2raw & atom)
+    {
+        const Z2 z2(atom);
+        uint64 value = z2.z2value();
+        if (z2.z2type() != BSONtypeCompressed::CFloatnum)
+            return (value ^ (1ULL << 63));
+        if (value == (1ULL << 63))
+        {
+            value = 0ULL;
+        }
+        return ((value & (1ULL << 63)) ? ~value : (value | (1ULL << 63)));
+    }
+
+    // false when the element has no root level atom of the first Z2name
+    bool key(const Z2raw * begin, const Z2raw * end, Key & out) const
+    {
+        std::fill(out.parts, out.parts + 2 * MAX_KEYS, 0ULL);
+        for (const Z2raw * cur = begin; (cur < end) && !Z2::invalid(*cur); ++cur)
+        {
+            if (cur->m128i_u32[0] != RootDocnum)
+                continue;
+            const Z2 z2(*cur);
+            auto found = std::find(m_names.begin(), m_names.end(), z2.z2name());
+            cuint32 keyIdx = static_cast<uint32>(found - m_names.begin());
+            if ((found != m_names.end()) && (out.parts[2 * keyIdx] == 0ULL))
+            {
+                out.parts[2 * keyIdx] = z2.z2low();
+                out.parts[2 * keyIdx + 1] = ordered(*cur);
+            }
+        }
+        return (out.parts[0] != 0ULL);
+    }
+
+    // [lo, hi] has every element that can pass $eq 'equals' and the ranges
+    // of 'comparisons'. False when they do not bound the first Z2name.
+    bool bounds(const std::vector<Z2raw> & equals, const std::vector<LFTraw> & comparisons, Key & lo, Key & hi) const
+    {
+        std::fill(lo.parts, lo.parts + 2 * MAX_KEYS, 0ULL);
+        std::fill(hi.parts, hi.parts + 2 * MAX_KEYS, ~0ULL);
+        for (uint32 keyIdx = 0; keyIdx < m_names.size(); ++keyIdx)
+        {
+            auto equal = std::find_if(equals.begin(), equals.end(),
+                [this, keyIdx](const Z2raw & z2raw) { return (Z2(z2raw).z2name() == m_names[keyIdx]); });
+            if (equal != equals.end())
+            {
+                lo.parts[2 * keyIdx] = hi.parts[2 * keyIdx] = Z2(*equal).z2low();
+                lo.parts[2 * keyIdx + 1] = hi.parts[2 * keyIdx + 1] = ordered(*equal);
+                continue;
+            }
+
+            // the last one bounded: what follows can be anything
+            bool bounded = false;
+            for (const LFTraw & lft : comparisons)
+            {
+                const Z2 z2(lft.z2raw);
+                if (z2.z2name() != m_names[keyIdx])
+                    continue;
+                cuint64 value = ordered(lft.z2raw);
+                Key one = lo;
+                if ((lft.qo == QO::GT) || (lft.qo == QO::GTE))
+                {
+                    one.parts[2 * keyIdx] = z2.z2low();
+                    one.parts[2 * keyIdx + 1] = (lft.qo == QO::GT) ? value + (value != ~0ULL) : value;
+                    lo = std::max(lo, one);
+                }
+                else {
+                    one = hi;
+                    one.parts[2 * keyIdx] = z2.z2low();
+                    one.parts[2 * keyIdx + 1] = (lft.qo == QO::LT) ? value - (value != 0ULL) : value;
+                    hi = std::min(hi, one);
+                }
+                bounded = true;
+            }
+            return (bounded || (keyIdx > 0));
+        }
+        return (true);
+    }
+
+    std::shared_ptr<const Run> run(uint32 binIdx) const
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(m_runsLock);
+        return ((binIdx < m_runs.size()) ? m_runs[binIdx] : nullptr);
+    }
+
+    void put(uint32 binIdx, std::shared_ptr<const Run> run)
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(m_runsLock);
+        if (binIdx >= m_runs.size())
+        {
+            m_runs.resize(binIdx + 1);
+        }
+        m_runs[binIdx] = run;
+    }
+};
+
+}
+}
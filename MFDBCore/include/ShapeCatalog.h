@@ -0,0 +1,224 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <string.h>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Inline.h"
+#include "MemFusion/LF/spinlock.h"
+#include "z2types.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   Shapes of the elements of one Bin. The shape of an element is the
+//   sequence of the names of its atoms, each flagged as root level or not.
+//   Documents of a collection mostly share a handful of shapes: looking a
+//   field up once per shape gives its atom offset in every element of that
+//   shape, instead of walking and comparing every atom of every element.
+//
+//   Shapes never change once published; readers only look at the first
+//   size() of them. Writers find the known ones without locking, and take
+//   a lock only to intern a new one.
+//   Elements too wide, or past MAX_SHAPES shapes, get UNKNOWN_SHAPE.
+class ShapeCatalog
+{
+public:
+    // TBD: from configuration
+    static const uint32 MAX_SHAPES = 255;
+    static const uint32 MAX_SHAPE_ATOMS = 256;
+    static const byte UNKNOWN_SHAPE = 255;
+
+private:
+    static const uint32 NESTED_BIT = 0x80000000;    // above Z2_NAME_BITS
+
+    struct Shape
+    {
+        std::vector<uint32> keys;
+    };
+
+    // by hash of the keys: twice the shapes, probes stay short
+    static const uint32 ID_SLOTS = 2 * (MAX_SHAPES + 1);
+
+    Shape shapes[MAX_SHAPES];
+    std::atomic<uint32> s_numShapes;
+    std::atomic<uint64> idHashes[ID_SLOTS];         // 0: free
+    byte ids[ID_SLOTS];                             // set before its hash
+    MemFusion::LF::spinlock s_internLock;           // new shapes only
+    std::unique_ptr<byte[]> elemShapes;
+
+    ShapeCatalog(const ShapeCatalog &);
+    void operator = (const ShapeCatalog &);
+
+    INLINE static uint32 key(const Z2raw & atom)
+    {
+        return (Z2(atom).z2name() | ((atom.m128i_u32[0] != 0) ? NESTED_BIT : 0));
+    }
+
+    static uint64 hash(const Z2raw * begin, const Z2raw * end)
+    {
+        // FNV-1a
+        uint64 ret = 0xCBF29CE484222325ULL;
+        for (const Z2raw * cur = begin; cur < end; ++cur)
+        {
+            ret = (ret ^ key(*cur)) * 0x100000001B3ULL;
+        }
+        return (ret);
+    }
+
+    // the slot of hash 'h', or the free one where it goes
+    uint32 slot(uint64 h) const
+    {
+        uint32 idx = static_cast<uint32>(h % ID_SLOTS);
+        for (uint64 now = idHashes[idx].load(std::memory_order_acquire); (now != 0ULL) && (now != h);
+            now = idHashes[idx].load(std::memory_order_acquire))
+        {
+            idx = (idx + 1) % ID_SLOTS;
+        }
+        return (idx);
+    }
+
+    // the shape of the slot of 'h' if it is that of [begin, end): a hash
+    // collision just walks
+    byte known(uint32 idx, const Z2raw * begin, const Z2raw * end) const
+    {
+        const std::vector<uint32> & keys = shapes[ids[idx]].keys;
+        bool same = (keys.size() == static_cast<size_t>(end - begin)) &&
+            std::equal(keys.begin(), keys.end(), begin,
+                [](uint32 k, const Z2raw & atom) { return (k == key(atom)); });
+        return (same ? ids[idx] : UNKNOWN_SHAPE);
+    }
+
+    byte intern(const Z2raw * begin, const Z2raw * end)
+    {
+        if (static_cast<uint64>(end - begin) > MAX_SHAPE_ATOMS)
+            return (UNKNOWN_SHAPE);
+
+        cuint64 h = std::max(hash(begin, end), 1ULL);
+        uint32 idx = slot(h);
+        if (idHashes[idx].load(std::memory_order_acquire) == h)
+            return (known(idx, begin, end));
+
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_internLock);
+        idx = slot(h);
+        if (idHashes[idx].load() == h)
+            return (known(idx, begin, end));
+
+        uint32 numShapes = s_numShapes.load();
+        if (numShapes == MAX_SHAPES)
+            return (UNKNOWN_SHAPE);
+
+        Shape & shape = shapes[numShapes];
+        shape.keys.reserve(end - begin);
+        for (const Z2raw * cur = begin; cur < end; ++cur)
+        {
+            shape.keys.push_back(key(*cur));
+        }
+        ids[idx] = static_cast<byte>(numShapes);
+        idHashes[idx].store(h, std::memory_order_release);
+        s_numShapes.store(numShapes + 1, std::memory_order_release);
+        return (static_cast<byte>(numShapes));
+    }
+
+public:
+    static const int32 ABSENT = -1;     // no atom with the name
+    static const int32 WALK = -2;       // unknown shape, or more than one atom with the name
+
+    explicit ShapeCatalog(uint32 numElems)
+        : s_numShapes(0),
+        elemShapes(new byte[numElems])
+    {
+        for (auto & h : idHashes)
+        {
+            h.store(0ULL);
+        }
+        memset(ids, 0, sizeof(ids));
+        memset(elemShapes.get(), UNKNOWN_SHAPE, numElems);
+    }
+
+    uint32 size() const { return (s_numShapes.load(std::memory_order_acquire)); }
+
+    byte shape(uint32 elemIdx) const { return (elemShapes[elemIdx]); }
+
+    // before element 'elemIdx' becomes active
+    void add(uint32 elemIdx, const Z2raw * begin, const Z2raw * end)
+    {
+        elemShapes[elemIdx] = intern(begin, end);
+    }
+
+    // offset of the atom named 'name' in shape 'shapeId' (only at root level
+    // when 'rootOnly'), ABSENT or WALK
+    int32 offset(uint32 shapeId, Z2name name, bool rootOnly) const
+    {
+        const std::vector<uint32> & keys = shapes[shapeId].keys;
+        int32 ret = ABSENT;
+        for (uint32 idx = 0; idx < keys.size(); ++idx)
+        {
+            bool match = rootOnly ? (keys[idx] == name) : ((keys[idx] & ~NESTED_BIT) == name);
+            if (!match)
+                continue;
+            if (ret != ABSENT)
+                return (WALK);
+            ret = static_cast<int32>(idx);
+        }
+        return (ret);
+    }
+};
+
+//   Offset of one field in every shape of a ShapeCatalog, taken once per
+//   scan. Shapes interned after it was taken (and UNKNOWN_SHAPE) walk.
+class ShapeLookup
+{
+    int32 offsets[ShapeCatalog::MAX_SHAPES + 1];
+
+    ShapeLookup(const ShapeLookup &);
+    void operator = (const ShapeLookup &);
+public:
+    ShapeLookup(const ShapeCatalog & catalog, Z2name name, bool rootOnly)
+    {
+        uint32 numShapes = catalog.size();
+        for (uint32 shapeId = 0; shapeId <= ShapeCatalog::MAX_SHAPES; ++shapeId)
+        {
+            offsets[shapeId] = (shapeId < numShapes) ? catalog.offset(shapeId, name, rootOnly) : ShapeCatalog::WALK;
+        }
+    }
+
+    INLINE int32 at(byte shapeId) const { return (offsets[shapeId]); }
+};
+
+}
+}
@@ -0,0 +1,435 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Inline.h"
+#include "z2types.h"
+#include "BlobStore.h"
+#include "LFT/QueryOperators.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+// The length of a string atom is in the top 4 bits of its low qword (the
+// front end's z2compword): 1-8 the bytes are in z2value, 0 z2value is the
+// hash of bytes kept in the BlobStore.
+INLINE uint32 string_vlen(uint64 low)
+{
+    return (static_cast<uint32>(low >> 60));
+}
+
+// the low qword of a string atom, whatever its length
+INLINE uint64 string_low(uint64 low)
+{
+    return (low & 0x0FFFFFFFFFFFFFFFULL);
+}
+
+INLINE bool is_string(uint64 low)
+{
+    return ((low != 0ULL) && (Z2(low, 0ULL).z2type() == BSONtypeCompressed::CUTF8String));
+}
+
+// What tells a string atom from another
+struct StringKey
+{
+    uint64 value;
+    uint32 vlen;
+
+    bool operator == (const StringKey & other) const
+    {
+        return ((value == other.value) && (vlen == other.vlen));
+    }
+};
+
+struct StringKeyHash
+{
+    size_t operator () (const StringKey & key) const
+    {
+        return (std::hash<uint64>()(key.value ^ (uint64(key.vlen) << 59)));
+    }
+};
+
+// The bytes of a string: inline ones are copied along, long ones stay in
+// the BlobStore (which never moves them).
+struct StringText
+{
+    uint64 inl;
+    const byte * ptr;
+    uint32 size;
+
+    const byte * data() const
+    {
+        return ((ptr != nullptr) ? ptr : reinterpret_cast<const byte*>(&inl));
+    }
+
+    // memcmp order, a prefix first
+    int compare(const StringText & other) const
+    {
+        int ret = memcmp(data(), other.data(), std::min(size, other.size));
+        if (ret != 0)
+            return ((ret < 0) ? -1 : 1);
+        return ((size < other.size) ? -1 : ((size > other.size) ? 1 : 0));
+    }
+
+    bool starts_with(const StringText & prefix) const
+    {
+        return ((size >= prefix.size) && (memcmp(data(), prefix.data(), prefix.size) == 0));
+    }
+};
+
+// The order-preserving codes of a StringDictionary, from 'lo' to 'hi'
+// excluded; 'negate' for all the codes but those.
+struct StringCodeRange
+{
+    uint64 lo;
+    uint64 hi;
+    bool negate;
+};
+
+//   One generation of the codes of a StringDictionary. Codes follow the
+//   order of the strings, and new strings take one between their
+//   neighbours; when there is none the dictionary re-codes all of them in
+//   a new generation. PackedColumns keep the generation they were coded
+//   with, and are re-coded when their Bin is sealed again.
+class StringCodes
+{
+    friend class StringDictionary;
+
+    struct TextLess
+    {
+        bool operator () (const StringText & left, const StringText & right) const
+        {
+            return (left.compare(right) < 0);
+        }
+    };
+
+    const uint64 generation;
+    std::map<StringText, uint64, TextLess> byText;
+    std::unordered_map<StringKey, uint64, StringKeyHash> byKey;
+
+    StringCodes(const StringCodes &);
+    void operator = (const StringCodes &);
+
+    explicit StringCodes(uint64 generation_)
+        : generation(generation_)
+    {
+    }
+
+    uint64 code_after(std::map<StringText, uint64, TextLess>::const_iterator iter) const;
+
+public:
+    static const uint64 END_CODE = 1ULL << 62;  // past all codes, int64 order as PackedColumn
+
+    uint64 GetGeneration() const { return (generation); }
+
+    // 0 when 'key' has no code in this generation
+    uint64 code(const StringKey & key) const
+    {
+        auto iter = byKey.find(key);
+        return ((iter != byKey.end()) ? iter->second : 0ULL);
+    }
+
+    // The codes of the strings T matches against 'text'
+    template <typename T>
+    StringCodeRange select(const StringText & text) const
+    {
+        StringCodeRange ret = { 0ULL, 0ULL, false };
+        auto ge = byText.lower_bound(text);
+        const bool found = (ge != byText.end()) && (ge->first.compare(text) == 0);
+        cuint64 geCode = (ge != byText.end()) ? ge->second : END_CODE;
+        cuint64 gtCode = found ? code_after(ge) : geCode;
+
+        // what T says of a value equal to the filter's
+        const Z2 one(1ULL, 1ULL);
+        const bool orEqual = T::apply(one, one);
+        switch (T::shape)
+        {
+        case LFT::MatchShape::Above:
+            ret.lo = orEqual ? geCode : gtCode;
+            ret.hi = END_CODE;
+            break;
+        case LFT::MatchShape::Below:
+            ret.lo = 1ULL;
+            ret.hi = orEqual ? gtCode : geCode;
+            break;
+        case LFT::MatchShape::Equal:
+        case LFT::MatchShape::NotEqual:
+            ret.lo = geCode;
+            ret.hi = gtCode;
+            ret.negate = (T::shape == LFT::MatchShape::NotEqual);
+            break;
+        case LFT::MatchShape::Prefix:
+            ret.lo = geCode;
+            ret.hi = END_CODE;
+            {
+                // the first string past those starting with 'text'
+                std::vector<byte> past(text.data(), text.data() + text.size);
+                while (!past.empty() && (past.back() == 0xFF))
+                {
+                    past.pop_back();
+                }
+                if (!past.empty())
+                {
+                    ++past.back();
+                    StringText bound = { 0ULL, past.data(), static_cast<uint32>(past.size()) };
+                    auto iter = byText.lower_bound(bound);
+                    ret.hi = (iter != byText.end()) ? iter->second : END_CODE;
+                }
+            }
+            break;
+        }
+        return (ret);
+    }
+};
+
+inline uint64 StringCodes::code_after(std::map<StringText, uint64, TextLess>::const_iterator iter) const
+{
+    ++iter;
+    return ((iter != byText.end()) ? iter->second : END_CODE);
+}
+
+//   The strings of a Collection with an order-preserving code each, for
+//   the string fields of its sealed Bins: packed by code, the filters on
+//   them are ranges of codes (PackedColumn::range), strings compared as
+//   integers.
+//
+//   Strings get in when a Bin is sealed; long ones need their bytes in the
+//   BlobStore (the front end adds them with the documents), otherwise they
+//   have no code and their column stays unpacked. Codes start SPACING
+//   apart: a new string goes half way between its neighbours, and only
+//   when they are next to each other all the strings get new codes.
+//   Nothing is persisted: sealing the Bins again codes them.
+//
+//   The current generation changes under m_mutex; all lookups take it too,
+//   once per Bin and filter.
+class StringDictionary
+{
+public:
+    // TBD: from configuration
+    static const uint64 SPACING = 1ULL << 32;
+
+    // A string constant of a filter, resolved once per query
+    struct Constant
+    {
+        StringKey key;
+        StringText text;
+        bool known;                             // 'text' is there
+
+        Constant()
+            : known(false)
+        {
+            key.value = 0ULL;
+            key.vlen = 0;
+            text.inl = 0ULL;
+            text.ptr = nullptr;
+            text.size = 0;
+        }
+    };
+
+private:
+    const BlobStore & blobs;
+    mutable std::mutex m_mutex;
+    std::shared_ptr<StringCodes> m_codes;       // the current generation
+    std::atomic<uint64> x_generation;
+    std::atomic<uint64> x_count;
+    mutable std::atomic<uint64> x_unresolved;
+
+    StringDictionary(const StringDictionary &);
+    void operator = (const StringDictionary &);
+
+    // all strings again, SPACING apart (less when there are very many)
+    void Recode()
+    {
+        std::shared_ptr<StringCodes> fresh(new StringCodes(m_codes->generation + 1));
+        cuint64 spacing = std::min(SPACING, StringCodes::END_CODE / (m_codes->byText.size() + 2));
+        std::unordered_map<uint64, uint64> recoded;
+        uint64 code = 0ULL;
+        for (auto & entry : m_codes->byText)
+        {
+            code += spacing;
+            fresh->byText.insert(fresh->byText.end(), std::make_pair(entry.first, code));
+            recoded[entry.second] = code;
+        }
+        for (auto & entry : m_codes->byKey)
+        {
+            fresh->byKey[entry.first] = recoded[entry.second];
+        }
+        m_codes = fresh;
+        x_generation.store(fresh->generation);
+    }
+
+    // 0 when there is no room between its neighbours
+    uint64 Add(const StringKey & key, const StringText & text)
+    {
+        StringCodes & codes = *m_codes;
+        auto ge = codes.byText.lower_bound(text);
+        if ((ge != codes.byText.end()) && (ge->first.compare(text) == 0))
+        {
+            codes.byKey[key] = ge->second;
+            return (ge->second);
+        }
+
+        cuint64 prev = (ge == codes.byText.begin()) ? 0ULL : std::prev(ge)->second;
+        cuint64 next = (ge == codes.byText.end()) ? StringCodes::END_CODE : ge->second;
+        uint64 code = (next == StringCodes::END_CODE) ? prev + SPACING : prev + (next - prev) / 2;
+        if ((code <= prev) || (code >= next))
+            return (0ULL);
+
+        codes.byText.insert(ge, std::make_pair(text, code));
+        codes.byKey[key] = code;
+        ++x_count;
+        return (code);
+    }
+
+public:
+    explicit StringDictionary(const BlobStore & blobs_)
+        : blobs(blobs_),
+        m_codes(new StringCodes(1ULL)),
+        x_generation(1ULL),
+        x_count(0ULL),
+        x_unresolved(0ULL)
+    {
+    }
+
+    uint64 generation() const { return (x_generation.load()); }
+    uint64 count() const { return (x_count.load()); }
+
+    // Strings a filter had to order without their bytes: it did not match
+    // them, rightly or not. The Collection reports the queries that met some.
+    void Unresolved() const { ++x_unresolved; }
+    uint64 unresolved() const { return (x_unresolved.load()); }
+
+    // False for a long string whose bytes are not in the BlobStore. The
+    // front end stores strings with their terminating zero: it is not part
+    // of the text.
+    bool text(const StringKey & key, StringText & out) const
+    {
+        out.inl = 0ULL;
+        out.ptr = nullptr;
+        out.size = 0;
+        if (key.vlen != 0)
+        {
+            out.inl = key.value;
+            out.size = std::min(key.vlen, 8U);
+            return (true);
+        }
+        uint32 size;
+        const void * found = blobs.find(key.value, size);
+        if (found == nullptr)
+            return (false);
+        out.ptr = static_cast<const byte*>(found);
+        out.size = ((size > 0) && (out.ptr[size - 1] == 0)) ? size - 1 : size;
+        return (true);
+    }
+
+    // The string of 'filter' (a string atom)
+    Constant constant(const Z2raw & filter) const
+    {
+        Constant ret;
+        ret.key.value = filter.m128i_u64[1];
+        ret.key.vlen = string_vlen(filter.m128i_u64[0]);
+        ret.known = text(ret.key, ret.text);
+        return (ret);
+    }
+
+    // A $regex that is an anchored literal: '^' then no metacharacter.
+    // 'constant' becomes the prefix.
+    static bool AnchoredPrefix(Constant & constant)
+    {
+        if (!constant.known || (constant.text.size == 0) || (constant.text.data()[0] != '^'))
+            return (false);
+        const byte * bytes = constant.text.data();
+        for (uint32 idx = 1; idx < constant.text.size; ++idx)
+        {
+            if (strchr("\\.[]()*+?{}|^$", bytes[idx]) != nullptr)
+                return (false);
+        }
+        if (constant.text.ptr != nullptr)
+        {
+            ++constant.text.ptr;
+        }
+        else {
+            constant.text.inl >>= 8;
+        }
+        --constant.text.size;
+        return (true);
+    }
+
+    // The codes of 'keys' in 'codes', 0 for those without bytes, adding the
+    // new ones; returns the generation they are from.
+    std::shared_ptr<const StringCodes> Code(const std::vector<StringKey> & keys, std::vector<uint64> & codes)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        codes.assign(keys.size(), 0ULL);
+        for (uint32 idx = 0; idx < keys.size(); ++idx)
+        {
+            codes[idx] = m_codes->code(keys[idx]);
+            StringText text;
+            if ((codes[idx] != 0ULL) || !this->text(keys[idx], text))
+                continue;
+            codes[idx] = Add(keys[idx], text);
+            if (codes[idx] == 0ULL)
+            {
+                // the codes so far are of the old generation
+                Recode();
+                idx = ~0U;
+            }
+        }
+        return (m_codes);
+    }
+
+    // 'key' in generation 'codes', 0 when not there
+    uint64 Find(const StringCodes & codes, const StringKey & key) const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return (codes.code(key));
+    }
+
+    template <typename T>
+    StringCodeRange Select(const StringCodes & codes, const StringText & text) const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return (codes.select<T>(text));
+    }
+};
+
+}
+}
@@ -29,12 +29,13 @@
 #pragma once
 
 #include <vector>
-#include <stack>
+#include <memory>
 
 #include "MemFusion/types.h"
 #include "LFT/LFT.h"
 #include "LFT/AT.h"
 #include "LFT/QueryOperators.h"
+#include "LFT/QPProgram.h"
 #include "MemFusion/Logger.h"
 #include "retail_assert.h"
 
@@ -56,6 +57,17 @@ public:
     virtual uint32 lft_size() const = 0;
 
     virtual const IZ2LFT<T1> * get_lft(uint32 idx) const = 0;
+
+    // What QueryContext schedules per bin: by default one scan per LFT.
+    virtual uint32 scan_size() const
+    {
+        return (lft_size());
+    }
+
+    virtual const IZ2LFT<T1> * get_scan(uint32 idx) const
+    {
+        return (get_lft(idx));
+    }
 };
 
 #pragma pack(push)
@@ -119,16 +131,64 @@ public:
     }
 };
 
+class Z2FindQuery;
+
+// Walks a bin once and evaluates all the LFTs of a find query on each
+// document, applying the QP inline: stage1 only receives final matches.
+class Z2FusedLFT : public IZ2LFT<uint32>
+{
+    const Z2FindQuery & query;
+
+    Z2FusedLFT(const Z2FusedLFT &);
+    void operator = (const Z2FusedLFT &);
+public:
+    explicit Z2FusedLFT(const Z2FindQuery & query_)
+        : query(query_)
+    {}
+
+    void apply_filter(const Bin<Z2raw> * bin, uint32 numElems, IStage1Producer<uint32, Stage1Payload> * realstage1) const;
+
+    bool may_match(const ZoneMap & zone) const;
+};
+
 class Z2FindQuery : public Z2Query<uint32>
 {
 public:
     typedef uint32 T1;
     typedef std::pair<uint32, uint32> Stage1Payload;
+
+    enum ScanMode
+    {
+        ScanAuto,       // fused when there is more than one LFT
+        ScanPerLFT,     // one chore per (LFT, Bin)
+        ScanFused,      // one chore per Bin
+    };
 private:
-    std::vector<const IZ2LFT<uint32> *> lfts;
-    const std::vector<QPraw> qps;
+    std::vector<const IZ2FindLFT *> lfts;
+    const std::vector<LFTraw> filters;    // as received, by LFTidx
+    const QPProgram program;
+    Z2FusedLFT fusedLFT;
+    bool fused;
+    std::vector<Z2raw> equals;      // constants of the $eq LFTs
+    std::vector<LFTraw> ranges;     // $gt, $gte, $lt, $lte but on strings
+
+    // Strings by the dictionary when there is one. A long string whose
+    // bytes are not in the BlobStore is only told from the others: nothing
+    // can be ordered against it.
+    template <typename T>
+    static const IZ2FindLFT * Make(const Z2 & z2, uint32 LFTidx, const StringDictionary * strings)
+    {
+        if ((strings != nullptr) && is_string(z2.z2low()))
+        {
+            const StringDictionary::Constant constant = strings->constant(z2);
+            if (!constant.known && (T::shape != LFT::MatchShape::Equal) && (T::shape != LFT::MatchShape::NotEqual))
+                throw std::exception("Long string of a range filter not in the BlobStore in Z2FindQuery.");
+            return (new Z2LFT<T>(z2, LFTidx, *strings, constant));
+        }
+        return (new Z2LFT<T>(z2, LFTidx));
+    }
 
-    void CreateLFTs(const std::vector<LFTraw> & lft_raws)
+    void CreateLFTs(const std::vector<LFTraw> & lft_raws, const StringDictionary * strings)
     {
         std::vector<LFTraw>::const_iterator iter = lft_raws.cbegin();
 
@@ -136,6 +196,11 @@ private:
         {
             Z2 z2(iter->z2raw);
             uint32 LFTidx = static_cast<uint32>(lfts.size());
+            if (((iter->qo == QO::GT) || (iter->qo == QO::GTE) || (iter->qo == QO::LT) || (iter->qo == QO::LTE)) &&
+                !is_string(z2.z2low()))
+            {
+                ranges.push_back(*iter);
+            }
 
             switch (iter->qo)
             {
@@ -144,7 +209,7 @@ private:
                     lfts.push_back(new Z2LFT<LFT::GT_float>(z2, LFTidx));
                 }
                 else {
-                    lfts.push_back(new Z2LFT<LFT::GT>(z2, LFTidx));
+                    lfts.push_back(Make<LFT::GT>(z2, LFTidx, strings));
                 }
                 break;
             case QO::GTE:  // $gte
@@ -152,7 +217,7 @@ private:
                     lfts.push_back(new Z2LFT<LFT::GTE_float>(z2, LFTidx));
                 }
                 else {
-                    lfts.push_back(new Z2LFT<LFT::GTE>(z2, LFTidx));
+                    lfts.push_back(Make<LFT::GTE>(z2, LFTidx, strings));
                 }
                 break;
             case QO::LT:  // $lt
@@ -160,7 +225,7 @@ private:
                     lfts.push_back(new Z2LFT<LFT::LT_float>(z2, LFTidx));
                 }
                 else {
-                    lfts.push_back(new Z2LFT<LFT::LT>(z2, LFTidx));
+                    lfts.push_back(Make<LFT::LT>(z2, LFTidx, strings));
                 }
                 break;
             case QO::LTE:  // $lte
@@ -168,14 +233,29 @@ private:
                     lfts.push_back(new Z2LFT<LFT::LTE_float>(z2, LFTidx));
                 }
                 else {
-                    lfts.push_back(new Z2LFT<LFT::LTE>(z2, LFTidx));
+                    lfts.push_back(Make<LFT::LTE>(z2, LFTidx, strings));
                 }
                 break;
             case QO::EQ:  // $EQ
-                lfts.push_back(new Z2LFT<LFT::EQ>(z2, LFTidx));
+                lfts.push_back(Make<LFT::EQ>(z2, LFTidx, strings));
+                equals.push_back(Z2::remove_doc(z2));
                 break;
             case QO::NE:  // $ne
-                lfts.push_back(new Z2LFT<LFT::NE>(z2, LFTidx));
+                lfts.push_back(Make<LFT::NE>(z2, LFTidx, strings));
+                break;
+            case QO::REGEX:  // $regex, anchored literals only
+                {
+                    StringDictionary::Constant prefix;
+                    if ((strings != nullptr) && is_string(z2.z2low()))
+                    {
+                        prefix = strings->constant(z2);
+                        if (!prefix.known)
+                            throw std::exception("Long string of a $regex not in the BlobStore in Z2FindQuery.");
+                    }
+                    if (!StringDictionary::AnchoredPrefix(prefix))
+                        throw std::exception("Only anchored literal prefixes for $regex in Z2FindQuery.");
+                    lfts.push_back(new Z2LFT<LFT::PREFIX>(z2, LFTidx, *strings, prefix));
+                }
                 break;
 #if 0
             case 13:
@@ -235,10 +315,17 @@ private:
     }
 
 public:
-    Z2FindQuery(const std::vector<LFTraw> & lft_raws, const std::vector<QPraw> & qps_)
-        : qps(remove_ends(qps_))
+    // 'strings' of the collection queried: filters on strings compare them
+    // by their bytes, not by z2value
+    Z2FindQuery(const std::vector<LFTraw> & lft_raws, const std::vector<QPraw> & qps_, ScanMode mode = ScanMode::ScanAuto,
+        const StringDictionary * strings = nullptr)
+        : filters(lft_raws),
+        program(static_cast<uint32>(lft_raws.size()), remove_ends(qps_)),
+        fusedLFT(*this)
     {
-        CreateLFTs(lft_raws);
+        CreateLFTs(lft_raws, strings);
+        fused = (mode == ScanMode::ScanFused) ||
+            ((mode == ScanMode::ScanAuto) && (lfts.size() > 1));
     }
 
     uint32 lft_size() const
@@ -251,65 +338,184 @@ public:
         return (idx < lfts.size() ? lfts[idx] : nullptr);
     }
 
-    bool apply_qp(std::vector<bool> & lfts) const
+    bool IsFused() const
+    {
+        return (fused);
+    }
+
+    uint32 scan_size() const
+    {
+        return (fused ? 1 : lft_size());
+    }
+
+    const IZ2LFT<uint32> * get_scan(uint32 idx) const
+    {
+        return (fused ? &fusedLFT : get_lft(idx));
+    }
+
+    const QPProgram & GetProgram() const
+    {
+        return (program);
+    }
+
+    const std::vector<LFTraw> & GetFilters() const
+    {
+        return (filters);
+    }
+
+    bool IsConjunction() const
+    {
+        return ((program.GetShape() == QPProgram::Shape::ShapeSingle) || (program.GetShape() == QPProgram::Shape::ShapeAnd));
+    }
+
+    // The $eq constants every match has: none unless the LFTs are ANDed
+    std::vector<Z2raw> equalities() const
+    {
+        return (IsConjunction() ? equals : std::vector<Z2raw>());
+    }
+
+    // Same for the comparisons with numbers and dates
+    std::vector<LFTraw> comparisons() const
     {
-        //FILE_LOG(logDEBUG4) << "QP: Applying " << lfts.size() << " lfts with " << qps.size() << " qps";
+        return (IsConjunction() ? ranges : std::vector<LFTraw>());
+    }
 
-        if (qps.size() == 0)
+    // The $eq constants of a disjunction of $eq on one Z2name ($in): every
+    // match has one of them. None for other queries.
+    std::vector<Z2raw> alternatives() const
+    {
+        if ((program.GetShape() != QPProgram::Shape::ShapeOr) || (equals.size() != lfts.size()))
+            return (std::vector<Z2raw>());
+        for (const Z2raw & equal : equals)
         {
-            assert(lfts.size() == 1);
-            return (lfts[0]);
+            if (Z2(equal).z2name() != Z2(equals.front()).z2name())
+                return (std::vector<Z2raw>());
         }
+        return (equals);
+    }
 
-        if ((qps.size() == 1) && (qps[0].command == QO::AND_ALL))
+    // One ShapeLookup per LFT, for the words of one Bin
+    typedef std::vector<std::unique_ptr<const ShapeLookup>> ShapeLookups;
+    ShapeLookups shape_lookups(const Bin<Z2raw> * bin) const
+    {
+        ShapeLookups ret;
+        for (const IZ2FindLFT * lft : lfts)
         {
-            bool ret = lfts[0];
-            for (bool v : lfts) { ret &= v; }
-            return (ret);
+            ret.emplace_back(new ShapeLookup(bin->shapes(), lft->field(), true));
         }
+        return (ret);
+    }
 
-        std::stack<bool> mystack;
-        for (bool v : lfts) { mystack.push(v); }
+    // Evaluates every LFT and the QP on the 'active' elements of a 64 elements
+    // word starting at 'base'. 'lookups' are those of shape_lookups(bin), 'regs'
+    // is scratch space with program.reg_size() words.
+    uint64 match_word(const Bin<Z2raw> * bin, const ShapeLookups & lookups, uint32 base, uint64 active, uint64 * regs) const
+    {
+        uint64 ret;
+        switch (program.GetShape())
+        {
+        case QPProgram::Shape::ShapeSingle:
+        case QPProgram::Shape::ShapeAnd:
+            // each LFT only looks at what survived the previous ones
+            ret = active;
+            for (uint32 LFTidx = 0; (LFTidx < lfts.size()) && ret; ++LFTidx)
+            {
+                ret = lfts[LFTidx]->match_word(bin, *lookups[LFTidx], base, ret);
+            }
+            return (ret);
+        case QPProgram::Shape::ShapeOr:
+            // each LFT only looks at what the previous ones did not take
+            ret = 0ULL;
+            for (uint32 LFTidx = 0; (LFTidx < lfts.size()) && (ret != active); ++LFTidx)
+            {
+                ret |= lfts[LFTidx]->match_word(bin, *lookups[LFTidx], base, active & ~ret);
+            }
+            return (ret);
+        default:
+            for (uint32 LFTidx = 0; LFTidx < lfts.size(); ++LFTidx)
+            {
+                regs[LFTidx] = lfts[LFTidx]->match_word(bin, *lookups[LFTidx], base, active);
+            }
+            return (program.eval(regs) & active);
+        }
+    }
 
-        bool ret = mystack.top();
+    // The QP on what the LFTs may match in 'zone'. Only sound without NOT:
+    // an LFT that cannot match makes its negation match everything.
+    bool may_match(const ZoneMap & zone) const
+    {
+        if (program.needs_universe())
+            return (true);
 
-        std::for_each(qps.begin(), qps.end(),
-            [&mystack, &ret](QPraw qp)
+        std::vector<uint64> regs(program.reg_size(), 0ULL);
+        for (uint32 LFTidx = 0; LFTidx < lfts.size(); ++LFTidx)
         {
-            uint32 kids = qp.kids;
-            QO cmd = qp.command;
+            regs[LFTidx] = lfts[LFTidx]->may_match(zone) ? ~0ULL : 0ULL;
+        }
+        return (program.eval(regs.data()) != 0ULL);
+    }
+
+    // Same QP on the per-LFT bitmaps of a whole Bin. Consumes 'bitmaps'.
+    ElemBitmap apply_qp(std::vector<ElemBitmap> & bitmaps, const ElemBitmap * universe) const
+    {
+        return (program.eval(bitmaps, universe));
+    }
+};
+
+inline bool Z2FusedLFT::may_match(const ZoneMap & zone) const
+{
+    return (query.may_match(zone));
+}
 
-            ret = mystack.top();
-            mystack.pop();
+inline void Z2FusedLFT::apply_filter(const Bin<Z2raw> * bin, uint32 numElems, IStage1Producer<uint32, Stage1Payload> * realstage1) const
+{
+    uint64 numAtoms = 0ULL;
+    auto core = bin->Get();
+    Stage1Writer writer(realstage1, std::make_pair(0U, bin->binIdx()));
+    std::vector<uint64> regs(query.GetProgram().reg_size(), 0ULL);
+    const Z2FindQuery::ShapeLookups lookups = query.shape_lookups(bin);
+
+    for (uint32 blockIdx = 0; blockIdx < Bin<Z2raw>::num_blocks(numElems); ++blockIdx)
+    {
+        if (!may_match(bin->blockZone(blockIdx)))
+            continue;
 
-            switch (cmd)
+        // blocks are whole words
+        cuint32 blockEnd = std::min(numElems, (blockIdx + 1) * Bin<Z2raw>::BLOCK_ELEMS);
+        for (uint32 base = blockIdx * Bin<Z2raw>::BLOCK_ELEMS; base < blockEnd; base += 64)
+        {
+            uint32 count = std::min(64U, blockEnd - base);
+            uint64 active = 0ULL;
+            for (uint32 bit = 0; bit < count; ++bit)
             {
-            case QO::AND:
-                for (uint32 times = 1; times < kids; ++times)
+                ElemInfo elem(core->s_vElems[base + bit]);
+                if (elem.status() == ElemState::ElemActive)
                 {
-                    ret &= mystack.top();
-                    mystack.pop();
+                    active |= (1ULL << bit);
+                    numAtoms += elem.atomSize();
                 }
-                mystack.push(ret);
-                break;
-            case QO::OR:
-                for (uint32 times = 1; times < kids; ++times)
-                {
-                    ret |= mystack.top();
-                    mystack.pop();
-                }
-                mystack.push(ret);
-                break;
-            default:
-                assert(UNREACHED);
             }
-        });
+            if (!active)
+                continue;
 
-        assert(mystack.size() == 1);
-        return (ret);
+            uint64 matches = query.match_word(bin, lookups, base, active, regs.data());
+            while (matches)
+            {
+                unsigned long bit;
+                _BitScanForward64(&bit, matches);
+                matches &= matches - 1;
+                writer.add(base + bit);
+            }
+        }
+    }
+    if (MemFusion::CpuFeatures::Level() != MemFusion::SimdLevel::SimdSSE42)
+    {
+        _mm256_zeroupper();
     }
+    writer.flush();
 
-};
+    MemFusion::Perfy::Instance().add<1>(0, numElems, numAtoms);
+}
 
 }
 }
@@ -0,0 +1,186 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <vector>
+#include <intrin.h>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Inline.h"
+#include "z2types.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+enum class UpdateOp : uint32
+{
+    Set = 1,    // $set
+    Inc = 2,    // $inc
+};
+
+//   One field update, as the driver sends it: 'z2' is a root level atom
+//   with the name, type and value to $set, or the amount to $inc by.
+struct UpdateRaw
+{
+    UpdateOp op;
+    Z2raw z2;
+};
+
+typedef std::vector<UpdateRaw> Z2Updates;
+
+//   Every atom is 16 bytes, and a number, bool or date is all in it: $set
+//   and $inc of such a field change that atom only. They are applied in
+//   place with one interlocked 64 or 128 bit write, so concurrent updates
+//   of the same field are not lost and scans see the old atom or the new
+//   one. Anything else changes the size of the document.
+class Z2Update
+{
+    INLINE static bool is_int(Z2type type)
+    {
+        return ((type == BSONtypeCompressed::CInt32) || (type == BSONtypeCompressed::CInt64));
+    }
+    INLINE static bool is_number(Z2type type)
+    {
+        return (is_int(type) || (type == BSONtypeCompressed::CFloatnum));
+    }
+    INLINE static double as_double(const Z2 & z2)
+    {
+        return (is_int(z2.z2type()) ? static_cast<double>(static_cast<int64>(z2.z2value())) : Z2::double_z2(z2));
+    }
+    // 'old' with 'type' and 'value': the control word comes from 'old' or
+    // 'arg' when they have that type already, as the driver wrote it
+    static Z2raw make(const Z2 & old, const Z2 & arg, BSONtypeCompressed type, uint32 vlen, uint64 value)
+    {
+        Z2raw ret;
+        ret.m128i_u32[0] = RootDocnum;
+        if (old.z2type() == type)
+        {
+            ret.m128i_u32[1] = static_cast<uint32>(old.z2low() >> 32);
+        }
+        else if (arg.z2type() == type)
+        {
+            ret.m128i_u32[1] = (static_cast<uint32>(arg.z2low() >> 32) & ~Z2::Z2_NAME_BITS) | old.z2name();
+        }
+        else {
+            ret.m128i_u32[1] = old.z2name() | (uint32(type) << 23) | (vlen << 28);
+        }
+        ret.m128i_u64[1] = value;
+        return (ret);
+    }
+
+public:
+    // the value a document without the field gets
+    static Z2raw initial(const UpdateRaw & upd)
+    {
+        return (Z2::remove_doc(upd.z2));
+    }
+
+    // a $set can put any single atom in place of one, a $inc needs numbers
+    static bool fits(const UpdateRaw & upd, const Z2raw & atom)
+    {
+        if (Z2(atom).HasInnerDoc() || Z2(upd.z2).HasInnerDoc())
+            return (false);
+        return ((upd.op == UpdateOp::Set) || is_number(Z2(atom).z2type()));
+    }
+
+    // 'atom' updated; false when the update does not apply to it
+    static bool apply(const UpdateRaw & upd, Z2raw & atom)
+    {
+        const Z2 old(atom);
+        const Z2 arg(upd.z2);
+        if (upd.op == UpdateOp::Set)
+        {
+            atom = initial(upd);
+            return (true);
+        }
+        if ((upd.op != UpdateOp::Inc) || !is_number(old.z2type()) || !is_number(arg.z2type()))
+            return (false);
+
+        if (is_int(old.z2type()) && is_int(arg.z2type()))
+        {
+            const int64 sum = static_cast<int64>(old.z2value()) + static_cast<int64>(arg.z2value());
+            // as MongoDB: int32 unless an operand is int64 or it overflows
+            if ((old.z2type() == BSONtypeCompressed::CInt32) && (arg.z2type() == BSONtypeCompressed::CInt32) &&
+                (sum == static_cast<int32>(sum)))
+            {
+                atom = make(old, arg, BSONtypeCompressed::CInt32, 4, static_cast<uint64>(sum));
+            }
+            else {
+                atom = make(old, arg, BSONtypeCompressed::CInt64, 8, static_cast<uint64>(sum));
+            }
+            return (true);
+        }
+        double sum = as_double(old) + as_double(arg);
+        atom = make(old, arg, BSONtypeCompressed::CFloatnum, 8, *(uint64*) &sum);
+        return (true);
+    }
+
+    // 'atom' is in a Bin and fits(): false when the update does not apply.
+    // 'was' is the atom this call swapped out, 'now' the one it put there.
+    static bool apply_in_place(const UpdateRaw & upd, Z2raw * atom, Z2raw & was, Z2raw & now)
+    {
+        volatile int64 * qwords = reinterpret_cast<volatile int64 *>(atom);
+
+        // same name and type: only the value qword changes
+        was.m128i_i64[0] = qwords[0];
+        if ((upd.op == UpdateOp::Set) && (was.m128i_u64[0] == initial(upd).m128i_u64[0]))
+        {
+            was.m128i_i64[1] = InterlockedExchange64(&qwords[1], static_cast<int64>(upd.z2.m128i_u64[1]));
+            now = was;
+            now.m128i_u64[1] = upd.z2.m128i_u64[1];
+            return (true);
+        }
+        if ((upd.op == UpdateOp::Inc) && (Z2(was).z2type() == BSONtypeCompressed::CInt64) && is_int(Z2(upd.z2).z2type()))
+        {
+            was.m128i_i64[1] = InterlockedExchangeAdd64(&qwords[1], static_cast<int64>(upd.z2.m128i_u64[1]));
+            now = was;
+            now.m128i_u64[1] += upd.z2.m128i_u64[1];
+            return (true);
+        }
+
+        // type changes: both qwords, retried if another update got there first
+        for (;;)
+        {
+            int64 expected[2] = { qwords[0], qwords[1] };
+            was.m128i_i64[0] = expected[0];
+            was.m128i_i64[1] = expected[1];
+            now = was;
+            if (!apply(upd, now))
+                return (false);
+            if (InterlockedCompareExchange128(qwords, now.m128i_i64[1], now.m128i_i64[0], expected))
+                return (true);
+        }
+    }
+};
+
+}
+}
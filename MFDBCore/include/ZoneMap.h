@@ -0,0 +1,260 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include <string.h>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Inline.h"
+#include "z2types.h"
+
+namespace MFDB
+{
+namespace Core
+{
+
+//   Range of the values of the atoms sharing one low qword, i.e. root level
+//   atoms with the same name, type and vlen.
+//
+//   Integers are compared signed, like the LFTs do. NaNs are left out of the
+//   float range: no float operator matches them.
+struct ZoneRange
+{
+    int64 minInt;
+    int64 maxInt;
+    double minFloat;
+    double maxFloat;
+
+    ZoneRange()
+        : minInt(std::numeric_limits<int64>::max()),
+        maxInt(std::numeric_limits<int64>::min()),
+        minFloat(std::numeric_limits<double>::infinity()),
+        maxFloat(-std::numeric_limits<double>::infinity())
+    {}
+
+    INLINE void add(uint64 value)
+    {
+        int64 ivalue = static_cast<int64>(value);
+        double fvalue = *(double*) &value;
+
+        minInt = std::min(minInt, ivalue);
+        maxInt = std::max(maxInt, ivalue);
+        if (fvalue == fvalue)
+        {
+            minFloat = std::min(minFloat, fvalue);
+            maxFloat = std::max(maxFloat, fvalue);
+        }
+    }
+};
+
+// Summary of a set of elements (a Bin, or a block of one): one ZoneRange per
+// low qword of the root level atoms, and a hashed signature of the Z2names
+// occurring at any level. The inserters update it before an element turns
+// active, so a query never skips an element it can see. Deleted elements are
+// not removed: the summary can only be wider than the truth.
+//
+// Lock free: inserters only widen, by CAS, a range already there or one they
+// claim in a fixed table. Past MAX_RANGES low qwords the ones left out may
+// have any value.
+class ZoneMap
+{
+public:
+    static const uint32 NAME_SIGNATURE_BITS = 256;
+    static const uint32 MAX_RANGES = 256;
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64> key;        // low qword, 0: free
+        std::atomic<int64> minInt;
+        std::atomic<int64> maxInt;
+        std::atomic<uint64> minFloat;   // bits of a double
+        std::atomic<uint64> maxFloat;
+    };
+
+    Slot slots[MAX_RANGES];
+    std::atomic<uint32> numRanges;
+    std::atomic<bool> overflow;         // some low qword found no Slot
+    std::atomic<uint64> names[NAME_SIGNATURE_BITS / 64];
+
+    INLINE static uint32 name_bit(Z2name name)
+    {
+        return ((name * 0x9E3779B1U) >> 24);
+    }
+
+    INLINE static uint32 home(uint64 key)
+    {
+        return (static_cast<uint32>((key * 0x9E3779B97F4A7C15ULL) >> 32) % MAX_RANGES);
+    }
+
+    INLINE static double as_double(uint64 bits)
+    {
+        return (*(double*) &bits);
+    }
+
+    // the Slot of 'key', claimed if it has none: nullptr when the table is full
+    Slot * claim(uint64 key)
+    {
+        for (uint32 probe = 0, idx = home(key); probe < MAX_RANGES; ++probe, idx = (idx + 1) % MAX_RANGES)
+        {
+            uint64 now = slots[idx].key.load(std::memory_order_acquire);
+            if ((now == 0ULL) && slots[idx].key.compare_exchange_strong(now, key))
+            {
+                ++numRanges;
+                return (&slots[idx]);
+            }
+            if (now == key)
+                return (&slots[idx]);
+        }
+        return (nullptr);
+    }
+
+    // slots are never freed: the first free one ends the search
+    const Slot * lookup(uint64 key) const
+    {
+        for (uint32 probe = 0, idx = home(key); probe < MAX_RANGES; ++probe, idx = (idx + 1) % MAX_RANGES)
+        {
+            cuint64 now = slots[idx].key.load(std::memory_order_acquire);
+            if (now == key)
+                return (&slots[idx]);
+            if (now == 0ULL)
+                return (nullptr);
+        }
+        return (nullptr);
+    }
+
+    INLINE static void widen(Slot & slot, uint64 value)
+    {
+        const int64 ivalue = static_cast<int64>(value);
+        int64 now = slot.minInt.load(std::memory_order_relaxed);
+        while ((ivalue < now) && !slot.minInt.compare_exchange_weak(now, ivalue)) {}
+        now = slot.maxInt.load(std::memory_order_relaxed);
+        while ((ivalue > now) && !slot.maxInt.compare_exchange_weak(now, ivalue)) {}
+
+        const double fvalue = as_double(value);
+        if (fvalue != fvalue)
+            return;
+        uint64 bits = slot.minFloat.load(std::memory_order_relaxed);
+        while ((fvalue < as_double(bits)) && !slot.minFloat.compare_exchange_weak(bits, value)) {}
+        bits = slot.maxFloat.load(std::memory_order_relaxed);
+        while ((fvalue > as_double(bits)) && !slot.maxFloat.compare_exchange_weak(bits, value)) {}
+    }
+
+    ZoneMap(const ZoneMap &);
+    void operator = (const ZoneMap &);
+public:
+    ZoneMap()
+        : numRanges(0),
+        overflow(false)
+    {
+        const ZoneRange empty;
+        for (Slot & slot : slots)
+        {
+            slot.key.store(0ULL);
+            slot.minInt.store(empty.minInt);
+            slot.maxInt.store(empty.maxInt);
+            slot.minFloat.store(*(uint64*) &empty.minFloat);
+            slot.maxFloat.store(*(uint64*) &empty.maxFloat);
+        }
+        for (auto & word : names)
+        {
+            word.store(0ULL);
+        }
+    }
+
+    // LFT filters have no docdepth: only root level atoms can match them
+    INLINE static bool summarized(const Z2raw & atom)
+    {
+        return ((atom.m128i_u32[0] == 0) && (atom.m128i_u32[1] != 0));
+    }
+
+    // the atoms of one element
+    void add(const Z2raw * begin, const Z2raw * end)
+    {
+        for (const Z2raw * cur = begin; cur < end; ++cur)
+        {
+            cuint32 bit = name_bit(Z2(*cur).z2name());
+            cuint64 mask = 1ULL << (bit & 63);
+            if ((names[bit >> 6].load(std::memory_order_relaxed) & mask) == 0)
+            {
+                names[bit >> 6].fetch_or(mask);
+            }
+            if (summarized(*cur))
+            {
+                Slot * slot = claim(cur->m128i_u64[0]);
+                if (slot != nullptr)
+                    widen(*slot, cur->m128i_u64[1]);
+                else
+                    overflow.store(true);
+            }
+        }
+    }
+
+    // false: no atom has this low qword
+    bool find(uint64 key, ZoneRange & range) const
+    {
+        const Slot * slot = lookup(key);
+        if (slot == nullptr)
+        {
+            if (!overflow.load())
+                return (false);
+            // left out: any value
+            range = ZoneRange();
+            range.minInt = std::numeric_limits<int64>::min();
+            range.maxInt = std::numeric_limits<int64>::max();
+            range.minFloat = -std::numeric_limits<double>::infinity();
+            range.maxFloat = std::numeric_limits<double>::infinity();
+            return (true);
+        }
+        range.minInt = slot->minInt.load();
+        range.maxInt = slot->maxInt.load();
+        range.minFloat = as_double(slot->minFloat.load());
+        range.maxFloat = as_double(slot->maxFloat.load());
+        return (true);
+    }
+
+    // false: no atom has this name (true can be a false positive)
+    bool may_contain(Z2name name) const
+    {
+        cuint32 bit = name_bit(name);
+        return ((names[bit >> 6].load() & (1ULL << (bit & 63))) != 0);
+    }
+
+    uint32 size() const
+    {
+        return (numRanges.load());
+    }
+};
+
+}
+}
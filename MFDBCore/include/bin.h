@@ -29,6 +29,13 @@
 #pragma once
 
 #include "z2types.h"
+#include "ZoneMap.h"
+#include "Column.h"
+#include "PackedColumn.h"
+#include "ShapeCatalog.h"
+#include "MemFusion/LF/spinlock.h"
+#include "MemFusion/Platform/MappedFile.h"
+#include "MemFusion/PageAllocator.h"
 #include "MemFusion/cache.h"
 #include "MemFusion/Exceptions.h"
 
@@ -38,6 +45,10 @@
 #include <atomic>
 #include <thread>
 #include <algorithm> 
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 
 #pragma warning(push)
 #pragma warning(disable: 4201)  // nonstandard extension used : nameless struct/union
@@ -56,13 +67,6 @@ struct ReleaseBufferError
         : buffer(b), elemIdx(idx) {}
 };
 
-struct BinFull
-{
-    uint32 binIdx;
-    BinFull(uint32 idx) : binIdx(idx)
-    {}
-};
-
 enum class ElemState : byte
 {
     ElemInactive = 0,
@@ -71,6 +75,16 @@ enum class ElemState : byte
     ElemForgotten,
 };
 
+// Where the atoms of a Bin are. Spilling and Loading are taken by one
+// thread, the others only wait for them to end.
+enum class Residency : uint32
+{
+    InMemory = 0,
+    Spilling,       // being written to local disk, still readable
+    OnDisk,         // freed: read back before use
+    Loading,        // being read back
+};
+
 // tuple<idx, size, bool>
 #pragma pack(push)
 #pragma pack(1)
@@ -92,6 +106,16 @@ public:
 
     ElemState status() const      { return static_cast<ElemState>((qword & 0xFF00000000000000) >> (24 + 32)); }
     void status(ElemState value)  { qword = (qword & 0x00FFFFFFFFFFFFFF) | (uint64(value) << (24 + 32)); }
+
+    // false when the status was not 'expected' (anymore)
+    bool status(ElemState expected, ElemState value)
+    {
+        cuint64 before = qword;
+        if (static_cast<ElemState>(before >> (24 + 32)) != expected)
+            return (false);
+        cuint64 after = (before & 0x00FFFFFFFFFFFFFF) | (uint64(value) << (24 + 32));
+        return (InterlockedCompareExchange64(reinterpret_cast<volatile int64 *>(&qword), after, before) == static_cast<int64>(before));
+    }
 };
 
 #pragma pack(pop)
@@ -110,28 +134,141 @@ public:
     const ZT * end() const { return m_end; }
 };
 
+//   Where the next element of a Bin and its atoms go. Both are reserved
+//   together with one fetch_add on a single qword, so inserters never wait
+//   for each other, and elements in index order have their atoms in address
+//   order whatever the interleaving. A reservation that does not fit means
+//   the Bin is full: every later one starts further on and does not fit
+//   either, so the first failed element index becomes the limit. An element
+//   that would not fit an empty Bin is refused up front and leaves the
+//   cursor alone: it must not make the Bin full for everybody else.
+class AppendCursor
+{
+    std::atomic<uint64> s_next;     // elemIdx << 32 | atomIdx of the next reservation
+    std::atomic<uint32> s_limit;    // elements from here on do not fit
+
+    AppendCursor(const AppendCursor &);
+    void operator = (const AppendCursor &);
+
+    // 'elemIdx' did not fit: nothing from there on does. Never down to 0,
+    // an empty Bin takes whatever is not oversized().
+    void cap(uint32 limit, uint32 elemIdx)
+    {
+        while ((elemIdx > 0) && (elemIdx < limit) && !s_limit.compare_exchange_weak(limit, elemIdx))
+        {
+        }
+    }
+public:
+    // reservations overshoot the end of a full Bin before they stop:
+    // the atom half must not carry into the element half
+    static const uint64 MAX_ATOMS = 1ULL << 31;
+
+    explicit AppendCursor(uint32 maxElems)
+        : s_next(0ULL),
+        s_limit(maxElems)
+    {}
+
+    // elements reserved so far (the last ones may still be being written)
+    uint32 load() const
+    {
+        cuint32 next = static_cast<uint32>(s_next.load() >> 32);
+        cuint32 limit = s_limit.load();
+        return ((next < limit) ? next : limit);
+    }
+    operator uint32 () const { return (load()); }
+
+    // first free atom, when the Bin is not full
+    uint32 atoms() const { return (static_cast<uint32>(s_next.load())); }
+
+    // not re-entrant: while the Bin is built
+    void store(uint32 elems, uint32 atoms_ = 0)
+    {
+        s_next.store((uint64(elems) << 32) | atoms_);
+    }
+
+    // no Bin of 'maxAtoms' ever takes it
+    static bool oversized(uint32 atomSize, uint64 maxAtoms)
+    {
+        return (atomSize >= maxAtoms);
+    }
+
+    // false when the Bin is full, or when the element is oversized()
+    bool reserve(uint32 atomSize, uint64 maxAtoms, uint32 & elemIdx, uint32 & atomIdx)
+    {
+        if (oversized(atomSize, maxAtoms))
+            return (false);
+        uint32 limit = s_limit.load();
+        if (static_cast<uint32>(s_next.load() >> 32) >= limit)
+            return (false);
+
+        cuint64 prev = s_next.fetch_add((1ULL << 32) | atomSize);
+        elemIdx = static_cast<uint32>(prev >> 32);
+        atomIdx = static_cast<uint32>(prev);
+        if ((elemIdx < limit) && (uint64(atomIdx) + atomSize < maxAtoms))
+            return (true);
+
+        cap(limit, elemIdx);
+        return (false);
+    }
+
+    // As many of 'count' elements as fit, in one go: a batch never makes
+    // the Bin full for what comes after it. Only when not even the first
+    // one fits the Bin is full, unless that one is oversized().
+    uint32 reserve(const uint32 * atomSizes, uint32 count, uint64 maxAtoms, uint32 & elemIdx, uint32 & atomIdx)
+    {
+        if ((count == 0) || oversized(atomSizes[0], maxAtoms))
+            return (0);
+        uint64 next = s_next.load();
+        for (;;)
+        {
+            uint32 limit = s_limit.load();
+            elemIdx = static_cast<uint32>(next >> 32);
+            atomIdx = static_cast<uint32>(next);
+            if (elemIdx >= limit)
+                return (0);
+
+            uint32 fit = 0;
+            uint64 atomsEnd = atomIdx;
+            while ((fit < count) && (elemIdx + fit < limit) && (atomsEnd + atomSizes[fit] < maxAtoms))
+            {
+                atomsEnd += atomSizes[fit++];
+            }
+            if (fit == 0)
+            {
+                cap(limit, elemIdx);
+                return (0);
+            }
+            if (s_next.compare_exchange_weak(next, (uint64(elemIdx + fit) << 32) | static_cast<uint32>(atomsEnd)))
+                return (fit);
+        }
+    }
+};
+
 // s_  synchronized (depending on type)
 // x_  almost synchronized ('x' from approximate)
 // f_  fixed
 
-typedef std::vector<ElemInfo> ElemListType;
+typedef std::vector<ElemInfo, MemFusion::PageAllocation<ElemInfo>> ElemListType;
 
 template <typename ZT>
 struct BinCore
 {
-    std::atomic_uint_fast32_t s_nFreeElemIdx;
+    AppendCursor s_nFreeElemIdx;
     ElemListType s_vElems;
     ZT * f_pRaw;
 
+    // the last ElemInfo stays free
     BinCore(uint32 maxElems)
-        : s_vElems(maxElems) {}
+        : s_nFreeElemIdx(maxElems - 1),
+        s_vElems(maxElems) {}
 
     BinCore(BinCore && other)
-        : s_vElems(other.s_vElems),
+        : s_nFreeElemIdx(static_cast<uint32>(other.s_vElems.size()) - 1),
+        s_vElems(other.s_vElems),
         f_pRaw(other.f_pRaw)
     {
         other.f_pRaw = nullptr;
-        s_nFreeElemIdx.store(other.s_nFreeElemIdx);
+        s_nFreeElemIdx.store(other.s_nFreeElemIdx, other.s_nFreeElemIdx.atoms());
         other.s_nFreeElemIdx.store(0);
     }
 
@@ -151,6 +288,11 @@ public:
 
     static const int a_to_bytes = sizeof(ZT);
 
+    // TBD: from configuration
+    static const uint32 BLOCK_ELEMS = 4096;     // elements summarized together
+    static const uint32 MAX_COLUMNS = 16;
+    static const uint32 NO_ELEM = 0xFFFFFFFF;
+
     friend class Collection;
 
     static uint64 ComputeSize(uint32 maxElems, uint64 binsize)
@@ -168,100 +310,650 @@ private:
     std::atomic_uint_fast64_t x_nNumActive;
     std::atomic_uint_fast64_t x_nNumDeleted;
     uint32  f_binIdx;
+    uint32  f_numaNode;                         // preferred for atoms and columns
+    ZoneMap s_zoneMap;
+    std::unique_ptr<ZoneMap[]> s_blockZones;     // one per BLOCK_ELEMS elements
+    MemFusion::LF::spinlock s_columnsLock;      // column changes and updates in place, not inserts
+    Column * s_columns[MAX_COLUMNS];
+    std::atomic<uint32> s_numColumns;
+    std::atomic<PackedColumn*> s_packed[MAX_COLUMNS];   // sealed form of s_columns, or nullptr
+    bool s_unpackable[MAX_COLUMNS];             // Pack() refused it, under s_columnsLock
+    std::vector<PackedColumn*> s_retired;       // unsealed, under s_columnsLock
+    std::unique_ptr<ShapeCatalog> s_shapes;
+    std::unique_ptr<MemFusion::MappedFile> f_mapped;   // owns f_pRaw when set
+    uint64 s_touchedFrom;                       // atoms updated in place since TakeTouched(),
+    uint64 s_touchedTo;                         // under s_columnsLock
+    uint64 s_atomsVersion;                      // bumped by Refresh(), under s_columnsLock
+    MemFusion::LF::spinlock s_residencyLock;
+    std::atomic<Residency> s_residency;
+    uint32 s_pins;                              // under s_residencyLock
+    uint64 s_spilledVersion;                    // of the atoms on disk, under s_residencyLock
+    mutable std::mutex s_loadMutex;             // WaitResident() till Loaded()
+    mutable std::condition_variable s_loadCond;
+    std::atomic<uint64> x_lastScan;
+    std::atomic<bool> s_sealed;                 // takes no more elements
+    std::atomic<bool> s_compacting;             // being copied: no more updates in place
+    std::atomic<bool> s_packing;                // Seal() went through the columns: inserters Settle()
     // -----------------------------------------------------------------------
     // storage required *only* for members above....
 
     Bin(const Bin &);
     void operator = (const Bin &);
 
-    void ZeroMemory()
+    void InitZones()
     {
-        memset(f_pRaw, 0, f_binSizeBytes);
-        memset((void*) &s_vElems[0], 0, s_vElems.size()*sizeof(ElemInfo));
+        s_blockZones.reset(new ZoneMap[num_blocks(static_cast<uint32>(s_vElems.size()))]);
+        s_numColumns.store(0);
+        for (uint32 colIdx = 0; colIdx < MAX_COLUMNS; ++colIdx)
+        {
+            s_packed[colIdx].store(nullptr);
+            s_unpackable[colIdx] = false;
+        }
+        s_shapes.reset(new ShapeCatalog(static_cast<uint32>(s_vElems.size())));
+        s_touchedFrom = ~0ULL;
+        s_touchedTo = 0ULL;
+        s_atomsVersion = 0ULL;
+        s_residency.store(Residency::InMemory);
+        s_pins = 0;
+        s_spilledVersion = ~0ULL;
+        x_lastScan.store(0ULL);
+        s_sealed.store(false);
+        s_compacting.store(false);
+        s_packing.store(false);
     }
 
-    // this must be re-entrant
-    uint32 AcquireAtoms(cuint32 elemAtomSize_a)
+    // Before the element turns active, without s_columnsLock: zone maps and
+    // shapes are lock free, and each element has its own Column entries.
+    // Returns how many columns it filled: Settle() it once active.
+    uint32 Summarize(uint32 idx)
     {
-        auto copy_nFreeElemIdx = s_nFreeElemIdx++;
-        uint32 prevAtomLastIdx = 0;
+        const ElemInfo & elem = s_vElems[idx];
+        const ZT * begin = &f_pRaw[elem.atomIdx()];
+        const ZT * end = &f_pRaw[elem.atomIdx() + elem.atomSize()];
+        s_zoneMap.add(begin, end);
+        s_blockZones[idx / BLOCK_ELEMS].add(begin, end);
+        s_shapes->add(idx, begin, end);
+        // packed or dropped columns change under the lock only
+        cuint32 numColumns = s_packing.load() ? 0 : s_numColumns.load();
+        for (uint32 colIdx = 0; colIdx < numColumns; ++colIdx)
+        {
+            s_columns[colIdx]->fill(idx, begin, end);
+        }
+        return (numColumns);
+    }
+
+    // Active elements summarized with 'numColumns' columns: when AddColumn()
+    // or Seal() went through the columns meanwhile they may have missed
+    // them, so they are filled again under the lock. Either this sees what
+    // those did, or those see the elements active (both sides fence).
+    void Settle(const uint32 * elemIdxs, uint32 count, uint32 numColumns)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ((s_numColumns.load() == numColumns) && !s_packing.load())
+            return;
+
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+        for (uint32 idx = 0; idx < count; ++idx)
+        {
+            const ElemInfo & elem = s_vElems[elemIdxs[idx]];
+            FillColumns(elemIdxs[idx], &f_pRaw[elem.atomIdx()], &f_pRaw[elem.atomIdx() + elem.atomSize()]);
+        }
+    }
 
-        if (copy_nFreeElemIdx < s_vElems.size() - 1)
+    // under s_columnsLock
+    void FillColumns(uint32 idx, const ZT * begin, const ZT * end)
+    {
+        for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
         {
-            if (copy_nFreeElemIdx > 0)
+            s_columns[colIdx]->fill(idx, begin, end);
+            PackedColumn * packed = s_packed[colIdx].load();
+            if ((packed != nullptr) && !packed->fill(idx, begin, end))
             {
-                ElemInfo & prev = s_vElems[copy_nFreeElemIdx - 1];
-                if ((prev.atomIdx() == 0) && (prev.atomSize() == 0))
-                {
-                    uint32 iterations = 0;
-                    do {
-                        _mm_pause();
-                        if ((++iterations % 1000) == 0)
-                        {
-                            std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 11));
-                        }
-                    } while ((prev.atomIdx() == 0) && (prev.atomSize() == 0));
-                }
-                prevAtomLastIdx = prev.atomIdx() + prev.atomSize();
+                Unseal(colIdx);
             }
-            if (elemAtomSize_a + prevAtomLastIdx >= f_binSizeAtoms)
+            s_unpackable[colIdx] = false;
+        }
+    }
+
+    // Back to the Column, refilled before scans stop using the PackedColumn.
+    // Under s_columnsLock; the PackedColumn goes with the Bin.
+    void Unseal(uint32 colIdx)
+    {
+        Column * col = s_columns[colIdx];
+        if (col->dropped())
+        {
+            col->restore();
+            cuint32 numElems = s_nFreeElemIdx;
+            for (uint32 idx = 0; idx < numElems; ++idx)
             {
-                --s_nFreeElemIdx;
-                throw BinFull(f_binIdx);   // handled
+                const ElemInfo & elem = s_vElems[idx];
+                if (elem.status() == ElemState::ElemActive)
+                {
+                    col->fill(idx, &f_pRaw[elem.atomIdx()], &f_pRaw[elem.atomIdx() + elem.atomSize()]);
+                }
             }
-            return copy_nFreeElemIdx;
         }
-        else
+        s_retired.push_back(s_packed[colIdx].exchange(nullptr, std::memory_order_acq_rel));
+    }
+
+    void CheckSize() const
+    {
+        if (f_binSizeAtoms > AppendCursor::MAX_ATOMS)
+            throw EXCEPTION("Bin %u too big: %llu atoms", f_binIdx, f_binSizeAtoms);
+    }
+
+    // An element being acquired has its ElemInfo still all zero: elements
+    // are in atomIdx order but for those, and the one looked for is never
+    // one of them.
+    uint32 FindElem(cuint32 atomIdx) const
+    {
+        cuint32 numElems = s_nFreeElemIdx;
+        uint32 lo = 0;
+        uint32 hi = numElems;
+        while (lo < hi)
         {
-            --s_nFreeElemIdx;
-            throw BinFull(f_binIdx);   // handled
+            cuint32 mid = lo + (hi - lo) / 2;
+            uint32 probe = mid;
+            while ((probe > lo) && (uint64(s_vElems[probe]) == 0ULL))
+            {
+                --probe;
+            }
+            const ElemInfo & elem = s_vElems[probe];
+            if ((uint64(elem) == 0ULL) || (elem.atomIdx() < atomIdx))
+            {
+                lo = mid + 1;
+            }
+            else if (elem.atomIdx() > atomIdx)
+            {
+                hi = probe;
+            }
+            else {
+                return (probe);
+            }
         }
+        return (NO_ELEM);
     }
 
-    Bin(uint32 idx, uint64 binsize_, BinCore<ZT> && core)
-        : f_binIdx(idx),
+    Bin(uint32 idx, uint64 binsize_, BinCore<ZT> && core, uint32 node = MemFusion::ANY_NODE)
+        : x_nNumActive(0ULL),
+        x_nNumDeleted(0ULL),
+        f_binIdx(idx),
+        f_numaNode(node),
         f_binSizeBytes(binsize_),
         f_binSizeAtoms(binsize_ / a_to_bytes),
         base_type(std::move(core))
     {
+        CheckSize();
+        InitZones();
+
+        // deserialized: appends go after the last element written
+        cuint32 numElems = s_nFreeElemIdx;
+        uint32 atomsEnd = 0;
+        for (uint32 idx = numElems; idx > 0; --idx)
+        {
+            const ElemInfo & elem = s_vElems[idx - 1];
+            if (uint64(elem) != 0ULL)
+            {
+                atomsEnd = elem.atomIdx() + elem.atomSize();
+                break;
+            }
+        }
+        s_nFreeElemIdx.store(numElems, atomsEnd);
+
+        // deserialized: summarize what is already there
+        for (uint32 idx = 0; idx < s_nFreeElemIdx; ++idx)
+        {
+            if (s_vElems[idx].status() == ElemState::ElemActive)
+            {
+                Summarize(idx);
+            }
+        }
     }
 
 public:
     ~Bin()
     {
-        _aligned_free(f_pRaw);
+        for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
+        {
+            delete s_packed[colIdx].load();
+            delete s_columns[colIdx];
+        }
+        for (PackedColumn * packed : s_retired)
+        {
+            delete packed;
+        }
+        if (!f_mapped && (f_pRaw != nullptr))
+        {
+            MemFusion::PageAllocator::Free(f_pRaw, f_binSizeBytes);
+        }
     }
-    Bin(uint32 idx, uint32 maxElems, uint64 binsize_, ZT * pRaw)
-        : f_binIdx(idx),
+    Bin(uint32 idx, uint32 maxElems, uint64 binsize_, ZT * pRaw, uint32 node = MemFusion::ANY_NODE)
+        : x_nNumActive(0ULL),
+        x_nNumDeleted(0ULL),
+        f_binIdx(idx),
+        f_numaNode(node),
         f_binSizeBytes(binsize_),
         f_binSizeAtoms(binsize_ / a_to_bytes),
         BinCore(maxElems)
     {
 #pragma warning(suppress: 6387)
         f_pRaw = pRaw;
+        CheckSize();
+        InitZones();
     }
 
-    static ZT * AllocateBinRaw(uint64 binsize)
+    static ZT * AllocateBinRaw(uint64 binsize, uint32 node = MemFusion::ANY_NODE)
     {
-        return (static_cast<ZT*>(_aligned_malloc(binsize, sizeof(CACHE_LINE))));
+        // zeroed, on large pages when possible
+        return (static_cast<ZT*>(MemFusion::PageAllocator::Allocate(binsize, node)));
     }
 
-    Bin(uint32 idx, uint32 maxElems, uint64 binsize_)
-        : Bin(idx, maxElems, binsize_, AllocateBinRaw(binsize_))
+    Bin(uint32 idx, uint32 maxElems, uint64 binsize_, uint32 node = MemFusion::ANY_NODE)
+        : Bin(idx, maxElems, binsize_, AllocateBinRaw(binsize_, node), node)
     {
-        ZeroMemory();
     }
 
     uint32 binIdx() const { return f_binIdx; }
+    uint32 numaNode() const { return f_numaNode; }
     uint64 binByteSize() const  { return f_binSizeBytes;  }
     uint64 binSizeAtoms() const { return f_binSizeAtoms; }
+    const ZoneMap & zoneMap() const { return s_zoneMap; }
+    const ZoneMap & blockZone(uint32 blockIdx) const { return s_blockZones[blockIdx]; }
+    const ShapeCatalog & shapes() const { return *s_shapes; }
+
+    static uint32 num_blocks(uint32 numElems) { return ((numElems + BLOCK_ELEMS - 1) / BLOCK_ELEMS); }
+
+    // Keeps 'name' also by column: elements released from now on fill it,
+    // the ones already active are backfilled here. Queries see the column
+    // once it is complete.
+    void AddColumn(Z2name name)
+    {
+        uint32 snapshot;
+        Column * col = new Column(name, static_cast<uint32>(s_vElems.size()), f_numaNode);
+        {
+            std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+            for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
+            {
+                if (s_columns[colIdx]->GetName() == name)
+                {
+                    delete col;
+                    return;
+                }
+            }
+            if (s_numColumns.load() == MAX_COLUMNS)
+            {
+                delete col;
+                throw EXCEPTION("Too many columns in Bin %u", f_binIdx);
+            }
+            s_columns[s_numColumns.load()] = col;
+            ++s_numColumns;
+            // what turns active from here on Settle()s into it
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            snapshot = s_nFreeElemIdx;
+
+            // under the lock: an update in place refills its entry after or before
+            for (uint32 idx = 0; idx < snapshot; ++idx)
+            {
+                const ElemInfo & elem = s_vElems[idx];
+                if (elem.status() == ElemState::ElemActive)
+                {
+                    col->fill(idx, &f_pRaw[elem.atomIdx()], &f_pRaw[elem.atomIdx() + elem.atomSize()]);
+                }
+            }
+        }
+        col->publish();
+    }
+
+    // nullptr when 'name' is not kept by column (yet). Ask packed() first:
+    // when the Bin is sealed the Column may have no entries.
+    const Column * column(Z2name name) const
+    {
+        for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
+        {
+            if ((s_columns[colIdx]->GetName() == name) && s_columns[colIdx]->published())
+                return (s_columns[colIdx]);
+        }
+        return (nullptr);
+    }
+
+    // nullptr when the column of 'name' is not sealed
+    const PackedColumn * packed(Z2name name) const
+    {
+        for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
+        {
+            if ((s_columns[colIdx]->GetName() == name) && s_columns[colIdx]->published())
+                return (s_packed[colIdx].load(std::memory_order_acquire));
+        }
+        return (nullptr);
+    }
+
+    // Some column could be sealed, or coded again
+    bool Unsealed()
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+        for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
+        {
+            PackedColumn * packed = s_packed[colIdx].load();
+            if ((packed == nullptr) ? (!s_unpackable[colIdx] && s_columns[colIdx]->published()) : packed->stale())
+                return (true);
+        }
+        return (false);
+    }
+
+    // For a Bin taking no more elements: the promoted columns get their
+    // packed form, which scans use from now on, string ones coded by
+    // 'strings'. The atoms are left as they are. Returns how many did. Their entries are still there for the scans that
+    // started before: DropSealed() them once those are done.
+    // Packed strings of an old generation of codes get the current one.
+    uint32 Seal(StringDictionary * strings = nullptr)
+    {
+        uint32 ret = 0;
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+        s_packing.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cuint32 numElems = s_nFreeElemIdx;
+        for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
+        {
+            PackedColumn * stale = s_packed[colIdx].load();
+            if ((stale != nullptr) && stale->stale())
+            {
+                PackedColumn * recoded = stale->Recode();
+                if (recoded != nullptr)
+                {
+                    s_packed[colIdx].store(recoded, std::memory_order_release);
+                    s_retired.push_back(stale);
+                    ++ret;
+                }
+                continue;
+            }
+            if ((stale != nullptr) || s_unpackable[colIdx] || !s_columns[colIdx]->published())
+                continue;
+            PackedColumn * packed = PackedColumn::Pack(*s_columns[colIdx], numElems, f_numaNode, strings);
+            if (packed == nullptr)
+            {
+                s_unpackable[colIdx] = true;
+                continue;
+            }
+            s_packed[colIdx].store(packed, std::memory_order_release);
+            ++ret;
+        }
+        return (ret);
+    }
+
+    // bytes freed
+    uint64 DropSealed()
+    {
+        uint64 ret = 0ULL;
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+        for (uint32 colIdx = 0; colIdx < s_numColumns.load(); ++colIdx)
+        {
+            if (s_packed[colIdx].load() != nullptr)
+            {
+                ret += s_columns[colIdx]->drop();
+            }
+        }
+        return (ret);
+    }
 
     void DisableElem(uint32 idx)
     {
         s_vElems[idx].status(ElemState::ElemInactive);
     }
 
-    // this must be re-entrant
+    // O(1): scans skip it from now on, compaction drops it. False when it
+    // is not active (removed already, or still being inserted).
+    bool RemoveElem(uint32 idx)
+    {
+        if (!s_vElems[idx].status(ElemState::ElemActive, ElemState::ElemForgotten))
+            return (false);
+        --x_nNumActive;
+        ++x_nNumDeleted;
+        return (true);
+    }
+
+    // the root level atom 'name' of element 'idx', nullptr when it has none
+    Z2raw * FindField(uint32 idx, Z2name name)
+    {
+        const ElemInfo & elem = s_vElems[idx];
+        ZT * end = &f_pRaw[elem.atomIdx() + elem.atomSize()];
+        for (ZT * cur = &f_pRaw[elem.atomIdx()]; (cur < end) && !Z2::invalid(*cur); ++cur)
+        {
+            if ((cur->m128i_u32[0] == RootDocnum) && (Z2(*cur).z2name() == name))
+                return (cur);
+        }
+        return (nullptr);
+    }
+
+    // after atoms of element 'idx' changed in place: zone maps widen, the
+    // columns take the new values
+    void Refresh(uint32 idx)
+    {
+        const ElemInfo & elem = s_vElems[idx];
+        cuint64 from = elem.atomIdx();
+        cuint64 to = from + elem.atomSize();
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+        s_zoneMap.add(&f_pRaw[from], &f_pRaw[to]);
+        s_blockZones[idx / BLOCK_ELEMS].add(&f_pRaw[from], &f_pRaw[to]);
+        FillColumns(idx, &f_pRaw[from], &f_pRaw[to]);
+        s_touchedFrom = std::min(s_touchedFrom, from);
+        s_touchedTo = std::max(s_touchedTo, to);
+        ++s_atomsVersion;
+    }
+
+    // changes with every Refresh()
+    uint64 atomsVersion()
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+        return (s_atomsVersion);
+    }
+
+    // atoms [from, to) updated in place since the last call: false if none
+    bool TakeTouched(uint64 & from, uint64 & to)
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_columnsLock);
+        from = s_touchedFrom;
+        to = s_touchedTo;
+        s_touchedFrom = ~0ULL;
+        s_touchedTo = 0ULL;
+        return (from < to);
+    }
+
+    // Once no inserter can still be in it: it is not the last Bin, and
+    // nothing is pending after the epoch of the Collection turned.
+    void MarkSealed() { s_sealed.store(true); }
+    bool sealed() const { return (s_sealed.load()); }
+
+    // Set before the Bin is copied by Compact(), once the epoch of the
+    // Collection turned: what is written in place after that is lost, so
+    // updates go elsewhere.
+    void MarkCompacting() { s_compacting.store(true); }
+    bool compacting() const { return (s_compacting.load()); }
+
+    // The atoms stay in memory till Unpin(): what they were when pinned.
+    // The one getting OnDisk reads them back and calls Loaded(); the
+    // others WaitResident().
+    Residency Pin()
+    {
+        x_lastScan.store(static_cast<uint64>(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_residencyLock);
+        ++s_pins;
+        const Residency ret = s_residency.load();
+        if (ret == Residency::OnDisk)
+        {
+            s_residency.store(Residency::Loading);
+        }
+        return (ret);
+    }
+
+    // Pinned only when spilled, and left so: its file is not written
+    // again till Unpin(). For reading the file, not the atoms.
+    bool PinSpilled()
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_residencyLock);
+        if (s_residency.load() != Residency::OnDisk)
+            return (false);
+        ++s_pins;
+        return (true);
+    }
+
+    void Unpin()
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_residencyLock);
+        --s_pins;
+    }
+
+    Residency residency() const { return (s_residency.load(std::memory_order_acquire)); }
+    bool resident() const
+    {
+        const Residency now = residency();
+        return ((now == Residency::InMemory) || (now == Residency::Spilling));
+    }
+    uint64 lastScan() const { return (x_lastScan.load()); }
+
+    // Blocks while somebody reads the atoms back: false when that failed.
+    // For a pinned Bin.
+    bool WaitResident() const
+    {
+        std::unique_lock<std::mutex> lock(s_loadMutex);
+        s_loadCond.wait(lock, [this]() { return (residency() != Residency::Loading); });
+        return (resident());
+    }
+
+    // atoms up to the end of the last element
+    uint64 usedAtoms() const
+    {
+        cuint32 numElems = s_nFreeElemIdx;
+        for (uint32 idx = numElems; idx > 0; --idx)
+        {
+            const ElemInfo & elem = s_vElems[idx - 1];
+            if (uint64(elem) != 0ULL)
+                return (elem.atomIdx() + elem.atomSize());
+        }
+        return (0ULL);
+    }
+
+    // A sealed Bin in memory that nobody pinned can be spilled: true when
+    // its atoms go now, 'version' says which. 'written' when the file has
+    // them already, from a spill that lost to a query.
+    bool BeginSpill(uint64 & version, bool & written)
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_residencyLock);
+        if (f_mapped || !sealed() || (s_pins > 0) || (s_residency.load() != Residency::InMemory))
+            return (false);
+        {
+            std::lock_guard<MemFusion::LF::spinlock> columns(s_columnsLock);
+            version = s_atomsVersion;
+        }
+        written = (version == s_spilledVersion);
+        s_residency.store(Residency::Spilling);
+        return (true);
+    }
+
+    // After the atoms of 'version' are on disk: bytes freed, 0 when they
+    // were pinned or updated meanwhile.
+    uint64 EndSpill(uint64 version)
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_residencyLock);
+        s_spilledVersion = version;
+        uint64 current;
+        {
+            std::lock_guard<MemFusion::LF::spinlock> columns(s_columnsLock);
+            current = s_atomsVersion;
+        }
+        if ((s_pins > 0) || (current != version))
+        {
+            s_residency.store(Residency::InMemory);
+            return (0ULL);
+        }
+        MemFusion::PageAllocator::Free(f_pRaw, f_binSizeBytes);
+        f_pRaw = nullptr;
+        s_residency.store(Residency::OnDisk, std::memory_order_release);
+        return (f_binSizeBytes);
+    }
+
+    // writing failed: the atoms stay
+    void AbortSpill()
+    {
+        std::lock_guard<MemFusion::LF::spinlock> guard(s_residencyLock);
+        s_residency.store(Residency::InMemory);
+    }
+
+    // The atoms read back after Pin() said OnDisk: nullptr when that failed.
+    void Loaded(ZT * pRaw)
+    {
+        {
+            std::lock_guard<MemFusion::LF::spinlock> guard(s_residencyLock);
+            if (pRaw == nullptr)
+            {
+                s_residency.store(Residency::OnDisk);
+            }
+            else
+            {
+                f_pRaw = pRaw;
+                s_residency.store(Residency::InMemory, std::memory_order_release);
+            }
+        }
+        std::lock_guard<std::mutex> lock(s_loadMutex);
+        s_loadCond.notify_all();
+    }
+
+    uint64 numActive() const { return (x_nNumActive.load()); }
+    uint64 numDeleted() const { return (x_nNumDeleted.load()); }
+
+    // Elements still being inserted: their buffer is out, or their ElemInfo
+    // is not written yet.
+    bool HasPending() const
+    {
+        cuint32 numElems = s_nFreeElemIdx;
+        for (uint32 idx = 0; idx < numElems; ++idx)
+        {
+            const ElemInfo & elem = s_vElems[idx];
+            if ((uint64(elem) == 0ULL) || (elem.status() == ElemState::ElemAcquired))
+                return (true);
+        }
+        return (false);
+    }
+
+    // A Bin with the elements active in 'from', packed and sized to fit
+    // them: same binIdx and NUMA node, no room for more. 'moved' gets the
+    // elemIdx in 'from' of each element of the copy.
+    static Bin * Compact(const Bin & from, std::vector<uint32> & moved)
+    {
+        moved.clear();
+        uint64 atoms = 0;
+        cuint32 numElems = from.s_nFreeElemIdx;
+        for (uint32 idx = 0; idx < numElems; ++idx)
+        {
+            const ElemInfo & elem = from.s_vElems[idx];
+            if (elem.status() == ElemState::ElemActive)
+            {
+                moved.push_back(idx);
+                atoms += elem.atomSize();
+            }
+        }
+
+        // the last ElemInfo and the last atom stay free
+        cuint32 count = static_cast<uint32>(moved.size());
+        Bin * ret = new Bin(from.f_binIdx, count + 1, (atoms + 1) * a_to_bytes, from.f_numaNode);
+        uint32 atomIdx = 0;
+        for (uint32 idx = 0; idx < count; ++idx)
+        {
+            ElemInfo elem(from.s_vElems[moved[idx]]);
+            const ZT * src = &from.f_pRaw[elem.atomIdx()];
+            memcpy(&ret->f_pRaw[atomIdx], src, elem.atomSize() * a_to_bytes);
+            elem.atomIdx(atomIdx);
+            elem.status(ElemState::ElemAcquired);
+            ret->s_vElems[idx].set(elem);
+            ret->Summarize(idx);
+            ret->s_vElems[idx].status(ElemState::ElemActive);
+            atomIdx += elem.atomSize();
+        }
+        ret->s_nFreeElemIdx.store(count, atomIdx);
+        ret->x_nNumActive = count;
+        return (ret);
+    }
+
+    // this must be re-entrant; nullptr when the Bin is full
     void * AcquireBuffer(uint32 sizeBytes)
     {
         if ((sizeBytes % sizeof(ZT) != 0))
@@ -269,56 +961,116 @@ public:
             sizeBytes += sizeof(ZT) - (sizeBytes % sizeof(ZT));
         }
         cuint32 elemAtomSize_a = (sizeBytes / a_to_bytes) + ((sizeBytes % a_to_bytes) > 0 ? 1 : 0);
-        uint32 copy_nFreeElemIdx = AcquireAtoms(elemAtomSize_a);
+        uint32 elemIdx;
+        uint32 atomIdx;
+        if (!s_nFreeElemIdx.reserve(elemAtomSize_a, f_binSizeAtoms, elemIdx, atomIdx))
+            return (nullptr);
         ++x_nNumActive;
-        ElemInfo & elem = s_vElems[copy_nFreeElemIdx];
-        cuint32 atomIdx_a = (copy_nFreeElemIdx == 0) ? 0 :
-            (s_vElems[copy_nFreeElemIdx - 1].atomIdx() + s_vElems[copy_nFreeElemIdx - 1].atomSize());
-        elem.atomIdx(atomIdx_a);
+
+        // one store: readers see all of it or nothing
+        ElemInfo elem(0ULL);
+        elem.atomIdx(atomIdx);
         elem.atomSize(elemAtomSize_a);
         elem.status(ElemState::ElemAcquired);
-        void * ret = &f_pRaw[elem.atomIdx()];
-        return (ret);
+        s_vElems[elemIdx].set(elem);
+        return (&f_pRaw[atomIdx]);
     }
 
-    void ReleaseBuffer(const void * buffer)
+    // Batch of AcquireBuffer: as many as fit, their elemIdx in 'elemIdxs'.
+    uint32 AcquireBuffers(uint32 count, const uint32 * sizesBytes, void ** buffers, uint32 * elemIdxs)
     {
-        ElemInfo target(0ULL);
-        uint64 diff64bit = static_cast<const ZT*>(buffer) - f_pRaw;
-        target.atomIdx(static_cast<uint32>(diff64bit));
+        std::vector<uint32> atomSizes(count);
+        for (uint32 idx = 0; idx < count; ++idx)
+        {
+            atomSizes[idx] = (sizesBytes[idx] + a_to_bytes - 1) / a_to_bytes;
+        }
 
-        auto last = s_vElems.begin() + s_nFreeElemIdx;
-        while (last->atomSize() == 0)
+        uint32 elemIdx;
+        uint32 atomIdx;
+        cuint32 got = s_nFreeElemIdx.reserve(atomSizes.data(), count, f_binSizeAtoms, elemIdx, atomIdx);
+        x_nNumActive += got;
+        for (uint32 idx = 0; idx < got; ++idx)
         {
-            --last;
-            if (last == s_vElems.begin())
-                break;
+            ElemInfo elem(0ULL);
+            elem.atomIdx(atomIdx);
+            elem.atomSize(atomSizes[idx]);
+            elem.status(ElemState::ElemAcquired);
+            s_vElems[elemIdx + idx].set(elem);
+            buffers[idx] = &f_pRaw[atomIdx];
+            elemIdxs[idx] = elemIdx + idx;
+            atomIdx += atomSizes[idx];
         }
+        return (got);
+    }
 
-        auto ret = std::lower_bound<ElemListType::iterator, ElemInfo>
-            (s_vElems.begin(), last, target,
-            [](const ElemInfo & left, const ElemInfo & right) -> bool
+    // throws unless all of them are acquired and not released yet
+    void CheckAcquired(const uint32 * elemIdxs, uint32 count) const
+    {
+        cuint32 numElems = s_nFreeElemIdx;
+        for (uint32 idx = 0; idx < count; ++idx)
         {
-            return (left.atomIdx() < right.atomIdx());
-        });
+            cuint32 elemIdx = elemIdxs[idx];
+            if ((elemIdx >= numElems) || (s_vElems[elemIdx].status() != ElemState::ElemAcquired))
+                throw ReleaseBufferError(nullptr, elemIdx);  //handled
+        }
+    }
 
-        if (ret != s_vElems.end())
+    // Batch of ReleaseBuffer, by elemIdx: no search. All or none.
+    void ReleaseElems(const uint32 * elemIdxs, uint32 count)
+    {
+        CheckAcquired(elemIdxs, count);
+
+        uint32 numColumns = ~0U;
+        for (uint32 idx = 0; idx < count; ++idx)
         {
-            ElemInfo & elem = *ret;
-            void * check = &f_pRaw[elem.atomIdx()];
-            if (check != buffer)
-                throw ReleaseBufferError(buffer, elem.atomIdx());  //handled
-            elem.status(ElemState::ElemActive);
+            numColumns = std::min(numColumns, Summarize(elemIdxs[idx]));
+            s_vElems[elemIdxs[idx]].status(ElemState::ElemActive);
         }
-        else {
+        Settle(elemIdxs, count, numColumns);
+    }
+
+    // returns the elemIdx of 'buffer'
+    uint32 ReleaseBuffer(const void * buffer)
+    {
+        uint64 diff64bit = static_cast<const ZT*>(buffer) - f_pRaw;
+        cuint32 elemIdx = FindElem(static_cast<uint32>(diff64bit));
+        if (elemIdx == NO_ELEM)
             throw ReleaseBufferError(buffer, 0xFFFFFFFF);  //handled
-        }
+
+        // inserters do not wait for each other
+        cuint32 numColumns = Summarize(elemIdx);
+        s_vElems[elemIdx].status(ElemState::ElemActive);
+        Settle(&elemIdx, 1, numColumns);
+        return (elemIdx);
+    }
+
+    // the elemIdx of 'buffer', acquired and not released yet
+    uint32 AcquiredElem(const void * buffer) const
+    {
+        uint64 diff64bit = static_cast<const ZT*>(buffer) - f_pRaw;
+        cuint32 elemIdx = FindElem(static_cast<uint32>(diff64bit));
+        if (elemIdx == NO_ELEM)
+            throw ReleaseBufferError(buffer, 0xFFFFFFFF);  //handled
+        CheckAcquired(&elemIdx, 1);
+        return (elemIdx);
+    }
+
+    // An acquired element that is not to be released: never active, its
+    // memory goes back when the Bin is compacted
+    bool DiscardElem(uint32 idx)
+    {
+        if (!s_vElems[idx].status(ElemState::ElemAcquired, ElemState::ElemForgotten))
+            return (false);
+        --x_nNumActive;
+        ++x_nNumDeleted;
+        return (true);
     }
 
     bool contains(const void * buffer) const
     {
+        // a spilled Bin has no atoms, and takes no inserts
         const ZT * ptr = static_cast<const ZT*>(buffer);
-        return ((ptr >= f_pRaw) && (ptr < &f_pRaw[f_binSizeAtoms]));
+        return ((f_pRaw != nullptr) && (ptr >= f_pRaw) && (ptr < &f_pRaw[f_binSizeAtoms]));
     }
 
     // -------------------------------------------------------
@@ -0,0 +1,71 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include "MemFusion/types.h"
+
+// AVX-512 intrinsics are available from VS2017 15.3 on.
+#if !defined(MF_AVX512_INTRINSICS) && defined(_MSC_VER) && (_MSC_VER >= 1911)
+#define MF_AVX512_INTRINSICS 1
+#endif
+
+namespace MemFusion
+{
+
+enum SimdLevel
+{
+    SimdSSE42 = 0,
+    SimdAVX2 = 1,
+    SimdAVX512 = 2,
+};
+
+// Detects once (at QueryEngine startup) the widest SIMD level both the CPU
+// and the OS support. Scan kernels read Level() and never re-check cpuid.
+class CpuFeatures
+{
+    static SimdLevel s_level;
+
+    CpuFeatures();
+public:
+    static SimdLevel Detect();
+
+    // 'maxLevel' lets configuration (or a test) cap the detected level.
+    static void Initialize(SimdLevel maxLevel = SimdAVX512);
+
+    static SimdLevel Level()
+    {
+        return (s_level);
+    }
+
+    static bool Supports(SimdLevel level);
+
+    static const char * Name(SimdLevel level);
+};
+
+}
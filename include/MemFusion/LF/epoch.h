@@ -0,0 +1,173 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "MemFusion/types.h"
+#include "MemFusion/Cache.h"
+
+namespace MemFusion
+{
+namespace LF
+{
+
+#pragma warning(push)
+#pragma warning(disable: 4324)  // structure was padded due to __declspec(align())
+
+//   Epoch based reclamation.
+//
+//   Readers enter() before loading shared pointers and leave() when done
+//   with what they point to. A writer that unlinked something calls
+//   synchronize() before freeing it: it returns once every reader that
+//   could still see it has left. Readers never wait for writers; with
+//   all the slots taken they block till a reader leaves.
+class epoch
+{
+public:
+    // TBD: from configuration
+    static const uint32 NUM_SLOTS = 128;    // readers at the same time
+
+private:
+    struct CACHE_ALIGN slot
+    {
+        std::atomic<uint64> s_entered;      // epoch at enter(), 0 when free
+    };
+    slot slots[NUM_SLOTS];
+    CACHE_ALIGN std::atomic<uint64> s_current;
+
+    // readers that found no free slot, and where they wait for one
+    CACHE_ALIGN std::atomic<uint32> s_waiters;
+    std::mutex m_waitMutex;
+    std::condition_variable m_waitCond;
+
+    bool try_enter(uint32 start, uint32 & slotIdx)
+    {
+        for (uint32 probe = 0; probe < NUM_SLOTS; ++probe)
+        {
+            slotIdx = (start + probe) % NUM_SLOTS;
+            uint64 expected = 0ULL;
+            if ((slots[slotIdx].s_entered.load(std::memory_order_relaxed) == 0ULL) &&
+                slots[slotIdx].s_entered.compare_exchange_strong(expected, s_current.load()))
+            {
+                return (true);
+            }
+        }
+        return (false);
+    }
+
+    epoch(const epoch &);
+    void operator = (const epoch &);
+public:
+    epoch()
+        : s_current(1ULL),
+        s_waiters(0)
+    {
+        for (auto & one : slots)
+        {
+            one.s_entered.store(0ULL);
+        }
+    }
+
+    // a slot index, for leave()
+    uint32 enter()
+    {
+        cuint32 start = static_cast<uint32>(std::hash<std::thread::id>()(std::this_thread::get_id()) % NUM_SLOTS);
+        uint32 slotIdx = 0;
+        if (try_enter(start, slotIdx))
+            return (slotIdx);
+
+        // counted before looking again: a leave() from now on sees it
+        std::unique_lock<std::mutex> lock(m_waitMutex);
+        ++s_waiters;
+        while (!try_enter(start, slotIdx))
+        {
+            m_waitCond.wait(lock);
+        }
+        --s_waiters;
+        return (slotIdx);
+    }
+
+    void leave(uint32 slotIdx)
+    {
+        slots[slotIdx].s_entered.store(0ULL);
+        if (s_waiters.load() != 0)
+        {
+            std::lock_guard<std::mutex> guard(m_waitMutex);
+            m_waitCond.notify_one();
+        }
+    }
+
+    // What was unlinked before this call is not reachable any more when
+    // it returns. Must not be called while entered.
+    void synchronize()
+    {
+        // readers entering from now on load the new pointers
+        cuint64 retired = s_current++;
+        for (auto & one : slots)
+        {
+            for (;;)
+            {
+                cuint64 entered = one.s_entered.load();
+                if ((entered == 0ULL) || (entered > retired))
+                    break;
+                std::this_thread::yield();
+            }
+        }
+    }
+};
+
+class epoch_guard
+{
+    epoch & m_epoch;
+    cuint32 m_slotIdx;
+
+    epoch_guard(const epoch_guard &);
+    void operator = (const epoch_guard &);
+public:
+    explicit epoch_guard(epoch & e)
+        : m_epoch(e),
+        m_slotIdx(e.enter())
+    {}
+
+    ~epoch_guard()
+    {
+        m_epoch.leave(m_slotIdx);
+    }
+};
+
+#pragma warning(pop)
+
+}
+
+}
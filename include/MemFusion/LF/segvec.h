@@ -0,0 +1,234 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <iterator>
+#include <algorithm>
+#include <intrin.h>
+#include "MemFusion/types.h"
+#include "MemFusion/Cache.h"
+#include "MemFusion/Exceptions.h"
+
+namespace MemFusion
+{
+namespace LF
+{
+
+#pragma warning(push)
+#pragma warning(disable: 4324)  // structure was padded due to __declspec(align())
+
+//   Append-only vector with no fixed capacity.
+//
+//   Elements live in segments of FIRST_SEGMENT, 2*FIRST_SEGMENT, 4*FIRST_SEGMENT...
+//   slots, allocated when first needed and never moved nor freed before the
+//   segvec is: growing never copies what is there.
+//   Readers never block and see every element below size(). Writers reserve
+//   a slot, fill it, and then publish it after the slots before it. A slot
+//   can be replace()d: readers see either the old or the new value.
+template <typename T>
+class segvec
+{
+public:
+    static cuint32 FIRST_SEGMENT_BITS = 6;
+    static cuint32 FIRST_SEGMENT = 1 << FIRST_SEGMENT_BITS;
+    static cuint32 MAX_SEGMENTS = 32 - FIRST_SEGMENT_BITS;
+    static cuint32 MAX_SIZE = 0xFFFFFFFF - FIRST_SEGMENT + 1;  // sum of all segments
+
+private:
+    std::atomic<std::atomic<T>*> s_segments[MAX_SEGMENTS];
+    CACHE_ALIGN std::atomic<uint32> s_reserved;
+    CACHE_ALIGN std::atomic<uint32> s_size;
+
+    segvec(const segvec &);
+    void operator = (const segvec &);
+
+    static uint32 segment_size(uint32 segIdx)
+    {
+        return (FIRST_SEGMENT << segIdx);
+    }
+
+    // segment k starts at FIRST_SEGMENT * (2^k - 1)
+    static void locate(uint32 idx, uint32 & segIdx, uint32 & offset)
+    {
+        unsigned long bit;
+        _BitScanReverse(&bit, (idx >> FIRST_SEGMENT_BITS) + 1);
+        segIdx = bit;
+        offset = idx - ((segment_size(segIdx) - FIRST_SEGMENT));
+    }
+
+    std::atomic<T> * segment(uint32 segIdx)
+    {
+        std::atomic<T> * ret = s_segments[segIdx].load(std::memory_order_acquire);
+        if (ret == nullptr)
+        {
+            // two writers may race for it: the loser frees its own
+            cuint32 num = segment_size(segIdx);
+            std::atomic<T> * fresh = new std::atomic<T>[num];
+            for (uint32 idx = 0; idx < num; ++idx)
+            {
+                fresh[idx].store(T());
+            }
+            if (s_segments[segIdx].compare_exchange_strong(ret, fresh))
+            {
+                ret = fresh;
+            }
+            else {
+                delete [] fresh;
+            }
+        }
+        return (ret);
+    }
+
+public:
+    class const_iterator
+    {
+        const segvec * vec;
+        uint32 idx;
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const T * pointer;
+        typedef T reference;
+
+        const_iterator(const segvec * vec_, uint32 idx_) : vec(vec_), idx(idx_) {}
+
+        T operator * () const { return (vec->at(idx)); }
+        const_iterator & operator ++ () { ++idx; return (*this); }
+        const_iterator operator ++ (int) { const_iterator ret(*this); ++idx; return (ret); }
+        bool operator == (const const_iterator & other) const { return (idx == other.idx); }
+        bool operator != (const const_iterator & other) const { return (idx != other.idx); }
+    };
+
+    segvec()
+        : s_reserved(0),
+        s_size(0)
+    {
+        for (auto & seg : s_segments)
+        {
+            seg.store(nullptr);
+        }
+    }
+
+    ~segvec()
+    {
+        for (auto & seg : s_segments)
+        {
+            delete [] seg.load();
+        }
+    }
+
+    uint32 size() const { return (s_size.load(std::memory_order_acquire)); }
+
+    uint32 add(T val)
+    {
+        cuint32 idx = s_reserved++;
+        if (idx >= MAX_SIZE)
+            throw EXCEPTION("segvec full exception. this 0x%x, idx %u", this, idx);
+
+        uint32 segIdx, offset;
+        locate(idx, segIdx, offset);
+        segment(segIdx)[offset].store(val);
+
+        // in order: a writer that got here first waits for the slots before it
+        uint32 expected = idx;
+        while (!s_size.compare_exchange_weak(expected, idx + 1, std::memory_order_release))
+        {
+            expected = idx;
+            std::this_thread::yield();
+        }
+        return (idx);
+    }
+
+    T at(uint32 idx) const
+    {
+        uint32 segIdx, offset;
+        locate(idx, segIdx, offset);
+        return (s_segments[segIdx].load(std::memory_order_acquire)[offset].load());
+    }
+
+    // the previous value: whoever reads the slot from now on gets 'val'
+    T replace(uint32 idx, T val)
+    {
+        if (idx >= size())
+            throw EXCEPTION("segvec out-of-bound exception. this 0x%x, size %u, idx %u", this, size(), idx);
+        uint32 segIdx, offset;
+        locate(idx, segIdx, offset);
+        return (s_segments[segIdx].load(std::memory_order_acquire)[offset].exchange(val));
+    }
+
+    T operator [] (uint32 idx) const
+    {
+        if (idx < size())
+        {
+            return (at(idx));
+        }
+        throw EXCEPTION("segvec out-of-bound exception. this 0x%x, size %u, idx %u", this, size(), idx);
+    }
+
+    T back() const
+    {
+        cuint32 num = size();
+        if (num > 0)
+            return (at(num - 1));
+        throw EXCEPTION("segvec out-of-bound exception. this 0x%x, back() called on empty segvec", this);
+    }
+
+    // iterates over the elements there when end() is called
+    const_iterator begin() const { return (const_iterator(this, 0)); }
+    const_iterator end() const { return (const_iterator(this, size())); }
+
+    // copy of the elements there now: it does not change when the segvec grows
+    std::vector<T> snapshot() const
+    {
+        cuint32 num = size();
+        std::vector<T> ret;
+        ret.reserve(num);
+        for (uint32 segIdx = 0; ret.size() < num; ++segIdx)
+        {
+            const std::atomic<T> * seg = s_segments[segIdx].load(std::memory_order_acquire);
+            cuint32 take = std::min(segment_size(segIdx), num - static_cast<uint32>(ret.size()));
+            for (uint32 idx = 0; idx < take; ++idx)
+            {
+                ret.push_back(seg[idx].load());
+            }
+        }
+        return (ret);
+    }
+};
+
+#pragma warning(pop)
+
+}
+
+}
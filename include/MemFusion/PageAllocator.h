@@ -0,0 +1,154 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include <atomic>
+#include <limits>
+#include <new>
+#include <utility>
+#include <cstddef>
+
+#include "MemFusion/types.h"
+#include "MemFusion/Platform/Numa.h"
+
+namespace MemFusion
+{
+
+enum PageSize : uint32
+{
+    PageSmall = 0,      // 4KB
+    PageLarge = 1,      // 2MB
+    PageHuge = 2,       // 1GB
+    NumPageSizes = 3,
+};
+
+// Bytes obtained so far with each page size, and how many times large
+// pages were asked for and not obtained.
+struct PageMetrics
+{
+    uint64 bytes[NumPageSizes];
+    uint64 fallbacks;
+};
+
+//   Allocation of big scanned areas (Bin atoms, ElemInfo, Columns, Stage1
+//   slots): from 1GB or 2MB pages when the process may lock memory and the
+//   area is at least that big, from normal pages otherwise or when the OS
+//   has no contiguous physical memory left. Areas below MIN_PAGED_BYTES
+//   come from the heap. Memory comes back zeroed, and is freed with the
+//   size it was allocated with. Paged areas can prefer a NUMA node.
+class PageAllocator
+{
+public:
+    static const uint64 MIN_PAGED_BYTES = 2 * 1024 * 1024;
+
+private:
+    static uint64 s_largePageSize;          // 0: no large pages
+    static bool s_hugePages;
+    static std::atomic<uint64> s_bytes[NumPageSizes];
+    static std::atomic<uint64> s_fallbacks;
+
+    PageAllocator();
+public:
+    // Enables large (and up to 'maxSize') pages, if the OS lets us.
+    static void Initialize(PageSize maxSize = PageLarge);
+
+    static void * Allocate(uint64 bytes, PageSize & obtained, uint32 node = ANY_NODE);
+    static void * Allocate(uint64 bytes, uint32 node = ANY_NODE)
+    {
+        PageSize obtained;
+        return (Allocate(bytes, obtained, node));
+    }
+    static void Free(void * ptr, uint64 bytes);
+
+    // Faults in every page now, rather than at first use. For memory
+    // allocated ahead of time.
+    static void Prefault(void * ptr, uint64 bytes);
+
+    static PageSize Largest();
+    static PageMetrics GetMetrics();
+    static const char * Name(PageSize size);
+};
+
+// std allocator on top of PageAllocator
+template <typename T>
+class PageAllocation
+{
+public:
+    typedef T value_type;
+    typedef T * pointer;
+    typedef const T * const_pointer;
+    typedef T & reference;
+    typedef const T & const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef PageAllocation<U> other;
+    };
+
+    PageAllocation() {}
+    template <typename U>
+    PageAllocation(const PageAllocation<U> &) {}
+
+    T * allocate(size_t n)
+    {
+        return (static_cast<T*>(PageAllocator::Allocate(n * sizeof(T))));
+    }
+
+    void deallocate(T * ptr, size_t n)
+    {
+        PageAllocator::Free(ptr, n * sizeof(T));
+    }
+
+    template <typename U, typename... Args>
+    void construct(U * ptr, Args &&... args)
+    {
+        ::new ((void*) ptr) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U * ptr)
+    {
+        ptr->~U();
+    }
+
+    size_t max_size() const
+    {
+        return ((std::numeric_limits<size_t>::max)() / sizeof(T));
+    }
+
+    template <typename U>
+    bool operator == (const PageAllocation<U> &) const { return (true); }
+    template <typename U>
+    bool operator != (const PageAllocation<U> &) const { return (false); }
+};
+
+}
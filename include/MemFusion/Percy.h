@@ -45,6 +45,7 @@ public:
     {
         LocalFileSystem = 1,
         CloudFileSystem = 2,
+        MappedFileSystem = 3,   // Bins live in memory mapped files, no Percy stream
     };
 
     template <typename T>
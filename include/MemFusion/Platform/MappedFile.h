@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#pragma once
+
+#include "MemFusion/types.h"
+#include "FileSystem.h"
+#include "Numa.h"
+
+namespace MemFusion
+{
+
+//   A file mapped whole in memory, read/write. Pages are brought in and
+//   written back by the OS: Flush() only starts writing back a dirty range,
+//   Sync() waits for everything written so far to reach the disk.
+class MappedFile
+{
+    Path     m_path;
+    void *   m_file;
+    void *   m_mapping;
+    byte *   m_view;
+    uint64   m_size;
+    uint32   m_node;
+
+    MappedFile(const MappedFile &);
+    void operator = (const MappedFile &);
+
+    void Map(bool create);
+public:
+    // a new file of 'size' bytes, all zero (an existing one is overwritten);
+    // its pages are brought in on 'node' when possible
+    MappedFile(Path path, uint64 size, uint32 node = ANY_NODE);
+    // an existing file, all of it
+    explicit MappedFile(Path path, uint32 node = ANY_NODE);
+    ~MappedFile();
+
+    byte * data() const { return (m_view); }
+    uint64 size() const { return (m_size); }
+
+    // page granularity is taken care of
+    void Flush(uint64 offset, uint64 bytes);
+    void Sync();
+
+    static uint32 PageSize();
+};
+
+}
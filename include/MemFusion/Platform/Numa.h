@@ -0,0 +1,86 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+
+#pragma once
+
+#include <vector>
+
+#include "MemFusion/types.h"
+
+namespace MemFusion
+{
+
+// no preferred node: the OS places memory where it is first touched
+static const uint32 ANY_NODE = 0xFFFFFFFF;
+
+//   The NUMA nodes that have processors, detected once at QueryEngine
+//   startup. Bins and workers are spread over them by ordinal: Bin n and
+//   worker n go to Node(n). With a single node nothing is preferred or
+//   pinned, and everything behaves as before.
+class Numa
+{
+    static std::vector<uint32> s_nodes;
+
+    Numa();
+public:
+    static void Initialize();
+
+    static uint32 NumNodes()
+    {
+        return (s_nodes.empty() ? 1 : static_cast<uint32>(s_nodes.size()));
+    }
+
+    // round robin over the nodes, ANY_NODE on single node machines
+    static uint32 Node(uint32 ordinal)
+    {
+        if (s_nodes.size() < 2)
+            return (ANY_NODE);
+        return (s_nodes[ordinal % s_nodes.size()]);
+    }
+
+    // inverse of Node(): 0 for ANY_NODE
+    static uint32 Ordinal(uint32 node);
+};
+
+//   Keeps the calling thread on the processors of 'node' while in scope,
+//   then gives it back its previous affinity (workers are pool threads).
+class NumaPin
+{
+    bool   m_pinned;
+    uint64 m_prevMask;
+    uint32 m_prevGroup;
+
+    NumaPin(const NumaPin &);
+    void operator = (const NumaPin &);
+public:
+    explicit NumaPin(uint32 node);
+    ~NumaPin();
+};
+
+}
@@ -65,6 +65,17 @@ public:
         queue_.pop();
     }
 
+    // does not wait: false when empty
+    bool try_dequeue(T & item)
+    {
+        std::unique_lock<std::mutex> mlock(mutex_);
+        if (queue_.empty())
+            return (false);
+        item = queue_.front();
+        queue_.pop();
+        return (true);
+    }
+
     size_t size()
     {
         std::unique_lock<std::mutex> mlock(mutex_);
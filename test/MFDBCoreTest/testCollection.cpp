@@ -32,6 +32,10 @@
 #include <thread>
 #include <ppl.h>
 #include <numeric>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <string>
 
 typedef unsigned int uint;
 
@@ -535,3 +539,1551 @@ void Test_FilterValue(bool serialize = false)
 }
 
 
+
+// Small collection with a few fixed root fields per document:
+//   _id: i,  101: i % 100,  102: i % 7,  103: i * 0.5
+void Write_Mixed_Docs(Collection & coll, uint32 from, uint32 to)
+{
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    for (uint32 i = from; i < to; ++i)
+    {
+        double half = i * 0.5;
+        __m128i doc[4] =
+        {
+            Z2(tint, MFDB::Constants::Id_1, i),
+            Z2(tint, 101, i % 100),
+            Z2(tint, 102, i % 7),
+            Z2(tfloat, 103, *(uint64*) &half),
+        };
+        Slow_Write_to_Collection(coll, doc, sizeof(doc));
+    }
+}
+
+Collection & Make_Mixed_Collection(const char * name, uint32 numDocs)
+{
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg(name, 20 * 1000, 4 * 1024 * 1024, 10),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Write_Mixed_Docs(coll, 0, numDocs);
+    return (coll);
+}
+
+LFTraw Make_LFT(uint32 idx, QO qo, Z2raw z2)
+{
+    LFTraw lft;
+    lft.idx = idx;
+    lft.qo = qo;
+    lft.pad = 0;
+    lft.z2raw = z2;
+    return (lft);
+}
+
+// returns the number of documents, output goes to 'out'
+uint64 Run_Find(Collection & coll, const Z2FindQuery & query, std::vector<byte> & out)
+{
+    out.assign(Collection::MAX_DOCUMENT_SIZE, 0);
+    Buffer buffer(&out[0], (uint32) out.size());
+    uint32 numz2 = coll.FindAndReturnAll(1234, buffer, &query);
+    out.resize((numz2 + 1) * sizeof(Z2raw));
+    return (reinterpret_cast<Z2*>(&out[0])->z2value());
+}
+
+// Whole compactor passes till 'done', at most 'passes' of them: whether it is
+template <typename Done>
+bool Wait_For_Compactor(Collection & coll, Done done, uint32 passes = 10)
+{
+    for (uint32 pass = 0; !done() && (pass < passes); ++pass)
+    {
+        coll.WaitForCompactor();
+    }
+    return (done());
+}
+
+// The same mixed documents, 999 per Bin, in 'coll' and in 'ref': 'ref'
+// gets no index and no budget, it is what 'coll' is compared with
+struct MixedPair
+{
+    Collection & coll;
+    Collection & ref;
+};
+
+MixedPair Make_Mixed_Pair(const std::string & name, uint32 numDocs, MemoryBudget * budget = nullptr)
+{
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg(name, 1000, 256 * 1024, 0, 1, budget),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Collection & ref = *Collection::Instantiate(CollectionIntrinsicCfg(name + "ref", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Write_Mixed_Docs(coll, 0, numDocs);
+    Write_Mixed_Docs(ref, 0, numDocs);
+    MixedPair pair = { coll, ref };
+    return (pair);
+}
+
+// Same output from both; 'lookup': 'coll' looked an index up for it.
+// Returns the number of documents.
+uint64 Check_Index(const char * when, MixedPair & pair, const Z2FindQuery & query, bool lookup)
+{
+    std::vector<byte> out1, out2;
+    cuint64 lookups = pair.coll.GetIndexLookups();
+    cuint64 docs1 = Run_Find(pair.coll, query, out1);
+    cuint64 docs2 = Run_Find(pair.ref, query, out2);
+    if ((docs1 != docs2) || (out1 != out2))
+    {
+        printf("%s: %llu docs, %llu scanned\n", when, docs1, docs2);
+        throw std::exception("test index: different output.");
+    }
+    if ((pair.coll.GetIndexLookups() != lookups) != lookup)
+    {
+        printf("%s: index %s\n", when, lookup ? "not looked up" : "looked up");
+        throw std::exception("test index: wrong plan.");
+    }
+    return (docs1);
+}
+
+void Test_FusedScan()
+{
+    printf("\nTest: fused scan\n");
+
+    cuint32 NUM_DOCS = 50 * 1000;
+    Collection & coll = Make_Mixed_Collection("fused", NUM_DOCS);
+
+    // (103 >= 100.0) AND ((101 < 10) OR (102 == 3))
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    double hundred = 100.0;
+    std::vector<LFTraw> lfts;
+    lfts.push_back(Make_LFT(0, QO::GTE, Z2(tfloat, 103, *(uint64*) &hundred)));
+    lfts.push_back(Make_LFT(1, QO::LT, Z2(tint, 101, 10)));
+    lfts.push_back(Make_LFT(2, QO::EQ, Z2(tint, 102, 3)));
+
+    QPraw start = { QO::START, 0 };
+    QPraw qpor = { QO::OR, 2 };
+    QPraw qpnor = { QO::NOR, 2 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw end = { QO::END, 0 };
+
+    // same LFTs, then (103 >= 100.0) AND NOT ((101 < 10) OR (102 == 3))
+    for (bool negate : { false, true })
+    {
+        std::vector<QPraw> qps = { start, negate ? qpnor : qpor, qpand, end };
+
+        uint64 expected = 0;
+        for (uint32 i = 0; i < NUM_DOCS; ++i)
+        {
+            if ((i * 0.5 >= 100.0) && ((((i % 100) < 10) || ((i % 7) == 3)) != negate))
+                ++expected;
+        }
+
+        Z2FindQuery perLFT(lfts, qps, Z2FindQuery::ScanMode::ScanPerLFT);
+        Z2FindQuery fused(lfts, qps, Z2FindQuery::ScanMode::ScanFused);
+        if (perLFT.IsFused() || !fused.IsFused())
+            throw std::exception("test fused scan: wrong scan mode.");
+
+        std::vector<byte> out1, out2;
+        uint64 docs1 = Run_Find(coll, perLFT, out1);
+        uint64 docs2 = Run_Find(coll, fused, out2);
+
+        printf("%s: expected %llu docs, per LFT %llu, fused %llu\n", negate ? "NOR" : "OR", expected, docs1, docs2);
+        if ((docs1 != expected) || (docs2 != expected))
+            throw std::exception("test fused scan: wrong number of documents.");
+        if (out1 != out2)
+            throw std::exception("test fused scan: different output.");
+    }
+}
+
+void Test_ZoneMap()
+{
+    printf("\nTest: zone maps\n");
+
+    // 19999 documents per Bin, _id is insertion ordered
+    cuint32 NUM_DOCS = 60 * 1000;
+    Collection & coll = Make_Mixed_Collection("zonemap", NUM_DOCS);
+    cuint32 numBins = coll.GetNumBins();
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    double ten = 10.0;
+
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw end = { QO::END, 0 };
+
+    struct ZoneCase
+    {
+        const char * name;
+        std::vector<LFTraw> lfts;
+        uint64 expectedDocs;
+        uint64 expectedSkipped;
+    };
+    std::vector<ZoneCase> cases =
+    {
+        // Bins 0 and 1 end below 50000
+        { "_id >= 50000", { Make_LFT(0, QO::GTE, Z2(tint, MFDB::Constants::Id_1, 50000)) }, NUM_DOCS - 50000, 2 },
+        // only Bin 0
+        { "103 < 10.0", { Make_LFT(0, QO::LT, Z2(tfloat, 103, *(uint64*) &ten)) }, 20, numBins - 1 },
+        // no such name anywhere
+        { "104 == 1", { Make_LFT(0, QO::EQ, Z2(tint, 104, 1)) }, 0, numBins },
+        // fused: one chore per Bin
+        { "_id >= 50000 AND 101 < 10",
+            { Make_LFT(0, QO::GTE, Z2(tint, MFDB::Constants::Id_1, 50000)), Make_LFT(1, QO::LT, Z2(tint, 101, 10)) },
+            (NUM_DOCS - 50000) / 10, 2 },
+    };
+
+    for (const ZoneCase & zc : cases)
+    {
+        std::vector<QPraw> qps = { start, end };
+        if (zc.lfts.size() > 1)
+        {
+            qps = { start, qpand, end };
+        }
+        Z2FindQuery query(zc.lfts, qps);
+
+        std::vector<byte> out;
+        uint64 docs = Run_Find(coll, query, out);
+        QueryMetrics metrics = coll.GetLastQueryCounters();
+
+        printf("%s: %llu docs (expected %llu), %llu chores skipped (expected %llu)\n",
+            zc.name, docs, zc.expectedDocs, metrics.choresSkipped, zc.expectedSkipped);
+        if (docs != zc.expectedDocs)
+            throw std::exception("test zone map: wrong number of documents.");
+        if (metrics.choresSkipped != zc.expectedSkipped)
+            throw std::exception("test zone map: wrong number of skipped chores.");
+    }
+
+    // inserters widen one ZoneMap together, without a lock; past MAX_RANGES
+    // low qwords the ones left out can be anything
+    ZoneMap zone;
+    cuint32 NUM_NAMES = ZoneMap::MAX_RANGES + 10;
+    Concurrency::parallel_for(0U, 8U, [&zone, tint, NUM_NAMES](uint32 thdIdx)
+    {
+        for (uint32 value = thdIdx; value < 8000; value += 8)
+        {
+            Z2raw atom = Z2(tint, 201 + value % NUM_NAMES, value);
+            zone.add(&atom, &atom + 1);
+        }
+    });
+    uint32 leftOut = 0;
+    for (uint32 name = 201; name < 201 + NUM_NAMES; ++name)
+    {
+        ZoneRange range;
+        Z2raw key = Z2(tint, name, 0);
+        if (!zone.find(key.m128i_u64[0], range) || !zone.may_contain(name))
+            throw std::exception("test zone map: name lost.");
+        cuint32 first = name - 201;
+        cuint32 last = first + ((7999 - first) / NUM_NAMES) * NUM_NAMES;
+        bool exact = (range.minInt == first) && (range.maxInt == last);
+        bool any = (range.minInt == std::numeric_limits<int64>::min()) && (range.maxInt == std::numeric_limits<int64>::max());
+        if (!exact && !any)
+            throw std::exception("test zone map: wrong range.");
+        leftOut += any ? 1 : 0;
+    }
+    printf("%u low qwords, %u with a range, %u left out\n", NUM_NAMES, zone.size(), leftOut);
+    if ((zone.size() != ZoneMap::MAX_RANGES) || (leftOut != NUM_NAMES - ZoneMap::MAX_RANGES))
+        throw std::exception("test zone map: wrong number of ranges.");
+}
+
+void Test_BlockSkipping()
+{
+    printf("\nTest: block skipping\n");
+
+    // one Bin, blocks of Bin<Z2raw>::BLOCK_ELEMS documents, _id is insertion ordered
+    cuint32 NUM_DOCS = 19999;
+    cuint32 FROM_ID = 4 * Bin<Z2raw>::BLOCK_ELEMS;
+    Collection & coll = Make_Mixed_Collection("blocks", NUM_DOCS);
+    if (coll.GetNumBins() != 1)
+        throw std::exception("test block skipping: expected one Bin.");
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw end = { QO::END, 0 };
+
+    // per LFT and fused: only the last block is read
+    std::vector<LFTraw> lfts = { Make_LFT(0, QO::GTE, Z2(tint, MFDB::Constants::Id_1, FROM_ID)) };
+    Z2FindQuery single(lfts, { start, end });
+    lfts.push_back(Make_LFT(1, QO::LT, Z2(tint, 101, 10)));
+    Z2FindQuery fused(lfts, { start, qpand, end });
+
+    uint64 expected2 = 0;
+    for (uint32 i = FROM_ID; i < NUM_DOCS; ++i)
+    {
+        if ((i % 100) < 10)
+            ++expected2;
+    }
+
+    std::vector<byte> out;
+    Perfy::Instance().StartMetrics();
+    uint64 docs1 = Run_Find(coll, single, out);
+    uint64 atoms1 = Perfy::Instance().GetAndResetMetrics().nTotalAtoms;
+    uint64 docs2 = Run_Find(coll, fused, out);
+    uint64 atoms2 = Perfy::Instance().GetAndResetMetrics().nTotalAtoms;
+
+    // the single LFT reads one atom per document (all of the same shape)
+    cuint64 lastBlockAtoms = (NUM_DOCS - FROM_ID) * 4;
+    printf("single: %llu docs, %llu atoms; fused: %llu docs, %llu atoms (last block %llu atoms)\n",
+        docs1, atoms1, docs2, atoms2, lastBlockAtoms);
+    if ((docs1 != NUM_DOCS - FROM_ID) || (docs2 != expected2))
+        throw std::exception("test block skipping: wrong number of documents.");
+    if ((atoms1 != NUM_DOCS - FROM_ID) || (atoms2 != lastBlockAtoms))
+        throw std::exception("test block skipping: blocks not skipped.");
+}
+
+// groups come out in no particular order
+std::vector<std::pair<uint64, uint64>> Run_Aggregate(Collection & coll, const Z2AggrQuery & query)
+{
+    std::vector<Z2raw> out(Collection::MAX_DOCUMENT_SIZE / sizeof(Z2raw));
+    Buffer buffer(&out[0], (uint32) (out.size() * sizeof(Z2raw)));
+    uint32 numz2 = coll.Aggregate(1234, buffer, &query);
+
+    std::vector<std::pair<uint64, uint64>> ret;
+    for (uint32 idx = 0; idx < numz2; ++idx)
+    {
+        const uint64 * qwords = reinterpret_cast<const uint64*>(&out[idx]);
+        ret.push_back(std::make_pair(qwords[0], qwords[1]));
+    }
+    std::sort(ret.begin(), ret.end());
+    return (ret);
+}
+
+void Test_Columns()
+{
+    printf("\nTest: promoted columns\n");
+
+    // same documents, only 'coll' has columns
+    cuint32 NUM_DOCS = 30 * 1000;
+    cuint32 MORE_DOCS = 20 * 1000;
+    Collection & ref = Make_Mixed_Collection("columns_ref", NUM_DOCS);
+    Collection & coll = Make_Mixed_Collection("columns", NUM_DOCS);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    double hundred = 100.0;
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw end = { QO::END, 0 };
+
+    Z2FindQuery single({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+    Z2FindQuery fused({ Make_LFT(0, QO::GTE, Z2(tfloat, 103, *(uint64*) &hundred)), Make_LFT(1, QO::EQ, Z2(tint, 102, 3)) },
+        { start, qpand, end }, Z2FindQuery::ScanMode::ScanFused);
+    std::vector<Aggr1> aggrlist = { { 201, 101, QO::SUM } };
+    Z2AggrQuery aggr(102, aggrlist, 0);
+
+    auto compare = [&](const char * when, uint64 numDocs)
+    {
+        std::vector<byte> out1, out2;
+        Perfy::Instance().StartMetrics();
+        uint64 docs1 = Run_Find(ref, single, out1);
+        uint64 atoms1 = Perfy::Instance().GetAndResetMetrics().nTotalAtoms;
+        uint64 docs2 = Run_Find(coll, single, out2);
+        uint64 atoms2 = Perfy::Instance().GetAndResetMetrics().nTotalAtoms;
+        printf("%s: single %llu/%llu docs, %llu/%llu atoms\n", when, docs1, docs2, atoms1, atoms2);
+        if (out1 != out2)
+            throw std::exception("test columns: different output for single LFT.");
+        // one atom per document either way: by shape, and by column
+        if ((atoms1 != numDocs) || (atoms2 != numDocs))
+            throw std::exception("test columns: wrong number of atoms.");
+
+        uint64 docs3 = Run_Find(ref, fused, out1);
+        uint64 docs4 = Run_Find(coll, fused, out2);
+        printf("%s: fused %llu/%llu docs\n", when, docs3, docs4);
+        if (out1 != out2)
+            throw std::exception("test columns: different output for fused scan.");
+
+        auto groups1 = Run_Aggregate(ref, aggr);
+        auto groups2 = Run_Aggregate(coll, aggr);
+        printf("%s: aggregate %llu/%llu atoms\n", when, (uint64) groups1.size(), (uint64) groups2.size());
+        if (groups1.empty() || (groups1 != groups2))
+            throw std::exception("test columns: different aggregation.");
+    };
+
+    // backfilled columns
+    for (Z2name name : { 101, 102, 103 })
+    {
+        coll.PromoteColumn(name);
+    }
+    coll.PromoteColumn(101);
+    compare("backfilled", NUM_DOCS);
+
+    // filled on insert, in the last Bin and in new ones
+    Write_Mixed_Docs(ref, NUM_DOCS, NUM_DOCS + MORE_DOCS);
+    Write_Mixed_Docs(coll, NUM_DOCS, NUM_DOCS + MORE_DOCS);
+    compare("inserted", NUM_DOCS + MORE_DOCS);
+}
+
+void Test_Shapes()
+{
+    printf("\nTest: shape catalog\n");
+
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("shapes", 20 * 1000, 4 * 1024 * 1024, 10),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+
+    // four shapes, plus a few documents too wide to be interned:
+    //   0: _id, 101, 102                       101 at a fixed offset
+    //   1: 102, _id, 104 { 101 }, 101          nested 101 first
+    //   2: _id, 101, 101, 102                  101 twice: walked
+    //   3: _id, 102                            no 101 at all
+    cuint32 NUM_DOCS = 8000;
+    cuint32 WIDE_ATOMS = 300;
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tdoc = { Z2type(BSONtypeCompressed::CEmbeddedDoc), 0 };
+
+    uint64 expectedDocs = 0;
+    uint64 expectedAtoms = 0;
+    // group by 102, sum of 101: the first root-level one, as a promoted
+    // Column holds it
+    std::map<uint64, double> expectedSums;
+    for (uint32 i = 0; i < NUM_DOCS; ++i)
+    {
+        cuint64 a = i % 100;
+        cuint64 b = (i + 50) % 100;
+        std::vector<Z2raw> doc;
+        bool wide = ((i % 1000) == 999);
+        uint32 kind = wide ? 0 : (i % 4);
+        switch (kind)
+        {
+        case 0:
+            doc = { Z2(tint, MFDB::Constants::Id_1, i), Z2(tint, 101, a), Z2(tint, 102, i % 7) };
+            break;
+        case 1:
+            doc = { Z2(tint, 102, i % 7), Z2(tint, MFDB::Constants::Id_1, i), Z2(tdoc, 104, 0), Z2(tint, 101, 5, 1), Z2(tint, 101, a) };
+            break;
+        case 2:
+            doc = { Z2(tint, MFDB::Constants::Id_1, i), Z2(tint, 101, a), Z2(tint, 101, b), Z2(tint, 102, i % 7) };
+            break;
+        default:
+            doc = { Z2(tint, MFDB::Constants::Id_1, i), Z2(tint, 102, i % 7) };
+            break;
+        }
+        for (uint32 extra = 0; wide && (extra < WIDE_ATOMS); ++extra)
+        {
+            doc.push_back(Z2(tint, 1100 + extra, extra));
+        }
+        Slow_Write_to_Collection(coll, &doc[0], (uint32) (doc.size() * sizeof(Z2raw)));
+
+        // 101 < 10, root level only
+        bool match = (kind != 3) && ((a < 10) || ((kind == 2) && (b < 10)));
+        expectedDocs += match ? 1 : 0;
+        expectedAtoms += wide ? doc.size() : (kind == 2) ? 4 : (kind == 3) ? 0 : 1;
+
+        if (kind != 3)
+            expectedSums[i % 7] += (double) a;
+    }
+
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery single({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+
+    std::vector<byte> out;
+    Perfy::Instance().StartMetrics();
+    uint64 docs = Run_Find(coll, single, out);
+    uint64 atoms = Perfy::Instance().GetAndResetMetrics().nTotalAtoms;
+    printf("find: %llu docs (expected %llu), %llu atoms (expected %llu)\n", docs, expectedDocs, atoms, expectedAtoms);
+    if (docs != expectedDocs)
+        throw std::exception("test shapes: wrong number of documents.");
+    if (atoms != expectedAtoms)
+        throw std::exception("test shapes: wrong number of atoms.");
+
+    std::vector<Aggr1> aggrlist = { { 201, 101, QO::SUM } };
+    Z2AggrQuery aggr(102, aggrlist, 0);
+    auto check = [&](const char * when)
+    {
+        std::vector<Z2raw> result(Collection::MAX_DOCUMENT_SIZE / sizeof(Z2raw));
+        Buffer buffer(&result[0], (uint32) (result.size() * sizeof(Z2raw)));
+        uint32 numz2 = coll.Aggregate(1234, buffer, &aggr);
+
+        std::map<uint64, double> sums;
+        uint64 group = 0;
+        for (uint32 idx = 1; idx <= numz2; ++idx)
+        {
+            Z2 z2(result[idx]);
+            if (z2.z2name() == MFDB::Constants::Id_1)
+                group = z2.z2value();
+            else if (z2.z2name() == 201)
+                sums[group] += Z2::double_z2(z2);
+        }
+        printf("%s: aggregate %llu groups (expected %llu)\n", when, (uint64) sums.size(), (uint64) expectedSums.size());
+        if (sums != expectedSums)
+            throw std::exception("test shapes: wrong aggregation.");
+    };
+    check("by row");
+
+    // the same groups once both fields are read by column
+    coll.PromoteColumn(101);
+    coll.PromoteColumn(102);
+    check("by column");
+}
+
+void Test_MappedBins()
+{
+    printf("\nTest: mapped Bins\n");
+
+    cuint32 NUM_DOCS = 30 * 1000;
+    CollectionIntrinsicCfg cfgi("mapped", 20 * 1000, 4 * 1024 * 1024, 10);
+    CollectionPercyCfg cfgp(Path(TestTempPath), PercyTraits::PersistencyType::MappedFileSystem);
+
+    Collection & coll = *Collection::Instantiate(cfgi, cfgp);
+    Write_Mixed_Docs(coll, 0, NUM_DOCS);
+    coll.PersistAll();
+
+    // the files are mapped again, nothing is read in
+    Collection * coll2 = Collection::DeserializeFromFile(cfgi, cfgp);
+    auto ret = Collection::Compare(&coll, coll2);
+    if (!std::get<0>(ret))
+    {
+        printf("%s", std::get<1>(ret).c_str());
+        throw std::exception("test mapped Bins: reopened collection differs.");
+    }
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery query({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+
+    std::vector<byte> out1, out2;
+    uint64 docs1 = Run_Find(coll, query, out1);
+    uint64 docs2 = Run_Find(*coll2, query, out2);
+    printf("%u Bins, %llu/%llu docs\n", coll2->GetNumBins(), docs1, docs2);
+    if ((docs1 != NUM_DOCS / 10) || (out1 != out2))
+        throw std::exception("test mapped Bins: different output.");
+}
+
+void Test_NumaChores()
+{
+    printf("\nTest: NUMA chore queues\n");
+
+    cuint32 NUM_DOCS = 60 * 1000;
+    Collection & coll = Make_Mixed_Collection("numa", NUM_DOCS);
+    cuint32 numBins = coll.GetNumBins();
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw qpor = { QO::OR, 2 };
+    QPraw end = { QO::END, 0 };
+    // per LFT: two chores per Bin
+    Z2FindQuery query({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)), Make_LFT(1, QO::EQ, Z2(tint, 102, 3)) },
+        { start, qpor, end }, Z2FindQuery::ScanMode::ScanPerLFT);
+
+    // every chore runs exactly once, whatever queue it is taken from
+    std::vector<byte> out;
+    uint64 docs = Run_Find(coll, query, out);
+    QueryMetrics metrics = coll.GetLastQueryCounters();
+
+    uint64 choresDone = 0;
+    for (uint32 thdIdx = 0; thdIdx < 256; ++thdIdx)
+    {
+        choresDone += metrics.choresDonePerThread[thdIdx];
+    }
+
+    uint64 expectedDocs = 0;
+    for (uint32 id = 0; id < NUM_DOCS; ++id)
+    {
+        expectedDocs += (((id % 100) < 10) || ((id % 7) == 3)) ? 1 : 0;
+    }
+
+    printf("%u node(s), %u Bins: %llu docs (expected %llu), %llu chores done, %llu skipped, %llu stolen\n",
+        Numa::NumNodes(), numBins, docs, expectedDocs, choresDone, metrics.choresSkipped, metrics.choresStolen);
+    if (docs != expectedDocs)
+        throw std::exception("test NUMA chores: wrong number of documents.");
+    if ((choresDone != metrics.numChores) || (choresDone + metrics.choresSkipped != uint64(query.scan_size()) * numBins))
+        throw std::exception("test NUMA chores: chores lost or run twice.");
+    if (metrics.choresStolen > choresDone)
+        throw std::exception("test NUMA chores: more chores stolen than done.");
+}
+
+void Test_BatchInsert()
+{
+    printf("\nTest: batch insert\n");
+
+    // batches span Bins: same content as one by one
+    cuint32 NUM_DOCS = 50 * 1000;
+    cuint32 BATCH = 7000;
+    Collection & reference = Make_Mixed_Collection("batchref", NUM_DOCS);
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("batch", 20 * 1000, 4 * 1024 * 1024, 10),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    std::vector<uint32> sizes(BATCH, 4 * sizeof(Z2raw));
+    std::vector<void*> buffers(BATCH);
+    std::vector<InsertHandle> handles(BATCH);
+
+    for (uint32 from = 0; from < NUM_DOCS; from += BATCH)
+    {
+        cuint32 count = std::min(BATCH, NUM_DOCS - from);
+        if (coll.AcquireInsertBuffers(count, sizes.data(), buffers.data(), handles.data()) != count)
+            throw std::exception("test batch insert: batch not acquired.");
+
+        for (uint32 idx = 0; idx < count; ++idx)
+        {
+            cuint32 i = from + idx;
+            double half = i * 0.5;
+            Z2raw * doc = static_cast<Z2raw*>(buffers[idx]);
+            doc[0] = Z2(tint, MFDB::Constants::Id_1, i);
+            doc[1] = Z2(tint, 101, i % 100);
+            doc[2] = Z2(tint, 102, i % 7);
+            doc[3] = Z2(tfloat, 103, *(uint64*) &half);
+        }
+        coll.ReleaseInsertBuffers(count, handles.data());
+    }
+
+    auto ret = Collection::Compare(&reference, &coll);
+    if (!std::get<0>(ret))
+    {
+        printf("%s", std::get<1>(ret).c_str());
+        throw std::exception("test batch insert: collection differs from one by one inserts.");
+    }
+
+    Z2FindQuery query({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { { QO::START, 0 }, { QO::END, 0 } });
+    std::vector<byte> out;
+    uint64 docs = Run_Find(coll, query, out);
+    printf("%u Bins, %llu docs\n", coll.GetNumBins(), docs);
+    if (docs != NUM_DOCS / 10)
+        throw std::exception("test batch insert: wrong number of documents.");
+
+    // released already
+    bool threw = false;
+    try
+    {
+        coll.ReleaseInsertBuffers(1, handles.data());
+    }
+    catch (ReleaseBufferError &)
+    {
+        threw = true;
+    }
+    if (!threw)
+        throw std::exception("test batch insert: released twice.");
+}
+
+void Test_OversizedInsert()
+{
+    printf("\nTest: oversized insert\n");
+
+    // a document bigger than a Bin is refused, and the Bin stays open
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("oversized", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    cuint32 BIG = 300 * 1024;
+    if (coll.AcquireInsertBuffer(BIG) != nullptr)
+        throw std::exception("test oversized insert: document bigger than a Bin acquired.");
+    Write_Mixed_Docs(coll, 0, 10);
+
+    cuint32 sizes[2] = { BIG, 4 * sizeof(Z2raw) };
+    void * buffers[2];
+    InsertHandle handles[2];
+    if (coll.AcquireInsertBuffers(2, sizes, buffers, handles) != 0)
+        throw std::exception("test oversized insert: batch starting with a big document acquired.");
+    Write_Mixed_Docs(coll, 10, 20);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2FindQuery query({ Make_LFT(0, QO::GTE, Z2(tint, 101, 0)) }, { { QO::START, 0 }, { QO::END, 0 } });
+    std::vector<byte> out;
+    if (Run_Find(coll, query, out) != 20)
+        throw std::exception("test oversized insert: documents after it not inserted.");
+}
+
+void Test_SpareBins()
+{
+    printf("\nTest: spare Bins\n");
+
+    // 19999 documents per Bin
+    cuint32 NUM_DOCS = 60 * 1000;
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("spares", 20 * 1000, 4 * 1024 * 1024, 10, 1),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+
+    // the spare is ready before the first Bin is full
+    Write_Mixed_Docs(coll, 0, 19999);
+    if (coll.WaitForSpares() != 1)
+        throw std::exception("test spare Bins: no spare made.");
+    Write_Mixed_Docs(coll, 19999, NUM_DOCS);
+
+    GrowMetrics metrics = coll.GetGrowMetrics();
+    printf("%u Bins: %llu from spares, %llu allocated, %llu waits\n",
+        coll.GetNumBins(), metrics.fromSpare, metrics.allocated, metrics.waits);
+    if (metrics.fromSpare + metrics.allocated != coll.GetNumBins())
+        throw std::exception("test spare Bins: Bins not accounted for.");
+    if (metrics.fromSpare == 0)
+        throw std::exception("test spare Bins: no spare used.");
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery query({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+    std::vector<byte> out;
+    if (Run_Find(coll, query, out) != NUM_DOCS / 10)
+        throw std::exception("test spare Bins: wrong number of documents.");
+}
+
+void Test_BinDirectory()
+{
+    printf("\nTest: growable Bin directory\n");
+
+    // concurrent writers, readers never see an unwritten slot
+    {
+        cuint32 NUM_WRITERS = 4;
+        cuint32 PER_WRITER = 50 * 1000;
+        LF::segvec<uint64> vec;
+        std::atomic<bool> done(false);
+        std::atomic<bool> torn(false);
+
+        std::thread reader([&vec, &done, &torn]()
+        {
+            while (!done)
+            {
+                cuint32 num = vec.size();
+                if ((num > 0) && (vec[num - 1] == 0ULL))
+                    torn = true;
+            }
+        });
+        std::vector<std::thread> writers;
+        for (uint32 wIdx = 0; wIdx < NUM_WRITERS; ++wIdx)
+        {
+            writers.emplace_back([&vec, wIdx, PER_WRITER]()
+            {
+                for (uint32 idx = 0; idx < PER_WRITER; ++idx)
+                {
+                    vec.add((static_cast<uint64>(wIdx) << 32) | (idx + 1));
+                }
+            });
+        }
+        for (auto & writer : writers)
+        {
+            writer.join();
+        }
+        done = true;
+        reader.join();
+
+        if (torn)
+            throw std::exception("test Bin directory: reader saw an unwritten element.");
+        if (vec.size() != NUM_WRITERS * PER_WRITER)
+            throw std::exception("test Bin directory: wrong size.");
+        auto snapshot = vec.snapshot();
+        if (!std::equal(snapshot.begin(), snapshot.end(), vec.begin()))
+            throw std::exception("test Bin directory: snapshot differs.");
+        std::sort(snapshot.begin(), snapshot.end());
+        if (std::unique(snapshot.begin(), snapshot.end()) != snapshot.end())
+            throw std::exception("test Bin directory: element added twice.");
+    }
+
+    // no limit on the number of Bins, more than the first segment holds
+    cuint32 NUM_DOCS = 100 * 1000;
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("bindir", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Write_Mixed_Docs(coll, 0, NUM_DOCS);
+    printf("%u Bins\n", coll.GetNumBins());
+    if (coll.GetNumBins() <= LF::segvec<uint64>::FIRST_SEGMENT)
+        throw std::exception("test Bin directory: too few Bins.");
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery query({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+    std::vector<byte> out;
+    if (Run_Find(coll, query, out) != NUM_DOCS / 10)
+        throw std::exception("test Bin directory: wrong number of documents.");
+}
+
+void Test_RemoveCompact()
+{
+    printf("\nTest: remove and compaction\n");
+
+    // 999 documents per Bin
+    cuint32 NUM_DOCS = 10 * 1000;
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("remove", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Write_Mixed_Docs(coll, 0, NUM_DOCS);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery half({ Make_LFT(0, QO::LT, Z2(tint, 101, 50)) }, { start, end });
+    Z2FindQuery some({ Make_LFT(0, QO::LT, Z2(tint, 101, 60)) }, { start, end });
+    std::vector<byte> out;
+
+    if (coll.Remove(0ULL, &half) != NUM_DOCS / 2)
+        throw std::exception("test remove: wrong number of documents removed.");
+    if (coll.Remove(0ULL, &half) != 0)
+        throw std::exception("test remove: documents removed twice.");
+    if (Run_Find(coll, half, out) != 0)
+        throw std::exception("test remove: removed documents found.");
+
+    // queries go on while the Bins are swapped
+    for (uint32 wait = 0; (coll.GetBinsCompacted() < coll.GetNumBins() - 1) && (wait < 100); ++wait)
+    {
+        if (Run_Find(coll, some, out) != NUM_DOCS / 10)
+            throw std::exception("test remove: wrong number of documents while compacting.");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    printf("%llu of %u Bins compacted\n", coll.GetBinsCompacted(), coll.GetNumBins());
+    if (coll.GetBinsCompacted() != coll.GetNumBins() - 1)
+        throw std::exception("test remove: Bins not compacted.");
+
+    if (Run_Find(coll, some, out) != NUM_DOCS / 10)
+        throw std::exception("test remove: wrong number of documents after compaction.");
+    Write_Mixed_Docs(coll, NUM_DOCS, NUM_DOCS + 1000);
+    if (Run_Find(coll, some, out) != (NUM_DOCS + 1000) / 10)
+        throw std::exception("test remove: wrong number of documents inserted after compaction.");
+}
+
+void Test_Update()
+{
+    printf("\nTest: in place updates\n");
+
+    cuint32 NUM_DOCS = 2000;
+    cuint32 NUM_THREADS = 4;
+    cuint32 NUM_INCS = 25;
+    Collection & coll = Make_Mixed_Collection("update", NUM_DOCS);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    double thousand = 1000.0;
+    double half = 0.5;
+    double zero = 0.0;
+    Z2FindQuery lt10({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+    Z2FindQuery eq3({ Make_LFT(0, QO::EQ, Z2(tint, 101, 3)) }, { start, end });
+    Z2FindQuery eq5({ Make_LFT(0, QO::EQ, Z2(tint, 101, 5)) }, { start, end });
+    Z2FindQuery eq7({ Make_LFT(0, QO::EQ, Z2(tint, 101, 7)) }, { start, end });
+    Z2FindQuery eq8({ Make_LFT(0, QO::EQ, Z2(tint, 101, 8)) }, { start, end });
+    Z2FindQuery all({ Make_LFT(0, QO::LT, Z2(tint, 101, 100)) }, { start, end });
+    Z2FindQuery sevens102({ Make_LFT(0, QO::EQ, Z2(tint, 102, 7)) }, { start, end });
+    Z2FindQuery big103({ Make_LFT(0, QO::GTE, Z2(tfloat, 103, *(uint64*) &thousand)) }, { start, end });
+    Z2FindQuery new104({ Make_LFT(0, QO::EQ, Z2(tint, 104, 42)) }, { start, end });
+    Z2FindQuery float102({ Make_LFT(0, QO::GTE, Z2(tfloat, 102, *(uint64*) &zero)) }, { start, end });
+    Z2FindQuery big102({ Make_LFT(0, QO::GTE, Z2(tint, 102, NUM_THREADS * NUM_INCS)) }, { start, end });
+    std::vector<byte> out;
+
+    UpdateRaw inc1 = { UpdateOp::Inc, Z2(tint, 102, 1) };
+    UpdateRaw incHalf = { UpdateOp::Inc, Z2(tfloat, 102, *(uint64*) &half) };
+    UpdateRaw setThousand = { UpdateOp::Set, Z2(tfloat, 103, *(uint64*) &thousand) };
+    UpdateRaw setNew = { UpdateOp::Set, Z2(tint, 104, 42) };
+
+    // $inc: 102 (i % 7) goes to 7 for one document in seven of those with 101 < 10
+    if (coll.Update(0ULL, &lt10, { inc1 }) != NUM_DOCS / 10)
+        throw std::exception("test update: wrong number of documents incremented.");
+    uint32 sevens = 0;
+    for (uint32 idx = 0; idx < NUM_DOCS; ++idx)
+    {
+        if ((idx % 100 < 10) && (idx % 7 == 6))
+            ++sevens;
+    }
+    if (Run_Find(coll, sevens102, out) != sevens)
+        throw std::exception("test update: incremented value not found.");
+
+    // $set of a float, in place
+    coll.Update(0ULL, &eq5, { setThousand });
+    if (Run_Find(coll, big103, out) != NUM_DOCS / 100)
+        throw std::exception("test update: set value not found.");
+
+    // $set of a new field: the documents are rewritten
+    if (coll.Update(0ULL, &eq7, { setNew }) != NUM_DOCS / 100)
+        throw std::exception("test update: wrong number of documents rewritten.");
+    if (Run_Find(coll, new104, out) != NUM_DOCS / 100)
+        throw std::exception("test update: new field not found.");
+    if (Run_Find(coll, all, out) != NUM_DOCS)
+        throw std::exception("test update: documents lost or duplicated by rewrite.");
+
+    // $inc of an integer by a double makes it a double
+    coll.Update(0ULL, &eq8, { incHalf });
+    if (Run_Find(coll, float102, out) != NUM_DOCS / 100)
+        throw std::exception("test update: promoted value not found.");
+
+    // concurrent $inc do not lose increments
+    std::vector<std::thread> threads;
+    for (uint32 thIdx = 0; thIdx < NUM_THREADS; ++thIdx)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            for (uint32 incIdx = 0; incIdx < NUM_INCS; ++incIdx)
+            {
+                coll.Update(0ULL, &eq3, { inc1 });
+            }
+        }));
+    }
+    for (auto & th : threads)
+    {
+        th.join();
+    }
+    if (Run_Find(coll, big102, out) != NUM_DOCS / 100)
+        throw std::exception("test update: concurrent increments lost.");
+}
+
+// $inc in place while the Bins are compacted: none is lost with the old Bin
+void Test_UpdateCompact()
+{
+    printf("\nTest: updates while compacting\n");
+
+    // 999 documents per Bin
+    cuint32 NUM_DOCS = 10 * 1000;
+    cuint32 MAX_INCS = 10 * 1000;
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("updatecompact", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Write_Mixed_Docs(coll, 0, NUM_DOCS);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery half({ Make_LFT(0, QO::LT, Z2(tint, 101, 50)) }, { start, end });
+    Z2FindQuery eq77({ Make_LFT(0, QO::EQ, Z2(tint, 101, 77)) }, { start, end });
+    UpdateRaw inc1 = { UpdateOp::Inc, Z2(tint, 102, 1) };
+
+    if (coll.Remove(0ULL, &half) != NUM_DOCS / 2)
+        throw std::exception("test update compact: wrong number of documents removed.");
+    // documents rewritten go to the last Bin: a new last Bin is not counted
+    cuint32 toCompact = coll.GetNumBins() - 1;
+    uint64 modified = 0;
+    uint32 incs = 0;
+    for (; (coll.GetBinsCompacted() < toCompact) && (incs < MAX_INCS); ++incs)
+    {
+        modified += coll.Update(0ULL, &eq77, { inc1 });
+    }
+    printf("%u $inc, %llu of %u Bins compacted\n", incs, coll.GetBinsCompacted(), toCompact);
+    if (coll.GetBinsCompacted() < toCompact)
+        throw std::exception("test update compact: Bins not compacted.");
+    if (modified != uint64(incs) * (NUM_DOCS / 100))
+        throw std::exception("test update compact: documents not modified.");
+
+    // 102 was i % 7: all of them from 'incs' on, none from 'incs' + 7
+    std::vector<byte> out;
+    Z2FindQuery from({ Make_LFT(0, QO::EQ, Z2(tint, 101, 77)), Make_LFT(1, QO::GTE, Z2(tint, 102, incs)) }, { start, qpand, end });
+    Z2FindQuery past({ Make_LFT(0, QO::EQ, Z2(tint, 101, 77)), Make_LFT(1, QO::GTE, Z2(tint, 102, incs + 7)) }, { start, qpand, end });
+    if ((Run_Find(coll, from, out) != NUM_DOCS / 100) || (Run_Find(coll, past, out) != 0))
+        throw std::exception("test update compact: increments lost.");
+}
+
+void Test_SealBins()
+{
+    printf("\nTest: sealed Bins, packed promoted columns\n");
+
+    // same documents, only 'coll' has columns; 999 documents per Bin
+    cuint32 NUM_DOCS = 10 * 1000;
+    Collection & ref = *Collection::Instantiate(CollectionIntrinsicCfg("seal_ref", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("seal", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Write_Mixed_Docs(ref, 0, NUM_DOCS);
+    Write_Mixed_Docs(coll, 0, NUM_DOCS);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    double hundred = 100.0;
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw end = { QO::END, 0 };
+
+    // 101 and 102 by frame of reference (8 and 4 bits), 103 by dictionary (16 bits)
+    Z2FindQuery lt({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+    Z2FindQuery gte({ Make_LFT(0, QO::GTE, Z2(tint, 101, 90)) }, { start, end });
+    Z2FindQuery ne({ Make_LFT(0, QO::NE, Z2(tint, 102, 3)) }, { start, end });
+    Z2FindQuery big({ Make_LFT(0, QO::GTE, Z2(tint, 101, 1000)) }, { start, end });
+    Z2FindQuery fused({ Make_LFT(0, QO::GTE, Z2(tfloat, 103, *(uint64*) &hundred)), Make_LFT(1, QO::EQ, Z2(tint, 102, 3)) },
+        { start, qpand, end }, Z2FindQuery::ScanMode::ScanFused);
+    std::vector<Aggr1> aggrlist = { { 201, 101, QO::SUM } };
+    Z2AggrQuery aggr(102, aggrlist, 0);
+
+    auto compare = [&](const char * when)
+    {
+        std::vector<byte> out1, out2;
+        for (const Z2FindQuery * query : { &lt, &gte, &ne, &big, &fused })
+        {
+            uint64 docs1 = Run_Find(ref, *query, out1);
+            uint64 docs2 = Run_Find(coll, *query, out2);
+            if ((docs1 != docs2) || (out1 != out2))
+            {
+                printf("%s: %llu/%llu docs\n", when, docs1, docs2);
+                throw std::exception("test seal: different output.");
+            }
+        }
+        if (Run_Aggregate(ref, aggr) != Run_Aggregate(coll, aggr))
+            throw std::exception("test seal: different aggregation.");
+    };
+
+    for (Z2name name : { 101, 102, 103 })
+    {
+        coll.PromoteColumn(name);
+    }
+    for (uint32 wait = 0; (coll.GetBinsPacked() < coll.GetNumBins() - 1) && (wait < 100); ++wait)
+    {
+        compare("sealing");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    printf("%llu of %u Bins with packed columns\n", coll.GetBinsPacked(), coll.GetNumBins());
+    if (coll.GetBinsPacked() != coll.GetNumBins() - 1)
+        throw std::exception("test seal: Bins not sealed.");
+    compare("sealed");
+
+    // the column entries go, the atoms stay
+    SealMetrics metrics = coll.GetSealMetrics();
+    printf("%llu Bins closed: %llu KB of column entries freed, %llu KB of atoms kept\n",
+        metrics.closed, metrics.freedBytes / 1024, metrics.keptBytes / 1024);
+    if ((metrics.closed != coll.GetNumBins() - 1) || (metrics.freedBytes == 0) || (metrics.keptBytes == 0))
+        throw std::exception("test seal: wrong seal metrics.");
+
+    // in place: a value with a code, then one without (the column is back)
+    Z2FindQuery eq5({ Make_LFT(0, QO::EQ, Z2(tint, 101, 5)) }, { start, end });
+    Z2FindQuery eq42({ Make_LFT(0, QO::EQ, Z2(tint, 101, 42)) }, { start, end });
+    UpdateRaw set77 = { UpdateOp::Set, Z2(tint, 101, 77) };
+    UpdateRaw set5000 = { UpdateOp::Set, Z2(tint, 101, 5000) };
+    for (Collection * which : { &ref, &coll })
+    {
+        which->Update(0ULL, &eq5, { set77 });
+        which->Update(0ULL, &eq42, { set5000 });
+    }
+    compare("updated");
+}
+
+void Test_Blobs()
+{
+    printf("\nTest: blob store\n");
+
+    cuint32 NUM_BLOBS = 100 * 1000;
+    CollectionIntrinsicCfg cfgi("blobs", 1000, 256 * 1024, 0);
+    CollectionPercyCfg cfgp(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem);
+    Collection & coll = *Collection::Instantiate(cfgi, cfgp);
+
+    // lookups go on while the index grows under them
+    auto blob = [](uint32 idx) { return (std::vector<byte>(idx % 300, static_cast<byte>(idx))); };
+    std::atomic<bool> adding(true);
+    std::atomic<uint32> wrong(0);
+    std::thread reader([&]()
+    {
+        while (adding)
+        {
+            for (uint32 idx = 0; idx < NUM_BLOBS; idx += 101)
+            {
+                uint32 size;
+                const void * found = coll.FindBlob(idx * 7919ULL, size);
+                if ((found != nullptr) && ((size != idx % 300) || (memcmp(found, blob(idx).data(), size) != 0)))
+                    ++wrong;
+            }
+        }
+    });
+    for (uint32 idx = 0; idx < NUM_BLOBS; ++idx)
+    {
+        auto bytes = blob(idx);
+        if (!coll.AddBlob(idx * 7919ULL, bytes.data(), static_cast<uint32>(bytes.size())))
+            ++wrong;
+    }
+    adding = false;
+    reader.join();
+
+    // bigger than an arena share: by itself
+    std::vector<byte> big(32 * 1024 * 1024, 0x5A);
+    byte other = 1;
+    if (!coll.AddBlob(1ULL, big.data(), static_cast<uint32>(big.size())) ||
+        coll.AddBlob(7919ULL * 5, &other, 1) ||
+        !coll.AddBlob(7919ULL * 5, blob(5).data(), 5))
+        throw std::exception("test blobs: add.");
+
+    coll.PersistAll();
+    Collection * coll2 = Collection::DeserializeFromFile(cfgi, cfgp);
+    const Collection * both[] = { &coll, coll2 };
+    for (const Collection * which : both)
+    {
+        for (uint32 idx = 0; idx < NUM_BLOBS; ++idx)
+        {
+            uint32 size;
+            const void * found = which->FindBlob(idx * 7919ULL, size);
+            if ((found == nullptr) || (size != idx % 300) || (memcmp(found, blob(idx).data(), size) != 0))
+                ++wrong;
+        }
+        uint32 size;
+        const void * found = which->FindBlob(1ULL, size);
+        if ((found == nullptr) || (size != big.size()) || (memcmp(found, big.data(), size) != 0) ||
+            (which->FindBlob(12345ULL, size) != nullptr))
+            ++wrong;
+    }
+    printf("%llu blobs, %llu reloaded\n", coll.GetNumBlobs(), coll2->GetNumBlobs());
+    if ((wrong != 0) || (coll2->GetNumBlobs() != NUM_BLOBS + 1))
+        throw std::exception("test blobs: wrong blobs.");
+}
+
+void Test_Spill()
+{
+    printf("\nTest: Bins spilled to disk\n");
+
+    // same documents, only 'coll' has a budget: room for 3 Bins of 256 KB
+    cuint32 NUM_DOCS = 10 * 1000;
+    cuint64 BIN_SIZE = 256 * 1024;
+    // outlives the test, as the collections do
+    MemoryBudget & budget = *new MemoryBudget();
+    MixedPair pair = Make_Mixed_Pair("spill", NUM_DOCS, &budget);
+    Collection & coll = pair.coll;
+    Collection & ref = pair.ref;
+
+    // the Bins get sealed by the compactor first, then it enforces the budget
+    budget.limit(3 * BIN_SIZE);
+    Wait_For_Compactor(coll, [&budget]() { return (budget.ResidentBytes() <= budget.limit()); });
+    printf("%llu of %u Bins spilled, %llu KB in memory\n", coll.GetBinsSpilled(), coll.GetNumBins(), budget.ResidentBytes() / 1024);
+    if ((budget.ResidentBytes() > budget.limit()) || (coll.GetBinsSpilled() != coll.GetNumBins() - 3))
+        throw std::exception("test spill: Bins not spilled.");
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery lt({ Make_LFT(0, QO::LT, Z2(tint, 101, 10)) }, { start, end });
+    Z2FindQuery none({ Make_LFT(0, QO::GTE, Z2(tint, 101, 1000)) }, { start, end });
+    std::vector<Aggr1> aggrlist = { { 201, 101, QO::SUM } };
+    Z2AggrQuery aggr(102, aggrlist, 0);
+
+    // the zone maps stay in memory: nothing read back
+    std::vector<byte> out1, out2;
+    if (Run_Find(coll, none, out2) != 0)
+        throw std::exception("test spill: wrong number of documents.");
+    if (coll.GetLastQueryCounters().binsFromDisk != 0)
+        throw std::exception("test spill: Bins read back for nothing.");
+
+    cuint64 spilled = coll.GetBinsSpilled();
+    uint64 docs1 = Run_Find(ref, lt, out1);
+    uint64 docs2 = Run_Find(coll, lt, out2);
+    QueryMetrics metrics = coll.GetLastQueryCounters();
+    printf("%llu Bins read back\n", metrics.binsFromDisk);
+    if ((docs1 != docs2) || (out1 != out2))
+        throw std::exception("test spill: different output.");
+    if (metrics.binsFromDisk != spilled)
+        throw std::exception("test spill: Bins not read back.");
+    if (Run_Aggregate(ref, aggr) != Run_Aggregate(coll, aggr))
+        throw std::exception("test spill: different aggregation.");
+
+    // no matches: each Bin is let go of once scanned, over the budget by
+    // the ones read back at the same time (MAX_LOADS_IN_FLIGHT) at most
+    QPraw qpand = { QO::AND, 2 };
+    Z2FindQuery nowhere({ Make_LFT(0, QO::EQ, Z2(tint, 101, 50)), Make_LFT(1, QO::EQ, Z2(tint, 101, 51)) }, { start, qpand, end });
+    if (Run_Find(coll, nowhere, out2) != 0)
+        throw std::exception("test spill: wrong number of documents.");
+    if (budget.ResidentBytes() > budget.limit() + 4 * BIN_SIZE)
+        throw std::exception("test spill: Bins scanned kept in memory.");
+
+    // over the budget again: the ones scanned least recently go, not written twice
+    budget.Enforce();
+    if (budget.ResidentBytes() > budget.limit())
+        throw std::exception("test spill: Bins not spilled again.");
+
+    // persisted from the spill files: still within the budget
+    coll.PersistAll();
+    if (budget.ResidentBytes() > budget.limit())
+        throw std::exception("test spill: Bins read back to be persisted.");
+    auto ret = Collection::Compare(&ref, &coll);
+    if (!std::get<0>(ret))
+    {
+        printf("%s", std::get<1>(ret).c_str());
+        throw std::exception("test spill: Bins read back differ.");
+    }
+}
+
+// A string atom as the front end makes it: up to 8 bytes in z2value, longer
+// ones by hash, their bytes (and terminating zero) in the blob store.
+// 'withBytes' false: a long string whose bytes never made it to the BlobStore
+Z2raw Make_String(Collection & coll, Z2name name, const std::string & str, bool withBytes = true)
+{
+    uint64 value = 0ULL;
+    cuint32 vlen = (str.size() <= 8) ? static_cast<uint32>(str.size()) : 0;
+    if (vlen != 0)
+    {
+        memcpy(&value, str.data(), vlen);
+    }
+    else {
+        value = std::hash<std::string>()(str);
+        if (withBytes)
+        {
+            coll.AddBlob(value, str.c_str(), static_cast<uint32>(str.size()) + 1);
+        }
+    }
+    cuint32 dw1 = name | (uint32(BSONtypeCompressed::CUTF8String) << 23) | (vlen << 28);
+    return (Z2(uint64(dw1) << 32, value));
+}
+
+void Test_Strings()
+{
+    printf("\nTest: string dictionary\n");
+
+    // 2 to 14 bytes: both inline and long strings
+    cuint32 NUM_DOCS = 10 * 1000;
+    Collection & coll = *Collection::Instantiate(CollectionIntrinsicCfg("strings", 1000, 256 * 1024, 0),
+        CollectionPercyCfg(Path(TestTempPath), PercyTraits::PersistencyType::LocalFileSystem));
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    std::vector<std::string> values;
+    for (uint32 i = 0; i < NUM_DOCS; ++i)
+    {
+        values.push_back(std::string(1 + i % 12, static_cast<char>('a' + i % 5)) + std::to_string(i % 97));
+        __m128i doc[2] =
+        {
+            Z2(tint, MFDB::Constants::Id_1, i),
+            Make_String(coll, 101, values.back()),
+        };
+        Slow_Write_to_Collection(coll, doc, sizeof(doc));
+    }
+
+    QPraw start = { QO::START, 0 };
+    QPraw end = { QO::END, 0 };
+    const std::string eqLong = values[11];
+    struct StringQuery
+    {
+        QO qo;
+        std::string constant;
+        std::function<bool(const std::string &)> expected;
+    };
+    const StringQuery queries[] =
+    {
+        { QO::GT, "c", [](const std::string & str) { return (str > "c"); } },
+        { QO::LTE, "bbbbbbbbbbb3", [](const std::string & str) { return (str <= "bbbbbbbbbbb3"); } },
+        { QO::GTE, "ddddd", [](const std::string & str) { return (str >= "ddddd"); } },
+        { QO::LT, "ccccccccc0", [](const std::string & str) { return (str < "ccccccccc0"); } },
+        { QO::EQ, eqLong, [eqLong](const std::string & str) { return (str == eqLong); } },
+        { QO::NE, "aa2", [](const std::string & str) { return (str != "aa2"); } },
+        { QO::REGEX, "^ccc", [](const std::string & str) { return (str.compare(0, 3, "ccc") == 0); } },
+        { QO::REGEX, "^eeeeeeeeeee", [](const std::string & str) { return (str.compare(0, 11, "eeeeeeeeeee") == 0); } },
+    };
+
+    auto check = [&](const char * when)
+    {
+        std::vector<byte> out;
+        for (const StringQuery & query : queries)
+        {
+            Z2FindQuery find({ Make_LFT(0, query.qo, Make_String(coll, 101, query.constant)) }, { start, end },
+                Z2FindQuery::ScanMode::ScanAuto, &coll.GetStrings());
+            cuint64 docs = Run_Find(coll, find, out);
+            cuint64 expected = std::count_if(values.begin(), values.end(), query.expected);
+            if (docs != expected)
+            {
+                printf("%s: %s %llu docs, %llu expected\n", when, query.constant.c_str(), docs, expected);
+                throw std::exception("test strings: wrong number of documents.");
+            }
+        }
+    };
+
+    // compared by their bytes, then by their codes
+    check("unsealed");
+    coll.PromoteColumn(101);
+    Wait_For_Compactor(coll, [&coll]() { return (coll.GetBinsPacked() >= coll.GetNumBins() - 1); });
+    printf("%llu of %u Bins with packed columns, %llu strings coded\n", coll.GetBinsPacked(), coll.GetNumBins(), coll.GetStrings().count());
+    if ((coll.GetBinsPacked() != coll.GetNumBins() - 1) || (coll.GetStrings().count() == 0))
+        throw std::exception("test strings: Bins not sealed.");
+    check("sealed");
+
+    // without its bytes a long string is told from the others, but not ordered
+    const std::string lost = "zzzzzzzzzzzz";
+    __m128i doc[2] = { Z2(tint, MFDB::Constants::Id_1, NUM_DOCS), Make_String(coll, 101, lost, false) };
+    Slow_Write_to_Collection(coll, doc, sizeof(doc));
+    bool threw = false;
+    try
+    {
+        Z2FindQuery above({ Make_LFT(0, QO::GT, Make_String(coll, 101, lost, false)) }, { start, end },
+            Z2FindQuery::ScanMode::ScanAuto, &coll.GetStrings());
+    }
+    catch (std::exception &)
+    {
+        threw = true;
+    }
+    if (!threw)
+        throw std::exception("test strings: range on a string without bytes accepted.");
+
+    std::vector<byte> out;
+    Z2FindQuery same({ Make_LFT(0, QO::EQ, Make_String(coll, 101, lost, false)) }, { start, end },
+        Z2FindQuery::ScanMode::ScanAuto, &coll.GetStrings());
+    if (Run_Find(coll, same, out) != 1)
+        throw std::exception("test strings: string without bytes not found by $eq.");
+    Z2FindQuery aboveC({ Make_LFT(0, QO::GT, Make_String(coll, 101, "c")) }, { start, end },
+        Z2FindQuery::ScanMode::ScanAuto, &coll.GetStrings());
+    cuint64 unresolved = coll.GetUnresolvedStrings();
+    cuint64 docs = Run_Find(coll, aboveC, out);
+    if ((docs != (uint64) std::count_if(values.begin(), values.end(), [](const std::string & str) { return (str > "c"); })) ||
+        (coll.GetUnresolvedStrings() == unresolved))
+        throw std::exception("test strings: string without bytes not reported.");
+}
+
+void Test_HashIndex()
+{
+    printf("\nTest: hash index\n");
+
+    // 999 documents per Bin: the index is built over 10 Bins, then kept by
+    // inserts, updates and compaction. 'ref' has none: it scans.
+    cuint32 NUM_DOCS = 10 * 1000;
+    MixedPair pair = Make_Mixed_Pair("hashindex", NUM_DOCS);
+    Collection & coll = pair.coll;
+    Collection & ref = pair.ref;
+    coll.CreateHashIndex(101);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw qpor = { QO::OR, 2 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery eq42({ Make_LFT(0, QO::EQ, Z2(tint, 101, 42)) }, { start, end });
+    Z2FindQuery eq77and({ Make_LFT(0, QO::LT, Z2(tint, 102, 3)), Make_LFT(1, QO::EQ, Z2(tint, 101, 77)) }, { start, qpand, end });
+    Z2FindQuery eq4242({ Make_LFT(0, QO::EQ, Z2(tint, 101, 4242)) }, { start, end });
+    Z2FindQuery eq77or({ Make_LFT(0, QO::EQ, Z2(tint, 101, 77)), Make_LFT(1, QO::EQ, Z2(tint, 102, 3)) }, { start, qpor, end });
+    Z2FindQuery lt50({ Make_LFT(0, QO::LT, Z2(tint, 101, 50)) }, { start, end });
+
+    auto check = [&pair](const char * when, const Z2FindQuery & query, bool lookup)
+    {
+        return (Check_Index(when, pair, query, lookup));
+    };
+
+    // conjunctions with $eq on 101 are looked up, the OR is scanned
+    if ((check("built", eq42, true) != NUM_DOCS / 100) || (check("built", eq77and, true) == 0))
+        throw std::exception("test hash index: wrong number of documents.");
+    check("built", eq77or, false);
+
+    Write_Mixed_Docs(coll, NUM_DOCS, NUM_DOCS + 1000);
+    Write_Mixed_Docs(ref, NUM_DOCS, NUM_DOCS + 1000);
+    if (check("inserted", eq42, true) != (NUM_DOCS + 1000) / 100)
+        throw std::exception("test hash index: inserted documents not found.");
+
+    // in place: from 42 to 4242
+    UpdateRaw set4242 = { UpdateOp::Set, Z2(tint, 101, 4242) };
+    coll.Update(0ULL, &eq42, { set4242 });
+    ref.Update(0ULL, &eq42, { set4242 });
+    if ((check("updated", eq42, true) != 0) || (check("updated", eq4242, true) != (NUM_DOCS + 1000) / 100))
+        throw std::exception("test hash index: updated documents not found.");
+
+    // elements move: the index follows them
+    coll.Remove(0ULL, &lt50);
+    ref.Remove(0ULL, &lt50);
+    for (uint32 wait = 0; ((coll.GetBinsCompacted() < coll.GetNumBins() - 1) || (ref.GetBinsCompacted() < ref.GetNumBins() - 1)) && (wait < 100); ++wait)
+    {
+        check("compacting", eq77and, true);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    if (coll.GetBinsCompacted() != coll.GetNumBins() - 1)
+        throw std::exception("test hash index: Bins not compacted.");
+    check("compacted", eq77and, true);
+    check("compacted", eq4242, true);
+
+    // one element set back and forth from two threads: the index has it
+    // under the value it ends up with
+    Z2FindQuery id77({ Make_LFT(0, QO::EQ, Z2(tint, MFDB::Constants::Id_1, 77)) }, { start, end });
+    Z2FindQuery eq5001({ Make_LFT(0, QO::EQ, Z2(tint, 101, 5001)) }, { start, end });
+    Z2FindQuery eq5002({ Make_LFT(0, QO::EQ, Z2(tint, 101, 5002)) }, { start, end });
+    std::vector<std::thread> setters;
+    for (uint64 value : { 5001, 5002 })
+    {
+        setters.push_back(std::thread([&coll, &id77, tint, value]()
+        {
+            UpdateRaw set = { UpdateOp::Set, Z2(tint, 101, value) };
+            for (uint32 idx = 0; idx < 1000; ++idx)
+            {
+                coll.Update(0ULL, &id77, { set });
+            }
+        }));
+    }
+    for (auto & setter : setters)
+    {
+        setter.join();
+    }
+    std::vector<byte> out;
+    cuint64 lookups = coll.GetIndexLookups();
+    if ((Run_Find(coll, eq5001, out) + Run_Find(coll, eq5002, out) != 1) || (coll.GetIndexLookups() == lookups))
+        throw std::exception("test hash index: element set concurrently not found.");
+}
+
+void Test_RangeIndex()
+{
+    printf("\nTest: range index\n");
+
+    // 999 documents per Bin, the last one without Runs. 'ref' scans.
+    cuint32 NUM_DOCS = 20 * 1000;
+    MixedPair pair = Make_Mixed_Pair("rangeindex", NUM_DOCS);
+    Collection & coll = pair.coll;
+    Collection & ref = pair.ref;
+    coll.CreateRangeIndex({ 103 });
+    coll.CreateRangeIndex({ 102, 101 });
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw end = { QO::END, 0 };
+    double from = 1000.0;
+    double to = 1100.0;
+    double inside = 1050.0;
+    Z2FindQuery between({ Make_LFT(0, QO::GTE, Z2(tfloat, 103, *(uint64*) &from)), Make_LFT(1, QO::LT, Z2(tfloat, 103, *(uint64*) &to)) },
+        { start, qpand, end });
+    Z2FindQuery eqAndRange({ Make_LFT(0, QO::GT, Z2(tint, 101, 95)), Make_LFT(1, QO::EQ, Z2(tint, 102, 3)) }, { start, qpand, end });
+    Z2FindQuery most({ Make_LFT(0, QO::GTE, Z2(tfloat, 103, *(uint64*) &from)) }, { start, end });
+    Z2FindQuery second({ Make_LFT(0, QO::LT, Z2(tint, 101, 2)) }, { start, end });
+
+    auto check = [&pair](const char * when, const Z2FindQuery & query, bool lookup)
+    {
+        return (Check_Index(when, pair, query, lookup));
+    };
+    auto wait_runs = [&coll](uint64 runs)
+    {
+        if (!Wait_For_Compactor(coll, [&coll, runs]() { return (coll.GetRangeRuns() >= runs); }))
+            throw std::exception("test range index: Runs not built.");
+    };
+
+    wait_runs(2 * (coll.GetNumBins() - 1));
+    printf("%llu Runs for %u Bins\n", coll.GetRangeRuns(), coll.GetNumBins());
+
+    // 200 documents, then 4 in 700; 103 >= 1000.0 is most of them, and the
+    // first Z2name of { 102, 101 } is not bounded by 101 < 2
+    if (check("runs", between, true) != 200)
+        throw std::exception("test range index: wrong number of documents.");
+    check("runs", eqAndRange, true);
+    check("runs", most, false);
+    check("runs", second, false);
+
+    // updated in place: that Bin is checked element by element till its Runs are built again
+    UpdateRaw set1050 = { UpdateOp::Set, Z2(tfloat, 103, *(uint64*) &inside) };
+    Z2FindQuery id5005({ Make_LFT(0, QO::EQ, Z2(tint, MFDB::Constants::Id_1, 5005)) }, { start, end });
+    cuint64 runs = coll.GetRangeRuns();
+    coll.Update(0ULL, &id5005, { set1050 });
+    ref.Update(0ULL, &id5005, { set1050 });
+    if (check("updated", between, true) != 201)
+        throw std::exception("test range index: updated document not found.");
+    wait_runs(runs + 2);
+    check("rebuilt", between, true);
+}
+
+void Test_BitmapIndex()
+{
+    printf("\nTest: bitmap index\n");
+
+    // 999 documents per Bin, the last one without Bitmaps. 'ref' scans.
+    cuint32 NUM_DOCS = 20 * 1000;
+    MixedPair pair = Make_Mixed_Pair("bitmapindex", NUM_DOCS);
+    Collection & coll = pair.coll;
+    Collection & ref = pair.ref;
+    coll.CreateBitmapIndex(102);
+    coll.CreateBitmapIndex(101);
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw qpor = { QO::OR, 2 };
+    QPraw qpnot = { QO::NOT, 1 };
+    QPraw end = { QO::END, 0 };
+    double from = 1000.0;
+    Z2FindQuery eq3({ Make_LFT(0, QO::EQ, Z2(tint, 102, 3)) }, { start, end });
+    Z2FindQuery in15({ Make_LFT(0, QO::EQ, Z2(tint, 102, 1)), Make_LFT(1, QO::EQ, Z2(tint, 102, 5)) }, { start, qpor, end });
+    Z2FindQuery neAndEq({ Make_LFT(0, QO::NE, Z2(tint, 102, 0)), Make_LFT(1, QO::EQ, Z2(tint, 101, 42)) }, { start, qpand, end });
+    Z2FindQuery not2({ Make_LFT(0, QO::EQ, Z2(tint, 102, 2)) }, { start, qpnot, end });
+    Z2FindQuery mixed({ Make_LFT(0, QO::EQ, Z2(tint, 102, 3)), Make_LFT(1, QO::GTE, Z2(tfloat, 103, *(uint64*) &from)) },
+        { start, qpand, end });
+
+    // and Count, from the Bitmaps alone, gets as many
+    auto check = [&](const char * when, const Z2FindQuery & query, bool lookup)
+    {
+        cuint64 docs = Check_Index(when, pair, query, lookup);
+        cuint64 count1 = coll.Count(0ULL, &query);
+        if ((count1 != docs) || (ref.Count(0ULL, &query) != docs))
+        {
+            printf("%s: %llu docs, counted %llu\n", when, docs, count1);
+            throw std::exception("test bitmap index: wrong count.");
+        }
+        return (docs);
+    };
+
+    if (!Wait_For_Compactor(coll, [&coll]() { return (coll.GetBitmapsBuilt() >= 2 * (coll.GetNumBins() - 1)); }))
+        throw std::exception("test bitmap index: Bitmaps not built.");
+    printf("%llu Bitmaps for %u Bins\n", coll.GetBitmapsBuilt(), coll.GetNumBins());
+
+    // $in is $or of $eq; 103 has no index
+    if (check("bitmaps", eq3, true) != 2857)
+        throw std::exception("test bitmap index: wrong number of documents.");
+    check("bitmaps", in15, true);
+    check("bitmaps", neAndEq, true);
+    check("bitmaps", not2, true);
+    check("bitmaps", mixed, false);
+
+    // removed after the Bitmaps were built: masked off
+    Z2FindQuery is42({ Make_LFT(0, QO::EQ, Z2(tint, 101, 42)) }, { start, end });
+    coll.Remove(0ULL, &is42);
+    ref.Remove(0ULL, &is42);
+    if (check("removed", neAndEq, true) != 0)
+        throw std::exception("test bitmap index: removed documents found.");
+    check("removed", not2, true);
+}
+
+void Test_IdIndex()
+{
+    printf("\nTest: _id index\n");
+
+    // 999 documents per Bin. 'ref' gets the same documents, duplicates
+    // excepted, one by one.
+    cuint32 NUM_DOCS = 10 * 1000;
+    MixedPair pair = Make_Mixed_Pair("idindex", NUM_DOCS);
+    Collection & coll = pair.coll;
+    Collection & ref = pair.ref;
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    QPraw start = { QO::START, 0 };
+    QPraw qpand = { QO::AND, 2 };
+    QPraw qpor = { QO::OR, 3 };
+    QPraw end = { QO::END, 0 };
+    Z2FindQuery id5005({ Make_LFT(0, QO::EQ, Z2(tint, MFDB::Constants::Id_1, 5005)) }, { start, end });
+    Z2FindQuery in3({ Make_LFT(0, QO::EQ, Z2(tint, MFDB::Constants::Id_1, 7)), Make_LFT(1, QO::EQ, Z2(tint, MFDB::Constants::Id_1, 9999)),
+        Make_LFT(2, QO::EQ, Z2(tint, MFDB::Constants::Id_1, 123456)) }, { start, qpor, end });
+    Z2FindQuery idAnd({ Make_LFT(0, QO::EQ, Z2(tint, MFDB::Constants::Id_1, 42)), Make_LFT(1, QO::EQ, Z2(tint, 101, 43)) }, { start, qpand, end });
+
+    // always looked up
+    auto check = [&pair](const char * when, const Z2FindQuery & query)
+    {
+        return (Check_Index(when, pair, query, true));
+    };
+
+    // 123456 is not there
+    if ((check("inserted", id5005) != 1) || (check("inserted", in3) != 2) || (check("inserted", idAnd) != 0))
+        throw std::exception("test _id index: wrong number of documents.");
+
+    // one by one: the second 5005 is not released
+    __m128i dup[2] = { Z2(tint, MFDB::Constants::Id_1, 5005), Z2(tint, 101, 77) };
+    auto ib = coll.AcquireInsertBuffer(sizeof(dup));
+    memcpy(ib, dup, sizeof(dup));
+    if (coll.ReleaseInsertBuffer(ib) || (coll.GetDuplicateIds() != 1))
+        throw std::exception("test _id index: duplicate released.");
+    if (check("duplicate", id5005) != 1)
+        throw std::exception("test _id index: duplicate found.");
+
+    // a batch: 42 is there already and 123456 comes twice
+    cuint32 BATCH = 4;
+    const uint64 ids[BATCH] = { 123456, 42, 123456, 123457 };
+    std::vector<uint32> sizes(BATCH, 2 * sizeof(Z2raw));
+    std::vector<void*> buffers(BATCH);
+    std::vector<InsertHandle> handles(BATCH);
+    if (coll.AcquireInsertBuffers(BATCH, sizes.data(), buffers.data(), handles.data()) != BATCH)
+        throw std::exception("test _id index: batch not acquired.");
+    for (uint32 idx = 0; idx < BATCH; ++idx)
+    {
+        Z2raw * doc = static_cast<Z2raw*>(buffers[idx]);
+        doc[0] = Z2(tint, MFDB::Constants::Id_1, ids[idx]);
+        doc[1] = Z2(tint, 101, idx);
+    }
+    byte released[BATCH];
+    if ((coll.ReleaseInsertBuffers(BATCH, handles.data(), released) != BATCH - 2) || (coll.GetDuplicateIds() != 3))
+        throw std::exception("test _id index: duplicates in batch released.");
+    if ((released[0] != 1) || (released[1] != 0) || (released[2] != 0) || (released[3] != 1))
+        throw std::exception("test _id index: wrong documents of the batch released.");
+    __m128i first[2] = { Z2(tint, MFDB::Constants::Id_1, 123456), Z2(tint, 101, 0) };
+    __m128i last[2] = { Z2(tint, MFDB::Constants::Id_1, 123457), Z2(tint, 101, 3) };
+    Slow_Write_to_Collection(ref, first, sizeof(first));
+    Slow_Write_to_Collection(ref, last, sizeof(last));
+    if (check("batch", in3) != 3)
+        throw std::exception("test _id index: batch documents not found.");
+
+    // removed: its _id is free again
+    coll.Remove(0ULL, &id5005);
+    ref.Remove(0ULL, &id5005);
+    if (check("removed", id5005) != 0)
+        throw std::exception("test _id index: removed document found.");
+    ib = coll.AcquireInsertBuffer(sizeof(dup));
+    memcpy(ib, dup, sizeof(dup));
+    if (!coll.ReleaseInsertBuffer(ib))
+        throw std::exception("test _id index: removed _id not released again.");
+    Slow_Write_to_Collection(ref, dup, sizeof(dup));
+    if (check("reinserted", id5005) != 1)
+        throw std::exception("test _id index: reinserted document not found.");
+
+    // rewritten by an update: the copy keeps the _id
+    UpdateRaw setNew = { UpdateOp::Set, Z2(tint, 104, 42) };
+    if ((coll.Update(0ULL, &id5005, { setNew }) != 1) || (ref.Update(0ULL, &id5005, { setNew }) != 1))
+        throw std::exception("test _id index: document not rewritten.");
+    ib = coll.AcquireInsertBuffer(sizeof(dup));
+    memcpy(ib, dup, sizeof(dup));
+    if (coll.ReleaseInsertBuffer(ib) || (coll.GetDuplicateIds() != 4))
+        throw std::exception("test _id index: duplicate of a rewritten document released.");
+    if (check("rewritten", id5005) != 1)
+        throw std::exception("test _id index: rewritten document not found.");
+}
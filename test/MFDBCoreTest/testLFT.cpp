@@ -0,0 +1,357 @@
+//
+// Copyright (c) 2014-2015 Benedetto Proietti
+//
+//
+//  This program is free software: you can redistribute it and/or  modify
+//  it under the terms of the GNU Affero General Public License, version 3,
+//  as published by the Free Software Foundation.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  As a special exception, the copyright holders give permission to link the
+//  code of portions of this program with the OpenSSL library under certain
+//  conditions as described in each individual source file and distribute
+//  linked combinations including the program with the OpenSSL library. You
+//  must comply with the GNU Affero General Public License in all respects for
+//  all of the code used other than as permitted herein. If you modify file(s)
+//  with this exception, you may extend this exception to your version of the
+//  file(s), but you are not obligated to do so. If you do not wish to do so,
+//  delete this exception statement from your version. If you delete this
+//  exception statement from all source files in the program, then also delete
+//  it in the license file.
+
+#include "MFDBCore/include/LFT/ScanKernels.h"
+#include "MFDBCore/include/LFT/Bitmap.h"
+#include "MFDBCore/include/LFT/QPProgram.h"
+#include <stdio.h>
+#include <vector>
+#include <set>
+#include <limits>
+#include <string>
+#include <exception>
+
+using namespace MFDB;
+using namespace MFDB::Core;
+using namespace MemFusion;
+
+namespace
+{
+
+double as_double(Z2raw z2)
+{
+    uint64 val = z2.m128i_u64[1];
+    return (*(double*) &val);
+}
+
+uint64 double_bits(double d)
+{
+    return (*(uint64*) &d);
+}
+
+// scalar definition every kernel must agree with
+template <typename Cmp>
+bool Reference(Z2raw filter, const Z2raw * begin, const Z2raw * end, Cmp cmp)
+{
+    for (const Z2raw * cur = begin; cur < end; ++cur)
+    {
+        if ((cur->m128i_u64[0] == filter.m128i_u64[0]) && cmp(*cur, filter))
+            return (true);
+    }
+    return (false);
+}
+
+// every range of 'atoms' from empty to a few full AVX-512 chunks plus a tail;
+// the number of matching ranges
+template <typename Scan, typename Cmp>
+uint32 Check_Kernel(const char * kernel, Scan & scan, Z2raw filter, const std::vector<Z2raw> & atoms, Cmp cmp)
+{
+    uint32 numMatches = 0;
+    const Z2raw * base = atoms.data();
+    for (size_t begin = 0; begin < atoms.size(); begin += 3)
+    {
+        for (size_t len = 0; len <= 11 && begin + len <= atoms.size(); ++len)
+        {
+            const Z2raw * b = base + begin;
+            const Z2raw * e = b + len;
+            bool expected = Reference(filter, b, e, cmp);
+            numMatches += expected ? 1 : 0;
+
+            if (scan.any(b, e) != expected)
+            {
+                std::string what = std::string(kernel) + " scan kernel mismatch";
+                throw std::exception(what.c_str());
+            }
+        }
+    }
+    return (numMatches);
+}
+
+// the wider kernels are only built where the CPU runs them
+template <typename T, typename Cmp>
+void Check_Kernels(const char * opname, Z2raw filter, const std::vector<Z2raw> & atoms, Cmp cmp)
+{
+    LFT::ScanSSE<T> sse(filter);
+    uint32 numMatches = Check_Kernel("SSE", sse, filter, atoms, cmp);
+
+    if (CpuFeatures::Supports(SimdLevel::SimdAVX2))
+    {
+        LFT::ScanAVX2<T> avx2(filter);
+        Check_Kernel("AVX2", avx2, filter, atoms, cmp);
+        avx2.done();
+    }
+#ifdef MF_AVX512_INTRINSICS
+    if (CpuFeatures::Supports(SimdLevel::SimdAVX512))
+    {
+        LFT::ScanAVX512<T> avx512(filter);
+        Check_Kernel("AVX-512", avx512, filter, atoms, cmp);
+    }
+#endif
+
+    printf("    %-10s %u matching ranges\n", opname, numMatches);
+}
+
+// Atoms around 'filter': same field with nearby values, same value under a
+// different name or depth, and both differing at once.
+std::vector<Z2raw> Make_Atoms(Z2raw filter, const std::vector<uint64> & values)
+{
+    std::vector<Z2raw> atoms;
+    for (int i = 0; i < 4000; ++i)
+    {
+        Z2raw z2 = filter;
+        z2.m128i_u64[1] = values[rand() % values.size()];
+        switch (rand() % 5)
+        {
+        case 0:
+            z2.m128i_u32[1] ^= 1;       // other name
+            break;
+        case 1:
+            z2.m128i_u32[0] = 1;        // inner document
+            break;
+        case 2:
+            z2.m128i_u32[0] = 2;
+            z2.m128i_u32[1] ^= 3;
+            break;
+        default:
+            break;
+        }
+        atoms.push_back(z2);
+    }
+    return (atoms);
+}
+
+}
+
+void Test_ScanKernels()
+{
+    printf("MFDBCoreTest :   Scan kernels (%s)\n", CpuFeatures::Name(CpuFeatures::Detect()));
+
+    Z2typeinfo tint = { Z2type(BSONtypeCompressed::CInt64), 0 };
+    Z2raw filter = Z2(tint, 123, uint64(-5LL));
+    std::vector<uint64> ivalues;
+    ivalues.push_back(uint64(-6LL));
+    ivalues.push_back(uint64(-5LL));
+    ivalues.push_back(uint64(-4LL));
+    ivalues.push_back(0x8000000000000000ULL);
+    ivalues.push_back(0x7FFFFFFFFFFFFFFFULL);
+    ivalues.push_back(7ULL);
+    std::vector<Z2raw> iatoms = Make_Atoms(filter, ivalues);
+
+    typedef const Z2raw & cz2;
+    auto ival = [](cz2 z2) { return (int64(z2.m128i_u64[1])); };
+    Check_Kernels<LFT::GT>("GT", filter, iatoms, [&](cz2 a, cz2 f) { return (ival(a) > ival(f)); });
+    Check_Kernels<LFT::GTE>("GTE", filter, iatoms, [&](cz2 a, cz2 f) { return (ival(a) >= ival(f)); });
+    Check_Kernels<LFT::LT>("LT", filter, iatoms, [&](cz2 a, cz2 f) { return (ival(a) < ival(f)); });
+    Check_Kernels<LFT::LTE>("LTE", filter, iatoms, [&](cz2 a, cz2 f) { return (ival(a) <= ival(f)); });
+    Check_Kernels<LFT::EQ>("EQ", filter, iatoms, [&](cz2 a, cz2 f) { return (ival(a) == ival(f)); });
+    Check_Kernels<LFT::NE>("NE", filter, iatoms, [&](cz2 a, cz2 f) { return (ival(a) != ival(f)); });
+
+    Z2typeinfo tfloat = { Z2type(BSONtypeCompressed::CFloatnum), 0 };
+    Z2raw ffilter = Z2(tfloat, 77, double_bits(2.5));
+    std::vector<uint64> fvalues;
+    fvalues.push_back(double_bits(2.5));
+    fvalues.push_back(double_bits(2.4999));
+    fvalues.push_back(double_bits(3.0));
+    fvalues.push_back(double_bits(-100.0));
+    fvalues.push_back(double_bits(std::numeric_limits<double>::quiet_NaN()));
+    fvalues.push_back(double_bits(std::numeric_limits<double>::infinity()));
+    std::vector<Z2raw> fatoms = Make_Atoms(ffilter, fvalues);
+
+    Check_Kernels<LFT::GT_float>("GT_float", ffilter, fatoms, [](cz2 a, cz2 f) { return (as_double(a) > as_double(f)); });
+    Check_Kernels<LFT::GTE_float>("GTE_float", ffilter, fatoms, [](cz2 a, cz2 f) { return (as_double(a) >= as_double(f)); });
+    Check_Kernels<LFT::LT_float>("LT_float", ffilter, fatoms, [](cz2 a, cz2 f) { return (as_double(a) < as_double(f)); });
+    Check_Kernels<LFT::LTE_float>("LTE_float", ffilter, fatoms, [](cz2 a, cz2 f) { return (as_double(a) <= as_double(f)); });
+}
+
+void Test_ElemBitmap()
+{
+    printf("MFDBCoreTest :   ElemBitmap\n");
+
+    for (int iter = 0; iter < 2000; ++iter)
+    {
+        // from very sparse to dense, on both sides
+        uint32 universe = 1 + rand() % 3000;
+        std::set<uint32> set1, set2;
+        std::vector<uint32> vec1, vec2;
+        uint32 num1 = rand() % (universe / (1 + rand() % 40) + 1);
+        uint32 num2 = rand() % (universe / (1 + rand() % 40) + 1);
+        for (uint32 idx = 0; idx < num1; ++idx) { vec1.push_back(rand() % universe); set1.insert(vec1.back()); }
+        for (uint32 idx = 0; idx < num2; ++idx) { vec2.push_back(rand() % universe); set2.insert(vec2.back()); }
+
+        ElemBitmap bitmap1(universe), bitmap2(universe);
+        bitmap1.add(vec1.begin(), vec1.end());
+        bitmap2.add(vec2.begin(), vec2.end());
+        bitmap1.normalize();
+        bitmap2.normalize();
+        if (bitmap1.count() != set1.size())
+            throw std::exception("ElemBitmap: wrong count.");
+
+        std::set<uint32> expected;
+        if (iter % 2)
+        {
+            bitmap1.and_with(bitmap2);
+            for (uint32 idx : set1) { if (set2.count(idx)) expected.insert(idx); }
+        }
+        else
+        {
+            bitmap1.or_with(bitmap2);
+            expected = set1;
+            expected.insert(set2.begin(), set2.end());
+        }
+
+        std::vector<uint32> result;
+        bitmap1.extract(result);
+        if (result != std::vector<uint32>(expected.begin(), expected.end()))
+            throw std::exception("ElemBitmap: wrong AND/OR result.");
+    }
+}
+
+namespace
+{
+
+// the QP semantics, one element at a time
+bool ReferenceQP(std::vector<bool> mystack, const std::vector<QPraw> & qps)
+{
+    for (const QPraw & qp : qps)
+    {
+        uint32 kids = (qp.kids == 0) ? 1 : qp.kids;
+        bool andv = true;
+        bool orv = false;
+        for (uint32 times = 0; times < kids; ++times)
+        {
+            andv = andv && mystack.back();
+            orv = orv || mystack.back();
+            mystack.pop_back();
+        }
+        switch (qp.command)
+        {
+        case QO::AND: mystack.push_back(andv); break;
+        case QO::OR:  mystack.push_back(orv); break;
+        case QO::NOT: mystack.push_back(!andv); break;
+        case QO::NOR: mystack.push_back(!orv); break;
+        default: throw std::exception("ReferenceQP: unexpected QO.");
+        }
+    }
+    bool ret = true;
+    for (bool v : mystack) { ret = ret && v; }
+    return (ret);
+}
+
+std::vector<QPraw> RandomQPs(uint32 numLFTs)
+{
+    static const QO cmds[] = { QO::AND, QO::OR, QO::NOT, QO::NOR };
+    std::vector<QPraw> qps;
+    uint32 depth = numLFTs;
+    while ((depth > 1) || (rand() % 3 == 0))
+    {
+        if (rand() % 8 == 0)
+            break;  // leftovers are ANDed
+        QPraw qp;
+        qp.command = cmds[rand() % 4];
+        qp.kids = 1 + rand() % depth;
+        qps.push_back(qp);
+        depth = depth - qp.kids + 1;
+    }
+    return (qps);
+}
+
+}
+
+void Test_QPProgram()
+{
+    printf("MFDBCoreTest :   QPProgram\n");
+
+    for (int iter = 0; iter < 2000; ++iter)
+    {
+        uint32 numLFTs = 1 + rand() % 8;
+        std::vector<QPraw> qps = RandomQPs(numLFTs);
+        QPProgram program(numLFTs, qps);
+
+        uint32 numElems = 1 + rand() % 1000;
+        std::vector<std::vector<bool>> lftResults(numElems, std::vector<bool>(numLFTs));
+        std::vector<bool> active(numElems);
+        for (uint32 elemIdx = 0; elemIdx < numElems; ++elemIdx)
+        {
+            active[elemIdx] = (rand() % 8 != 0);
+            for (uint32 LFTidx = 0; LFTidx < numLFTs; ++LFTidx)
+            {
+                lftResults[elemIdx][LFTidx] = (rand() % 2 == 0);
+            }
+        }
+
+        // word at a time
+        std::vector<uint64> regs(program.reg_size());
+        for (uint32 base = 0; base < numElems; base += 64)
+        {
+            uint64 activeWord = 0ULL;
+            for (uint32 LFTidx = 0; LFTidx < numLFTs; ++LFTidx) { regs[LFTidx] = 0ULL; }
+            for (uint32 bit = 0; (bit < 64) && (base + bit < numElems); ++bit)
+            {
+                if (active[base + bit]) { activeWord |= (1ULL << bit); }
+                for (uint32 LFTidx = 0; LFTidx < numLFTs; ++LFTidx)
+                {
+                    if (lftResults[base + bit][LFTidx]) { regs[LFTidx] |= (1ULL << bit); }
+                }
+            }
+            uint64 matches = program.eval(regs.data()) & activeWord;
+            for (uint32 bit = 0; (bit < 64) && (base + bit < numElems); ++bit)
+            {
+                bool expected = active[base + bit] && ReferenceQP(lftResults[base + bit], qps);
+                if (expected != ((matches & (1ULL << bit)) != 0))
+                    throw std::exception("QPProgram: wrong word result.");
+            }
+        }
+
+        // whole bitmaps, as stage2 hands them over: only active elements
+        ElemBitmap universe(numElems);
+        std::vector<ElemBitmap> bitmaps(numLFTs);
+        for (uint32 LFTidx = 0; LFTidx < numLFTs; ++LFTidx) { bitmaps[LFTidx].reset(numElems); }
+        std::vector<uint32> expected;
+        for (uint32 elemIdx = 0; elemIdx < numElems; ++elemIdx)
+        {
+            if (!active[elemIdx])
+                continue;
+            universe.add(elemIdx);
+            for (uint32 LFTidx = 0; LFTidx < numLFTs; ++LFTidx)
+            {
+                if (lftResults[elemIdx][LFTidx]) { bitmaps[LFTidx].add(elemIdx); }
+            }
+            if (ReferenceQP(lftResults[elemIdx], qps)) { expected.push_back(elemIdx); }
+        }
+        if (iter % 2)
+        {
+            universe.densify();
+            for (ElemBitmap & bitmap : bitmaps) { bitmap.densify(); }
+        }
+
+        std::vector<uint32> result;
+        program.eval(bitmaps, &universe).extract(result);
+        if (result != expected)
+            throw std::exception("QPProgram: wrong bitmap result.");
+    }
+}
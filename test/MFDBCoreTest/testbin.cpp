@@ -28,6 +28,7 @@
 
 
 #include "MFDBCore/include/bin.h"
+#include "MemFusion/PageAllocator.h"
 #include <stdio.h>
 #include <atomic>
 #include <thread>
@@ -87,19 +88,18 @@ void writer(volatile long & shuttingDown, Bin<Z2raw> * pmybin, uint thdIdx)
     char buffer[2048];
     uint iter = 0;
 
-    try {
-        while (shuttingDown != 1)
+    while (shuttingDown != 1)
+    {
+        sprintf_s<2048>(buffer, "Thread ....................................................................................................%u iter %u.", thdIdx, iter++);
+        uint sizeBytes = (uint) strlen(buffer) + 1;
+        char * binbuffer = static_cast<char*>(pmybin->AcquireBuffer(sizeBytes));
+        if (binbuffer == nullptr)
         {
-            sprintf_s<2048>(buffer, "Thread ....................................................................................................%u iter %u.", thdIdx, iter++);
-            uint sizeBytes = (uint) strlen(buffer) + 1;
-            char * binbuffer = static_cast<char*>(pmybin->AcquireBuffer(sizeBytes));
-            memcpy(binbuffer, buffer, sizeBytes);
-            std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 10));
+            printf("Bin %u is full.------------------------------------------------------\n", pmybin->binIdx());
+            break;
         }
-    }
-    catch (BinFull & ex)
-    {
-        printf("Bin %u is full.------------------------------------------------------\n", ex.binIdx);
+        memcpy(binbuffer, buffer, sizeBytes);
+        std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 10));
     }
     shuttingDown = 1;
 }
@@ -139,3 +139,97 @@ void Test_Bin()
 
     delete pmybin;
 }
+
+// Writers of different sizes fill one Bin acquiring and releasing at full
+// speed: every element must come out active, with its own atoms, in order.
+void Test_BinAppend()
+{
+    printf("MFDBCoreTest :   Bin append\n");
+
+    cuint32 NUM_WRITERS = 8;
+    auto * pmybin = new Bin<Z2raw>(13, 100 * 1000, 4 * 1024 * 1024);
+    std::atomic<uint32> written(0);
+
+    Concurrency::parallel_for(0U, NUM_WRITERS, [pmybin, &written](uint thdIdx)
+    {
+        for (uint32 iter = 0;; ++iter)
+        {
+            cuint32 numAtoms = 1 + (thdIdx + iter) % 5;
+            Z2raw * atoms = static_cast<Z2raw*>(pmybin->AcquireBuffer(numAtoms * sizeof(Z2raw)));
+            if (atoms == nullptr)
+                break;
+            for (uint32 idx = 0; idx < numAtoms; ++idx)
+            {
+                atoms[idx].m128i_u64[0] = thdIdx;
+                atoms[idx].m128i_u64[1] = numAtoms;
+            }
+            pmybin->ReleaseBuffer(atoms);
+            ++written;
+        }
+    });
+
+    auto ret = pmybin->Get();
+    cuint32 numElems = ret->s_nFreeElemIdx;
+    uint32 atomIdx = 0;
+    for (uint32 elemIdx = 0; elemIdx < numElems; ++elemIdx)
+    {
+        const ElemInfo & elem = ret->s_vElems[elemIdx];
+        if ((elem.status() != ElemState::ElemActive) || (elem.atomIdx() != atomIdx))
+            throw std::exception("test Bin append: element not active, or atoms out of order.");
+        const Z2raw * atoms = &ret->f_pRaw[elem.atomIdx()];
+        for (uint32 idx = 0; idx < elem.atomSize(); ++idx)
+        {
+            if ((atoms[idx].m128i_u64[1] != elem.atomSize()) || (atoms[idx].m128i_u64[0] != atoms[0].m128i_u64[0]))
+                throw std::exception("test Bin append: atoms written by two writers.");
+        }
+        atomIdx += elem.atomSize();
+    }
+    printf("%u elements, %u atoms\n", numElems, atomIdx);
+    if (numElems != written.load())
+        throw std::exception("test Bin append: elements lost.");
+
+    delete pmybin;
+}
+
+// Up to 1GB pages: each area comes back zeroed and counted with the page
+// size it got, which is the largest one that fits unless the OS had none
+// left (a fallback).
+void Test_PageAllocator()
+{
+    printf("MFDBCoreTest :   page allocator\n");
+
+    using MemFusion::PageAllocator;
+    PageAllocator::Initialize(MemFusion::PageHuge);
+    const MemFusion::PageSize largest = PageAllocator::Largest();
+    printf("largest pages %s\n", PageAllocator::Name(largest));
+
+    cuint64 HUGE_BYTES = 1024ULL * 1024 * 1024;
+    for (uint64 bytes : { 64 * 1024ULL, PageAllocator::MIN_PAGED_BYTES, HUGE_BYTES })
+    {
+        MemFusion::PageSize fits = MemFusion::PageSmall;
+        if ((bytes >= HUGE_BYTES) && (largest == MemFusion::PageHuge))
+            fits = MemFusion::PageHuge;
+        else if ((bytes >= PageAllocator::MIN_PAGED_BYTES) && (largest != MemFusion::PageSmall))
+            fits = MemFusion::PageLarge;
+
+        const MemFusion::PageMetrics before = PageAllocator::GetMetrics();
+        MemFusion::PageSize obtained;
+        byte * area = static_cast<byte*>(PageAllocator::Allocate(bytes, obtained));
+        const MemFusion::PageMetrics after = PageAllocator::GetMetrics();
+        printf("%llu KB: %s pages (%s fit), %llu fallbacks\n", bytes / 1024, PageAllocator::Name(obtained),
+            PageAllocator::Name(fits), after.fallbacks);
+
+        if ((obtained > fits) || ((obtained < fits) && (after.fallbacks == before.fallbacks)))
+            throw std::exception("test page allocator: wrong page size.");
+        if (after.bytes[obtained] < before.bytes[obtained] + bytes)
+            throw std::exception("test page allocator: bytes not counted.");
+        for (uint64 offset = 0; offset < bytes; offset += 1024 * 1024)
+        {
+            if ((area[offset] != 0) || (area[std::min(bytes, offset + 1024 * 1024) - 1] != 0))
+                throw std::exception("test page allocator: not zeroed.");
+        }
+        area[0] = 1;
+        area[bytes - 1] = 1;
+        PageAllocator::Free(area, bytes);
+    }
+}
@@ -29,6 +29,8 @@
 
 
 void Test_Bin();
+void Test_BinAppend();
+void Test_PageAllocator();
 void Test_FilterValue(bool = false);
 void Test_FilterQuery1();
 void test_QE_Collections_insert_simple1();
@@ -37,11 +39,62 @@ void test_query_1_adhoc();
 void Test_QP_AND2();
 void Test_Serialization();
 void Test_Aggregate1();
+void Test_ScanKernels();
+void Test_FusedScan();
+void Test_ElemBitmap();
+void Test_QPProgram();
+void Test_ZoneMap();
+void Test_BlockSkipping();
+void Test_Columns();
+void Test_Shapes();
+void Test_MappedBins();
+void Test_NumaChores();
+void Test_BatchInsert();
+void Test_OversizedInsert();
+void Test_SpareBins();
+void Test_BinDirectory();
+void Test_RemoveCompact();
+void Test_Update();
+void Test_UpdateCompact();
+void Test_SealBins();
+void Test_Spill();
+void Test_Blobs();
+void Test_Strings();
+void Test_HashIndex();
+void Test_RangeIndex();
+void Test_BitmapIndex();
+void Test_IdIndex();
 
 int main()
 {
     Prepare_QA();
 
+    Test_ScanKernels();
+    Test_ElemBitmap();
+    Test_QPProgram();
+    Test_FusedScan();
+    Test_ZoneMap();
+    Test_BlockSkipping();
+    Test_Columns();
+    Test_Shapes();
+    Test_MappedBins();
+    Test_NumaChores();
+    Test_BatchInsert();
+    Test_OversizedInsert();
+    Test_SpareBins();
+    Test_BinDirectory();
+    Test_RemoveCompact();
+    Test_Update();
+    Test_UpdateCompact();
+    Test_SealBins();
+    Test_Spill();
+    Test_Blobs();
+    Test_Strings();
+    Test_HashIndex();
+    Test_RangeIndex();
+    Test_BitmapIndex();
+    Test_IdIndex();
+
     Test_Aggregate1();
 
     Test_FilterValue(true);
@@ -49,6 +102,8 @@ int main()
 
     test_QE_Collections_insert_simple1();
     Test_Bin();
+    Test_BinAppend();
+    Test_PageAllocator();
     Test_QP_AND2();
 
     return 0;